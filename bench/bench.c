@@ -0,0 +1,654 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "cupid.h"
+#include "protocol.h"
+
+// Loopback load generator: shares a directory of synthetic files from a
+// freshly started server and drives concurrent clients against it with
+// a weighted mix of requests, then prints one JSON object per engine.
+
+// Kinds of request in the mix
+#define OP_LIST 0
+#define OP_TINY 1
+#define OP_MEDIUM 2
+#define OP_LARGE 3
+#define OP_COUNT 4
+
+// Synthetic files
+#define TINY_FILES 1000
+#define TINY_SIZE 1024
+#define MEDIUM_FILES 8
+#define MEDIUM_SIZE (4 * 1024 * 1024)
+#define LARGE_NAME "large.bin"
+#define LARGE_RANGE (64 * 1024 * 1024)      // Bytes fetched per large GET
+#define LARGE_ISLAND (1024 * 1024)          // Data written between holes
+#define LARGE_ISLANDS 16
+
+// How long to wait for the server to accept connections
+#define STARTUP_TRIES 100
+#define STARTUP_DELAY_US 50000
+
+// Receive buffer for discarded bodies
+#define DRAIN_SIZE (256 * 1024)
+
+static const char *op_names[OP_COUNT] = { "list", "tiny", "medium", "large" };
+
+// Settings from the command line
+typedef struct {
+    const char *server;         // cupid binary
+    const char *engines;        // Comma-separated engines to compare
+    int clients;
+    int seconds;
+    int port;
+    int weights[OP_COUNT];
+    uint64_t large_size;        // Apparent size of the sparse file
+    int verbose;                // Show the server's output
+} bench_options_t;
+
+// Latencies of one kind of request, in nanoseconds
+typedef struct {
+    uint64_t *samples;
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;
+} op_stats_t;
+
+// One client thread
+typedef struct {
+    const bench_options_t *options;
+    uint64_t seed;
+    op_stats_t ops[OP_COUNT];
+    uint64_t errors;
+    int failed;                 // The connection broke
+} client_t;
+
+static volatile int running;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// xorshift64*: cheap per-thread randomness
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Fill a buffer with incompressible bytes
+static void fill_random(unsigned char *buffer, size_t len, uint64_t *state) {
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t value = next_random(state);
+        memcpy(buffer + i, &value, 8);
+    }
+}
+
+// Write a file of random content. Returns 0 or -1.
+static int write_file(const char *dir, const char *name, size_t size, uint64_t *state) {
+    char path[PATH_MAX];
+    unsigned char *data;
+    int fd, status = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    data = malloc(size);
+    if (data == NULL)
+        return -1;
+    fill_random(data, size, state);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, data, size) != (ssize_t)size)
+        status = -1;
+    if (fd != -1)
+        close(fd);
+    free(data);
+    return status;
+}
+
+// Write a sparse file of the given apparent size with islands of data
+// spread over it, so reads cross both holes and real extents
+static int write_sparse_file(const char *dir, uint64_t size, uint64_t *state) {
+    char path[PATH_MAX];
+    unsigned char *data;
+    int fd, status = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, LARGE_NAME);
+    data = malloc(LARGE_ISLAND);
+    if (data == NULL)
+        return -1;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1)
+        status = -1;
+    for (int i = 0; i < LARGE_ISLANDS && status == 0; i++) {
+        off_t offset = size / LARGE_ISLANDS * i;
+
+        fill_random(data, LARGE_ISLAND, state);
+        if (pwrite(fd, data, LARGE_ISLAND, offset) != LARGE_ISLAND)
+            status = -1;
+    }
+    if (fd != -1)
+        close(fd);
+    free(data);
+    return status;
+}
+
+// Create the shared directory. Returns 0 or -1.
+static int create_files(const char *dir, uint64_t large_size) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    char name[64];
+
+    for (int i = 0; i < TINY_FILES; i++) {
+        snprintf(name, sizeof(name), "t%04d.dat", i);
+        if (write_file(dir, name, TINY_SIZE, &state) == -1)
+            return -1;
+    }
+    for (int i = 0; i < MEDIUM_FILES; i++) {
+        snprintf(name, sizeof(name), "m%d.dat", i);
+        if (write_file(dir, name, MEDIUM_SIZE, &state) == -1)
+            return -1;
+    }
+    return write_sparse_file(dir, large_size, &state);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Connect to the server on loopback. Returns the socket or -1.
+static int connect_server(int port) {
+    struct sockaddr_in addr;
+    int sock, one = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+// Start the server on dir. Returns its pid or -1.
+static pid_t launch_server(const bench_options_t *options, const char *engine, const char *dir) {
+    char port[16];
+    pid_t pid;
+
+    snprintf(port, sizeof(port), "%d", options->port);
+    pid = fork();
+    if (pid == -1) {
+        perror("Error starting server");
+        return -1;
+    }
+    if (pid == 0) {
+        if (!options->verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execl(options->server, options->server, "server", "--engine", engine,
+              "--port", port, dir, "127.0.0.1", (char *)NULL);
+        perror("Error running server");
+        _exit(127);
+    }
+
+    // Ready once it accepts a connection
+    for (int i = 0; i < STARTUP_TRIES; i++) {
+        int sock = connect_server(options->port);
+
+        if (sock != -1) {
+            close(sock);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            fprintf(stderr, "Server exited during startup (is port %d free?)\n", options->port);
+            return -1;
+        }
+        usleep(STARTUP_DELAY_US);
+    }
+
+    fprintf(stderr, "Server did not start listening on port %d\n", options->port);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// Read and throw away length bytes. Returns 0 or -1.
+static int drain(int sock, uint64_t length, char *buffer) {
+    while (length > 0) {
+        size_t want = length < DRAIN_SIZE ? length : DRAIN_SIZE;
+        ssize_t received = recv(sock, buffer, want, MSG_TRUNC);
+
+        if (received == -1 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return -1;
+        length -= received;
+    }
+    return 0;
+}
+
+// Read frames until the one ending the response. Returns the bytes
+// received, or -1 when the connection broke. *error is set when the
+// server answered with CMD_ERROR.
+static int64_t read_response(int sock, int op, char *buffer, int *error) {
+    cupid_header_t header;
+    int64_t total = 0;
+
+    *error = 0;
+    while (1) {
+        if (recv_header(sock, &header) != 0 || drain(sock, header.length, buffer) == -1)
+            return -1;
+        total += CUPID_HEADER_SIZE + header.length;
+
+        if (header.opcode == CMD_ERROR) {
+            *error = 1;
+            return total;
+        }
+        if (op == OP_LIST ? header.opcode == CMD_LIST_END : header.opcode == CMD_FILE_CHECKSUM)
+            return total;
+    }
+}
+
+// Send one request of the given kind
+static int send_request(int sock, int op, uint64_t large_size, uint64_t *seed) {
+    unsigned char payload[GET_RANGE_SIZE + 64];
+    uint64_t offset;
+    int len;
+
+    switch (op) {
+        case OP_LIST:
+            memset(payload, 0, LIST_REQUEST_SIZE);
+            return send_frame(sock, CMD_LIST_FILES, 0, 1, payload, LIST_REQUEST_SIZE);
+        case OP_TINY:
+            len = snprintf((char *)payload, sizeof(payload), "t%04d.dat",
+                           (int)(next_random(seed) % TINY_FILES));
+            return send_frame(sock, CMD_GET_FILE, 0, 1, payload, len);
+        case OP_MEDIUM:
+            len = snprintf((char *)payload, sizeof(payload), "m%d.dat",
+                           (int)(next_random(seed) % MEDIUM_FILES));
+            return send_frame(sock, CMD_GET_FILE, 0, 1, payload, len);
+        default:
+            // A page-aligned range anywhere in the sparse file
+            offset = large_size > LARGE_RANGE ? next_random(seed) % (large_size - LARGE_RANGE) : 0;
+            offset &= ~(uint64_t)4095;
+            put_u64(payload, offset);
+            put_u64(payload + 8, LARGE_RANGE);
+            put_u64(payload + 16, 0);
+            put_u64(payload + 24, 0);
+            memcpy(payload + GET_RANGE_SIZE, LARGE_NAME, strlen(LARGE_NAME));
+            return send_frame(sock, CMD_GET_FILE, GET_RANGE, 1, payload,
+                              GET_RANGE_SIZE + strlen(LARGE_NAME));
+    }
+}
+
+// Keep a latency sample. Returns 0 or -1 when out of memory.
+static int add_sample(op_stats_t *stats, uint64_t latency, uint64_t bytes) {
+    if (stats->count == stats->capacity) {
+        size_t capacity = stats->capacity ? stats->capacity * 2 : 4096;
+        uint64_t *samples = realloc(stats->samples, capacity * sizeof(uint64_t));
+        if (samples == NULL)
+            return -1;
+        stats->samples = samples;
+        stats->capacity = capacity;
+    }
+    stats->samples[stats->count++] = latency;
+    stats->bytes += bytes;
+    return 0;
+}
+
+// Pick the next kind of request by weight
+static int pick_op(const int *weights, uint64_t *seed) {
+    int total = 0, roll;
+
+    for (int i = 0; i < OP_COUNT; i++)
+        total += weights[i];
+    roll = next_random(seed) % total;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (roll < weights[i])
+            return i;
+        roll -= weights[i];
+    }
+    return OP_LIST;
+}
+
+// Closed loop: one request in flight per client, back to back
+static void *client_run(void *arg) {
+    client_t *client = arg;
+    const bench_options_t *options = client->options;
+    char *buffer = malloc(DRAIN_SIZE);
+    int sock = connect_server(options->port);
+
+    if (sock == -1 || buffer == NULL) {
+        client->failed = 1;
+        free(buffer);
+        if (sock != -1)
+            close(sock);
+        return NULL;
+    }
+
+    while (running) {
+        int op = pick_op(options->weights, &client->seed);
+        uint64_t started = now_ns();
+        int64_t bytes;
+        int error;
+
+        if (send_request(sock, op, options->large_size, &client->seed) == -1 ||
+            (bytes = read_response(sock, op, buffer, &error)) == -1) {
+            client->failed = 1;
+            break;
+        }
+        if (error) {
+            client->errors++;
+            continue;
+        }
+        if (add_sample(&client->ops[op], now_ns() - started, bytes) == -1) {
+            client->failed = 1;
+            break;
+        }
+    }
+
+    close(sock);
+    free(buffer);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Value at quantile q of sorted samples
+static uint64_t quantile(const uint64_t *sorted, size_t count, double q) {
+    size_t index = (size_t)(q * count + 0.999999);
+
+    if (count == 0)
+        return 0;
+    if (index == 0)
+        index = 1;
+    if (index > count)
+        index = count;
+    return sorted[index - 1];
+}
+
+// Print {"p50":..,"p99":..,"p999":..,"max":..} in milliseconds; sorts samples
+static void print_latency(uint64_t *samples, size_t count) {
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    printf("{\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+           quantile(samples, count, 0.5) / 1e6, quantile(samples, count, 0.99) / 1e6,
+           quantile(samples, count, 0.999) / 1e6, count ? samples[count - 1] / 1e6 : 0.0);
+}
+
+// Run the clients against one engine and print its results
+static int run_engine(const bench_options_t *options, const char *engine, const char *dir) {
+    client_t *clients = calloc(options->clients, sizeof(client_t));
+    pthread_t *threads = calloc(options->clients, sizeof(pthread_t));
+    op_stats_t merged[OP_COUNT];
+    uint64_t *all = NULL, started, elapsed, errors = 0, bytes = 0;
+    size_t total = 0;
+    int failed = 0, status = 0, started_clients;
+    pid_t pid;
+
+    if (clients == NULL || threads == NULL) {
+        perror("Error allocating memory");
+        free(clients);
+        free(threads);
+        return -1;
+    }
+
+    pid = launch_server(options, engine, dir);
+    if (pid == -1) {
+        free(clients);
+        free(threads);
+        return -1;
+    }
+
+    running = 1;
+    started = now_ns();
+    for (started_clients = 0; started_clients < options->clients; started_clients++) {
+        clients[started_clients].options = options;
+        clients[started_clients].seed = 0x853C49E6748FEA9BULL * (started_clients + 1);
+        if (pthread_create(&threads[started_clients], NULL, client_run,
+                           &clients[started_clients]) != 0) {
+            perror("Error creating client thread");
+            status = -1;
+            break;
+        }
+    }
+    if (status == 0)
+        sleep(options->seconds);
+    running = 0;
+    for (int i = 0; i < started_clients; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now_ns() - started;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (status == -1)
+        goto out;
+
+    // Merge per-client samples by kind, then across kinds
+    memset(merged, 0, sizeof(merged));
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int i = 0; i < options->clients; i++) {
+            op_stats_t *stats = &clients[i].ops[op];
+
+            for (size_t j = 0; j < stats->count; j++)
+                add_sample(&merged[op], stats->samples[j], 0);
+            merged[op].bytes += stats->bytes;
+        }
+        total += merged[op].count;
+        bytes += merged[op].bytes;
+    }
+    for (int i = 0; i < options->clients; i++) {
+        errors += clients[i].errors;
+        failed += clients[i].failed;
+    }
+    all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (all == NULL) {
+        perror("Error allocating memory");
+        status = -1;
+        goto out;
+    }
+    total = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        memcpy(all + total, merged[op].samples, merged[op].count * sizeof(uint64_t));
+        total += merged[op].count;
+    }
+
+    printf("{\"engine\":\"%s\",\"clients\":%d,\"seconds\":%.3f,\"requests\":%zu,"
+           "\"errors\":%llu,\"broken_connections\":%d,\"requests_per_sec\":%.1f,"
+           "\"throughput_mb_per_sec\":%.1f,\"latency_ms\":",
+           engine, options->clients, elapsed / 1e9, total, (unsigned long long)errors, failed,
+           total / (elapsed / 1e9), bytes / (elapsed / 1e9) / 1e6);
+    print_latency(all, total);
+    printf(",\"ops\":{");
+    for (int op = 0; op < OP_COUNT; op++) {
+        printf("%s\"%s\":{\"requests\":%zu,\"bytes\":%llu,\"latency_ms\":", op ? "," : "",
+               op_names[op], merged[op].count, (unsigned long long)merged[op].bytes);
+        print_latency(merged[op].samples, merged[op].count);
+        printf("}");
+    }
+    printf("}}\n");
+    fflush(stdout);
+    if (failed > 0)
+        status = -1;
+
+out:
+    for (int op = 0; op < OP_COUNT; op++)
+        free(merged[op].samples);
+    for (int i = 0; i < options->clients; i++) {
+        for (int op = 0; op < OP_COUNT; op++)
+            free(clients[i].ops[op].samples);
+    }
+    free(all);
+    free(clients);
+    free(threads);
+    return status;
+}
+
+// Parse list:tiny:medium:large weights. Returns 0 or -1.
+static int parse_mix(const char *text, int *weights) {
+    if (sscanf(text, "%d:%d:%d:%d", &weights[0], &weights[1], &weights[2], &weights[3]) != 4)
+        return -1;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (weights[i] < 0)
+            return -1;
+    }
+    return weights[0] + weights[1] + weights[2] + weights[3] > 0 ? 0 : -1;
+}
+
+static void print_usage(void) {
+    printf("Usage: cupid-bench [options]\n\n");
+    printf("Starts a cupid server on a temporary directory of synthetic files and\n");
+    printf("drives concurrent clients against it over loopback. Prints one JSON\n");
+    printf("object per engine.\n\n");
+    printf("  --server PATH   cupid binary to benchmark (default ./cupid)\n");
+    printf("  --engine LIST   Comma-separated engines to compare (default threads)\n");
+    printf("  --clients N     Concurrent clients (default 8)\n");
+    printf("  --duration S    Seconds per engine (default 10)\n");
+    printf("  --mix L:T:M:G   Weights of LIST, tiny, medium and large GETs (default 10:60:25:5)\n");
+    printf("  --large-size N  Apparent size of the sparse file in GB (default 4)\n");
+    printf("  --port N        Server port (default 19876)\n");
+    printf("  --verbose       Show the server's output\n");
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"server", required_argument, NULL, 's'},
+        {"engine", required_argument, NULL, 'e'},
+        {"clients", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"mix", required_argument, NULL, 'm'},
+        {"large-size", required_argument, NULL, 'g'},
+        {"port", required_argument, NULL, 'p'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    bench_options_t options = {
+        .server = "./cupid",
+        .engines = "threads",
+        .clients = 8,
+        .seconds = 10,
+        .port = 19876,
+        .weights = { 10, 60, 25, 5 },
+        .large_size = 4ULL << 30,
+    };
+    char dir[] = "/tmp/cupid-bench.XXXXXX";
+    char *engines, *engine, *save;
+    int opt, status = EXIT_SUCCESS;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                options.server = optarg;
+                break;
+            case 'e':
+                options.engines = optarg;
+                break;
+            case 'c':
+                options.clients = atoi(optarg);
+                if (options.clients < 1) {
+                    fprintf(stderr, "Invalid number of clients: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                options.seconds = atoi(optarg);
+                if (options.seconds < 1) {
+                    fprintf(stderr, "Invalid duration: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                if (parse_mix(optarg, options.weights) == -1) {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'g':
+                options.large_size = strtoull(optarg, NULL, 10) << 30;
+                if (options.large_size == 0) {
+                    fprintf(stderr, "Invalid large file size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                options.port = atoi(optarg);
+                if (options.port < 1 || options.port > 65535) {
+                    fprintf(stderr, "Invalid port: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'v':
+                options.verbose = 1;
+                break;
+            default:
+                print_usage();
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (access(options.server, X_OK) == -1) {
+        fprintf(stderr, "Cannot run server binary %s: %s\n", options.server, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // A client whose server went away must not kill the generator
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mkdtemp(dir) == NULL) {
+        perror("Error creating temporary directory");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Creating synthetic files in %s\n", dir);
+    if (create_files(dir, options.large_size) == -1) {
+        perror("Error creating files");
+        nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return EXIT_FAILURE;
+    }
+
+    engines = strdup(options.engines);
+    for (engine = strtok_r(engines, ",", &save); engine != NULL; engine = strtok_r(NULL, ",", &save)) {
+        fprintf(stderr, "Benchmarking %s engine for %d s with %d clients\n",
+                engine, options.seconds, options.clients);
+        if (run_engine(&options, engine, dir) == -1)
+            status = EXIT_FAILURE;
+    }
+    free(engines);
+
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "cupid.h"
+#include "protocol.h"
+#include "checksum.h"
+#include "index.h"
+#include "cache.h"
+
+// Hash buckets of the entry table
+#define CACHE_BUCKETS 4096
+
+// Most recently used files first. One mutex covers the table, the list
+// and the counters; it is held only to look up or relink an entry, never
+// while a file is read or a reply is copied out.
+static struct {
+    uint64_t budget;
+    uint64_t max_file;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    cache_stats_t stats;
+    pthread_mutex_t lock;
+} file_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// FNV-1a hash of a name
+static size_t hash_name(const char *name) {
+    uint64_t hash = 1469598103934665603ULL;
+
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
+    }
+    return hash % CACHE_BUCKETS;
+}
+
+// Bytes an entry counts against the budget
+static uint64_t entry_cost(const cache_entry_t *entry) {
+    return entry->frames_len + strlen(entry->name) + sizeof(cache_entry_t);
+}
+
+// Whether two stats describe the same version of a file
+static int same_version(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+// Take an entry out of the table and the list; its reference goes with it
+static void cache_unlink(cache_entry_t *entry) {
+    cache_entry_t **slot = &file_cache.buckets[hash_name(entry->name)];
+
+    while (*slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    *slot = entry->hash_next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        file_cache.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        file_cache.lru_tail = entry->lru_prev;
+    }
+
+    file_cache.stats.bytes -= entry_cost(entry);
+    file_cache.stats.entries--;
+    cache_release(entry);
+}
+
+// Put an entry at the front of the list
+static void cache_push_front(cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = file_cache.lru_head;
+    if (file_cache.lru_head != NULL) {
+        file_cache.lru_head->lru_prev = entry;
+    } else {
+        file_cache.lru_tail = entry;
+    }
+    file_cache.lru_head = entry;
+}
+
+// Find the entry for name in the table
+static cache_entry_t *cache_find(const char *name) {
+    cache_entry_t *entry = file_cache.buckets[hash_name(name)];
+
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+// Set the cache's budget and file size limit
+void cache_init(uint64_t budget, uint64_t max_file) {
+    file_cache.budget = budget;
+    file_cache.max_file = max_file < budget ? max_file : budget;
+}
+
+// Take a reference to the cached reply for name if it is still current
+cache_entry_t *cache_lookup(const char *name) {
+    cache_entry_t *entry;
+    uint64_t generation = 0;
+    struct stat st;
+    int known;
+
+    if (file_cache.budget == 0) {
+        return NULL;
+    }
+
+    // Top-level files of a watched directory are checked against the
+    // index without a system call; anything else is stat'ed
+    known = index_generation(name, &generation);
+    if (known == -1 || (known == 0 && index_stat(name, &st) == -1)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&file_cache.lock);
+    entry = cache_find(name);
+    if (entry != NULL) {
+        if (known ? !entry->indexed || entry->generation != generation :
+                    entry->indexed || !same_version(&entry->st, &st)) {
+            cache_unlink(entry);
+            entry = NULL;
+        } else {
+            if (entry != file_cache.lru_head) {
+                entry->lru_prev->lru_next = entry->lru_next;
+                if (entry->lru_next != NULL) {
+                    entry->lru_next->lru_prev = entry->lru_prev;
+                } else {
+                    file_cache.lru_tail = entry->lru_prev;
+                }
+                cache_push_front(entry);
+            }
+            atomic_fetch_add(&entry->refs, 1);
+            file_cache.stats.hits++;
+        }
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return entry;
+}
+
+// Read a whole file into the body of a reply. Returns 0, or -1 when the
+// file is not exactly size bytes long.
+static int read_body(int fd, unsigned char *body, uint64_t size) {
+    uint64_t got = 0;
+    unsigned char extra;
+    ssize_t n;
+
+    while (got < size) {
+        n = pread(fd, body + got, size - got, got);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        got += n;
+    }
+
+    // A file that grew since fstat() would be cached cut short
+    do {
+        n = pread(fd, &extra, 1, size);
+    } while (n == -1 && errno == EINTR);
+    return n == 0 ? 0 : -1;
+}
+
+// Serialize the reply to a whole-file GET of an entry's file
+static void build_frames(cache_entry_t *entry) {
+    unsigned char *p = entry->frames;
+    cupid_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    header.version = CUPID_PROTO_VERSION;
+
+    header.opcode = CMD_FILE_INFO;
+    header.length = FILE_INFO_SIZE;
+    encode_header(&header, p + CACHE_INFO_OFFSET);
+    put_u64(p + CUPID_HEADER_SIZE, entry->size);
+    put_u64(p + CUPID_HEADER_SIZE + 8, entry->mtime);
+    put_u64(p + CUPID_HEADER_SIZE + 16, 0);
+
+    header.opcode = CMD_FILE_DATA;
+    header.length = entry->size;
+    encode_header(&header, p + CACHE_DATA_OFFSET);
+
+    p += CACHE_CHECKSUM_OFFSET(entry->size);
+    header.opcode = CMD_FILE_CHECKSUM;
+    header.length = FILE_CHECKSUM_SIZE;
+    encode_header(&header, p);
+    put_u32(p + CUPID_HEADER_SIZE,
+            crc32c(0, entry->frames + CACHE_DATA_OFFSET + CUPID_HEADER_SIZE, entry->size));
+}
+
+// Read a file into a new entry that replaces any older one
+cache_entry_t *cache_fill(const char *name, int fd, uint64_t size) {
+    cache_entry_t *entry, *old;
+    uint64_t generation = 0;
+    int known;
+
+    if (file_cache.budget == 0 || size > file_cache.max_file) {
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(cache_entry_t));
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    // The version is taken before the file is read: a change made while
+    // it is read moves the generation or the stat on, so the entry is
+    // never current with a torn copy
+    known = index_generation(name, &generation);
+    if (known == -1 || fstat(fd, &entry->st) == -1 || !S_ISREG(entry->st.st_mode) ||
+        (uint64_t)entry->st.st_size > file_cache.max_file) {
+        free(entry);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&file_cache.lock);
+    file_cache.stats.misses++;
+    pthread_mutex_unlock(&file_cache.lock);
+
+    entry->size = entry->st.st_size;
+    entry->mtime = entry->st.st_mtime;
+    entry->indexed = known;
+    entry->generation = generation;
+    entry->frames_len = CACHE_CHECKSUM_OFFSET(entry->size) + CUPID_HEADER_SIZE + FILE_CHECKSUM_SIZE;
+    entry->frames = malloc(entry->frames_len);
+    entry->name = strdup(name);
+    if (entry->frames == NULL || entry->name == NULL ||
+        read_body(fd, entry->frames + CACHE_DATA_OFFSET + CUPID_HEADER_SIZE, entry->size) == -1) {
+        free(entry->frames);
+        free(entry->name);
+        free(entry);
+        return NULL;
+    }
+    build_frames(entry);
+
+    // One reference for the table, one for the caller
+    atomic_init(&entry->refs, 2);
+
+    pthread_mutex_lock(&file_cache.lock);
+    old = cache_find(name);
+    if (old != NULL) {
+        cache_unlink(old);
+    }
+    entry->hash_next = file_cache.buckets[hash_name(name)];
+    file_cache.buckets[hash_name(name)] = entry;
+    cache_push_front(entry);
+    file_cache.stats.bytes += entry_cost(entry);
+    file_cache.stats.entries++;
+    while (file_cache.stats.bytes > file_cache.budget && file_cache.lru_tail != entry) {
+        cache_unlink(file_cache.lru_tail);
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return entry;
+}
+
+// Drop a reference to an entry, freeing it with the last one
+void cache_release(cache_entry_t *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free(entry->frames);
+        free(entry->name);
+        free(entry);
+    }
+}
+
+// Copy the counters
+void cache_stats(cache_stats_t *stats) {
+    pthread_mutex_lock(&file_cache.lock);
+    *stats = file_cache.stats;
+    pthread_mutex_unlock(&file_cache.lock);
+}
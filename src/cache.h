@@ -0,0 +1,66 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "cupid.h"
+
+// A small file held in memory as the complete reply to a whole-file GET:
+// the CMD_FILE_INFO frame, the CMD_FILE_DATA header, the body and the
+// CMD_FILE_CHECKSUM trailer, serialized with a request ID of 0. Entries
+// are reference counted so one evicted or replaced while a response
+// copies it out stays valid until released.
+typedef struct cache_entry {
+    atomic_int refs;
+    uint64_t size;
+    int64_t mtime;
+    unsigned char *frames;
+    size_t frames_len;
+    // Private to the cache
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    int indexed;                // Validated by index generation, not by stat
+    uint64_t generation;
+    struct stat st;
+    char *name;
+} cache_entry_t;
+
+// Offsets of the frame headers in a cached reply, for stamping request IDs
+#define CACHE_INFO_OFFSET 0
+#define CACHE_DATA_OFFSET (CUPID_HEADER_SIZE + FILE_INFO_SIZE)
+#define CACHE_CHECKSUM_OFFSET(size) (CACHE_DATA_OFFSET + CUPID_HEADER_SIZE + (size))
+
+// Keep up to budget bytes of files no larger than max_file in memory.
+// A budget of 0 turns the cache off.
+void cache_init(uint64_t budget, uint64_t max_file);
+
+// Take a reference to the cached reply for name if it is still current.
+// Returns NULL on a miss, or when the cache is off.
+cache_entry_t *cache_lookup(const char *name);
+
+// Read the open file fd, known to the index as name, into a new entry
+// that replaces any older one. size is the file size as last seen, so
+// large files are passed over without a system call. Returns a reference
+// to the entry, or NULL when the file is too large, changed while being
+// read, or memory ran out.
+cache_entry_t *cache_fill(const char *name, int fd, uint64_t size);
+
+// Drop a reference taken by cache_lookup() or cache_fill()
+void cache_release(cache_entry_t *entry);
+
+// Counters for the metrics. A miss is a GET of a file small enough to
+// cache that had to be read from disk.
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes;             // Reply bytes held
+    uint64_t entries;
+} cache_stats_t;
+
+void cache_stats(cache_stats_t *stats);
+
+#endif /* CACHE_H */
@@ -0,0 +1,420 @@
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "checksum.h"
+
+// CRC-32C polynomial, reflected
+#define CRC32C_POLY 0x82f63b78
+
+// Lengths of the blocks the hardware CRC runs three at a time. Three
+// independent crc32 streams hide the instruction's latency; their results
+// are merged by shifting with precomputed zero-block operators.
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+// xxHash64 primes
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+// rsync-style weak checksum of a block
+uint32_t rolling_checksum(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b & 0xffff) << 16;
+}
+
+// Slicing-by-8 tables for the portable CRC-32C
+static uint32_t crc32c_table[8][256];
+
+// Operators that append CRC32C_LONG or CRC32C_SHORT zero bytes to a CRC
+static uint32_t crc32c_long_zeros[4][256];
+static uint32_t crc32c_short_zeros[4][256];
+
+// Implementation picked for this CPU
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *data, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Multiply a vector by a 32x32 matrix over GF(2)
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+// Square a 32x32 matrix over GF(2)
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+// Build the operator that feeds len zero bytes (a power of two) to a CRC
+static void crc32c_zeros_op(uint32_t *even, size_t len) {
+    uint32_t odd[32];
+    uint32_t row = 1;
+    int n;
+
+    // Operator for one zero bit
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    // Square up to one zero byte, then once per halving of len
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+
+    for (n = 0; n < 32; n++)
+        even[n] = odd[n];
+}
+
+// Tabulate a zero-byte operator a byte at a time
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+    uint32_t op[32];
+    uint32_t n;
+
+    crc32c_zeros_op(op, len);
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+// Apply a tabulated zero-byte operator to a CRC
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+// Portable CRC-32C, eight bytes per step
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t word;
+
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Hardware CRC-32C: three interleaved crc32 streams per block
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc0, crc1, crc2, word;
+    const unsigned char *end;
+
+    crc0 = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        len--;
+    }
+
+    while (len >= CRC32C_LONG * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = p + CRC32C_LONG;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(p + CRC32C_LONG));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(p + 2 * CRC32C_LONG));
+            p += 8;
+        } while (p < end);
+        crc0 = crc32c_shift(crc32c_long_zeros, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long_zeros, crc0) ^ crc2;
+        p += CRC32C_LONG * 2;
+        len -= CRC32C_LONG * 3;
+    }
+
+    while (len >= CRC32C_SHORT * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = p + CRC32C_SHORT;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(p + CRC32C_SHORT));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(p + 2 * CRC32C_SHORT));
+            p += 8;
+        } while (p < end);
+        crc0 = crc32c_shift(crc32c_short_zeros, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short_zeros, crc0) ^ crc2;
+        p += CRC32C_SHORT * 2;
+        len -= CRC32C_SHORT * 3;
+    }
+
+    while (len >= 8) {
+        memcpy(&word, p, sizeof(word));
+        crc0 = _mm_crc32_u64(crc0, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        len--;
+    }
+    return ~(uint32_t)crc0;
+}
+#endif
+
+// Build the tables and pick the fastest implementation
+static void crc32c_init(void) {
+    uint32_t n, crc;
+    int k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_zeros(crc32c_long_zeros, CRC32C_LONG);
+        crc32c_zeros(crc32c_short_zeros, CRC32C_SHORT);
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+// Extend a CRC-32C over len more bytes
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, data, len);
+}
+
+// Combine the CRC-32Cs of two adjacent pieces, the second len2 bytes
+// long, into the CRC-32C of both
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+    int n;
+
+    if (len2 == 0)
+        return crc1;
+
+    // Operator for one zero bit, squared up to four
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    // Apply one zero byte, two, four... for each bit set in len2
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0)
+            break;
+        gf2_matrix_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+
+    return crc1 ^ crc2;
+}
+
+// Rotate a 64-bit value left
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Load a little-endian 64-bit value
+static inline uint64_t read_le64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Load a little-endian 32-bit value
+static inline uint32_t read_le32(const unsigned char *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// Mix one 8-byte lane into an accumulator
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+// Fold an accumulator into the converged hash
+static inline uint64_t xxh64_merge(uint64_t hash, uint64_t acc) {
+    hash ^= xxh64_round(0, acc);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+// Hash the final (less than 32) bytes and avalanche
+static uint64_t xxh64_finish(uint64_t hash, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        hash ^= xxh64_round(0, read_le64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        hash ^= (uint64_t)read_le32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        hash ^= *p * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+        p++;
+        len--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Start an incremental hash
+void xxh64_init(xxh64_state_t *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+}
+
+// Feed more data into an incremental hash
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    state->total_len += len;
+
+    // Complete a stripe left over from the previous call
+    if (state->buffered > 0) {
+        size_t fill = 32 - state->buffered;
+        if (fill > len) {
+            fill = len;
+        }
+        memcpy(state->buffer + state->buffered, p, fill);
+        state->buffered += fill;
+        p += fill;
+        len -= fill;
+        if (state->buffered < 32) {
+            return;
+        }
+        state->v[0] = xxh64_round(state->v[0], read_le64(state->buffer));
+        state->v[1] = xxh64_round(state->v[1], read_le64(state->buffer + 8));
+        state->v[2] = xxh64_round(state->v[2], read_le64(state->buffer + 16));
+        state->v[3] = xxh64_round(state->v[3], read_le64(state->buffer + 24));
+        state->buffered = 0;
+    }
+
+    while (len >= 32) {
+        state->v[0] = xxh64_round(state->v[0], read_le64(p));
+        state->v[1] = xxh64_round(state->v[1], read_le64(p + 8));
+        state->v[2] = xxh64_round(state->v[2], read_le64(p + 16));
+        state->v[3] = xxh64_round(state->v[3], read_le64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+
+    memcpy(state->buffer, p, len);
+    state->buffered = len;
+}
+
+// Hash of everything fed so far
+uint64_t xxh64_digest(const xxh64_state_t *state) {
+    uint64_t hash;
+
+    if (state->total_len >= 32) {
+        hash = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+               rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        hash = xxh64_merge(hash, state->v[0]);
+        hash = xxh64_merge(hash, state->v[1]);
+        hash = xxh64_merge(hash, state->v[2]);
+        hash = xxh64_merge(hash, state->v[3]);
+    } else {
+        hash = state->seed + PRIME64_5;
+    }
+
+    hash += state->total_len;
+    return xxh64_finish(hash, state->buffer, state->buffered);
+}
+
+// xxHash64 of a buffer
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    xxh64_state_t state;
+
+    xxh64_init(&state, seed);
+    xxh64_update(&state, data, len);
+    return xxh64_digest(&state);
+}
@@ -0,0 +1,46 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// State of an incremental xxHash64 computation
+typedef struct {
+    uint64_t total_len;
+    uint64_t v[4];
+    unsigned char buffer[32];
+    size_t buffered;
+    uint64_t seed;
+} xxh64_state_t;
+
+// rsync-style weak checksum of a block: two 16-bit sums packed as b:a
+uint32_t rolling_checksum(const unsigned char *data, size_t len);
+
+// Slide the weak checksum of a len-byte window one byte forward,
+// dropping out and taking in
+static inline uint32_t rolling_checksum_roll(uint32_t sum, size_t len,
+                                             unsigned char out, unsigned char in) {
+    uint32_t a = sum & 0xffff, b = sum >> 16;
+
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)(len * out) + a) & 0xffff;
+    return a | b << 16;
+}
+
+// Extend a CRC-32C (Castagnoli) over len more bytes; start from 0.
+// Uses the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// CRC-32C of two adjacent pieces from the CRC-32C of each, len2 being
+// the length of the second
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// xxHash64 of a buffer
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+// Incremental xxHash64: init, feed any number of buffers, then digest
+void xxh64_init(xxh64_state_t *state, uint64_t seed);
+void xxh64_update(xxh64_state_t *state, const void *data, size_t len);
+uint64_t xxh64_digest(const xxh64_state_t *state);
+
+#endif /* CHECKSUM_H */
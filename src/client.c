@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,11 +7,62 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <stdatomic.h>
+#include <poll.h>
 #include "cupid.h"
 #include "networking.h"
+#include "protocol.h"
+#include "checksum.h"
+#include "compress.h"
+#include "tcp_tune.h"
+#include "multicast.h"
+#include "discovery.h"
+
+// Requests kept in flight on one connection before waiting for replies
+#define PIPELINE_DEPTH 16
+
+// Bounds on the byte ranges claimed by parallel streams. Segments start
+// large and shrink as the file runs out so streams finish together.
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+#define SEGMENT_MAX_SIZE (16 * 1024 * 1024)
+
+// How long each address of a discovered server gets to accept a connection
+#define DISCOVERY_CONNECT_TIMEOUT_MS 500
+
+// Smallest block a delta sync asks signatures for
+#define DELTA_MIN_BLOCK_SIZE 2048
+
+// Blocks a swarm download checks each range in, and how long each of its
+// sources gets to accept a connection
+#define SWARM_BLOCK_SIZE MAX_BLOCK_SIZE
+#define SWARM_CONNECT_TIMEOUT_MS 3000
+
+// Pipe that spliced bodies pass through on their way to the file; the
+// kernel may grant a smaller one
+#define RECEIVE_PIPE_SIZE (1024 * 1024)
+
+// Spliced bodies are pushed to disk and dropped from the page cache in
+// windows of this size, one window behind the write point
+#define WRITEBACK_WINDOW (8 * 1024 * 1024)
+
+// Outcome of receiving one file body
+#define RECEIVE_OK 0
+#define RECEIVE_FAILED 1    // The file failed but the session is still usable
+#define RECEIVE_BROKEN -1   // The session can no longer be used
+#define RECEIVE_FALLBACK 2  // A delta sync failed; download the whole file
+
+// Compressed blocks are read into the upper half of a receive buffer
+// and inflated into the lower half
+#if TRANSFER_CHUNK_SIZE < 2 * COMPRESS_BLOCK_SIZE
+#error "TRANSFER_CHUNK_SIZE must hold two compressed blocks"
+#endif
 
 // Function to determine if IPs are on the same subnet
 int is_same_subnet(const char *ip1, const char *ip2, const char *mask) {
@@ -82,16 +134,54 @@ char *get_matching_local_ip(const char *target_ip) {
     return matching_ip[0] != '\0' ? matching_ip : NULL;
 }
 
-// Connect to a server with intelligent routing
+// Parse "address[:port]", the port defaulting to CUPID_PORT. Returns 0,
+// or -1 when the address or the port is malformed.
+int parse_server_address(const char *text, struct in_addr *address, uint16_t *port) {
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strchr(text, ':');
+    size_t len = colon != NULL ? (size_t)(colon - text) : strlen(text);
+    long value = CUPID_PORT;
+    char *rest;
+    
+    if (len >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, text, len);
+    host[len] = '\0';
+    if (colon != NULL) {
+        value = strtol(colon + 1, &rest, 10);
+        if (rest == colon + 1 || *rest != '\0' || value < 1 || value > 65535) {
+            return -1;
+        }
+    }
+    if (inet_pton(AF_INET, host, address) != 1) {
+        return -1;
+    }
+    *port = value;
+    return 0;
+}
+
+// Connect to a server, given as "address[:port]", with intelligent routing
 int connect_to_server(const char *server_ip) {
     int client_socket;
     struct sockaddr_in server_addr, client_addr;
     char *local_ip;
+    char server_host[INET_ADDRSTRLEN];
     char server_network[INET_ADDRSTRLEN];
-    char local_network[INET_ADDRSTRLEN];
-    char *gateway;
+    topology_path_t path;
+    uint16_t port;
+    
+    // Prepare server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    if (parse_server_address(server_ip, &server_addr.sin_addr, &port) == -1) {
+        fprintf(stderr, "Invalid address: %s\n", server_ip);
+        return -1;
+    }
+    server_addr.sin_port = htons(port);
+    inet_ntop(AF_INET, &server_addr.sin_addr, server_host, sizeof(server_host));
     
-    printf("Connecting to server at %s:%d...\n", server_ip, CUPID_PORT);
+    printf("Connecting to server at %s:%d...\n", server_host, port);
     
     // Create socket
     client_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -100,18 +190,6 @@ int connect_to_server(const char *server_ip) {
         return -1;
     }
     
-    // Prepare server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(CUPID_PORT);
-    
-    // Convert IP address to binary form
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        fprintf(stderr, "Invalid address: %s\n", server_ip);
-        close(client_socket);
-        return -1;
-    }
-    
     // Try direct connection first
     if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) != -1) {
         printf("Connected directly to server\n");
@@ -119,7 +197,7 @@ int connect_to_server(const char *server_ip) {
     }
     
     // If direct connection fails, try to find a matching local IP
-    local_ip = get_matching_local_ip(server_ip);
+    local_ip = get_matching_local_ip(server_host);
     if (local_ip != NULL) {
         printf("Direct connection failed. Trying with local IP %s...\n", local_ip);
         
@@ -154,39 +232,37 @@ int connect_to_server(const char *server_ip) {
         }
     }
     
-    // If we're still here, try to add a route to the server's network
-    get_network_address(server_ip, server_network, "255.255.0.0");
-    if (local_ip) {
-        get_network_address(local_ip, local_network, "255.255.0.0");
+    // If we're still here, try to add a route to the server's network,
+    // sized like the local subnet it would be reached through
+    if (topology_init(0) == 0 && topology_lookup(server_addr.sin_addr.s_addr, &path) == 0 &&
+        !path.on_link) {
+        int prefix_len = path.prefix_len >= 0 ? path.prefix_len : 32;
+        in_addr_t network = server_addr.sin_addr.s_addr & prefix_mask(prefix_len);
         
-        if (strcmp(server_network, local_network) != 0) {
-            printf("Server is on a different subnet (%s vs %s)\n", 
-                   server_network, local_network);
-            
-            // Try to get default gateway
-            gateway = get_default_gateway();
-            if (gateway != NULL) {
-                printf("Attempting to add route to server network via default gateway %s\n", gateway);
-                if (add_route(server_network, "16", gateway) == 0) {
-                    // Try connecting again after adding route
-                    close(client_socket);
-                    return connect_to_server(server_ip); // Recursive call after adding route
-                }
-            } else {
-                // Try direct routing through server
-                printf("Attempting to add direct route to server network\n");
-                if (add_route(server_network, "16", server_ip) == 0) {
-                    // Try connecting again after adding route
-                    close(client_socket);
-                    return connect_to_server(server_ip); // Recursive call after adding route
-                }
+        inet_ntop(AF_INET, &network, server_network, INET_ADDRSTRLEN);
+        printf("Server is on a different subnet (%s/%d)\n", server_network, prefix_len);
+        
+        if (path.gateway != 0) {
+            printf("Attempting to add route to server network via default gateway\n");
+            if (add_route(network, prefix_len, path.gateway) == 0) {
+                // Try connecting again after adding route
+                close(client_socket);
+                return connect_to_server(server_ip); // Recursive call after adding route
+            }
+        } else {
+            // Try direct routing through server
+            printf("Attempting to add direct route to server network\n");
+            if (add_route(network, prefix_len, server_addr.sin_addr.s_addr) == 0) {
+                // Try connecting again after adding route
+                close(client_socket);
+                return connect_to_server(server_ip); // Recursive call after adding route
             }
         }
     }
     
     // If we're here, all connection attempts failed
     perror("Connection failed");
-    fprintf(stderr, "Could not connect to server at %s:%d\n", server_ip, CUPID_PORT);
+    fprintf(stderr, "Could not connect to server at %s:%d\n", server_host, port);
     fprintf(stderr, "Possible solutions:\n");
     fprintf(stderr, "1. Make sure server and client are on the same network or can route to each other\n");
     fprintf(stderr, "2. Check if server is running and bound to the correct IP\n");
@@ -197,53 +273,214 @@ int connect_to_server(const char *server_ip) {
     return -1;
 }
 
-// List files available on server
-int list_files(const char *server_ip) {
-    int client_socket;
-    char buffer[MAX_PACKET_SIZE];
-    ssize_t bytes_received;
+// Read and throw away the rest of a frame payload
+static int skip_payload(int client_socket, uint64_t length) {
+    char discard[MAX_PACKET_SIZE];
     
-    // Connect to server
-    client_socket = connect_to_server(server_ip);
-    if (client_socket == -1) {
-        return EXIT_FAILURE;
+    while (length > 0) {
+        size_t want = length < sizeof(discard) ? length : sizeof(discard);
+        ssize_t received = recv_all(client_socket, discard, want);
+        if (received != (ssize_t)want) {
+            return -1;
+        }
+        length -= received;
     }
+    return 0;
+}
+
+// Read the CMD_FILE_CHECKSUM trailer that follows every file body.
+// Returns 0 and sets *crc, or -1 when the session is out of step.
+static int recv_checksum(int client_socket, uint32_t request_id, uint32_t *crc) {
+    cupid_header_t header;
+    unsigned char trailer[FILE_CHECKSUM_SIZE];
     
-    // Send list files command
-    buffer[0] = CMD_LIST_FILES;
-    if (send(client_socket, buffer, 1, 0) <= 0) {
+    if (recv_header(client_socket, &header) != 0 || header.opcode != CMD_FILE_CHECKSUM ||
+        header.length != FILE_CHECKSUM_SIZE || header.request_id != request_id ||
+        recv_all(client_socket, trailer, sizeof(trailer)) != sizeof(trailer)) {
+        fprintf(stderr, "Missing checksum from server\n");
+        return -1;
+    }
+    *crc = get_u32(trailer);
+    return 0;
+}
+
+// Throw away the rest of a file body and its checksum trailer
+static int skip_file_body(int client_socket, uint32_t request_id, uint64_t length) {
+    uint32_t crc;
+    
+    if (skip_payload(client_socket, length) == -1) {
+        return -1;
+    }
+    return recv_checksum(client_socket, request_id, &crc);
+}
+
+// Read the message of a CMD_ERROR frame and print it, prefixed with
+// context when given
+static int report_server_error(int client_socket, const cupid_header_t *header,
+                               const char *context) {
+    char message[MAX_PACKET_SIZE];
+    size_t len = header->length < sizeof(message) - 1 ? header->length : sizeof(message) - 1;
+    ssize_t received = recv_all(client_socket, message, len);
+    int status = 0;
+    
+    if (received < 0) {
+        received = 0;
+    }
+    message[received] = '\0';
+    if ((size_t)received != len || skip_payload(client_socket, header->length - len) == -1) {
+        status = -1;
+    }
+    
+    if (context != NULL) {
+        fprintf(stderr, "%s: Server error: %s\n", context, message);
+    } else {
+        fprintf(stderr, "Server error: %s\n", message);
+    }
+    return status;
+}
+
+// Send a request frame. A server that turned the connection away may
+// already have answered with an error, so report that if present.
+static int send_request(int client_socket, uint8_t opcode, uint16_t flags, uint32_t request_id,
+                        const void *payload, uint64_t length) {
+    cupid_header_t header;
+    int saved_errno;
+    
+    if (send_frame(client_socket, opcode, flags, request_id, payload, length) == 0) {
+        return 0;
+    }
+    
+    saved_errno = errno;
+    if (recv_header(client_socket, &header) == 0 && header.opcode == CMD_ERROR) {
+        report_server_error(client_socket, &header, NULL);
+    } else {
+        errno = saved_errno;
         perror("Error sending command");
-        close(client_socket);
+    }
+    return -1;
+}
+
+// Print the entries packed into one CMD_LIST_ENTRIES payload
+static int print_list_entries(const unsigned char *payload, size_t length) {
+    size_t offset = 0;
+    
+    while (offset < length) {
+        const unsigned char *p = payload + offset;
+        char name[MAX_PACKET_SIZE];
+        char when[32];
+        time_t mtime;
+        size_t name_len;
+        
+        if (length - offset < LIST_ENTRY_SIZE) {
+            return -1;
+        }
+        name_len = get_u16(p + 17);
+        if (length - offset - LIST_ENTRY_SIZE < name_len) {
+            return -1;
+        }
+        memcpy(name, p + LIST_ENTRY_SIZE, name_len);
+        name[name_len] = '\0';
+        
+        mtime = (time_t)get_u64(p + 9);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+        
+        printf("%c %12llu  %s  %s%s\n",
+               p[0] == ENTRY_FILE ? '-' : p[0] == ENTRY_DIR ? 'd' : '?',
+               (unsigned long long)get_u64(p + 1), when, name,
+               p[0] == ENTRY_DIR ? "/" : "");
+        offset += LIST_ENTRY_SIZE + name_len;
+    }
+    return 0;
+}
+
+// List files on a connected server, printing entries as they arrive.
+// pattern may be NULL; a NULL cursor starts at the beginning; limit 0
+// lists all.
+static int list_on_socket(int client_socket, const char *label, const char *pattern,
+                          const char *cursor, uint32_t limit) {
+    cupid_header_t header;
+    unsigned char request[LIST_REQUEST_SIZE + LIST_CURSOR_MAX + MAX_PATH_LENGTH];
+    unsigned char *payload;
+    size_t pattern_len = pattern != NULL ? strlen(pattern) : 0;
+    size_t cursor_len = cursor != NULL ? strlen(cursor) : 0;
+    int status = EXIT_FAILURE;
+    
+    if (pattern_len >= MAX_PATH_LENGTH) {
+        fprintf(stderr, "Pattern too long\n");
+        return EXIT_FAILURE;
+    }
+    if (cursor_len > LIST_CURSOR_MAX) {
+        fprintf(stderr, "Cursor too long\n");
         return EXIT_FAILURE;
     }
+    put_u32(request, limit);
+    put_u16(request + 4, cursor_len);
+    if (cursor_len > 0) {
+        memcpy(request + LIST_REQUEST_SIZE, cursor, cursor_len);
+    }
+    if (pattern_len > 0) {
+        memcpy(request + LIST_REQUEST_SIZE + cursor_len, pattern, pattern_len);
+    }
     
-    // Receive response
-    bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-    if (bytes_received <= 0) {
-        perror("Error receiving response");
-        close(client_socket);
+    payload = malloc(MAX_PACKET_SIZE);
+    if (payload == NULL) {
+        perror("Error allocating memory");
         return EXIT_FAILURE;
     }
     
-    // Process response
-    if (buffer[0] == CMD_ERROR) {
-        fprintf(stderr, "Server error: %s\n", buffer + 1);
-        close(client_socket);
+    // Send list files command
+    if (send_request(client_socket, CMD_LIST_FILES, 0, 1, request,
+                     LIST_REQUEST_SIZE + cursor_len + pattern_len) == -1) {
+        free(payload);
         return EXIT_FAILURE;
-    } else if (buffer[0] == CMD_LIST_FILES) {
-        printf("Files available on server %s:\n", server_ip);
-        printf("%s\n", buffer + 1);
     }
     
-    close(client_socket);
-    return EXIT_SUCCESS;
+    printf("Files available on server %s:\n", label);
+    
+    // Entries arrive in batches until CMD_LIST_END
+    while (1) {
+        if (recv_header(client_socket, &header) != 0) {
+            perror("Error receiving response");
+            break;
+        }
+        
+        if (header.opcode == CMD_ERROR) {
+            report_server_error(client_socket, &header, NULL);
+            break;
+        }
+        if ((header.opcode != CMD_LIST_ENTRIES && header.opcode != CMD_LIST_END) ||
+            header.length > MAX_PACKET_SIZE ||
+            (header.opcode == CMD_LIST_END && header.length > LIST_CURSOR_MAX)) {
+            fprintf(stderr, "Unexpected response from server\n");
+            break;
+        }
+        
+        if (recv_all(client_socket, payload, header.length) != (ssize_t)header.length) {
+            fprintf(stderr, "Error receiving response: connection closed early\n");
+            break;
+        }
+        
+        if (header.opcode == CMD_LIST_END) {
+            if (header.length > 0) {
+                printf("More entries available: use --cursor '%.*s'\n", (int)header.length, payload);
+            }
+            status = EXIT_SUCCESS;
+            break;
+        }
+        
+        if (print_list_entries(payload, header.length) == -1) {
+            fprintf(stderr, "Malformed listing from server\n");
+            break;
+        }
+    }
+    
+    free(payload);
+    return status;
 }
 
-// Get file from server
-int get_file(const char *server_ip, const char *filename) {
-    int client_socket, file_fd;
-    char buffer[MAX_PACKET_SIZE];
-    ssize_t bytes_received;
+// List files available on server
+int list_files(const char *server_ip, const char *pattern, const char *cursor, uint32_t limit) {
+    int client_socket, status;
     
     // Connect to server
     client_socket = connect_to_server(server_ip);
@@ -251,56 +488,2617 @@ int get_file(const char *server_ip, const char *filename) {
         return EXIT_FAILURE;
     }
     
-    // Send get file command
-    buffer[0] = CMD_GET_FILE;
-    strcpy(buffer + 1, filename);
-    if (send(client_socket, buffer, strlen(filename) + 2, 0) <= 0) {
-        perror("Error sending command");
-        close(client_socket);
+    status = list_on_socket(client_socket, server_ip, pattern, cursor, limit);
+    close(client_socket);
+    return status;
+}
+
+// Connect to address:port, giving up after timeout_ms. Returns the
+// socket, or -1.
+static int connect_quickly(struct in_addr address, uint16_t port, int timeout_ms) {
+    struct sockaddr_in server_addr;
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int client_socket, error = 0;
+    
+    client_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client_socket == -1) {
+        return -1;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr = address;
+    server_addr.sin_port = htons(port);
+    
+    if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        pfd.fd = client_socket;
+        pfd.events = POLLOUT;
+        if (errno != EINPROGRESS || poll(&pfd, 1, timeout_ms) != 1 ||
+            getsockopt(client_socket, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+            close(client_socket);
+            return -1;
+        }
+    }
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) & ~O_NONBLOCK);
+    return client_socket;
+}
+
+// Connect to a discovered server: the address that worked last time
+// first, then the ones it announced, then the one its beacon came from.
+// Records the address that answered.
+static int connect_discovered(discovered_server_t *server) {
+    int client_socket, i;
+    
+    if (server->reachable.s_addr != 0) {
+        client_socket = connect_quickly(server->reachable, server->port,
+                                        DISCOVERY_CONNECT_TIMEOUT_MS);
+        if (client_socket != -1) {
+            return client_socket;
+        }
+    }
+    for (i = 0; i < server->address_count; i++) {
+        if (server->addresses[i].s_addr == server->reachable.s_addr) {
+            continue;
+        }
+        client_socket = connect_quickly(server->addresses[i], server->port,
+                                        DISCOVERY_CONNECT_TIMEOUT_MS);
+        if (client_socket != -1) {
+            server->reachable = server->addresses[i];
+            return client_socket;
+        }
+    }
+    return -1;
+}
+
+// List files on every server found on the network or in the cache
+int list_discovered(const char *pattern, uint32_t limit) {
+    discovered_server_t *servers;
+    char label[DISCOVERY_NAME_MAX + 64], address[INET_ADDRSTRLEN];
+    int count, client_socket, failures = 0, i;
+    
+    count = discovery_find(&servers);
+    if (count <= 0) {
+        printf("No servers found on the network; name one with cupid list <server_ip>\n");
+        free(servers);
         return EXIT_FAILURE;
     }
     
-    // Create local file for writing
-    file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (file_fd == -1) {
-        perror("Error creating local file");
+    for (i = 0; i < count; i++) {
+        discovered_server_t *server = &servers[i];
+        
+        if (i > 0) {
+            printf("\n");
+        }
+        client_socket = connect_discovered(server);
+        if (client_socket == -1) {
+            inet_ntop(AF_INET, &server->addresses[0], address, sizeof(address));
+            printf("Server %s (%s:%u) is not reachable; last heard %lld s ago\n", server->name,
+                   address, server->port, (long long)(time(NULL) - server->last_seen));
+            failures++;
+            continue;
+        }
+        
+        inet_ntop(AF_INET, &server->reachable, address, sizeof(address));
+        snprintf(label, sizeof(label), "%s (%s:%u%s)", server->name, address, server->port,
+                 server->answered ? "" : ", from cache");
+        failures += list_on_socket(client_socket, label, pattern, NULL, limit) != EXIT_SUCCESS;
         close(client_socket);
+    }
+    
+    // Remember which addresses answered
+    discovery_save(servers, count);
+    free(servers);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Fetch and print the server's metrics
+int show_stats(const char *server_ip) {
+    int client_socket;
+    cupid_header_t header;
+    char *payload;
+    int status = EXIT_FAILURE;
+    
+    payload = malloc(MAX_PACKET_SIZE + 1);
+    if (payload == NULL) {
+        perror("Error allocating memory");
         return EXIT_FAILURE;
     }
     
-    printf("Downloading %s from %s...\n", filename, server_ip);
+    client_socket = connect_to_server(server_ip);
+    if (client_socket == -1) {
+        free(payload);
+        return EXIT_FAILURE;
+    }
     
-    // Receive file data
-    size_t total_bytes = 0;
-    while ((bytes_received = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
-        if (buffer[0] == CMD_ERROR) {
-            fprintf(stderr, "Server error: %s\n", buffer + 1);
-            close(file_fd);
-            close(client_socket);
-            unlink(filename); // Delete partial file
-            return EXIT_FAILURE;
-        } else if (buffer[0] == CMD_FILE_DATA) {
-            // Write data to file
-            if (write(file_fd, buffer + 1, bytes_received - 1) != bytes_received - 1) {
-                perror("Error writing to file");
-                close(file_fd);
-                close(client_socket);
-                unlink(filename); // Delete partial file
-                return EXIT_FAILURE;
-            }
-            total_bytes += bytes_received - 1;
+    if (send_request(client_socket, CMD_GET_STATS, 0, 1, NULL, 0) == 0) {
+        if (recv_header(client_socket, &header) != 0) {
+            perror("Error receiving response");
+        } else if (header.opcode == CMD_ERROR) {
+            report_server_error(client_socket, &header, NULL);
+        } else if (header.opcode != CMD_STATS || header.length > MAX_PACKET_SIZE) {
+            fprintf(stderr, "Unexpected response from server\n");
+        } else if (recv_all(client_socket, payload, header.length) != (ssize_t)header.length) {
+            fprintf(stderr, "Error receiving response: connection closed early\n");
+        } else {
+            payload[header.length] = '\0';
+            fputs(payload, stdout);
+            status = EXIT_SUCCESS;
         }
     }
     
-    close(file_fd);
+    free(payload);
     close(client_socket);
+    return status;
+}
+
+// Build the path of the sidecar that records which server version of
+// filename a partial download belongs to: dir/name -> dir/.name.cupid
+static void sidecar_path(const char *filename, char *path, size_t size) {
+    const char *base = strrchr(filename, '/');
+    
+    if (base == NULL) {
+        snprintf(path, size, ".%s.cupid", filename);
+    } else {
+        snprintf(path, size, "%.*s/.%s.cupid", (int)(base - filename), filename, base + 1);
+    }
+}
+
+// Build a GET request for filename. When resuming, ask for the rest of
+// the local partial file provided the server's copy is the one it came
+// from. With compress, offer every codec built in. Returns the payload
+// length and sets *flags.
+static size_t build_get_request(const char *filename, int resume, int compress,
+                                unsigned char *payload, uint16_t *flags) {
+    size_t name_len = strlen(filename);
+    char path[MAX_PATH_LENGTH + 16];
+    unsigned long long size, mtime;
+    struct stat st;
+    FILE *sidecar;
+    
+    *flags = 0;
+    if (resume && stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+        sidecar_path(filename, path, sizeof(path));
+        sidecar = fopen(path, "r");
+        if (sidecar != NULL) {
+            if (fscanf(sidecar, "%llu %llu", &size, &mtime) == 2) {
+                put_u64(payload, st.st_size);
+                put_u64(payload + 8, 0);
+                put_u64(payload + 16, size);
+                put_u64(payload + 24, mtime);
+                memcpy(payload + GET_RANGE_SIZE, filename, name_len);
+                *flags = GET_RANGE | GET_IF_UNCHANGED;
+            }
+            fclose(sidecar);
+        }
+        if (*flags == 0) {
+            printf("%s: nothing to resume from, downloading it again\n", filename);
+        }
+    }
+    
+    if (compress && codec_supported() != 0) {
+        *flags |= GET_COMPRESS | codec_supported() << GET_CODECS_SHIFT;
+    }
+    if (!(*flags & GET_RANGE)) {
+        memcpy(payload, filename, name_len);
+        return name_len;
+    }
+    return GET_RANGE_SIZE + name_len;
+}
+
+// Where a download session's bodies go and what they cost on the wire
+typedef struct {
+    codec_state_t *codecs;      // NULL unless compressed bodies were asked for
+    int codec;                  // Codec of the last compressed block seen
+    uint64_t raw_bytes;         // Body bytes stored
+    uint64_t wire_bytes;        // Body bytes received, block framing included
+    atomic_uint_least64_t *progress;    // Also counts body bytes stored, if set
+    int quiet;                  // Leave out the per-file messages of success
+    int zero_copy;              // Preallocate files and splice raw bodies into them
+    int pipefd[2];              // Pipe for spliced bodies, -1 until first used
+    tcp_tuning_t *tcp;          // Tuning of the connection, NULL for none
+} receive_context_t;
+
+// Count body bytes taken off the socket towards the connection's tuning
+// and say when it grew the receive buffer
+static void tune_received(receive_context_t *context, uint64_t bytes) {
+    char tuning[256];
+    
+    if (context->tcp != NULL && tcp_tune_progress(context->tcp, bytes)) {
+        tcp_tune_describe(context->tcp, tuning, sizeof(tuning));
+        printf("Tuned connection to %s: %s\n", context->tcp->peer, tuning);
+    }
+}
+
+// Start writing back the window of a spliced body that just filled up and
+// drop the one before it from the page cache, so a large download leaves
+// neither a wall of dirty pages nor a cache full of data nobody reads
+static void release_written(int file_fd, off_t window) {
+    sync_file_range(file_fd, window, WRITEBACK_WINDOW, SYNC_FILE_RANGE_WRITE);
+    if (window >= WRITEBACK_WINDOW) {
+        window -= WRITEBACK_WINDOW;
+        sync_file_range(file_fd, window, WRITEBACK_WINDOW,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file_fd, window, WRITEBACK_WINDOW, POSIX_FADV_DONTNEED);
+    }
+}
+
+// Move as much of a raw body as it can from the socket into file_fd at its
+// file offset through the context's pipe, without copying it through user
+// space. What landed is read back from the page cache for the checksum.
+// Stops short, leaving the rest to the copy loop, at the end of the stream,
+// on a socket error or when the socket or the file cannot be spliced.
+// *total counts the body bytes taken off the socket. Returns 0, or -1 when
+// the file could not be written.
+static int splice_body(int client_socket, uint64_t length, int file_fd, char *buffer,
+                       receive_context_t *context, uint32_t *crc, uint64_t *total) {
+    off_t position = lseek(file_fd, 0, SEEK_CUR);
+    off_t window = position;    // Start of the writeback window being filled
+    
+    if (position == -1) {
+        return 0;
+    }
+    if (context->pipefd[0] == -1) {
+        if (pipe2(context->pipefd, O_CLOEXEC) == -1) {
+            return 0;
+        }
+        fcntl(context->pipefd[1], F_SETPIPE_SZ, RECEIVE_PIPE_SIZE);
+    }
+    
+    while (*total < length) {
+        uint64_t remaining = length - *total;
+        size_t want = remaining < RECEIVE_PIPE_SIZE ? remaining : RECEIVE_PIPE_SIZE;
+        ssize_t filled, moved;
+        size_t left;
+        int written = 1;
+        
+        filled = splice(client_socket, NULL, context->pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if (filled == -1 && errno == EINTR) {
+            continue;
+        }
+        if (filled <= 0) {
+            break;
+        }
+        *total += filled;
+        context->wire_bytes += filled;
+        tune_received(context, filled);
+        
+        // Empty the pipe into the file, through buffer if the file refuses splice
+        left = filled;
+        while (left > 0) {
+            moved = splice(context->pipefd[0], NULL, file_fd, NULL, left, SPLICE_F_MOVE);
+            if (moved == -1 && errno == EINTR) {
+                continue;
+            }
+            if (moved <= 0) {
+                break;
+            }
+            left -= moved;
+        }
+        while (left > 0) {
+            size_t chunk = left < TRANSFER_CHUNK_SIZE ? left : TRANSFER_CHUNK_SIZE;
+            
+            moved = read(context->pipefd[0], buffer, chunk);
+            if (moved == -1 && errno == EINTR) {
+                continue;
+            }
+            if (moved <= 0) {
+                break; // Cannot happen with data in the pipe
+            }
+            if (written && write(file_fd, buffer, moved) != moved) {
+                written = 0;
+            }
+            left -= moved;
+        }
+        if (left > 0 || !written) {
+            // A pipe left holding data would corrupt the next body
+            close(context->pipefd[0]);
+            close(context->pipefd[1]);
+            context->pipefd[0] = context->pipefd[1] = -1;
+            return -1;
+        }
+        
+        // Checksum the bytes where they landed, while they are still hot
+        for (left = filled; left > 0; ) {
+            size_t chunk = left < TRANSFER_CHUNK_SIZE ? left : TRANSFER_CHUNK_SIZE;
+            
+            moved = pread(file_fd, buffer, chunk, position);
+            if (moved == -1 && errno == EINTR) {
+                continue;
+            }
+            if (moved <= 0) {
+                return -1;
+            }
+            *crc = crc32c(*crc, buffer, moved);
+            position += moved;
+            left -= moved;
+        }
+        context->raw_bytes += filled;
+        if (context->progress != NULL) {
+            atomic_fetch_add_explicit(context->progress, filled, memory_order_relaxed);
+        }
+        
+        while (position - window >= WRITEBACK_WINDOW) {
+            release_written(file_fd, window);
+            window += WRITEBACK_WINDOW;
+        }
+    }
+    return 0;
+}
+
+// Receive a raw CMD_FILE_DATA body and its checksum trailer into file_fd.
+// On a local error the rest of the body is discarded.
+static int receive_raw_body(int client_socket, const cupid_header_t *header, int file_fd,
+                            char *buffer, receive_context_t *context, uint32_t *crc,
+                            uint32_t *expected) {
+    ssize_t bytes_received = 0;
+    uint64_t total_bytes = 0;
+    
+    if (context->zero_copy &&
+        splice_body(client_socket, header->length, file_fd, buffer, context, crc,
+                    &total_bytes) == -1) {
+        perror("Error writing to file");
+        return skip_file_body(client_socket, header->request_id,
+                              header->length - total_bytes) == 0 ?
+               RECEIVE_FAILED : RECEIVE_BROKEN;
+    }
+
+    // Receive exactly the announced number of bytes
+    while (total_bytes < header->length) {
+        uint64_t remaining = header->length - total_bytes;
+        size_t want = remaining < TRANSFER_CHUNK_SIZE ? remaining : TRANSFER_CHUNK_SIZE;
+        
+        bytes_received = recv(client_socket, buffer, want, 0);
+        if (bytes_received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received <= 0) {
+            break;
+        }
+        total_bytes += bytes_received;
+        context->wire_bytes += bytes_received;
+        tune_received(context, bytes_received);
+        *crc = crc32c(*crc, buffer, bytes_received);
+        
+        // Write data to file
+        if (write(file_fd, buffer, bytes_received) != bytes_received) {
+            perror("Error writing to file");
+            return skip_file_body(client_socket, header->request_id,
+                                  header->length - total_bytes) == 0 ?
+                   RECEIVE_FAILED : RECEIVE_BROKEN;
+        }
+        context->raw_bytes += bytes_received;
+        if (context->progress != NULL) {
+            atomic_fetch_add_explicit(context->progress, bytes_received, memory_order_relaxed);
+        }
+    }
     
     if (bytes_received == -1) {
         perror("Error receiving data");
-        unlink(filename); // Delete partial file
-        return EXIT_FAILURE;
+        return RECEIVE_BROKEN;
     }
+    if (total_bytes != header->length) {
+        fprintf(stderr, "Connection closed early: received %llu of %llu body bytes\n",
+                (unsigned long long)total_bytes, (unsigned long long)header->length);
+        return RECEIVE_BROKEN;
+    }
+    return recv_checksum(client_socket, header->request_id, expected) == 0 ?
+           RECEIVE_OK : RECEIVE_BROKEN;
+}
+
+// Receive CMD_FILE_BLOCK frames up to the checksum trailer, decompressing
+// each block into place as it arrives. header is the first block's.
+// Blocks are read into the upper half of buffer and inflated into the
+// lower half. On a local error, or with file_fd -1, the remaining blocks
+// are drained.
+static int receive_block_body(int client_socket, const cupid_header_t *header, int file_fd,
+                              char *buffer, uint64_t length, receive_context_t *context,
+                              uint32_t *crc, uint32_t *expected) {
+    cupid_header_t frame = *header;
+    unsigned char block_header[FILE_BLOCK_HEADER_SIZE];
+    char *packed = buffer + COMPRESS_BLOCK_SIZE;
+    uint64_t total_bytes = 0;
+    int status = RECEIVE_OK;
     
-    printf("Downloaded %s (%zu bytes)\n", filename, total_bytes);
-    return EXIT_SUCCESS;
-} 
\ No newline at end of file
+    while (1) {
+        uint64_t data_len = frame.length - FILE_BLOCK_HEADER_SIZE;
+        uint32_t raw_len;
+        const char *raw;
+        
+        if (frame.opcode == CMD_FILE_CHECKSUM && frame.length == FILE_CHECKSUM_SIZE) {
+            unsigned char trailer[FILE_CHECKSUM_SIZE];
+            
+            if (recv_all(client_socket, trailer, sizeof(trailer)) != sizeof(trailer)) {
+                perror("Error receiving data");
+                return RECEIVE_BROKEN;
+            }
+            *expected = get_u32(trailer);
+            break;
+        }
+        if (frame.opcode == CMD_ERROR) {
+            return report_server_error(client_socket, &frame, NULL) == 0 ?
+                   RECEIVE_FAILED : RECEIVE_BROKEN;
+        }
+        if (frame.opcode != CMD_FILE_BLOCK || frame.request_id != header->request_id ||
+            frame.length <= FILE_BLOCK_HEADER_SIZE ||
+            data_len > COMPRESS_BLOCK_SIZE ||
+            recv_all(client_socket, block_header, sizeof(block_header)) != sizeof(block_header) ||
+            recv_all(client_socket, packed, data_len) != (ssize_t)data_len) {
+            fprintf(stderr, "Error receiving compressed block\n");
+            return RECEIVE_BROKEN;
+        }
+        context->wire_bytes += CUPID_HEADER_SIZE + frame.length;
+        tune_received(context, CUPID_HEADER_SIZE + frame.length);
+        raw_len = get_u32(block_header);
+        
+        if (frame.flags == CODEC_NONE) {
+            raw = packed;
+            if (raw_len != data_len) {
+                fprintf(stderr, "Malformed block from server\n");
+                return RECEIVE_BROKEN;
+            }
+        } else {
+            context->codec = frame.flags;
+            raw = buffer;
+            if (raw_len > COMPRESS_BLOCK_SIZE ||
+                codec_decompress(context->codecs, frame.flags, packed, data_len, buffer,
+                                 COMPRESS_BLOCK_SIZE) != (ssize_t)raw_len) {
+                fprintf(stderr, "Corrupt %s block from server\n", codec_name(frame.flags));
+                return RECEIVE_BROKEN;
+            }
+        }
+        if (total_bytes + raw_len > length) {
+            fprintf(stderr, "Server sent more than it announced\n");
+            return RECEIVE_BROKEN;
+        }
+        total_bytes += raw_len;
+        *crc = crc32c(*crc, raw, raw_len);
+        
+        if (status == RECEIVE_OK && file_fd != -1) {
+            if (write(file_fd, raw, raw_len) != (ssize_t)raw_len) {
+                perror("Error writing to file");
+                status = RECEIVE_FAILED;
+            } else {
+                context->raw_bytes += raw_len;
+                if (context->progress != NULL) {
+                    atomic_fetch_add_explicit(context->progress, raw_len, memory_order_relaxed);
+                }
+            }
+        }
+        
+        if (recv_header(client_socket, &frame) != 0) {
+            perror("Error receiving data");
+            return RECEIVE_BROKEN;
+        }
+    }
+    
+    if (status == RECEIVE_OK && total_bytes != length) {
+        fprintf(stderr, "Server ended the body early: %llu of %llu bytes\n",
+                (unsigned long long)total_bytes, (unsigned long long)length);
+        status = RECEIVE_FAILED;
+    }
+    return status;
+}
+
+// Receive a file body into a local file, starting at the offset given by
+// the preceding CMD_FILE_INFO. header is the CMD_FILE_DATA frame, or the
+// first CMD_FILE_BLOCK of a compressed body. A partial file is kept with
+// a sidecar so the download can be resumed. On a local error the rest of
+// the body is discarded so the session stays usable. A body that fails
+// its checksum is dropped, back to the resume offset.
+static int receive_file(int client_socket, const cupid_header_t *header,
+                        const unsigned char *info, const char *filename, char *buffer,
+                        receive_context_t *context) {
+    int file_fd, status;
+    uint64_t file_size = get_u64(info);
+    uint64_t offset = get_u64(info + 16);
+    uint64_t wire_start = context->wire_bytes;
+    uint32_t crc = 0, expected;
+    char path[MAX_PATH_LENGTH + 16];
+    FILE *sidecar;
+    
+    // Create local file for writing; a resumed one keeps its first offset
+    // bytes. Spliced bodies are read back for their checksum.
+    file_fd = open(filename, (context->zero_copy ? O_RDWR : O_WRONLY) | O_CREAT |
+                   (offset == 0 ? O_TRUNC : 0), 0644);
+    if (file_fd == -1 ||
+        (offset > 0 && (ftruncate(file_fd, offset) == -1 ||
+                        lseek(file_fd, offset, SEEK_SET) == -1))) {
+        perror(file_fd == -1 ? "Error creating local file" : "Error resuming local file");
+        if (file_fd != -1) {
+            close(file_fd);
+        }
+        // Drain the body so the session stays in step
+        if (header->opcode == CMD_FILE_DATA) {
+            status = skip_file_body(client_socket, header->request_id, header->length) == 0 ?
+                     RECEIVE_OK : RECEIVE_BROKEN;
+        } else {
+            status = receive_block_body(client_socket, header, -1, buffer, file_size - offset,
+                                        context, &crc, &expected);
+        }
+        return status == RECEIVE_BROKEN ? RECEIVE_BROKEN : RECEIVE_FAILED;
+    }
+    
+    // Reserve the rest of the file in one piece rather than growing it a
+    // chunk at a time; its size still follows the data, so an interrupted
+    // download resumes where it stopped
+    if (context->zero_copy && file_size > offset) {
+        fallocate(file_fd, FALLOC_FL_KEEP_SIZE, offset, file_size - offset);
+    }
+    
+    // Remember which version of the file this is until it is complete
+    sidecar_path(filename, path, sizeof(path));
+    sidecar = fopen(path, "w");
+    if (sidecar != NULL) {
+        fprintf(sidecar, "%llu %llu\n", (unsigned long long)file_size,
+                (unsigned long long)get_u64(info + 8));
+        fclose(sidecar);
+    }
+    
+    if (context->quiet) {
+        // A progress line stands in for the per-file messages
+    } else if (offset > 0) {
+        printf("Resuming %s at %llu of %llu bytes...\n", filename,
+               (unsigned long long)offset, (unsigned long long)file_size);
+    } else {
+        printf("Downloading %s (%llu bytes)...\n", filename, (unsigned long long)file_size);
+    }
+    
+    if (header->opcode == CMD_FILE_DATA) {
+        status = receive_raw_body(client_socket, header, file_fd, buffer, context, &crc,
+                                  &expected);
+    } else {
+        status = receive_block_body(client_socket, header, file_fd, buffer,
+                                    file_size - offset, context, &crc, &expected);
+    }
+    close(file_fd);
+    
+    if (status != RECEIVE_OK) {
+        fprintf(stderr, "Partial download of %s kept; use --resume to continue it\n", filename);
+        return status;
+    }
+    
+    if (crc != expected) {
+        fprintf(stderr, "%s: Checksum mismatch (got %08x, expected %08x), download discarded\n",
+                filename, crc, expected);
+        if (offset > 0 && truncate(filename, offset) == 0) {
+            return RECEIVE_FAILED; // The earlier part can still be resumed
+        }
+        unlink(filename);
+        unlink(path);
+        return RECEIVE_FAILED;
+    }
+    
+    unlink(path);
+    if (context->quiet) {
+        return RECEIVE_OK;
+    }
+    if (header->opcode == CMD_FILE_DATA) {
+        printf("Downloaded %s (%llu bytes)\n", filename, (unsigned long long)file_size);
+    } else {
+        printf("Downloaded %s (%llu bytes, %llu on the wire)\n", filename,
+               (unsigned long long)file_size,
+               (unsigned long long)(context->wire_bytes - wire_start));
+    }
+    return RECEIVE_OK;
+}
+
+// A multi-file download spread over a pool of connections
+typedef struct {
+    char **filenames;
+    int count;
+    int resume;
+    int compress;
+    int depth;                  // Requests each connection keeps in flight
+    int quiet;                  // Per-file messages give way to the progress line
+    int zero_copy;              // Splice raw bodies into preallocated files
+    const char *server_ip;      // For the logs
+    pthread_mutex_t lock;
+    pthread_cond_t finished_cond;
+    int next;                   // Next file no connection has claimed
+    int *returned;              // Files given back by broken connections
+    int returned_count;
+    int done;                   // Files answered, downloaded or not
+    int downloaded;
+    int finished;
+    atomic_uint_least64_t received;     // Body bytes stored, for the progress line
+    uint64_t raw_bytes;         // Totals of the connections that ended
+    uint64_t wire_bytes;
+    int codec;
+    struct timespec started;
+} download_t;
+
+// One connection of the pool
+typedef struct {
+    download_t *download;
+    int sock;                   // Closed by the session when it ends
+    int started;                // Runs on its own thread
+    pthread_t thread;
+} download_session_t;
+
+// Seconds since the download started
+static double download_elapsed(const download_t *download) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - download->started.tv_sec) +
+           (now.tv_nsec - download->started.tv_nsec) / 1e9;
+}
+
+// Claim the next file to request: files given back by broken connections
+// first. Returns its index, or -1 when none are left.
+static int claim_file(download_t *download) {
+    int index = -1;
+    
+    pthread_mutex_lock(&download->lock);
+    if (download->returned_count > 0) {
+        index = download->returned[--download->returned_count];
+    } else if (download->next < download->count) {
+        index = download->next++;
+    }
+    pthread_mutex_unlock(&download->lock);
+    return index;
+}
+
+// Fetch files over one connection until none are left, keeping up to
+// depth requests in flight. Files are claimed one at a time as the
+// pipeline has room, so faster connections take more of them.
+// Responses arrive in request order and carry the file index plus one.
+static void *download_session_run(void *arg) {
+    download_session_t *session = arg;
+    download_t *download = session->download;
+    int client_socket = session->sock;
+    int in_flight[PIPELINE_DEPTH];
+    unsigned char request[GET_RANGE_SIZE + MAX_PATH_LENGTH];
+    unsigned char info[FILE_INFO_SIZE];
+    cupid_header_t header;
+    receive_context_t context;
+    tcp_tuning_t tcp;
+    char *buffer;
+    int sent = 0, answered = 0, broken = 0, claimed_all = 0;
+    
+    memset(&context, 0, sizeof(context));
+    tcp_tune_connected(&tcp, client_socket, download->server_ip, 1, NULL, 0);
+    context.tcp = &tcp;
+    context.progress = &download->received;
+    context.quiet = download->quiet;
+    context.zero_copy = download->zero_copy;
+    context.pipefd[0] = context.pipefd[1] = -1;
+    buffer = malloc(TRANSFER_CHUNK_SIZE);
+    if (buffer == NULL || (download->compress && (context.codecs = codec_state_new()) == NULL)) {
+        perror("Error allocating memory");
+        broken = 1;
+    }
+    
+    while (!broken) {
+        int index, ok = 0;
+        
+        // Keep the pipeline full
+        while (!claimed_all && sent - answered < download->depth) {
+            uint16_t flags;
+            size_t length;
+            
+            index = claim_file(download);
+            if (index == -1) {
+                claimed_all = 1;
+                break;
+            }
+            in_flight[sent % PIPELINE_DEPTH] = index;
+            sent++;
+            length = build_get_request(download->filenames[index], download->resume,
+                                       download->compress, request, &flags);
+            if (send_request(client_socket, CMD_GET_FILE, flags, index + 1, request, length) == -1) {
+                broken = 1;
+                break;
+            }
+        }
+        if (broken || sent == answered) {
+            break;
+        }
+        
+        index = in_flight[answered % PIPELINE_DEPTH];
+        if (recv_header(client_socket, &header) != 0) {
+            perror("Error receiving response");
+            break;
+        }
+        if (header.request_id != (uint32_t)index + 1) {
+            fprintf(stderr, "Unexpected response from server\n");
+            break;
+        }
+        
+        // From here on the file counts as answered, even if the session breaks
+        answered++;
+        if (header.opcode == CMD_ERROR) {
+            if (report_server_error(client_socket, &header, download->filenames[index]) == -1) {
+                broken = 1;
+            }
+        } else if (header.opcode == CMD_FILE_INFO && header.length == FILE_INFO_SIZE) {
+            int status;
+            
+            // The body follows its file info
+            if (recv_all(client_socket, info, sizeof(info)) != sizeof(info) ||
+                recv_header(client_socket, &header) != 0) {
+                perror("Error receiving response");
+                broken = 1;
+            } else if ((header.opcode != CMD_FILE_DATA &&
+                        (header.opcode != CMD_FILE_BLOCK || context.codecs == NULL)) ||
+                       header.request_id != (uint32_t)index + 1) {
+                fprintf(stderr, "Unexpected response from server\n");
+                broken = 1;
+            } else {
+                status = receive_file(client_socket, &header, info, download->filenames[index],
+                                      buffer, &context);
+                broken = status == RECEIVE_BROKEN;
+                ok = status == RECEIVE_OK;
+            }
+        } else {
+            fprintf(stderr, "Unexpected response from server\n");
+            broken = 1;
+        }
+        
+        pthread_mutex_lock(&download->lock);
+        download->done++;
+        download->downloaded += ok;
+        pthread_mutex_unlock(&download->lock);
+    }
+    
+    // Requests this connection never got an answer to go to the others
+    pthread_mutex_lock(&download->lock);
+    while (answered < sent) {
+        download->returned[download->returned_count++] = in_flight[answered++ % PIPELINE_DEPTH];
+    }
+    download->raw_bytes += context.raw_bytes;
+    download->wire_bytes += context.wire_bytes;
+    if (context.codec != CODEC_NONE) {
+        download->codec = context.codec;
+    }
+    pthread_mutex_unlock(&download->lock);
+    
+    // Closing now frees the server's worker for a connection still queued
+    close(client_socket);
+    if (context.pipefd[0] != -1) {
+        close(context.pipefd[0]);
+        close(context.pipefd[1]);
+    }
+    free(buffer);
+    codec_state_free(context.codecs);
+    return NULL;
+}
+
+// Show aggregate progress until the download finishes: redrawn in place
+// on a terminal, a line every few seconds in a log
+static void *download_progress_run(void *arg) {
+    download_t *download = arg;
+    int tty = isatty(STDERR_FILENO);
+    struct timespec deadline;
+    
+    pthread_mutex_lock(&download->lock);
+    while (!download->finished) {
+        uint64_t received;
+        double seconds;
+        
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += tty ? 200000000 : 0;
+        deadline.tv_sec += tty ? 0 : 5;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&download->finished_cond, &download->lock, &deadline);
+        if (download->finished) {
+            break;
+        }
+        
+        received = atomic_load_explicit(&download->received, memory_order_relaxed);
+        seconds = download_elapsed(download);
+        fprintf(stderr, "%s%d/%d files, %.1f MB, %.1f MB/s%s", tty ? "\r" : "",
+                download->done, download->count, received / 1e6,
+                seconds > 0 ? received / seconds / 1e6 : 0.0, tty ? "\033[K" : "\n");
+    }
+    if (tty) {
+        fputs("\r\033[K", stderr);
+    }
+    pthread_mutex_unlock(&download->lock);
+    return NULL;
+}
+
+// Open another connection to the server sock is connected to, from the
+// same local address, without going through connect_to_server()'s
+// fallbacks again
+static int connect_again(int sock) {
+    struct sockaddr_in local, peer;
+    socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+    int new_sock;
+    
+    if (getsockname(sock, (struct sockaddr *)&local, &local_len) == -1 ||
+        getpeername(sock, (struct sockaddr *)&peer, &peer_len) == -1) {
+        return -1;
+    }
+    local.sin_port = 0;
+    
+    new_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (new_sock == -1) {
+        return -1;
+    }
+    if (bind(new_sock, (struct sockaddr *)&local, sizeof(local)) == -1 ||
+        connect(new_sock, (struct sockaddr *)&peer, sizeof(peer)) == -1) {
+        close(new_sock);
+        return -1;
+    }
+    return new_sock;
+}
+
+// Get several files concurrently over a pool of up to connections
+// connections, each pipelining its requests so a file costs no extra
+// round trip. Only the first connection goes through connect_to_server();
+// the rest reuse the route it found. With resume, files partially
+// downloaded earlier continue where they stopped. With compress, bodies
+// may arrive as compressed blocks and the effective ratio and throughput
+// are reported at the end. With zero_copy, files are preallocated and raw
+// bodies spliced into them.
+static int get_files_pooled(const char *server_ip, char **filenames, int count, int resume,
+                            int compress, int zero_copy, int connections) {
+    download_session_t sessions[MAX_STREAMS];
+    download_t download;
+    pthread_t progress;
+    int i, opened = 0, show_progress = count > 1;
+    double seconds;
+    
+    for (i = 0; i < count; i++) {
+        if (strlen(filenames[i]) >= MAX_PATH_LENGTH) {
+            fprintf(stderr, "%s: File name too long\n", filenames[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (compress && codec_supported() == 0) {
+        fprintf(stderr, "No compression codecs were built in; downloading uncompressed\n");
+        compress = 0;
+    }
+    if (connections > count) {
+        connections = count;
+    }
+    
+    memset(&download, 0, sizeof(download));
+    download.filenames = filenames;
+    download.count = count;
+    download.resume = resume;
+    download.compress = compress;
+    download.zero_copy = zero_copy;
+    download.server_ip = server_ip;
+    // A short list is spread out rather than queued behind one connection
+    download.depth = count / connections;
+    if (download.depth < 1) {
+        download.depth = 1;
+    } else if (download.depth > PIPELINE_DEPTH) {
+        download.depth = PIPELINE_DEPTH;
+    }
+    download.quiet = show_progress && isatty(STDERR_FILENO);
+    atomic_init(&download.received, 0);
+    download.returned = malloc(count * sizeof(int));
+    if (download.returned == NULL) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+    }
+    
+    sessions[0].sock = connect_to_server(server_ip);
+    if (sessions[0].sock == -1) {
+        free(download.returned);
+        return EXIT_FAILURE;
+    }
+    for (opened = 1; opened < connections; opened++) {
+        sessions[opened].sock = connect_again(sessions[0].sock);
+        if (sessions[opened].sock == -1) {
+            break;
+        }
+    }
+    
+    pthread_mutex_init(&download.lock, NULL);
+    pthread_cond_init(&download.finished_cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &download.started);
+    if (show_progress && pthread_create(&progress, NULL, download_progress_run, &download) != 0) {
+        show_progress = 0;
+    }
+    
+    // The first connection is served on this thread
+    for (i = 0; i < opened; i++) {
+        sessions[i].download = &download;
+        sessions[i].started = i > 0 && pthread_create(&sessions[i].thread, NULL,
+                                                      download_session_run, &sessions[i]) == 0;
+        if (i > 0 && !sessions[i].started) {
+            close(sessions[i].sock);
+        }
+    }
+    download_session_run(&sessions[0]);
+    for (i = 1; i < opened; i++) {
+        if (sessions[i].started) {
+            pthread_join(sessions[i].thread, NULL);
+        }
+    }
+    seconds = download_elapsed(&download);
+    
+    if (show_progress) {
+        pthread_mutex_lock(&download.lock);
+        download.finished = 1;
+        pthread_cond_signal(&download.finished_cond);
+        pthread_mutex_unlock(&download.lock);
+        pthread_join(progress, NULL);
+    }
+    pthread_cond_destroy(&download.finished_cond);
+    pthread_mutex_destroy(&download.lock);
+    free(download.returned);
+    
+    if (count > 1) {
+        printf("Downloaded %d of %d files from %s in %.1f s, %.1f MB/s over %d connection%s\n",
+               download.downloaded, count, server_ip, seconds,
+               seconds > 0 ? download.raw_bytes / seconds / 1e6 : 0.0, opened,
+               opened == 1 ? "" : "s");
+    }
+    if (compress && download.wire_bytes > 0) {
+        printf("Compression (%s): %llu bytes in %llu on the wire, ratio %.2f, "
+               "%.1f MB/s effective, %.1f MB/s on the wire\n",
+               download.codec != CODEC_NONE ? codec_name(download.codec) : "no block compressed",
+               (unsigned long long)download.raw_bytes, (unsigned long long)download.wire_bytes,
+               (double)download.raw_bytes / download.wire_bytes,
+               seconds > 0 ? download.raw_bytes / seconds / 1e6 : 0.0,
+               seconds > 0 ? download.wire_bytes / seconds / 1e6 : 0.0);
+    }
+    
+    return download.downloaded == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// A file being fetched in byte ranges over several connections
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // A segment finished or was given back
+    const char *filename;
+    int file_fd;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t next;              // Start of the unclaimed tail of the file
+    uint64_t received;          // Bytes written into place so far
+    uint64_t returned_offset[MAX_STREAMS];  // Ranges given back by failed streams
+    uint64_t returned_length[MAX_STREAMS];
+    int returned;
+    int streams;                // Streams still running
+    int busy;                   // Streams holding a segment
+    double rate[MAX_STREAMS];   // Bytes per second of each running stream, 0 until known
+    const uint64_t *block_hashes;   // xxh64 of each block to check, NULL for none
+    uint32_t block_size;
+} segmented_file_t;
+
+// One connection of a parallel download
+typedef struct {
+    int sock;
+    uint32_t request_id;
+    int index;                  // Position in the stream array
+    const char *source;         // Server address, for messages
+    segmented_file_t *file;
+    char *buffer;
+    uint64_t size;              // Version of the file expected from this server
+    uint64_t mtime;
+    uint64_t bytes;             // Stored from this stream for the current file
+    double seconds;             // Spent fetching them
+    int first_claimed;          // Headers of a first segment were already read
+    uint64_t first_offset;
+    uint64_t first_length;
+    int started;
+    pthread_t thread;
+} segment_stream_t;
+
+// Claim the next range to fetch: ranges returned by failed streams
+// first, then a guided share of what is left of the file, weighted by
+// how fast this stream has been against the others so that slow
+// streams are not left holding large ranges at the end. With nothing
+// left, wait while other streams might still give a range back.
+static int claim_segment(segmented_file_t *file, segment_stream_t *stream,
+                         uint64_t *offset, uint64_t *length) {
+    uint64_t remaining, share;
+    double total = 0;
+    int found = 1, known = 0, i;
+    
+    pthread_mutex_lock(&file->lock);
+    while (file->returned == 0 && file->next >= file->size && file->busy > 0) {
+        pthread_cond_wait(&file->changed, &file->lock);
+    }
+    
+    if (file->returned > 0) {
+        file->returned--;
+        *offset = file->returned_offset[file->returned];
+        *length = file->returned_length[file->returned];
+    } else if (file->next < file->size) {
+        remaining = file->size - file->next;
+        share = remaining / (2 * (uint64_t)file->streams);
+        
+        // Streams not measured yet count as average ones
+        for (i = 0; i < MAX_STREAMS; i++) {
+            if (file->rate[i] > 0) {
+                total += file->rate[i];
+                known++;
+            }
+        }
+        if (file->rate[stream->index] > 0) {
+            if (known < file->streams) {
+                total += total / known * (file->streams - known);
+            }
+            share = remaining * (file->rate[stream->index] / total) / 2;
+        }
+        
+        if (share < SEGMENT_MIN_SIZE) {
+            share = SEGMENT_MIN_SIZE;
+        } else if (share > SEGMENT_MAX_SIZE) {
+            share = SEGMENT_MAX_SIZE;
+        }
+        
+        // Checked ranges start on a block boundary
+        if (file->block_hashes != NULL) {
+            share = (share + file->block_size - 1) / file->block_size * file->block_size;
+        }
+        *offset = file->next;
+        *length = share < remaining ? share : remaining;
+        file->next += *length;
+    } else {
+        found = 0;
+    }
+    if (found) {
+        file->busy++;
+    }
+    pthread_mutex_unlock(&file->lock);
+    return found;
+}
+
+// Receive a segment body and write it into place. Returns the number of
+// bytes stored; fewer than length means the stream failed. Only verified
+// bytes count: a segment that fails its checksum, or ends before its
+// checksum arrives, counts as not stored at all. With block hashes, each
+// block is checked as it completes and a mismatch or a short segment
+// stops after the last good block.
+static uint64_t receive_segment(segment_stream_t *stream, uint64_t offset, uint64_t length) {
+    segmented_file_t *file = stream->file;
+    uint64_t done = 0, checked = 0, block_end = 0;
+    uint32_t crc = 0, expected;
+    xxh64_state_t state;
+    int bad = 0;
+    
+    if (file->block_hashes != NULL) {
+        xxh64_init(&state, 0);
+        block_end = offset + file->block_size < file->size ? offset + file->block_size : file->size;
+    }
+    
+    while (done < length && !bad) {
+        uint64_t remaining = length - done;
+        size_t want = remaining < TRANSFER_CHUNK_SIZE ? remaining : TRANSFER_CHUNK_SIZE;
+        ssize_t received = recv(stream->sock, stream->buffer, want, 0);
+        
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        if (pwrite(file->file_fd, stream->buffer, received, offset + done) != received) {
+            perror("Error writing to file");
+            break;
+        }
+        crc = crc32c(crc, stream->buffer, received);
+        
+        // Check every block this piece completes against its hash
+        if (file->block_hashes != NULL) {
+            uint64_t at = offset + done, end = at + received;
+            
+            while (at < end) {
+                uint64_t take = (end < block_end ? end : block_end) - at;
+                uint64_t block = (block_end - 1) / file->block_size;
+                
+                xxh64_update(&state, stream->buffer + (at - offset - done), take);
+                at += take;
+                if (at < block_end) {
+                    continue;
+                }
+                if (xxh64_digest(&state) != file->block_hashes[block]) {
+                    fprintf(stderr, "%s: Block at %llu from %s does not match the other copies, "
+                            "fetching it elsewhere\n", file->filename,
+                            (unsigned long long)(block * file->block_size), stream->source);
+                    bad = 1;
+                    break;
+                }
+                checked = block_end - offset;
+                xxh64_init(&state, 0);
+                block_end = block_end + file->block_size < file->size ?
+                            block_end + file->block_size : file->size;
+            }
+        }
+        done += received;
+    }
+    
+    if (bad) {
+        return checked;
+    }
+    if (done == length) {
+        if (recv_checksum(stream->sock, stream->request_id, &expected) == -1) {
+            return 0;
+        }
+        if (crc != expected) {
+            fprintf(stderr, "%s: Checksum mismatch in bytes %llu-%llu, fetching them again\n",
+                    file->filename, (unsigned long long)offset,
+                    (unsigned long long)(offset + length));
+            return 0;
+        }
+    }
+    
+    // Unchecked bytes are fetched again: those after the last whole block,
+    // or without block hashes the whole segment, whose CRC never arrived
+    if (done < length) {
+        return file->block_hashes != NULL ? checked : 0;
+    }
+    return done;
+}
+
+// Account for a claimed segment of which stored bytes arrived in seconds,
+// giving the rest back for another stream when the stream failed
+static void finish_segment(segment_stream_t *stream, uint64_t offset, uint64_t length,
+                           uint64_t stored, double seconds) {
+    segmented_file_t *file = stream->file;
+    double *rate = &file->rate[stream->index];
+    
+    pthread_mutex_lock(&file->lock);
+    file->received += stored;
+    stream->bytes += stored;
+    stream->seconds += seconds;
+    if (stored < length) {
+        file->returned_offset[file->returned] = offset + stored;
+        file->returned_length[file->returned] = length - stored;
+        file->returned++;
+        file->streams--;
+        *rate = 0;
+    } else if (seconds > 0) {
+        // Recent segments weigh most, as a server's load changes
+        *rate = *rate > 0 ? (*rate * 3 + stored / seconds) / 4 : stored / seconds;
+    }
+    file->busy--;
+    pthread_cond_broadcast(&file->changed);
+    pthread_mutex_unlock(&file->lock);
+}
+
+// Request a byte range and read the frames that precede its body.
+// Returns the body length, or -1 when the stream cannot continue.
+static int64_t request_segment(segment_stream_t *stream, uint64_t offset, uint64_t length,
+                               unsigned char *info) {
+    segmented_file_t *file = stream->file;
+    unsigned char request[GET_RANGE_SIZE + MAX_PATH_LENGTH];
+    size_t name_len = strlen(file->filename);
+    cupid_header_t header;
+    
+    put_u64(request, offset);
+    put_u64(request + 8, length);
+    put_u64(request + 16, 0);
+    put_u64(request + 24, 0);
+    memcpy(request + GET_RANGE_SIZE, file->filename, name_len);
+    
+    stream->request_id++;
+    if (send_request(stream->sock, CMD_GET_FILE, GET_RANGE, stream->request_id,
+                     request, GET_RANGE_SIZE + name_len) == -1 ||
+        recv_header(stream->sock, &header) != 0) {
+        return -1;
+    }
+    if (header.opcode == CMD_ERROR) {
+        report_server_error(stream->sock, &header, file->filename);
+        return -1;
+    }
+    if (header.opcode != CMD_FILE_INFO || header.length != FILE_INFO_SIZE ||
+        header.request_id != stream->request_id ||
+        recv_all(stream->sock, info, FILE_INFO_SIZE) != FILE_INFO_SIZE ||
+        recv_header(stream->sock, &header) != 0 || header.opcode != CMD_FILE_DATA) {
+        fprintf(stderr, "%s: Unexpected response from server\n", file->filename);
+        return -1;
+    }
+    return header.length;
+}
+
+// Stream thread: fetch claimed ranges until the file is covered
+static void *segment_stream_run(void *arg) {
+    segment_stream_t *stream = arg;
+    segmented_file_t *file = stream->file;
+    unsigned char info[FILE_INFO_SIZE];
+    uint64_t offset = stream->first_offset, length = stream->first_length;
+    uint64_t stored;
+    int64_t announced;
+    struct timespec started, now;
+    
+    // The first segment of the first stream was requested up front
+    if (stream->first_claimed) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        stored = receive_segment(stream, offset, length);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        finish_segment(stream, offset, length, stored, (now.tv_sec - started.tv_sec) +
+                       (now.tv_nsec - started.tv_nsec) / 1e9);
+        if (stored < length) {
+            goto failed;
+        }
+    }
+    
+    while (claim_segment(file, stream, &offset, &length)) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        announced = request_segment(stream, offset, length, info);
+        
+        // Every range must come from the same version of the file
+        if (announced != -1 &&
+            (get_u64(info) != stream->size || get_u64(info + 8) != stream->mtime ||
+             (uint64_t)announced != length)) {
+            fprintf(stderr, "%s: File changed on %s during download\n", file->filename,
+                    stream->source);
+            announced = -1;
+        }
+        
+        stored = announced == -1 ? 0 : receive_segment(stream, offset, length);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        finish_segment(stream, offset, length, stored, (now.tv_sec - started.tv_sec) +
+                       (now.tv_nsec - started.tv_nsec) / 1e9);
+        if (stored < length) {
+            goto failed;
+        }
+    }
+    return NULL;
+    
+failed:
+    close(stream->sock);
+    stream->sock = -1;
+    return NULL;
+}
+
+// Fetch one file over the open stream connections. Without block_hashes
+// the first segment tells the file's version; with them, each stream's
+// size and mtime were set from its server and every block is checked
+// against its hash of block_size bytes. Returns 0 or -1.
+static int get_file_segmented(segment_stream_t *streams, int count, const char *filename,
+                              const uint64_t *block_hashes, uint32_t block_size) {
+    segmented_file_t file;
+    unsigned char info[FILE_INFO_SIZE];
+    int64_t first;
+    int i, j;
+    
+    memset(&file, 0, sizeof(file));
+    pthread_mutex_init(&file.lock, NULL);
+    pthread_cond_init(&file.changed, NULL);
+    file.filename = filename;
+    file.file_fd = -1;
+    file.block_hashes = block_hashes;
+    file.block_size = block_size;
+    for (i = 0; i < count; i++) {
+        streams[i].index = i;
+        streams[i].file = &file;
+        streams[i].bytes = 0;
+        streams[i].seconds = 0;
+        streams[i].first_claimed = 0;
+        streams[i].first_offset = 0;
+        streams[i].first_length = 0;
+        streams[i].started = 0;
+        if (streams[i].sock != -1) {
+            file.streams++;
+        }
+    }
+    if (file.streams == 0 || strlen(filename) >= MAX_PATH_LENGTH) {
+        fprintf(stderr, "%s: Cannot download\n", filename);
+        pthread_cond_destroy(&file.changed);
+        pthread_mutex_destroy(&file.lock);
+        return -1;
+    }
+    
+    // The first segment tells the file size and version
+    for (i = 0; streams[i].sock == -1; i++)
+        ;
+    first = request_segment(&streams[i], 0, block_hashes != NULL ? SEGMENT_MIN_SIZE :
+                            SEGMENT_MAX_SIZE, info);
+    if (first == -1) {
+        pthread_cond_destroy(&file.changed);
+        pthread_mutex_destroy(&file.lock);
+        return -1;
+    }
+    file.size = get_u64(info);
+    file.mtime = get_u64(info + 8);
+    if (block_hashes == NULL) {
+        for (j = 0; j < count; j++) {
+            streams[j].size = file.size;
+            streams[j].mtime = file.mtime;
+        }
+    } else if (file.size != streams[i].size || file.mtime != streams[i].mtime ||
+               (uint64_t)first > file.size) {
+        fprintf(stderr, "%s: File changed on %s during download\n", filename, streams[i].source);
+        pthread_cond_destroy(&file.changed);
+        pthread_mutex_destroy(&file.lock);
+        close(streams[i].sock);
+        streams[i].sock = -1;
+        return -1;
+    }
+    file.next = first;
+    file.busy = 1;
+    streams[i].first_claimed = 1;
+    streams[i].first_length = first;
+    
+    // Allocate the whole file up front so ranges land in place
+    file.file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file.file_fd == -1 ||
+        (file.size > 0 && posix_fallocate(file.file_fd, 0, file.size) != 0 &&
+         ftruncate(file.file_fd, file.size) == -1)) {
+        perror("Error creating local file");
+        if (file.file_fd != -1) {
+            close(file.file_fd);
+        }
+        pthread_cond_destroy(&file.changed);
+        pthread_mutex_destroy(&file.lock);
+        skip_file_body(streams[i].sock, streams[i].request_id, first);
+        return -1;
+    }
+    
+    printf("Downloading %s (%llu bytes) over %d streams...\n", filename,
+           (unsigned long long)file.size, file.streams);
+    
+    for (i = 0; i < count; i++) {
+        if (streams[i].sock == -1) {
+            continue;
+        }
+        if (pthread_create(&streams[i].thread, NULL, segment_stream_run, &streams[i]) != 0) {
+            perror("Error creating thread");
+            if (streams[i].first_claimed) {
+                finish_segment(&streams[i], 0, streams[i].first_length, 0, 0);
+            }
+            close(streams[i].sock);
+            streams[i].sock = -1;
+            continue;
+        }
+        streams[i].started = 1;
+    }
+    for (i = 0; i < count; i++) {
+        if (streams[i].started) {
+            pthread_join(streams[i].thread, NULL);
+        }
+    }
+    
+    close(file.file_fd);
+    pthread_cond_destroy(&file.changed);
+    pthread_mutex_destroy(&file.lock);
+    
+    if (file.received != file.size) {
+        fprintf(stderr, "%s: Download incomplete: received %llu of %llu bytes\n", filename,
+                (unsigned long long)file.received, (unsigned long long)file.size);
+        unlink(filename);
+        return -1;
+    }
+    
+    printf("Downloaded %s (%llu bytes)\n", filename, (unsigned long long)file.size);
+    return 0;
+}
+
+// Get files one after another, each split into byte ranges fetched over
+// several connections at once
+static int get_files_parallel(const char *server_ip, char **filenames, int count, int streams) {
+    segment_stream_t stream[MAX_STREAMS];
+    int i, connected = 0, failures = 0;
+    
+    memset(stream, 0, sizeof(stream));
+    for (i = 0; i < streams; i++) {
+        stream[i].source = server_ip;
+        stream[i].sock = connect_to_server(server_ip);
+        stream[i].buffer = malloc(TRANSFER_CHUNK_SIZE);
+        if (stream[i].buffer == NULL && stream[i].sock != -1) {
+            close(stream[i].sock);
+            stream[i].sock = -1;
+        }
+        if (stream[i].sock != -1) {
+            connected++;
+        }
+    }
+    
+    if (connected == 0) {
+        failures = count;
+    }
+    for (i = 0; i < count && connected > 0; i++) {
+        if (get_file_segmented(stream, streams, filenames[i], NULL, 0) == -1) {
+            failures++;
+        }
+    }
+    
+    for (i = 0; i < streams; i++) {
+        if (stream[i].sock != -1) {
+            close(stream[i].sock);
+        }
+        free(stream[i].buffer);
+    }
+    
+    if (count > 1) {
+        printf("Downloaded %d of %d files from %s\n", count - failures, count, server_ip);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Pick a delta block size near the square root of the file size, which
+// balances signature volume against the bytes resent per changed block
+static uint32_t choose_block_size(uint64_t size) {
+    uint32_t block_size = DELTA_MIN_BLOCK_SIZE;
+    
+    while (block_size < MAX_BLOCK_SIZE && (uint64_t)block_size * block_size < size) {
+        block_size <<= 1;
+    }
+    return block_size;
+}
+
+// Block signatures of the server's copy of a file
+typedef struct {
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t file_hash;
+    uint32_t block_size;
+    size_t count;
+    uint32_t *weak;
+    uint64_t *strong;
+    uint64_t *source;           // Local offset holding the block, or NO_SOURCE
+    int32_t *buckets;           // Weak checksum hash table over full blocks
+    int32_t *chain;
+    size_t bucket_mask;
+} delta_plan_t;
+
+// Marks a block that has to be fetched from the server
+#define NO_SOURCE UINT64_MAX
+
+// Free a delta plan
+static void delta_plan_free(delta_plan_t *plan) {
+    free(plan->weak);
+    free(plan->strong);
+    free(plan->source);
+    free(plan->buckets);
+    free(plan->chain);
+}
+
+// Receive the signature stream that follows CMD_FILE_INFO.
+// Returns RECEIVE_OK, or RECEIVE_FAILED / RECEIVE_BROKEN on errors.
+static int receive_signatures(int client_socket, const char *filename, delta_plan_t *plan) {
+    unsigned char payload[MAX_PACKET_SIZE];
+    cupid_header_t header;
+    size_t have = 0, i;
+    
+    plan->count = plan->size / plan->block_size + (plan->size % plan->block_size != 0);
+    plan->weak = malloc((plan->count + 1) * sizeof(uint32_t));
+    plan->strong = malloc((plan->count + 1) * sizeof(uint64_t));
+    plan->source = malloc((plan->count + 1) * sizeof(uint64_t));
+    plan->chain = malloc((plan->count + 1) * sizeof(int32_t));
+    for (plan->bucket_mask = 1; plan->bucket_mask < plan->count * 2; plan->bucket_mask <<= 1)
+        ;
+    plan->buckets = malloc(plan->bucket_mask * sizeof(int32_t));
+    plan->bucket_mask--;
+    if (plan->weak == NULL || plan->strong == NULL || plan->source == NULL ||
+        plan->chain == NULL || plan->buckets == NULL) {
+        perror("Error allocating memory");
+        return RECEIVE_BROKEN;
+    }
+    
+    while (1) {
+        if (recv_header(client_socket, &header) != 0) {
+            perror("Error receiving signatures");
+            return RECEIVE_BROKEN;
+        }
+        if (header.opcode == CMD_ERROR) {
+            return report_server_error(client_socket, &header, filename) == 0 ?
+                   RECEIVE_FAILED : RECEIVE_BROKEN;
+        }
+        if (header.length > sizeof(payload) ||
+            recv_all(client_socket, payload, header.length) != (ssize_t)header.length) {
+            fprintf(stderr, "%s: Unexpected response from server\n", filename);
+            return RECEIVE_BROKEN;
+        }
+        
+        if (header.opcode == CMD_SIGNATURES_END && header.length == SIGNATURES_END_SIZE &&
+            have == plan->count) {
+            plan->file_hash = get_u64(payload);
+            break;
+        }
+        if (header.opcode != CMD_SIGNATURES || header.length % SIGNATURE_SIZE != 0 ||
+            have + header.length / SIGNATURE_SIZE > plan->count) {
+            fprintf(stderr, "%s: Unexpected response from server\n", filename);
+            return RECEIVE_BROKEN;
+        }
+        for (i = 0; i < header.length; i += SIGNATURE_SIZE, have++) {
+            plan->weak[have] = get_u32(payload + i);
+            plan->strong[have] = get_u64(payload + i + 4);
+        }
+    }
+    
+    // Index full blocks by weak checksum; a short last block is only
+    // ever matched in place
+    memset(plan->buckets, -1, (plan->bucket_mask + 1) * sizeof(int32_t));
+    for (i = 0; i < plan->count; i++) {
+        plan->source[i] = NO_SOURCE;
+        if ((i + 1) * plan->block_size <= plan->size) {
+            size_t bucket = plan->weak[i] & plan->bucket_mask;
+            plan->chain[i] = plan->buckets[bucket];
+            plan->buckets[bucket] = i;
+        }
+    }
+    return RECEIVE_OK;
+}
+
+// Record the blocks whose content sits at offset of the local copy.
+// Blocks are only taken from at or after their own offset so the file
+// can be rebuilt in place in one forward pass; a block already in its
+// own place is preferred. Returns 1 if any block was assigned.
+static int match_blocks(delta_plan_t *plan, const unsigned char *map, uint64_t offset,
+                        uint32_t weak) {
+    int32_t j = plan->buckets[weak & plan->bucket_mask];
+    uint64_t strong = 0;
+    int have_strong = 0, matched = 0;
+    
+    for (; j != -1; j = plan->chain[j]) {
+        uint64_t home = (uint64_t)j * plan->block_size;
+        
+        if (plan->weak[j] != weak || offset < home ||
+            (plan->source[j] != NO_SOURCE && plan->source[j] == home)) {
+            continue;
+        }
+        if (!have_strong) {
+            strong = xxh64(map + offset, plan->block_size, 0);
+            have_strong = 1;
+        }
+        if (plan->strong[j] == strong && (plan->source[j] == NO_SOURCE || offset == home)) {
+            plan->source[j] = offset;
+            matched = 1;
+        }
+    }
+    return matched;
+}
+
+// Slide over the local copy looking for blocks of the server's file
+static void find_local_blocks(delta_plan_t *plan, const unsigned char *map, uint64_t local_size) {
+    uint32_t block_size = plan->block_size;
+    uint64_t offset = 0;
+    uint32_t weak = 0;
+    int fresh = 1;
+    
+    while (offset + block_size <= local_size) {
+        if (fresh) {
+            weak = rolling_checksum(map + offset, block_size);
+            fresh = 0;
+        }
+        if (match_blocks(plan, map, offset, weak)) {
+            offset += block_size;
+            fresh = 1;
+            continue;
+        }
+        if (offset + block_size < local_size) {
+            weak = rolling_checksum_roll(weak, block_size, map[offset], map[offset + block_size]);
+        }
+        offset++;
+    }
+    
+    // A short last block can still be unchanged in place
+    if (plan->count > 0 && plan->size % block_size != 0) {
+        size_t last = plan->count - 1;
+        uint64_t home = (uint64_t)last * block_size;
+        size_t len = plan->size - home;
+        
+        if (home + len <= local_size && rolling_checksum(map + home, len) == plan->weak[last] &&
+            xxh64(map + home, len, 0) == plan->strong[last]) {
+            plan->source[last] = home;
+        }
+    }
+}
+
+// Move blocks found elsewhere in the local copy to their place, in
+// ascending order so no source is overwritten before it is read
+static int copy_local_blocks(const delta_plan_t *plan, int file_fd, char *buffer,
+                             uint64_t *moved) {
+    size_t j;
+    
+    for (j = 0; j < plan->count; j++) {
+        uint64_t home = (uint64_t)j * plan->block_size;
+        size_t len = plan->size - home < plan->block_size ? plan->size - home : plan->block_size;
+        
+        if (plan->source[j] == NO_SOURCE || plan->source[j] == home) {
+            continue;
+        }
+        if (pread(file_fd, buffer, len, plan->source[j]) != (ssize_t)len ||
+            pwrite(file_fd, buffer, len, home) != (ssize_t)len) {
+            perror("Error rearranging local file");
+            return -1;
+        }
+        *moved += len;
+    }
+    return 0;
+}
+
+// Fetch the byte ranges of all blocks without a local source, pipelined
+// on the open connection, and write them into place. A range that fails
+// its checksum makes the sync fall back once the pipeline is drained.
+static int fetch_missing_blocks(int client_socket, uint32_t *request_id, const char *filename,
+                                const delta_plan_t *plan, int file_fd, char *buffer,
+                                uint64_t *fetched) {
+    unsigned char request[GET_RANGE_SIZE + MAX_PATH_LENGTH];
+    unsigned char info[FILE_INFO_SIZE];
+    uint64_t range_offset[PIPELINE_DEPTH], range_length[PIPELINE_DEPTH];
+    size_t name_len = strlen(filename);
+    size_t next = 0;
+    uint32_t first_id = *request_id + 1;
+    uint32_t sent = 0, done = 0;
+    uint32_t crc, expected;
+    int corrupt = 0;
+    cupid_header_t header;
+    
+    while (1) {
+        // Queue ranges of consecutive missing blocks
+        while (sent - done < PIPELINE_DEPTH) {
+            uint64_t start, end;
+            
+            while (next < plan->count && plan->source[next] != NO_SOURCE) {
+                next++;
+            }
+            if (next == plan->count) {
+                break;
+            }
+            start = (uint64_t)next * plan->block_size;
+            while (next < plan->count && plan->source[next] == NO_SOURCE) {
+                next++;
+            }
+            end = (uint64_t)next * plan->block_size;
+            if (end > plan->size) {
+                end = plan->size;
+            }
+            
+            put_u64(request, start);
+            put_u64(request + 8, end - start);
+            put_u64(request + 16, 0);
+            put_u64(request + 24, 0);
+            memcpy(request + GET_RANGE_SIZE, filename, name_len);
+            if (send_request(client_socket, CMD_GET_FILE, GET_RANGE, first_id + sent,
+                             request, GET_RANGE_SIZE + name_len) == -1) {
+                return RECEIVE_BROKEN;
+            }
+            range_offset[sent % PIPELINE_DEPTH] = start;
+            range_length[sent % PIPELINE_DEPTH] = end - start;
+            sent++;
+        }
+        if (done == sent) {
+            break;
+        }
+        
+        // Replies arrive in request order
+        uint64_t offset = range_offset[done % PIPELINE_DEPTH];
+        uint64_t length = range_length[done % PIPELINE_DEPTH];
+        uint64_t stored = 0;
+        
+        if (recv_header(client_socket, &header) != 0) {
+            perror("Error receiving response");
+            return RECEIVE_BROKEN;
+        }
+        if (header.opcode == CMD_ERROR) {
+            report_server_error(client_socket, &header, filename);
+            return RECEIVE_BROKEN;
+        }
+        if (header.opcode != CMD_FILE_INFO || header.length != FILE_INFO_SIZE ||
+            header.request_id != first_id + done ||
+            recv_all(client_socket, info, sizeof(info)) != sizeof(info) ||
+            recv_header(client_socket, &header) != 0 || header.opcode != CMD_FILE_DATA) {
+            fprintf(stderr, "%s: Unexpected response from server\n", filename);
+            return RECEIVE_BROKEN;
+        }
+        if (get_u64(info) != plan->size || get_u64(info + 8) != plan->mtime ||
+            header.length != length) {
+            fprintf(stderr, "%s: File changed on the server during sync\n", filename);
+            if (skip_file_body(client_socket, first_id + done, header.length) == -1) {
+                return RECEIVE_BROKEN;
+            }
+            corrupt = 1;
+            done++;
+            continue;
+        }
+        
+        crc = 0;
+        while (stored < length) {
+            uint64_t remaining = length - stored;
+            size_t want = remaining < TRANSFER_CHUNK_SIZE ? remaining : TRANSFER_CHUNK_SIZE;
+            ssize_t received = recv(client_socket, buffer, want, 0);
+            
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                perror("Error receiving data");
+                return RECEIVE_BROKEN;
+            }
+            if (pwrite(file_fd, buffer, received, offset + stored) != received) {
+                perror("Error writing to file");
+                return RECEIVE_BROKEN;
+            }
+            crc = crc32c(crc, buffer, received);
+            stored += received;
+        }
+        if (recv_checksum(client_socket, first_id + done, &expected) == -1) {
+            return RECEIVE_BROKEN;
+        }
+        if (crc != expected) {
+            fprintf(stderr, "%s: Checksum mismatch in bytes %llu-%llu\n", filename,
+                    (unsigned long long)offset, (unsigned long long)(offset + length));
+            corrupt = 1;
+        }
+        *fetched += length;
+        done++;
+    }
+    
+    *request_id += sent;
+    return corrupt ? RECEIVE_FALLBACK : RECEIVE_OK;
+}
+
+// Hash a local file the way CMD_SIGNATURES_END does
+static int hash_local_file(int file_fd, char *buffer, uint64_t *hash) {
+    xxh64_state_t state;
+    off_t offset = 0;
+    ssize_t got;
+    
+    xxh64_init(&state, 0);
+    while ((got = pread(file_fd, buffer, TRANSFER_CHUNK_SIZE, offset)) > 0) {
+        xxh64_update(&state, buffer, got);
+        offset += got;
+    }
+    *hash = xxh64_digest(&state);
+    return got == 0 ? 0 : -1;
+}
+
+// Ask for the signatures of a file in blocks of block_size. Returns 0 or -1.
+static int request_signatures(int client_socket, uint32_t request_id, const char *filename,
+                              uint32_t block_size) {
+    unsigned char request[SIGNATURE_REQUEST_SIZE + MAX_PATH_LENGTH];
+    size_t name_len = strlen(filename);
+    
+    put_u32(request, block_size);
+    memcpy(request + SIGNATURE_REQUEST_SIZE, filename, name_len);
+    return send_request(client_socket, CMD_GET_SIGNATURES, 0, request_id, request,
+                        SIGNATURE_REQUEST_SIZE + name_len);
+}
+
+// Read the reply to request_signatures() into plan, whose block_size is
+// set. The caller frees the plan whatever the outcome.
+static int read_signatures(int client_socket, uint32_t request_id, const char *filename,
+                           delta_plan_t *plan) {
+    unsigned char info[FILE_INFO_SIZE];
+    cupid_header_t header;
+    
+    if (recv_header(client_socket, &header) != 0) {
+        return RECEIVE_BROKEN;
+    }
+    if (header.opcode == CMD_ERROR) {
+        return report_server_error(client_socket, &header, filename) == 0 ?
+               RECEIVE_FAILED : RECEIVE_BROKEN;
+    }
+    if (header.opcode != CMD_FILE_INFO || header.length != FILE_INFO_SIZE ||
+        header.request_id != request_id ||
+        recv_all(client_socket, info, sizeof(info)) != sizeof(info)) {
+        fprintf(stderr, "%s: Unexpected response from server\n", filename);
+        return RECEIVE_BROKEN;
+    }
+    plan->size = get_u64(info);
+    plan->mtime = get_u64(info + 8);
+    return receive_signatures(client_socket, filename, plan);
+}
+
+// Bring an existing local copy in line with the server's file, fetching
+// only the blocks it does not already have. The file is rebuilt in place.
+static int sync_file_delta(int client_socket, uint32_t *request_id, const char *filename,
+                           int file_fd, uint64_t local_size, char *buffer) {
+    delta_plan_t plan;
+    unsigned char *map = NULL;
+    uint64_t moved = 0, fetched = 0, hash;
+    int status;
+    
+    memset(&plan, 0, sizeof(plan));
+    plan.block_size = choose_block_size(local_size);
+    
+    (*request_id)++;
+    if (request_signatures(client_socket, *request_id, filename, plan.block_size) == -1) {
+        return RECEIVE_BROKEN;
+    }
+    status = read_signatures(client_socket, *request_id, filename, &plan);
+    if (status != RECEIVE_OK) {
+        delta_plan_free(&plan);
+        return status;
+    }
+    
+    printf("Syncing %s (%llu bytes, %zu blocks of %u bytes)...\n", filename,
+           (unsigned long long)plan.size, plan.count, plan.block_size);
+    
+    map = mmap(NULL, local_size, PROT_READ, MAP_SHARED, file_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping local file");
+        delta_plan_free(&plan);
+        return RECEIVE_FALLBACK;
+    }
+    posix_madvise(map, local_size, POSIX_MADV_SEQUENTIAL);
+    find_local_blocks(&plan, map, local_size);
+    munmap(map, local_size);
+    
+    // Local moves first: fetched data may land on a block's source
+    status = RECEIVE_FALLBACK;
+    if (copy_local_blocks(&plan, file_fd, buffer, &moved) == 0) {
+        status = fetch_missing_blocks(client_socket, request_id, filename, &plan,
+                                      file_fd, buffer, &fetched);
+    }
+    if (status == RECEIVE_OK && ftruncate(file_fd, plan.size) == -1) {
+        perror("Error truncating local file");
+        status = RECEIVE_FALLBACK;
+    }
+    delta_plan_free(&plan);
+    if (status != RECEIVE_OK) {
+        return status;
+    }
+    
+    if (hash_local_file(file_fd, buffer, &hash) == -1 || hash != plan.file_hash) {
+        fprintf(stderr, "%s: Synced copy does not match the server's file\n", filename);
+        return RECEIVE_FALLBACK;
+    }
+    
+    printf("Synced %s: fetched %llu bytes, moved %llu, reused %llu in place\n", filename,
+           (unsigned long long)fetched, (unsigned long long)moved,
+           (unsigned long long)(plan.size - fetched - moved));
+    return RECEIVE_OK;
+}
+
+// Download one whole file with a plain GET on a session of its own
+static int download_whole_file(int client_socket, uint32_t *request_id, const char *filename,
+                               char *buffer, receive_context_t *context) {
+    unsigned char info[FILE_INFO_SIZE];
+    cupid_header_t header;
+    
+    (*request_id)++;
+    if (send_request(client_socket, CMD_GET_FILE, 0, *request_id, filename, strlen(filename)) == -1 ||
+        recv_header(client_socket, &header) != 0) {
+        return RECEIVE_BROKEN;
+    }
+    if (header.opcode == CMD_ERROR) {
+        return report_server_error(client_socket, &header, filename) == 0 ?
+               RECEIVE_FAILED : RECEIVE_BROKEN;
+    }
+    if (header.opcode != CMD_FILE_INFO || header.length != FILE_INFO_SIZE ||
+        recv_all(client_socket, info, sizeof(info)) != sizeof(info) ||
+        recv_header(client_socket, &header) != 0 || header.opcode != CMD_FILE_DATA) {
+        fprintf(stderr, "%s: Unexpected response from server\n", filename);
+        return RECEIVE_BROKEN;
+    }
+    return receive_file(client_socket, &header, info, filename, buffer, context);
+}
+
+// Get files, syncing existing local copies block by block and
+// downloading the others whole
+static int get_files_delta(const char *server_ip, char **filenames, int count) {
+    int client_socket;
+    uint32_t request_id = 0;
+    receive_context_t context;
+    char *buffer;
+    int i, status = RECEIVE_OK, failures = 0;
+    
+    memset(&context, 0, sizeof(context));
+    client_socket = connect_to_server(server_ip);
+    if (client_socket == -1) {
+        return EXIT_FAILURE;
+    }
+    
+    buffer = malloc(TRANSFER_CHUNK_SIZE);
+    if (buffer == NULL) {
+        perror("Error allocating memory");
+        close(client_socket);
+        return EXIT_FAILURE;
+    }
+    
+    for (i = 0; i < count && status != RECEIVE_BROKEN; i++) {
+        struct stat st;
+        int file_fd;
+        
+        if (strlen(filenames[i]) >= MAX_PATH_LENGTH) {
+            fprintf(stderr, "%s: File name too long\n", filenames[i]);
+            failures++;
+            continue;
+        }
+        
+        file_fd = open(filenames[i], O_RDWR);
+        if (file_fd != -1 && fstat(file_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            status = sync_file_delta(client_socket, &request_id, filenames[i], file_fd,
+                                     st.st_size, buffer);
+            close(file_fd);
+            if (status != RECEIVE_FALLBACK) {
+                failures += status != RECEIVE_OK;
+                continue;
+            }
+            printf("%s: Falling back to a full download\n", filenames[i]);
+        } else if (file_fd != -1) {
+            close(file_fd);
+        }
+        
+        // No usable local copy: plain download
+        status = download_whole_file(client_socket, &request_id, filenames[i], buffer, &context);
+        failures += status != RECEIVE_OK;
+    }
+    
+    free(buffer);
+    close(client_socket);
+    
+    failures += count - i;
+    if (count > 1) {
+        printf("Synced %d of %d files from %s\n", count - failures, count, server_ip);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// CRC-32C of a whole local file, as MULTICAST_END carries it
+static int crc_local_file(int file_fd, char *buffer, uint32_t *crc) {
+    off_t offset = 0;
+    ssize_t got;
+    
+    *crc = 0;
+    while ((got = pread(file_fd, buffer, TRANSFER_CHUNK_SIZE, offset)) > 0) {
+        *crc = crc32c(*crc, buffer, got);
+        offset += got;
+    }
+    return got == 0 ? 0 : -1;
+}
+
+// Receive one file from the server's multicast group, then fetch every
+// range the group did not deliver with ranged GETs. The repair requests
+// are the negative acknowledgements: only receivers that lost something
+// ask, and only for what they lost.
+static int receive_multicast(int client_socket, uint32_t *request_id, const char *filename,
+                             struct in_addr local, char *buffer) {
+    unsigned char payload[MULTICAST_INFO_SIZE];
+    multicast_info_t info;
+    multicast_reception_t reception;
+    delta_plan_t plan, check;
+    cupid_header_t header;
+    uint64_t repaired = 0, hash;
+    size_t i;
+    uint32_t crc;
+    int file_fd, status;
+    
+    (*request_id)++;
+    if (send_request(client_socket, CMD_MULTICAST_JOIN, 0, *request_id,
+                     filename, strlen(filename)) == -1 ||
+        recv_header(client_socket, &header) != 0) {
+        return RECEIVE_BROKEN;
+    }
+    if (header.opcode == CMD_ERROR) {
+        // A missing file is missing over TCP too; anything else may not be
+        int code = header.flags;
+        
+        if (report_server_error(client_socket, &header, filename) == -1) {
+            return RECEIVE_BROKEN;
+        }
+        return code == ERR_NOT_FOUND ? RECEIVE_FAILED : RECEIVE_FALLBACK;
+    }
+    if (header.opcode != CMD_MULTICAST_INFO || header.length != MULTICAST_INFO_SIZE ||
+        header.request_id != *request_id ||
+        recv_all(client_socket, payload, sizeof(payload)) != sizeof(payload)) {
+        fprintf(stderr, "%s: Unexpected response from server\n", filename);
+        return RECEIVE_BROKEN;
+    }
+    multicast_info_decode(payload, &info);
+    
+    file_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file_fd == -1) {
+        perror("Error creating local file");
+        return RECEIVE_FAILED;
+    }
+    // Datagrams land anywhere in the file, so it is laid out in full first
+    if (info.size > 0 && fallocate(file_fd, 0, 0, info.size) == -1 &&
+        ftruncate(file_fd, info.size) == -1) {
+        perror("Error sizing local file");
+        close(file_fd);
+        return RECEIVE_FAILED;
+    }
+    
+    printf("Receiving %s (%llu bytes) from multicast session %u, starting in %.1f s...\n",
+           filename, (unsigned long long)info.size, info.session, info.start_ms / 1e3);
+    if (multicast_receive(&info, local, file_fd, &reception) == -1) {
+        reception.received = NULL;
+        reception.received_count = 0;
+        reception.ended = 0;
+    }
+    
+    // Chunks the group delivered are in place; the rest come over TCP
+    memset(&plan, 0, sizeof(plan));
+    plan.size = info.size;
+    plan.mtime = info.mtime;
+    plan.block_size = MULTICAST_PAYLOAD;
+    plan.count = info.size / MULTICAST_PAYLOAD + (info.size % MULTICAST_PAYLOAD != 0);
+    plan.source = malloc((plan.count + 1) * sizeof(uint64_t));
+    if (plan.source == NULL) {
+        perror("Error allocating memory");
+        free(reception.received);
+        close(file_fd);
+        return RECEIVE_FAILED;
+    }
+    for (i = 0; i < plan.count; i++) {
+        plan.source[i] = reception.received != NULL && reception.received[i] ?
+                         (uint64_t)i * MULTICAST_PAYLOAD : NO_SOURCE;
+    }
+    free(reception.received);
+    
+    status = fetch_missing_blocks(client_socket, request_id, filename, &plan, file_fd,
+                                  buffer, &repaired);
+    free(plan.source);
+    
+    // The datagrams only had UDP's checksum; the whole file is checked
+    // against the sender's CRC when its end was heard, and otherwise
+    // against the whole-file hash the server gives for a delta sync
+    if (status == RECEIVE_OK && reception.ended &&
+        (crc_local_file(file_fd, buffer, &crc) == -1 || crc != reception.crc)) {
+        fprintf(stderr, "%s: Received copy does not match the server's file\n", filename);
+        status = RECEIVE_FALLBACK;
+    } else if (status == RECEIVE_OK && !reception.ended && reception.received_count > 0) {
+        memset(&check, 0, sizeof(check));
+        check.block_size = MAX_BLOCK_SIZE;
+        (*request_id)++;
+        status = request_signatures(client_socket, *request_id, filename, check.block_size) == -1 ?
+                 RECEIVE_BROKEN : read_signatures(client_socket, *request_id, filename, &check);
+        if (status == RECEIVE_FAILED) {
+            status = RECEIVE_FALLBACK;
+        }
+        if (status == RECEIVE_OK &&
+            (check.size != info.size || check.mtime != info.mtime ||
+             hash_local_file(file_fd, buffer, &hash) == -1 || hash != check.file_hash)) {
+            fprintf(stderr, "%s: Received copy does not match the server's file\n", filename);
+            status = RECEIVE_FALLBACK;
+        }
+        delta_plan_free(&check);
+    }
+    close(file_fd);
+    if (status != RECEIVE_OK) {
+        return status;
+    }
+    
+    printf("Received %s: %llu bytes by multicast, %llu repaired over TCP\n", filename,
+           (unsigned long long)(info.size - repaired), (unsigned long long)repaired);
+    return RECEIVE_OK;
+}
+
+// Get files from the server's multicast group one after another,
+// downloading any the group cannot deliver over TCP instead
+static int get_files_multicast(const char *server_ip, char **filenames, int count) {
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    uint32_t request_id = 0;
+    receive_context_t context;
+    char *buffer;
+    int client_socket, i, status = RECEIVE_OK, failures = 0;
+    
+    memset(&context, 0, sizeof(context));
+    client_socket = connect_to_server(server_ip);
+    if (client_socket == -1) {
+        return EXIT_FAILURE;
+    }
+    
+    // Join the group on the interface that reaches the server
+    if (getsockname(client_socket, (struct sockaddr *)&local, &local_len) == -1) {
+        perror("Error reading local address");
+        close(client_socket);
+        return EXIT_FAILURE;
+    }
+    
+    buffer = malloc(TRANSFER_CHUNK_SIZE);
+    if (buffer == NULL) {
+        perror("Error allocating memory");
+        close(client_socket);
+        return EXIT_FAILURE;
+    }
+    
+    for (i = 0; i < count && status != RECEIVE_BROKEN; i++) {
+        if (strlen(filenames[i]) >= MAX_PATH_LENGTH) {
+            fprintf(stderr, "%s: File name too long\n", filenames[i]);
+            failures++;
+            continue;
+        }
+        
+        status = receive_multicast(client_socket, &request_id, filenames[i],
+                                   local.sin_addr, buffer);
+        if (status == RECEIVE_FALLBACK) {
+            printf("%s: Falling back to a full download\n", filenames[i]);
+            status = download_whole_file(client_socket, &request_id, filenames[i],
+                                         buffer, &context);
+        }
+        failures += status != RECEIVE_OK;
+    }
+    
+    free(buffer);
+    close(client_socket);
+    
+    failures += count - i;
+    if (count > 1) {
+        printf("Received %d of %d files from %s\n", count - failures, count, server_ip);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// A server of a swarm download
+typedef struct {
+    char label[INET_ADDRSTRLEN + 8];    // "address" or "address:port"
+    struct in_addr address;
+    uint16_t port;
+} swarm_source_t;
+
+// Split "address[:port],..." into sources. Returns how many, or -1 after
+// printing what is wrong with the list.
+static int parse_sources(const char *list, swarm_source_t *sources) {
+    char item[INET_ADDRSTRLEN + 8];
+    const char *end;
+    size_t len;
+    int count = 0;
+    
+    while (*list != '\0') {
+        end = strchr(list, ',');
+        len = end != NULL ? (size_t)(end - list) : strlen(list);
+        if (count == MAX_STREAMS) {
+            fprintf(stderr, "Too many sources (max %d)\n", MAX_STREAMS);
+            return -1;
+        }
+        if (len == 0 || len >= sizeof(item)) {
+            fprintf(stderr, "Invalid source: %.*s\n", (int)len, list);
+            return -1;
+        }
+        memcpy(item, list, len);
+        item[len] = '\0';
+        
+        if (parse_server_address(item, &sources[count].address, &sources[count].port) == -1) {
+            fprintf(stderr, "Invalid source: %s\n", item);
+            return -1;
+        }
+        memcpy(sources[count].label, list, len);
+        sources[count].label[len] = '\0';
+        count++;
+        
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return count;
+}
+
+// Ask every source for the signatures of a file and keep those whose copy
+// has the size and content hash most of them agree on. Fills use with
+// the indexes of the chosen streams and block_hashes with the agreed
+// hash of each block, which the caller frees. Returns how many sources
+// were chosen, or 0 when the copies disagree or none has the file.
+static int agree_on_file(segment_stream_t *streams, int count, const char *filename,
+                         int *use, uint64_t **block_hashes) {
+    delta_plan_t plans[MAX_STREAMS];
+    int status[MAX_STREAMS];
+    int answered = 0, best = -1, best_votes = 0, chosen = 0, votes, i, j;
+    
+    // Every server hashes its copy at the same time
+    memset(plans, 0, sizeof(plans));
+    for (i = 0; i < count; i++) {
+        status[i] = RECEIVE_BROKEN;
+        plans[i].block_size = SWARM_BLOCK_SIZE;
+        if (streams[i].sock != -1 &&
+            request_signatures(streams[i].sock, ++streams[i].request_id, filename,
+                               SWARM_BLOCK_SIZE) == 0) {
+            status[i] = RECEIVE_OK;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (status[i] == RECEIVE_OK) {
+            status[i] = read_signatures(streams[i].sock, streams[i].request_id, filename,
+                                        &plans[i]);
+        }
+        if (status[i] == RECEIVE_BROKEN && streams[i].sock != -1) {
+            fprintf(stderr, "%s: Lost connection to %s\n", filename, streams[i].source);
+            close(streams[i].sock);
+            streams[i].sock = -1;
+        }
+        answered += status[i] == RECEIVE_OK;
+    }
+    
+    // The copy held by most sources wins, the earliest listed on a tie
+    for (i = 0; i < count; i++) {
+        if (status[i] != RECEIVE_OK) {
+            continue;
+        }
+        votes = 0;
+        for (j = 0; j < count; j++) {
+            votes += status[j] == RECEIVE_OK && plans[j].size == plans[i].size &&
+                     plans[j].file_hash == plans[i].file_hash;
+        }
+        if (votes > best_votes) {
+            best = i;
+            best_votes = votes;
+        }
+    }
+    
+    if (best == -1) {
+        fprintf(stderr, "%s: No source has the file\n", filename);
+    } else if (best_votes * 2 <= answered) {
+        fprintf(stderr, "%s: The sources hold different copies; not downloading\n", filename);
+    } else {
+        for (i = 0; i < count; i++) {
+            if (status[i] != RECEIVE_OK) {
+                continue;
+            }
+            if (plans[i].size != plans[best].size || plans[i].file_hash != plans[best].file_hash) {
+                fprintf(stderr, "%s: The copy on %s differs from the others; not using it\n",
+                        filename, streams[i].source);
+                continue;
+            }
+            streams[i].size = plans[i].size;
+            streams[i].mtime = plans[i].mtime;
+            use[chosen++] = i;
+        }
+        printf("%s: %d of %d sources hold identical copies (xxh64 %016llx)\n", filename,
+               chosen, count, (unsigned long long)plans[best].file_hash);
+        *block_hashes = plans[best].strong;
+        plans[best].strong = NULL;
+    }
+    
+    for (i = 0; i < count; i++) {
+        delta_plan_free(&plans[i]);
+    }
+    return chosen;
+}
+
+// Get files one after another, each split into byte ranges fetched from
+// several servers holding the same copy, checked block by block against
+// the hashes they agree on. Faster servers are given larger ranges, and
+// a range that fails its check is fetched again from another server.
+static int get_files_swarm(const char *list, char **filenames, int count) {
+    swarm_source_t sources[MAX_STREAMS];
+    segment_stream_t stream[MAX_STREAMS], chosen[MAX_STREAMS];
+    int use[MAX_STREAMS];
+    uint64_t *block_hashes;
+    int sources_count, i, j, n, connected = 0, failures = 0;
+    
+    sources_count = parse_sources(list, sources);
+    if (sources_count <= 0) {
+        if (sources_count == 0) {
+            fprintf(stderr, "No sources given\n");
+        }
+        return EXIT_FAILURE;
+    }
+    
+    memset(stream, 0, sizeof(stream));
+    for (i = 0; i < sources_count; i++) {
+        stream[i].source = sources[i].label;
+        stream[i].sock = connect_quickly(sources[i].address, sources[i].port,
+                                         SWARM_CONNECT_TIMEOUT_MS);
+        stream[i].buffer = malloc(TRANSFER_CHUNK_SIZE);
+        if (stream[i].sock == -1) {
+            fprintf(stderr, "Could not connect to %s\n", sources[i].label);
+        } else if (stream[i].buffer == NULL) {
+            close(stream[i].sock);
+            stream[i].sock = -1;
+        } else {
+            connected++;
+        }
+    }
+    
+    if (connected == 0) {
+        failures = count;
+    }
+    for (i = 0; i < count && connected > 0; i++) {
+        if (strlen(filenames[i]) >= MAX_PATH_LENGTH) {
+            fprintf(stderr, "%s: File name too long\n", filenames[i]);
+            failures++;
+            continue;
+        }
+        block_hashes = NULL;
+        n = agree_on_file(stream, sources_count, filenames[i], use, &block_hashes);
+        if (n == 0) {
+            failures++;
+            continue;
+        }
+        
+        for (j = 0; j < n; j++) {
+            chosen[j] = stream[use[j]];
+        }
+        if (get_file_segmented(chosen, n, filenames[i], block_hashes, SWARM_BLOCK_SIZE) == -1) {
+            failures++;
+        }
+        free(block_hashes);
+        
+        // Sources that failed stay closed for the files that follow
+        for (j = 0; j < n; j++) {
+            stream[use[j]] = chosen[j];
+            if (chosen[j].bytes > 0) {
+                printf("  %s: %llu bytes at %.1f MB/s\n", chosen[j].source,
+                       (unsigned long long)chosen[j].bytes,
+                       chosen[j].seconds > 0 ? chosen[j].bytes / chosen[j].seconds / 1e6 : 0.0);
+            }
+        }
+    }
+    
+    failures += count - i;
+    for (i = 0; i < sources_count; i++) {
+        if (stream[i].sock != -1) {
+            close(stream[i].sock);
+        }
+        free(stream[i].buffer);
+    }
+    
+    if (count > 1) {
+        printf("Downloaded %d of %d files from %d sources\n", count - failures, count,
+               sources_count);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Whether a path from a tree reply is safe to create under the local
+// directory: relative, with no empty, "." or ".." components
+static int safe_tree_path(const char *path, size_t length) {
+    const char *part = path, *end = path + length;
+    
+    if (length == 0 || memchr(path, '\0', length) != NULL || path[length - 1] == '/') {
+        return 0;
+    }
+    while (part < end) {
+        const char *slash = memchr(part, '/', end - part);
+        size_t part_len = (slash != NULL ? slash : end) - part;
+        
+        if (part_len == 0 || (part_len == 1 && part[0] == '.') ||
+            (part_len == 2 && part[0] == '.' && part[1] == '.')) {
+            return 0;
+        }
+        part += part_len + 1;
+    }
+    return 1;
+}
+
+// Give a received file the server's modification time
+static void set_file_mtime(int file_fd, uint64_t mtime) {
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)mtime, 0 } };
+    
+    futimens(file_fd, times);
+}
+
+// Write a small file that arrived inline in a tree reply
+static int store_tree_file(const char *path, const unsigned char *data, uint64_t size,
+                           uint64_t mtime) {
+    int file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (file_fd == -1) {
+        perror(path);
+        return -1;
+    }
+    if (write(file_fd, data, size) != (ssize_t)size) {
+        perror(path);
+        close(file_fd);
+        return -1;
+    }
+    set_file_mtime(file_fd, mtime);
+    close(file_fd);
+    return 0;
+}
+
+// Receive the body of a large file that follows a tree frame
+static int receive_tree_body(int client_socket, uint32_t request_id, const char *path,
+                             uint64_t size, uint64_t mtime, char *buffer,
+                             receive_context_t *context) {
+    cupid_header_t header;
+    uint32_t crc = 0, expected;
+    int file_fd, status;
+    
+    if (recv_header(client_socket, &header) != 0 || header.opcode != CMD_FILE_DATA ||
+        header.request_id != request_id || header.length != size) {
+        fprintf(stderr, "%s: Unexpected response from server\n", path);
+        return RECEIVE_BROKEN;
+    }
+    
+    file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd == -1) {
+        perror(path);
+        return skip_file_body(client_socket, request_id, size) == 0 ?
+               RECEIVE_FAILED : RECEIVE_BROKEN;
+    }
+    status = receive_raw_body(client_socket, &header, file_fd, buffer, context, &crc, &expected);
+    if (status == RECEIVE_OK && crc != expected) {
+        fprintf(stderr, "%s: Checksum mismatch, file discarded\n", path);
+        status = RECEIVE_FAILED;
+    }
+    if (status == RECEIVE_OK) {
+        set_file_mtime(file_fd, mtime);
+    }
+    close(file_fd);
+    if (status != RECEIVE_OK) {
+        unlink(path);
+    }
+    return status;
+}
+
+// Receive one tree reply, recreating its directories and files under
+// dest. Files that cannot be written locally are counted and skipped.
+static int receive_tree(int client_socket, uint32_t request_id, const char *dest,
+                        unsigned char *frame, char *buffer) {
+    receive_context_t context;
+    cupid_header_t header;
+    char path[MAX_PATH_LENGTH + TREE_PATH_MAX + 2];
+    uint64_t files = 0, failed = 0;
+    
+    memset(&context, 0, sizeof(context));
+    while (1) {
+        size_t records_len, position = 0;
+        
+        if (recv_header(client_socket, &header) != 0) {
+            perror("Error receiving response");
+            return RECEIVE_BROKEN;
+        }
+        if (header.request_id != request_id) {
+            fprintf(stderr, "Unexpected response from server\n");
+            return RECEIVE_BROKEN;
+        }
+        if (header.opcode == CMD_ERROR) {
+            return report_server_error(client_socket, &header, dest) == 0 ?
+                   RECEIVE_FAILED : RECEIVE_BROKEN;
+        }
+        if (header.opcode == CMD_TREE_END && header.length == TREE_END_SIZE) {
+            unsigned char end[TREE_END_SIZE];
+            
+            if (recv_all(client_socket, end, sizeof(end)) != sizeof(end)) {
+                perror("Error receiving response");
+                return RECEIVE_BROKEN;
+            }
+            printf("Received %s: %llu of %llu files, %llu bytes\n", dest,
+                   (unsigned long long)(files - failed), (unsigned long long)get_u64(end),
+                   (unsigned long long)get_u64(end + 8));
+            return failed == 0 && files == get_u64(end) ? RECEIVE_OK : RECEIVE_FAILED;
+        }
+        if (header.opcode != CMD_TREE_ENTRIES || header.length < FILE_CHECKSUM_SIZE ||
+            header.length > TREE_BATCH_SIZE ||
+            recv_all(client_socket, frame, header.length) != (ssize_t)header.length) {
+            fprintf(stderr, "Unexpected response from server\n");
+            return RECEIVE_BROKEN;
+        }
+        records_len = header.length - FILE_CHECKSUM_SIZE;
+        if (crc32c(0, frame, records_len) != get_u32(frame + records_len)) {
+            fprintf(stderr, "%s: Corrupt tree frame from server\n", dest);
+            return RECEIVE_BROKEN;
+        }
+        
+        while (position < records_len) {
+            const unsigned char *record = frame + position;
+            uint64_t size, mtime, inline_size;
+            size_t path_len;
+            
+            if (records_len - position < TREE_RECORD_SIZE) {
+                fprintf(stderr, "%s: Malformed tree frame\n", dest);
+                return RECEIVE_BROKEN;
+            }
+            size = get_u64(record + 1);
+            mtime = get_u64(record + 9);
+            path_len = get_u16(record + 17);
+            inline_size = record[0] == ENTRY_FILE && size <= TREE_INLINE_MAX ? size : 0;
+            if (records_len - position - TREE_RECORD_SIZE < path_len + inline_size ||
+                !safe_tree_path((const char *)record + TREE_RECORD_SIZE, path_len)) {
+                fprintf(stderr, "%s: Malformed tree frame\n", dest);
+                return RECEIVE_BROKEN;
+            }
+            snprintf(path, sizeof(path), "%s/%.*s", dest, (int)path_len,
+                     (const char *)record + TREE_RECORD_SIZE);
+            position += TREE_RECORD_SIZE + path_len + inline_size;
+            
+            if (record[0] == ENTRY_DIR) {
+                if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+                    perror(path);
+                }
+            } else if (record[0] == ENTRY_FILE && inline_size == size) {
+                files++;
+                failed += store_tree_file(path, record + TREE_RECORD_SIZE + path_len,
+                                          size, mtime) == -1;
+            } else if (record[0] == ENTRY_FILE && position == records_len) {
+                int status = receive_tree_body(client_socket, request_id, path, size, mtime,
+                                               buffer, &context);
+                
+                if (status == RECEIVE_BROKEN) {
+                    return RECEIVE_BROKEN;
+                }
+                files++;
+                failed += status != RECEIVE_OK;
+            } else {
+                fprintf(stderr, "%s: Malformed tree frame\n", dest);
+                return RECEIVE_BROKEN;
+            }
+        }
+    }
+}
+
+// Mirror directories of the server's share, each streamed as one reply,
+// over a single connection
+static int get_trees(const char *server_ip, char **names, int count) {
+    int client_socket;
+    unsigned char *frame;
+    char *buffer;
+    int i, status = RECEIVE_OK, failures = 0;
+    
+    client_socket = connect_to_server(server_ip);
+    if (client_socket == -1) {
+        return EXIT_FAILURE;
+    }
+    
+    frame = malloc(TREE_BATCH_SIZE);
+    buffer = malloc(TRANSFER_CHUNK_SIZE);
+    if (frame == NULL || buffer == NULL) {
+        perror("Error allocating memory");
+        free(frame);
+        free(buffer);
+        close(client_socket);
+        return EXIT_FAILURE;
+    }
+    
+    for (i = 0; i < count && status != RECEIVE_BROKEN; i++) {
+        char name[MAX_PATH_LENGTH];
+        size_t name_len = strlen(names[i]);
+        const char *dest;
+        int created;
+        
+        // "dir/" names the same tree as "dir"
+        while (name_len > 1 && names[i][name_len - 1] == '/') {
+            name_len--;
+        }
+        if (name_len >= sizeof(name)) {
+            fprintf(stderr, "%s: Directory name too long\n", names[i]);
+            failures++;
+            continue;
+        }
+        memcpy(name, names[i], name_len);
+        name[name_len] = '\0';
+        
+        // The tree lands in a local directory named like the remote one
+        dest = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+        created = mkdir(dest, 0755) == 0;
+        if (!created && errno != EEXIST) {
+            perror(dest);
+            failures++;
+            continue;
+        }
+        
+        printf("Receiving %s into %s/...\n", name, dest);
+        if (send_request(client_socket, CMD_GET_TREE, 0, i + 1, name, name_len) == -1) {
+            status = RECEIVE_BROKEN;
+        } else {
+            status = receive_tree(client_socket, i + 1, dest, frame, buffer);
+        }
+        if (status != RECEIVE_OK && created) {
+            rmdir(dest); // Only goes if nothing arrived
+        }
+        failures += status != RECEIVE_OK;
+    }
+    
+    free(frame);
+    free(buffer);
+    close(client_socket);
+    
+    failures += count - i;
+    if (count > 1) {
+        printf("Received %d of %d directories from %s\n", count - failures, count, server_ip);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Get files from server as the options ask
+int get_files(const char *server_ip, char **filenames, int count, const client_options_t *options) {
+    if (options->sources != NULL) {
+        return get_files_swarm(options->sources, filenames, count);
+    }
+    if (options->recursive) {
+        return get_trees(server_ip, filenames, count);
+    }
+    if (options->delta) {
+        return get_files_delta(server_ip, filenames, count);
+    }
+    if (options->multicast) {
+        return get_files_multicast(server_ip, filenames, count);
+    }
+    if (options->streams > 1) {
+        return get_files_parallel(server_ip, filenames, count, options->streams);
+    }
+    return get_files_pooled(server_ip, filenames, count, options->resume, options->compress,
+                            options->zero_copy, options->connections > 0 ? options->connections : DEFAULT_CONNECTIONS);
+}
+
+// Get file from server
+int get_file(const char *server_ip, const char *filename) {
+    client_options_t options;
+    char *filenames[1] = { (char *)filename };
+    
+    memset(&options, 0, sizeof(options));
+    options.streams = 1;
+    options.zero_copy = 1;
+    return get_files(server_ip, filenames, 1, &options);
+}
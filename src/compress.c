@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "cupid.h"
+#include "compress.h"
+
+// zstd and deflate levels: fast enough to keep up with a LAN link
+#define ZSTD_LEVEL 1
+#define DEFLATE_LEVEL 1
+
+// Codecs in order of preference when both sides have several
+static const int codec_preference[] = { CODEC_ZSTD, CODEC_LZ4, CODEC_DEFLATE };
+
+struct codec_state {
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd_compress;
+    ZSTD_DCtx *zstd_decompress;
+#endif
+#ifdef HAVE_ZLIB
+    z_stream deflate;
+    z_stream inflate;
+    int deflate_ready;
+    int inflate_ready;
+#endif
+    int unused;             // Keeps the struct non-empty without any codec
+};
+
+// Bit mask of the codecs built into this program
+uint16_t codec_supported(void) {
+    uint16_t mask = 0;
+
+#ifdef HAVE_LZ4
+    mask |= 1 << CODEC_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    mask |= 1 << CODEC_ZSTD;
+#endif
+#ifdef HAVE_ZLIB
+    mask |= 1 << CODEC_DEFLATE;
+#endif
+    return mask;
+}
+
+// Best codec both sides support
+int codec_choose(uint16_t peer_mask) {
+    uint16_t common = peer_mask & codec_supported();
+    size_t i;
+
+    for (i = 0; i < sizeof(codec_preference) / sizeof(codec_preference[0]); i++) {
+        if (common & (1 << codec_preference[i])) {
+            return codec_preference[i];
+        }
+    }
+    return CODEC_NONE;
+}
+
+// Short name of a codec
+const char *codec_name(int codec) {
+    switch (codec) {
+        case CODEC_NONE:
+            return "none";
+        case CODEC_LZ4:
+            return "lz4";
+        case CODEC_ZSTD:
+            return "zstd";
+        case CODEC_DEFLATE:
+            return "deflate";
+        default:
+            return "unknown";
+    }
+}
+
+// Create empty codec contexts
+codec_state_t *codec_state_new(void) {
+    return calloc(1, sizeof(codec_state_t));
+}
+
+// Free codec contexts
+void codec_state_free(codec_state_t *state) {
+    if (state == NULL) {
+        return;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(state->zstd_compress);
+    ZSTD_freeDCtx(state->zstd_decompress);
+#endif
+#ifdef HAVE_ZLIB
+    if (state->deflate_ready) {
+        deflateEnd(&state->deflate);
+    }
+    if (state->inflate_ready) {
+        inflateEnd(&state->inflate);
+    }
+#endif
+    free(state);
+}
+
+// Compress one block; every block stands alone
+ssize_t codec_compress(codec_state_t *state, int codec, const void *src, size_t len,
+                       void *dst, size_t capacity) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case CODEC_LZ4: {
+            int out = LZ4_compress_default(src, dst, len, capacity);
+            return out > 0 ? out : -1;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: {
+            size_t out;
+
+            if (state->zstd_compress == NULL &&
+                (state->zstd_compress = ZSTD_createCCtx()) == NULL) {
+                return -1;
+            }
+            out = ZSTD_compressCCtx(state->zstd_compress, dst, capacity, src, len, ZSTD_LEVEL);
+            return ZSTD_isError(out) ? -1 : (ssize_t)out;
+        }
+#endif
+#ifdef HAVE_ZLIB
+        case CODEC_DEFLATE:
+            // Raw deflate: the transfer already carries its own checksum
+            if (!state->deflate_ready) {
+                if (deflateInit2(&state->deflate, DEFLATE_LEVEL, Z_DEFLATED, -15, 8,
+                                 Z_DEFAULT_STRATEGY) != Z_OK) {
+                    return -1;
+                }
+                state->deflate_ready = 1;
+            } else if (deflateReset(&state->deflate) != Z_OK) {
+                return -1;
+            }
+            state->deflate.next_in = (Bytef *)src;
+            state->deflate.avail_in = len;
+            state->deflate.next_out = dst;
+            state->deflate.avail_out = capacity;
+            if (deflate(&state->deflate, Z_FINISH) != Z_STREAM_END) {
+                return -1;
+            }
+            return capacity - state->deflate.avail_out;
+#endif
+        default:
+            (void)state;
+            (void)src;
+            (void)len;
+            (void)dst;
+            (void)capacity;
+            return -1;
+    }
+}
+
+// Decompress one block
+ssize_t codec_decompress(codec_state_t *state, int codec, const void *src, size_t len,
+                         void *dst, size_t capacity) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case CODEC_LZ4: {
+            int out = LZ4_decompress_safe(src, dst, len, capacity);
+            return out >= 0 ? out : -1;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD: {
+            size_t out;
+
+            if (state->zstd_decompress == NULL &&
+                (state->zstd_decompress = ZSTD_createDCtx()) == NULL) {
+                return -1;
+            }
+            out = ZSTD_decompressDCtx(state->zstd_decompress, dst, capacity, src, len);
+            return ZSTD_isError(out) ? -1 : (ssize_t)out;
+        }
+#endif
+#ifdef HAVE_ZLIB
+        case CODEC_DEFLATE:
+            if (!state->inflate_ready) {
+                if (inflateInit2(&state->inflate, -15) != Z_OK) {
+                    return -1;
+                }
+                state->inflate_ready = 1;
+            } else if (inflateReset(&state->inflate) != Z_OK) {
+                return -1;
+            }
+            state->inflate.next_in = (Bytef *)src;
+            state->inflate.avail_in = len;
+            state->inflate.next_out = dst;
+            state->inflate.avail_out = capacity;
+            if (inflate(&state->inflate, Z_FINISH) != Z_STREAM_END ||
+                state->inflate.avail_in != 0) {
+                return -1;
+            }
+            return capacity - state->inflate.avail_out;
+#endif
+        default:
+            (void)state;
+            (void)src;
+            (void)len;
+            (void)dst;
+            (void)capacity;
+            return -1;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Per-connection codec contexts, created lazily for the codecs used
+typedef struct codec_state codec_state_t;
+
+// Bit mask of the codecs built into this program, (1 << CODEC_x) each
+uint16_t codec_supported(void);
+
+// Best codec in both this program's and the peer's mask, or CODEC_NONE
+int codec_choose(uint16_t peer_mask);
+
+// Short name of a codec for messages
+const char *codec_name(int codec);
+
+// Create and free codec contexts. Returns NULL when out of memory.
+codec_state_t *codec_state_new(void);
+void codec_state_free(codec_state_t *state);
+
+// Compress len bytes of src into at most capacity bytes of dst.
+// Returns the compressed length, or -1 when it does not fit or fails.
+ssize_t codec_compress(codec_state_t *state, int codec, const void *src, size_t len,
+                       void *dst, size_t capacity);
+
+// Decompress len bytes of src into at most capacity bytes of dst.
+// Returns the decompressed length, or -1 on corrupt input.
+ssize_t codec_decompress(codec_state_t *state, int codec, const void *src, size_t len,
+                         void *dst, size_t capacity);
+
+#endif /* COMPRESS_H */
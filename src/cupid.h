@@ -1,6 +1,9 @@
 #ifndef CUPID_H
 #define CUPID_H
 
+#include <stdint.h>
+#include <netinet/in.h>
+
 // Port for the file sharing service
 #define CUPID_PORT 9876
 
@@ -10,15 +13,266 @@
 // Maximum size of a single packet
 #define MAX_PACKET_SIZE 8192
 
+// Size of the buffer used to stream file bodies
+#define TRANSFER_CHUNK_SIZE (256 * 1024)
+
+// Wire protocol version carried in every frame header
+#define CUPID_PROTO_VERSION 1
+
+// Size of an encoded frame header on the wire
+#define CUPID_HEADER_SIZE 16
+
 // Command codes
 #define CMD_LIST_FILES 1
 #define CMD_GET_FILE 2
 #define CMD_FILE_DATA 3
 #define CMD_ERROR 4
+#define CMD_LIST_ENTRIES 5
+#define CMD_LIST_END 6
+#define CMD_FILE_INFO 7
+#define CMD_GET_SIGNATURES 8
+#define CMD_SIGNATURES 9
+#define CMD_SIGNATURES_END 10
+#define CMD_FILE_CHECKSUM 11
+#define CMD_FILE_BLOCK 12
+#define CMD_GET_TREE 13
+#define CMD_TREE_ENTRIES 14
+#define CMD_TREE_END 15
+#define CMD_GET_STATS 16
+#define CMD_STATS 17
+#define CMD_MULTICAST_JOIN 18
+#define CMD_MULTICAST_INFO 19
+
+// LIST request payload (all optional, empty means everything):
+//   limit:4 cursor_length:2 cursor pattern:rest
+// The cursor comes from a previous CMD_LIST_END and is the last name that
+// page covered; the listing resumes at the first name sorting after it,
+// so files created or removed in between neither repeat nor skip entries.
+// limit 0 means no limit; pattern is an fnmatch() glob such as "log-*".
+#define LIST_REQUEST_SIZE 6
+#define LIST_CURSOR_MAX (MAX_PATH_LENGTH - 1)
+
+// A LIST reply is any number of CMD_LIST_ENTRIES frames, each packing
+// entries of  type:1 size:8 mtime:8 name_length:2 name,  followed by one
+// CMD_LIST_END frame whose payload is the cursor of the next page (empty
+// when the listing is complete).
+#define LIST_ENTRY_SIZE 19
+
+// GET request flags, carried in the flags field of CMD_GET_FILE
+#define GET_RANGE 0x1           // Payload starts with a range
+#define GET_IF_UNCHANGED 0x2    // Serve the range only if size and mtime still
+                                // match, otherwise send the whole file
+#define GET_COMPRESS 0x4        // Body may come as compressed CMD_FILE_BLOCKs
+#define GET_CODECS_SHIFT 8      // With GET_COMPRESS, the top byte of the flags
+                                // holds the (1 << CODEC_x) codecs accepted
+
+// GET payload is the file name, or with GET_RANGE:
+//   offset:8 length:8 size:8 mtime:8 name:rest
+// length 0 means up to the end of the file; size and mtime are what the
+// client last saw and are only checked with GET_IF_UNCHANGED.
+#define GET_RANGE_SIZE 32
+
+// Every CMD_FILE_DATA is preceded by a CMD_FILE_INFO frame of
+//   size:8 mtime:8 offset:8
+// giving the whole file's size and mtime and where the body starts.
+#define FILE_INFO_SIZE 24
+
+// Every CMD_FILE_DATA body is followed by a CMD_FILE_CHECKSUM frame of
+//   crc32c:4
+// the CRC-32C (Castagnoli) of exactly the body bytes sent, so a receiver
+// can tell a corrupted transfer from a good one.
+#define FILE_CHECKSUM_SIZE 4
+
+// With GET_COMPRESS the server may send the body as CMD_FILE_BLOCK frames
+// instead of one CMD_FILE_DATA. Each frame carries the codec in its flags
+// (CODEC_NONE for a block that did not compress) and a payload of
+//   raw_length:4 data
+// covering the next COMPRESS_BLOCK_SIZE bytes or less; every block
+// decompresses on its own. The CMD_FILE_CHECKSUM trailer ends the body
+// and is computed over the uncompressed bytes.
+#define FILE_BLOCK_HEADER_SIZE 4
+#define COMPRESS_BLOCK_SIZE (128 * 1024)
+
+// Compression codecs
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+#define CODEC_DEFLATE 3
+
+// Block signatures for delta sync. The request payload is
+//   block_size:4 name:rest
+// and is answered with CMD_FILE_INFO, then CMD_SIGNATURES frames packing
+//   weak:4 strong:8
+// for every block of the file in order (the last block may be short),
+// then CMD_SIGNATURES_END carrying the xxHash64 of the whole file. weak
+// is an rsync rolling checksum and strong the block's xxHash64, so a
+// client can find blocks it already has and fetch only the rest with
+// ranged GETs.
+#define SIGNATURE_REQUEST_SIZE 4
+#define SIGNATURE_SIZE 12
+#define SIGNATURES_END_SIZE 8
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE (128 * 1024)
+
+// Recursive transfer of a directory. The request payload is the
+// directory's path ("." for the whole share). The reply is a stream of
+// CMD_TREE_ENTRIES frames packing records of
+//   type:1 size:8 mtime:8 path_length:2 path
+// with paths relative to the requested directory, each directory before
+// its contents, and ending with the crc32c:4 of the records. A file of at
+// most TREE_INLINE_MAX bytes has its data right after its record, so
+// small files travel many to a frame. A larger file is the last record
+// of its frame and is followed by a CMD_FILE_DATA body and its
+// CMD_FILE_CHECKSUM. CMD_TREE_END closes the reply with
+//   files:8 bytes:8
+// Hidden entries and symbolic links are skipped.
+#define TREE_RECORD_SIZE 19
+#define TREE_INLINE_MAX (64 * 1024)
+#define TREE_BATCH_SIZE (256 * 1024)
+#define TREE_PATH_MAX 4096
+#define TREE_END_SIZE 16
+
+// Server metrics. CMD_GET_STATS has an empty payload and is answered
+// with one CMD_STATS frame whose payload is the metrics in the Prometheus
+// text exposition format: request, error, byte and connection counters,
+// and time-to-first-byte and response duration quantiles.
+
+// Multicast distribution. CMD_MULTICAST_JOIN carries a file name and asks
+// the server to send that file to its multicast group. Joins for the same
+// file within a short gathering window share one session, and so does a
+// join while the file is already on the way. The reply is one
+// CMD_MULTICAST_INFO of
+//   group:4 port:2 reserved:2 session:4 start_ms:4 size:8 mtime:8
+// telling the receiver which group to join and how long until the first
+// datagram (0 when the session is already sending). The file then goes
+// out once as UDP datagrams of
+//   magic:4 session:4 type:1 reserved:3 offset:8 data
+// where a MULTICAST_DATA datagram carries the MULTICAST_PAYLOAD bytes at
+// offset (fewer at the end of the file), and a MULTICAST_END datagram,
+// sent a few times after the last data, carries the crc32c:4 of the whole
+// file. Nothing is retransmitted over multicast: a receiver asks for the
+// ranges it missed with ranged CMD_GET_FILE requests.
+#define MULTICAST_PORT 9877
+#define MULTICAST_INFO_SIZE 32
+#define MULTICAST_MAGIC 0x43504d43     // "CPMC"
+#define MULTICAST_HEADER_SIZE 20
+#define MULTICAST_DATAGRAM_SIZE 1472    // Fits an Ethernet frame unfragmented
+#define MULTICAST_PAYLOAD (MULTICAST_DATAGRAM_SIZE - MULTICAST_HEADER_SIZE)
+#define MULTICAST_DATA 1
+#define MULTICAST_END 2
+
+// LAN discovery. Every DISCOVERY_INTERVAL seconds a server sends a
+// beacon to DISCOVERY_GROUP:DISCOVERY_PORT out of each of its interfaces,
+// and it answers a query datagram sent there with a beacon of its own,
+// straight to the asker. A beacon is
+//   magic:4 type:1 address_count:1 port:2 server_id:8 catalog:8
+//   name_length:1 addresses:4*address_count name
+// server_id is random for each run of a server and tells its beacons
+// apart from another's heard on a different interface; catalog changes
+// whenever the shared directory's listing does. A query is just
+//   magic:4 type:1
+#define DISCOVERY_GROUP "239.255.67.68"
+#define DISCOVERY_PORT 9878
+#define DISCOVERY_INTERVAL 5
+#define DISCOVERY_MAGIC 0x43504442     // "CPDB"
+#define DISCOVERY_BEACON 1
+#define DISCOVERY_QUERY 2
+#define DISCOVERY_HEADER_SIZE 25
+#define DISCOVERY_QUERY_SIZE 5
+#define DISCOVERY_MAX_ADDRESSES 16
+#define DISCOVERY_NAME_MAX 255
+
+// Directory entry types in a listing
+#define ENTRY_FILE 1
+#define ENTRY_DIR 2
+#define ENTRY_OTHER 3
+
+// Error codes carried in the flags field of a CMD_ERROR frame
+#define ERR_GENERIC 0
+#define ERR_BAD_REQUEST 1
+#define ERR_NOT_FOUND 2
+#define ERR_UNKNOWN_COMMAND 3
+#define ERR_VERSION 4
+#define ERR_BUSY 5
+#define ERR_RANGE 6
+
+// Frame header. Every message starts with one of these followed by
+// `length` bytes of payload. Fields are big-endian on the wire:
+//   version:1 opcode:1 flags:2 request_id:4 length:8
+// A CMD_FILE_DATA response carries the whole file as its payload, so the
+// receiver knows the file size before the first body byte arrives.
+// A connection carries any number of requests; responses come back in
+// request order and echo the request_id of the request they answer.
+typedef struct {
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t request_id;
+    uint64_t length;
+} cupid_header_t;
+
+// Engines that drive client connections
+#define ENGINE_THREADS 0
+#define ENGINE_EPOLL 1
+#define ENGINE_POOL 2
+#define ENGINE_URING 3
+
+// What the worker pool does when its queue is full
+#define OVERLOAD_WAIT 0     // Stop accepting until a worker frees a slot
+#define OVERLOAD_REJECT 1   // Answer new clients with ERR_BUSY
+
+// Server settings chosen on the command line
+typedef struct {
+    int zero_copy;      // Send file bodies with sendfile()/splice()
+    int engine;         // ENGINE_THREADS, ENGINE_EPOLL, ENGINE_POOL or ENGINE_URING
+    int event_loops;    // Number of epoll loops for ENGINE_EPOLL
+    int workers;        // Worker threads for ENGINE_POOL
+    int queue_size;     // Accepted connections waiting for a worker
+    int overload;       // OVERLOAD_WAIT or OVERLOAD_REJECT
+    int backlog;        // listen() backlog
+    int compress;       // Honour GET_COMPRESS requests
+    uint64_t rate;          // Total send rate cap in bytes per second, 0 for none
+    uint64_t client_rate;   // Send rate cap per client address, 0 for none
+    int metrics_port;   // Local port serving Prometheus metrics, 0 for none
+    int port;           // Port to listen on
+    uint64_t cache_size;        // Bytes of small files kept in memory, 0 for none
+    uint64_t cache_max_file;    // Largest file the cache takes
+    const char *congestion;     // TCP congestion control, NULL for the system default
+    const char *wan_congestion; // For clients beyond a gateway, NULL for congestion
+    int notsent_lowat;  // Most unsent bytes queued on a client socket, 0 for no limit
+    const char *multicast;      // "group[:port]" to distribute files to, NULL for none
+    uint64_t multicast_rate;    // Send rate of multicast sessions in bytes per second
+    int multicast_wait;         // Seconds a new session waits for more receivers
+    int announce;               // Send discovery beacons and answer queries
+    const char *name;           // Share name in beacons, NULL for host:directory
+} server_options_t;
+
+// Most connections one parallel download may use
+#define MAX_STREAMS 16
+
+// Connections a multi-file download is spread over unless told otherwise
+#define DEFAULT_CONNECTIONS 4
+
+// Client settings chosen on the command line
+typedef struct {
+    int resume;         // Continue partial downloads
+    int streams;        // Connections used to fetch each file
+    int delta;          // Only fetch blocks that differ from the local copy
+    int compress;       // Ask for compressed file bodies
+    int recursive;      // Names are directories to mirror
+    int connections;    // Connections for a multi-file download, 0 for the default
+    int zero_copy;      // Splice file bodies into preallocated files
+    int multicast;      // Receive files from the server's multicast group
+    const char *sources;        // "address[:port],..." fetched from at once, NULL for one server
+} client_options_t;
 
 // Function prototypes
-int start_server(const char *directory, const char *bind_ip);
-int list_files(const char *server_ip);
+int start_server(const char *directory, const char *bind_ip, const server_options_t *options);
+int parse_server_address(const char *text, struct in_addr *address, uint16_t *port);
+int list_files(const char *server_ip, const char *pattern, const char *cursor, uint32_t limit);
+int list_discovered(const char *pattern, uint32_t limit);
 int get_file(const char *server_ip, const char *filename);
+int get_files(const char *server_ip, char **filenames, int count, const client_options_t *options);
+int show_stats(const char *server_ip);
 
-#endif /* CUPID_H */
\ No newline at end of file
+#endif /* CUPID_H */
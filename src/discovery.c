@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+#include "discovery.h"
+#include "protocol.h"
+#include "index.h"
+#include "scheduler.h"
+
+// Largest beacon on the wire
+#define BEACON_MAX_SIZE (DISCOVERY_HEADER_SIZE + 4 * DISCOVERY_MAX_ADDRESSES + DISCOVERY_NAME_MAX)
+
+// Interfaces looked at when sending beacons and queries
+#define MAX_INTERFACES 32
+
+// After every cached server answered, how long newcomers still have
+#define DISCOVERY_GRACE_MS 50
+
+// What this server announces
+static struct {
+    int sock;
+    char name[DISCOVERY_NAME_MAX + 1];
+    struct in_addr local;
+    uint16_t port;
+    uint64_t server_id;
+    struct sockaddr_in group;
+} announcer = { .sock = -1 };
+
+// Monotonic clock in milliseconds
+static uint64_t now_ms(void) {
+    return sched_now() / 1000000;
+}
+
+// Addresses of the IPv4 interfaces that are up, loopback included.
+// Returns how many were stored.
+static int interface_addresses(struct in_addr *addresses, int max, int *loopbacks) {
+    struct ifaddrs *ifaddr, *ifa;
+    int count = 0;
+
+    *loopbacks = 0;
+    if (getifaddrs(&ifaddr) == -1) {
+        return 0;
+    }
+    for (ifa = ifaddr; ifa != NULL && count < max; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET ||
+            !(ifa->ifa_flags & IFF_UP)) {
+            continue;
+        }
+        addresses[count++] = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+        if (ifa->ifa_flags & IFF_LOOPBACK) {
+            (*loopbacks)++;
+        }
+    }
+    freeifaddrs(ifaddr);
+    return count;
+}
+
+// Whether an address is in 127.0.0.0/8
+static int is_loopback(struct in_addr address) {
+    return (ntohl(address.s_addr) >> 24) == 127;
+}
+
+// Build this server's beacon. Loopback addresses are only announced when
+// the server has nothing else. Returns its length.
+static size_t build_beacon(unsigned char *out) {
+    struct in_addr interfaces[MAX_INTERFACES];
+    size_t name_len = strlen(announcer.name);
+    int count = 0, total, loopbacks, i;
+
+    if (announcer.local.s_addr != INADDR_ANY) {
+        interfaces[0] = announcer.local;
+        total = 1;
+        loopbacks = 0;
+    } else {
+        total = interface_addresses(interfaces, MAX_INTERFACES, &loopbacks);
+    }
+    for (i = 0; i < total && count < DISCOVERY_MAX_ADDRESSES; i++) {
+        if (!is_loopback(interfaces[i]) || total == loopbacks) {
+            memcpy(out + DISCOVERY_HEADER_SIZE + 4 * count++, &interfaces[i].s_addr, 4);
+        }
+    }
+
+    put_u32(out, DISCOVERY_MAGIC);
+    out[4] = DISCOVERY_BEACON;
+    out[5] = count;
+    put_u16(out + 6, announcer.port);
+    put_u64(out + 8, announcer.server_id);
+    put_u64(out + 16, index_catalog_version());
+    out[24] = name_len;
+    memcpy(out + DISCOVERY_HEADER_SIZE + 4 * count, announcer.name, name_len);
+    return DISCOVERY_HEADER_SIZE + 4 * count + name_len;
+}
+
+// Send the beacon to the group out of every interface, joining the group
+// on each so queries from there are heard. Interfaces that came up since
+// the last round are picked up here.
+static void send_beacons(void) {
+    unsigned char beacon[BEACON_MAX_SIZE];
+    struct in_addr interfaces[MAX_INTERFACES];
+    struct ip_mreq membership;
+    size_t length = build_beacon(beacon);
+    int count, loopbacks, i;
+
+    if (announcer.local.s_addr != INADDR_ANY) {
+        interfaces[0] = announcer.local;
+        count = 1;
+    } else {
+        count = interface_addresses(interfaces, MAX_INTERFACES, &loopbacks);
+    }
+
+    for (i = 0; i < count; i++) {
+        membership.imr_multiaddr = announcer.group.sin_addr;
+        membership.imr_interface = interfaces[i];
+        // Already a member after the first round; that error is expected
+        setsockopt(announcer.sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership));
+
+        if (setsockopt(announcer.sock, IPPROTO_IP, IP_MULTICAST_IF, &interfaces[i],
+                       sizeof(interfaces[i])) == 0) {
+            sendto(announcer.sock, beacon, length, 0, (struct sockaddr *)&announcer.group,
+                   sizeof(announcer.group));
+        }
+    }
+}
+
+// Announce periodically and answer queries as they come
+static void *announce_run(void *arg) {
+    unsigned char datagram[BEACON_MAX_SIZE];
+    unsigned char beacon[BEACON_MAX_SIZE];
+    uint64_t next = 0;
+
+    (void)arg;
+    while (1) {
+        struct pollfd pfd = { .fd = announcer.sock, .events = POLLIN };
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        uint64_t now = now_ms();
+        ssize_t length;
+
+        if (now >= next) {
+            send_beacons();
+            next = now + DISCOVERY_INTERVAL * 1000;
+        }
+        if (poll(&pfd, 1, next - now) <= 0) {
+            continue;
+        }
+
+        length = recvfrom(announcer.sock, datagram, sizeof(datagram), 0,
+                          (struct sockaddr *)&from, &from_len);
+        if (length >= DISCOVERY_QUERY_SIZE && get_u32(datagram) == DISCOVERY_MAGIC &&
+            datagram[4] == DISCOVERY_QUERY) {
+            sendto(announcer.sock, beacon, build_beacon(beacon), 0,
+                   (struct sockaddr *)&from, sizeof(from));
+        }
+    }
+    return NULL;
+}
+
+// Open the discovery port and start announcing
+int discovery_start(const char *name, struct in_addr local, int port) {
+    struct sockaddr_in addr;
+    unsigned char loop = 1;
+    pthread_t thread;
+    int opt = 1;
+
+    snprintf(announcer.name, sizeof(announcer.name), "%s", name);
+    announcer.local = local;
+    announcer.port = port;
+    if (getrandom(&announcer.server_id, sizeof(announcer.server_id), 0) !=
+        sizeof(announcer.server_id)) {
+        announcer.server_id = ((uint64_t)getpid() << 32) ^ sched_now();
+    }
+    memset(&announcer.group, 0, sizeof(announcer.group));
+    announcer.group.sin_family = AF_INET;
+    announcer.group.sin_port = htons(DISCOVERY_PORT);
+    inet_pton(AF_INET, DISCOVERY_GROUP, &announcer.group.sin_addr);
+
+    // Other servers on this host share the port, and each hears every query
+    announcer.sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (announcer.sock == -1) {
+        perror("Error creating discovery socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(DISCOVERY_PORT);
+    if (setsockopt(announcer.sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+        setsockopt(announcer.sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1 ||
+        bind(announcer.sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Error opening discovery port");
+        close(announcer.sock);
+        announcer.sock = -1;
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, announce_run, NULL) != 0) {
+        perror("Error creating discovery thread");
+        close(announcer.sock);
+        announcer.sock = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Path of the client's cache of servers
+static int cache_path(char *path, size_t size, int create) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    char directory[MAX_PATH_LENGTH];
+
+    if (base != NULL && base[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s", base);
+    } else if ((base = getenv("HOME")) != NULL && base[0] != '\0') {
+        snprintf(directory, sizeof(directory), "%s/.cache", base);
+    } else {
+        return -1;
+    }
+    if (create) {
+        mkdir(directory, 0755);
+    }
+    if ((size_t)snprintf(path, size, "%s/cupid", directory) >= size) {
+        return -1;
+    }
+    if (create) {
+        mkdir(path, 0755);
+    }
+    strncat(path, "/servers", size - strlen(path) - 1);
+    return 0;
+}
+
+// Growable list of servers
+typedef struct {
+    discovered_server_t *servers;
+    int count;
+    int capacity;
+} server_list_t;
+
+// Append an empty server. Returns it, or NULL when out of memory.
+static discovered_server_t *add_server(server_list_t *list) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        discovered_server_t *grown = realloc(list->servers, capacity * sizeof(*grown));
+
+        if (grown == NULL) {
+            return NULL;
+        }
+        list->servers = grown;
+        list->capacity = capacity;
+    }
+    memset(&list->servers[list->count], 0, sizeof(discovered_server_t));
+    return &list->servers[list->count++];
+}
+
+// Add an address to a server's list unless it is there already
+static void add_address(discovered_server_t *server, struct in_addr address) {
+    int i;
+
+    for (i = 0; i < server->address_count; i++) {
+        if (server->addresses[i].s_addr == address.s_addr) {
+            return;
+        }
+    }
+    if (server->address_count <= DISCOVERY_MAX_ADDRESSES) {
+        server->addresses[server->address_count++] = address;
+    }
+}
+
+// Read the cache, skipping servers not heard from for too long
+static void load_cache(server_list_t *list) {
+    char path[MAX_PATH_LENGTH], line[1024], reachable[INET_ADDRSTRLEN], addresses[512];
+    time_t now = time(NULL);
+    FILE *fp;
+
+    if (cache_path(path, sizeof(path), 0) == -1 || (fp = fopen(path, "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        discovered_server_t server;
+        unsigned long long id, catalog;
+        long long seen;
+        unsigned int port;
+        char *address, *saved;
+        int name_start = 0;
+        size_t name_len;
+
+        memset(&server, 0, sizeof(server));
+        if (sscanf(line, "%llx %lld %u %llu %15s %511s %n", &id, &seen, &port, &catalog,
+                   reachable, addresses, &name_start) < 6 || name_start == 0 ||
+            now - seen > DISCOVERY_CACHE_TTL) {
+            continue;
+        }
+        server.server_id = id;
+        server.last_seen = seen;
+        server.port = port;
+        server.catalog = catalog;
+        inet_pton(AF_INET, reachable, &server.reachable);
+        for (address = strtok_r(addresses, ",", &saved); address != NULL;
+             address = strtok_r(NULL, ",", &saved)) {
+            struct in_addr parsed;
+
+            if (inet_pton(AF_INET, address, &parsed) == 1) {
+                add_address(&server, parsed);
+            }
+        }
+        name_len = strcspn(line + name_start, "\n");
+        if (name_len > DISCOVERY_NAME_MAX) {
+            name_len = DISCOVERY_NAME_MAX;
+        }
+        memcpy(server.name, line + name_start, name_len);
+        server.name[name_len] = '\0';
+        if (server.address_count == 0) {
+            continue;
+        }
+
+        discovered_server_t *slot = add_server(list);
+        if (slot == NULL) {
+            break;
+        }
+        *slot = server;
+    }
+    fclose(fp);
+}
+
+// Write servers to the cache, replacing it whole
+int discovery_save(const discovered_server_t *servers, int count) {
+    char path[MAX_PATH_LENGTH], temp[MAX_PATH_LENGTH + 16], address[INET_ADDRSTRLEN];
+    FILE *fp;
+    int i, j;
+
+    if (cache_path(path, sizeof(path), 1) == -1) {
+        return -1;
+    }
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    fp = fopen(temp, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        const discovered_server_t *server = &servers[i];
+
+        if (server->reachable.s_addr != 0) {
+            inet_ntop(AF_INET, &server->reachable, address, sizeof(address));
+        } else {
+            strcpy(address, "-");
+        }
+        fprintf(fp, "%016llx %lld %u %llu %s ", (unsigned long long)server->server_id,
+                (long long)server->last_seen, server->port,
+                (unsigned long long)server->catalog, address);
+        for (j = 0; j < server->address_count; j++) {
+            inet_ntop(AF_INET, &server->addresses[j], address, sizeof(address));
+            fprintf(fp, "%s%s", j > 0 ? "," : "", address);
+        }
+        fprintf(fp, " %s\n", server->name);
+    }
+    if (fclose(fp) != 0 || rename(temp, path) == -1) {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// Merge a beacon heard from source into the list. Returns 0, or -1 when
+// it is malformed.
+static int merge_beacon(server_list_t *list, const unsigned char *data, size_t length,
+                        struct in_addr source) {
+    discovered_server_t *server = NULL;
+    uint64_t id;
+    size_t name_len, i;
+    int count, j;
+
+    if (length < DISCOVERY_HEADER_SIZE || get_u32(data) != DISCOVERY_MAGIC ||
+        data[4] != DISCOVERY_BEACON || data[5] > DISCOVERY_MAX_ADDRESSES) {
+        return -1;
+    }
+    count = data[5];
+    name_len = data[24];
+    if (length < DISCOVERY_HEADER_SIZE + 4 * (size_t)count + name_len) {
+        return -1;
+    }
+    id = get_u64(data + 8);
+
+    for (j = 0; j < list->count; j++) {
+        if (list->servers[j].server_id == id) {
+            server = &list->servers[j];
+            break;
+        }
+    }
+    if (server == NULL) {
+        server = add_server(list);
+        if (server == NULL) {
+            return -1;
+        }
+        server->server_id = id;
+    } else if (server->answered) {
+        return 0;   // Heard on another interface too
+    }
+
+    // The addresses announced are the ones the server listens on; the one
+    // the beacon came from routes back to us and is tried last
+    server->port = get_u16(data + 6);
+    server->catalog = get_u64(data + 16);
+    server->last_seen = time(NULL);
+    server->answered = 1;
+    server->address_count = 0;
+    for (j = 0; j < count; j++) {
+        struct in_addr address;
+
+        memcpy(&address.s_addr, data + DISCOVERY_HEADER_SIZE + 4 * j, 4);
+        add_address(server, address);
+    }
+    add_address(server, source);
+    memcpy(server->name, data + DISCOVERY_HEADER_SIZE + 4 * count, name_len);
+    server->name[name_len] = '\0';
+    for (i = 0; i < name_len; i++) {
+        if ((unsigned char)server->name[i] < 0x20) {
+            server->name[i] = '?';     // The cache is one line per server
+        }
+    }
+    return 0;
+}
+
+// Drop cached servers that a server which answered replaces: same name
+// and port and a shared address, so the same server under a new ID
+static void drop_restarted(server_list_t *list) {
+    int i, j, a, b, kept = 0;
+
+    for (i = 0; i < list->count; i++) {
+        const discovered_server_t *old = &list->servers[i];
+        int replaced = 0;
+
+        for (j = 0; j < list->count && !old->answered && !replaced; j++) {
+            const discovered_server_t *current = &list->servers[j];
+
+            if (!current->answered || current->port != old->port ||
+                strcmp(current->name, old->name) != 0) {
+                continue;
+            }
+            for (a = 0; a < old->address_count && !replaced; a++) {
+                for (b = 0; b < current->address_count; b++) {
+                    if (old->addresses[a].s_addr == current->addresses[b].s_addr) {
+                        replaced = 1;
+                        break;
+                    }
+                }
+            }
+        }
+        if (!replaced) {
+            list->servers[kept++] = list->servers[i];
+        }
+    }
+    list->count = kept;
+}
+
+// Order servers by name for printing
+static int compare_servers(const void *a, const void *b) {
+    const discovered_server_t *x = a, *y = b;
+    int order = strcmp(x->name, y->name);
+
+    return order != 0 ? order : (x->port > y->port) - (x->port < y->port);
+}
+
+// Send a query out of every interface and merge the answers into list
+static void query_servers(server_list_t *list) {
+    struct in_addr interfaces[MAX_INTERFACES];
+    unsigned char query[DISCOVERY_QUERY_SIZE], datagram[BEACON_MAX_SIZE];
+    struct sockaddr_in group;
+    int sock, count, loopbacks, cached = list->count, answered = 0, i;
+    uint64_t deadline;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == -1) {
+        perror("Error creating discovery socket");
+        return;
+    }
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(DISCOVERY_PORT);
+    inet_pton(AF_INET, DISCOVERY_GROUP, &group.sin_addr);
+    put_u32(query, DISCOVERY_MAGIC);
+    query[4] = DISCOVERY_QUERY;
+
+    count = interface_addresses(interfaces, MAX_INTERFACES, &loopbacks);
+    for (i = 0; i < count; i++) {
+        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &interfaces[i],
+                       sizeof(interfaces[i])) == 0) {
+            sendto(sock, query, sizeof(query), 0, (struct sockaddr *)&group, sizeof(group));
+        }
+    }
+
+    // Answers come within a round trip; once every server the cache knows
+    // has answered, newcomers get only a short grace
+    deadline = now_ms() + DISCOVERY_WAIT_MS;
+    while (1) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        uint64_t now = now_ms();
+        ssize_t length;
+
+        if (now >= deadline || poll(&pfd, 1, deadline - now) <= 0) {
+            break;
+        }
+        length = recvfrom(sock, datagram, sizeof(datagram), 0, (struct sockaddr *)&from,
+                          &from_len);
+        if (length <= 0 || merge_beacon(list, datagram, length, from.sin_addr) == -1) {
+            continue;
+        }
+
+        // Cached servers stay at the front; newcomers are appended
+        answered = 0;
+        for (i = 0; i < cached; i++) {
+            answered += list->servers[i].answered;
+        }
+        if (cached > 0 && answered == cached && deadline > now + DISCOVERY_GRACE_MS) {
+            deadline = now + DISCOVERY_GRACE_MS;
+        }
+    }
+    close(sock);
+}
+
+// Find servers in the cache and on the network
+int discovery_find(discovered_server_t **servers) {
+    server_list_t list = { NULL, 0, 0 };
+
+    load_cache(&list);
+    query_servers(&list);
+    drop_restarted(&list);
+    if (list.count > 1) {
+        qsort(list.servers, list.count, sizeof(discovered_server_t), compare_servers);
+    }
+    discovery_save(list.servers, list.count);
+
+    *servers = list.servers;
+    return list.count;
+}
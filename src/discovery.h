@@ -0,0 +1,42 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "cupid.h"
+
+// Milliseconds a client waits for servers to answer a query
+#define DISCOVERY_WAIT_MS 300
+
+// Seconds a server stays in the client's cache after it was last heard
+#define DISCOVERY_CACHE_TTL (7 * 24 * 3600)
+
+// A server as the client knows it from beacons and its cache
+typedef struct {
+    uint64_t server_id;
+    char name[DISCOVERY_NAME_MAX + 1];
+    uint16_t port;
+    uint64_t catalog;
+    int address_count;
+    struct in_addr addresses[DISCOVERY_MAX_ADDRESSES + 1];  // Announced, then the sender's
+    struct in_addr reachable;   // Address the last connection was made to, 0 if none
+    time_t last_seen;
+    int answered;               // Answered this time rather than only cached
+} discovered_server_t;
+
+// Announce this server as name, reachable on port at local (INADDR_ANY
+// for every interface), from a background thread. Returns 0, or -1 when
+// the discovery port cannot be opened.
+int discovery_start(const char *name, struct in_addr local, int port);
+
+// Find servers: those in the cache, and those answering a query sent out
+// of every interface, which also refresh the cache. Sets *servers to an
+// array the caller frees, even when none were found. Returns how many.
+int discovery_find(discovered_server_t **servers);
+
+// Write the servers back to the cache, e.g. after their reachable
+// addresses were updated. Returns 0 or -1.
+int discovery_save(const discovered_server_t *servers, int count);
+
+#endif /* DISCOVERY_H */
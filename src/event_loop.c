@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "cupid.h"
+#include "protocol.h"
+#include "server.h"
+#include "scheduler.h"
+
+// Maximum events handled per epoll_wait() call
+#define MAX_EVENTS 256
+
+// Where a connection is in its request/response cycle
+#define CONN_READ_HEADER 0
+#define CONN_READ_PAYLOAD 1
+#define CONN_WRITE_RESPONSE 2
+
+// Why a connection is not waiting on epoll
+#define PARK_NONE 0
+#define PARK_READY 1        // In the ready queue for its next quantum
+#define PARK_THROTTLED 2    // Paying off bandwidth debt until wake
+
+// Per-connection state driven by the event loop
+typedef struct connection {
+    int fd;
+    int state;
+    struct sockaddr_in addr;
+    unsigned char raw_header[CUPID_HEADER_SIZE];
+    size_t received;
+    cupid_header_t header;
+    char payload[MAX_PACKET_SIZE];
+    response_t response;
+    int close_after_response;   // The request was unusable; end the session
+    sched_flow_t flow;
+    int parked;                 // PARK_NONE, PARK_READY or PARK_THROTTLED
+    uint64_t wake;              // sched_now() at which a throttled send resumes
+    struct connection *next_throttled;
+} connection_t;
+
+// One epoll instance and the listening socket it accepts from. Responses
+// that used up their quantum wait in ready and take turns in virtual
+// finish order, so a few large transfers cannot crowd out small ones.
+typedef struct {
+    int server_socket;
+    int epoll_fd;
+    sched_queue_t ready;
+    connection_t *throttled;
+} event_loop_t;
+
+// Tear down a connection; closing the fd also removes it from epoll
+static void connection_close(connection_t *conn) {
+    response_release(&conn->response);
+    close(conn->fd);
+    client_disconnected(&conn->addr, &conn->response.tcp);
+    sched_flow_release(&conn->flow);
+    free(conn);
+}
+
+// Take a connection off epoll's hands until wait nanoseconds from now,
+// or until its turn in the ready queue when wait is 0
+static void connection_park(event_loop_t *loop, connection_t *conn, uint64_t wait,
+                            uint64_t sent) {
+    if (wait > 0) {
+        conn->parked = PARK_THROTTLED;
+        conn->wake = sched_now() + wait;
+        conn->next_throttled = loop->throttled;
+        loop->throttled = conn;
+        return;
+    }
+
+    if (sched_queue_push(&loop->ready, &conn->flow, conn->response.sched_class, sent) == -1) {
+        perror("Error queueing connection");
+        connection_close(conn);
+        return;
+    }
+    conn->parked = PARK_READY;
+}
+
+// Read as much of the request as is available.
+// Returns 1 once a response is ready, 0 when more input is needed,
+// -1 when the connection should be closed.
+static int connection_read(connection_t *conn) {
+    while (conn->state != CONN_WRITE_RESPONSE) {
+        char *dest;
+        size_t want;
+
+        if (conn->state == CONN_READ_HEADER) {
+            dest = (char *)conn->raw_header + conn->received;
+            want = CUPID_HEADER_SIZE - conn->received;
+        } else {
+            dest = conn->payload + conn->received;
+            want = conn->header.length - conn->received;
+        }
+
+        if (want > 0) {
+            ssize_t n = recv(conn->fd, dest, want, 0);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            if (n == 0)
+                return -1;
+            conn->received += n;
+            if ((size_t)n < want)
+                continue;
+        }
+
+        if (conn->state == CONN_READ_HEADER) {
+            decode_header(conn->raw_header, &conn->header);
+            conn->received = 0;
+            if (conn->header.version != CUPID_PROTO_VERSION) {
+                response_init(&conn->response, 0);
+                response_error(&conn->response, ERR_VERSION, "Unsupported protocol version");
+                conn->close_after_response = 1;
+                conn->state = CONN_WRITE_RESPONSE;
+            } else if (conn->header.length >= sizeof(conn->payload)) {
+                response_init(&conn->response, conn->header.request_id);
+                response_error(&conn->response, ERR_BAD_REQUEST, "Request too large");
+                conn->close_after_response = 1;
+                conn->state = CONN_WRITE_RESPONSE;
+            } else {
+                conn->state = CONN_READ_PAYLOAD;
+            }
+        } else {
+            conn->payload[conn->header.length] = '\0';
+            handle_request(&conn->response, &conn->header, conn->payload);
+            conn->state = CONN_WRITE_RESPONSE;
+        }
+    }
+
+    return 1;
+}
+
+// Serve a connection until it must wait for the socket or its next turn
+static void connection_run(event_loop_t *loop, connection_t *conn) {
+    uint64_t sent, wait;
+    int status;
+
+    conn->parked = PARK_NONE;
+
+    // Pipelined requests may already be buffered, so keep going until
+    // the socket has nothing to read or no room to write
+    while (1) {
+        if (conn->state != CONN_WRITE_RESPONSE) {
+            status = connection_read(conn);
+            if (status == -1) {
+                connection_close(conn);
+                return;
+            }
+            if (status == 0)
+                return;
+        }
+
+        // Stream one quantum of the response, then let others have a turn
+        conn->response.allowance = SCHED_QUANTUM;
+        status = response_send(&conn->response, conn->fd);
+        sent = SCHED_QUANTUM - conn->response.allowance;
+        wait = status == -1 ? 0 : sched_charge(&conn->flow, sent);
+        if (status == RESPONSE_YIELD) {
+            connection_park(loop, conn, wait, sent);
+            return;
+        }
+        if (status == 0) {
+            if (wait > 0)
+                connection_park(loop, conn, wait, sent);
+            return;
+        }
+
+        response_release(&conn->response);
+        if (status == -1 || conn->close_after_response) {
+            connection_close(conn);
+            return;
+        }
+
+        // Ready for the next request on this session
+        conn->state = CONN_READ_HEADER;
+        conn->received = 0;
+        if (wait > 0) {
+            connection_park(loop, conn, wait, sent);
+            return;
+        }
+    }
+}
+
+// Advance a connection after epoll reported it ready
+static void connection_ready(event_loop_t *loop, connection_t *conn, uint32_t events) {
+    // A parked connection resumes on its own; a socket error will show
+    // up then, so nothing else is tracking it when it closes
+    if (conn->parked != PARK_NONE)
+        return;
+
+    if (events & EPOLLERR) {
+        connection_close(conn);
+        return;
+    }
+
+    connection_run(loop, conn);
+}
+
+// Resume throttled connections whose debt is paid. Returns the
+// milliseconds until the next one is due, or -1 when none is waiting.
+static int wake_throttled(event_loop_t *loop) {
+    connection_t **link = &loop->throttled;
+    uint64_t now = sched_now(), next = UINT64_MAX;
+
+    while (*link != NULL) {
+        connection_t *conn = *link;
+
+        if (conn->wake <= now) {
+            *link = conn->next_throttled;
+            connection_run(loop, conn);
+            continue;
+        }
+        if (conn->wake < next)
+            next = conn->wake;
+        link = &conn->next_throttled;
+    }
+
+    if (next == UINT64_MAX)
+        return -1;
+    return (next - now + 999999) / 1000000;
+}
+
+// Give every connection queued so far one more quantum, earliest
+// virtual finish first; ones queued meanwhile wait for the next pass
+// so new requests are read in between
+static void serve_ready(event_loop_t *loop) {
+    size_t turns = loop->ready.count;
+
+    while (turns-- > 0) {
+        sched_flow_t *flow = sched_queue_pop(&loop->ready);
+
+        if (flow == NULL)
+            break;
+        connection_run(loop, flow->owner);
+    }
+}
+
+// Accept every pending connection on the listening socket
+static void accept_connections(event_loop_t *loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        struct epoll_event event;
+        connection_t *conn;
+        int client_socket;
+
+        client_socket = accept4(loop->server_socket, (struct sockaddr *)&client_addr,
+                                &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Error accepting connection");
+            return;
+        }
+
+        conn = malloc(sizeof(connection_t));
+        if (conn == NULL) {
+            perror("Error allocating memory");
+            close(client_socket);
+            continue;
+        }
+
+        conn->fd = client_socket;
+        conn->state = CONN_READ_HEADER;
+        conn->addr = client_addr;
+        conn->received = 0;
+        conn->close_after_response = 0;
+        conn->parked = PARK_NONE;
+        response_init(&conn->response, 0);
+        sched_flow_init(&conn->flow, &client_addr, conn);
+
+        client_connected(client_socket, &client_addr, &conn->response.tcp);
+
+        // Edge-triggered: handlers always run until EAGAIN
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+            perror("Error registering connection");
+            connection_close(conn);
+        }
+    }
+}
+
+// Run one event loop forever
+static void *event_loop_run(void *arg) {
+    event_loop_t *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Only poll while transfers are waiting for their turn
+        int timeout = wake_throttled(loop);
+        if (loop->ready.count > 0)
+            timeout = 0;
+
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for events");
+            return NULL;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(loop);
+            } else {
+                connection_ready(loop, events[i].data.ptr, events[i].events);
+            }
+        }
+
+        serve_ready(loop);
+    }
+
+    return NULL;
+}
+
+// Serve connections on the listening socket with epoll event loops
+int run_event_loops(int server_socket, int loops) {
+    event_loop_t *event_loops;
+    int flags;
+
+    if (loops < 1)
+        loops = 1;
+
+    // Accepting is driven by readiness, so the socket must not block
+    flags = fcntl(server_socket, F_GETFL, 0);
+    if (flags == -1 || fcntl(server_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("Error making socket non-blocking");
+        return EXIT_FAILURE;
+    }
+
+    event_loops = calloc(loops, sizeof(event_loop_t));
+    if (event_loops == NULL) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < loops; i++) {
+        struct epoll_event event;
+
+        event_loops[i].server_socket = server_socket;
+        event_loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (event_loops[i].epoll_fd == -1) {
+            perror("Error creating epoll instance");
+            return EXIT_FAILURE;
+        }
+
+        // Every loop accepts; EPOLLEXCLUSIVE wakes only one per connection
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(event_loops[i].epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+            perror("Error registering listening socket");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("Serving with %d epoll event loop%s\n", loops, loops == 1 ? "" : "s");
+
+    // Extra loops get their own threads; the first runs on this one
+    for (int i = 1; i < loops; i++) {
+        pthread_t thread_id;
+
+        if (pthread_create(&thread_id, NULL, event_loop_run, &event_loops[i]) != 0) {
+            perror("Error creating event loop thread");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread_id);
+    }
+
+    event_loop_run(&event_loops[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include "cupid.h"
+#include "protocol.h"
+#include "index.h"
+
+// Initial number of hash buckets; grows as the directory does
+#define INDEX_INITIAL_BUCKETS 256
+
+// Size of the buffer inotify events are read into
+#define INOTIFY_BUFFER_SIZE (64 * 1024)
+
+// Changes that affect what a listing shows
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                          IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | \
+                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// One entry of the shared directory, chained in a hash bucket
+typedef struct index_entry {
+    struct index_entry *next;
+    uint8_t type;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t generation;    // Changes whenever inotify reports the entry changed
+    size_t name_len;
+    char name[];
+} index_entry_t;
+
+// The index of the shared directory. The watcher thread is the only
+// writer of the table; snapshots are rebuilt lazily by the first
+// listing after a change.
+static struct {
+    int dir_fd;
+    int inotify_fd;
+    int watching;                   // Cleared when changes can no longer be seen
+    pthread_rwlock_t lock;
+    index_entry_t **buckets;
+    size_t bucket_count;
+    size_t count;
+    uint64_t generation;            // Last generation handed to an entry
+    index_snapshot_t *snapshot;     // NULL when stale
+} directory_index = { .dir_fd = -1, .inotify_fd = -1, .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+// FNV-1a hash of a name
+static size_t hash_name(const char *name, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Find the bucket slot that holds name, or the empty slot ending its chain
+static index_entry_t **index_slot(const char *name, size_t len) {
+    index_entry_t **slot = &directory_index.buckets[hash_name(name, len) & (directory_index.bucket_count - 1)];
+
+    while (*slot != NULL && ((*slot)->name_len != len || memcmp((*slot)->name, name, len) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Double the bucket array once entries outnumber buckets
+static void index_grow(void) {
+    size_t new_count = directory_index.bucket_count * 2;
+    index_entry_t **buckets = calloc(new_count, sizeof(index_entry_t *));
+    size_t i;
+
+    if (buckets == NULL) {
+        return;     // Keep the longer chains
+    }
+
+    for (i = 0; i < directory_index.bucket_count; i++) {
+        index_entry_t *entry = directory_index.buckets[i];
+        while (entry != NULL) {
+            index_entry_t *next = entry->next;
+            size_t bucket = hash_name(entry->name, entry->name_len) & (new_count - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(directory_index.buckets);
+    directory_index.buckets = buckets;
+    directory_index.bucket_count = new_count;
+}
+
+// Bring the entry for name in line with the directory: stat it and
+// insert or refresh it, or drop it when it is gone
+static void index_update(const char *name) {
+    size_t len = strlen(name);
+    index_entry_t **slot = index_slot(name, len);
+    index_entry_t *entry = *slot;
+    struct stat st;
+
+    // Entries are typed by what they point to, like the old listing did
+    if (fstatat(directory_index.dir_fd, name, &st, 0) == -1) {
+        if (entry != NULL) {
+            *slot = entry->next;
+            free(entry);
+            directory_index.count--;
+            directory_index.generation++;   // The catalog changed too
+        }
+        return;
+    }
+
+    if (entry == NULL) {
+        entry = malloc(sizeof(index_entry_t) + len + 1);
+        if (entry == NULL) {
+            perror("Error allocating memory");
+            return;
+        }
+        memcpy(entry->name, name, len + 1);
+        entry->name_len = len;
+        entry->next = NULL;
+        *slot = entry;
+        directory_index.count++;
+        if (directory_index.count > directory_index.bucket_count) {
+            index_grow();
+        }
+    }
+
+    entry->type = S_ISREG(st.st_mode) ? ENTRY_FILE : S_ISDIR(st.st_mode) ? ENTRY_DIR : ENTRY_OTHER;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->generation = ++directory_index.generation;
+}
+
+// Free every entry in the table
+static void index_clear(void) {
+    size_t i;
+
+    for (i = 0; i < directory_index.bucket_count; i++) {
+        index_entry_t *entry = directory_index.buckets[i];
+        while (entry != NULL) {
+            index_entry_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        directory_index.buckets[i] = NULL;
+    }
+    directory_index.count = 0;
+}
+
+// Throw the current snapshot away; the next listing builds a new one
+static void index_invalidate(void) {
+    if (directory_index.snapshot != NULL) {
+        index_snapshot_release(directory_index.snapshot);
+        directory_index.snapshot = NULL;
+    }
+}
+
+// Rebuild the table from a full read of the directory
+static int index_rescan(void) {
+    struct dirent *dirent;
+    DIR *dir;
+    int fd;
+
+    // fdopendir() takes over the descriptor, so hand it a copy
+    fd = dup(directory_index.dir_fd);
+    if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+        perror("Error reading shared directory");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    rewinddir(dir);
+
+    index_clear();
+    while ((dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        index_update(dirent->d_name);
+    }
+
+    closedir(dir);
+    index_invalidate();
+    return 0;
+}
+
+// Order snapshot entries by name
+static int compare_entries(const void *a, const void *b) {
+    return strcmp((*(index_entry_t *const *)a)->name, (*(index_entry_t *const *)b)->name);
+}
+
+// Serialize the visible entries of the table into a new snapshot
+static index_snapshot_t *index_build_snapshot(void) {
+    index_snapshot_t *snapshot;
+    index_entry_t **sorted;
+    size_t i, count = 0, records_len = 0;
+
+    sorted = malloc((directory_index.count + 1) * sizeof(index_entry_t *));
+    snapshot = calloc(1, sizeof(index_snapshot_t));
+    if (sorted == NULL || snapshot == NULL) {
+        free(sorted);
+        free(snapshot);
+        return NULL;
+    }
+
+    // Hidden files are served but never listed
+    for (i = 0; i < directory_index.bucket_count; i++) {
+        index_entry_t *entry;
+        for (entry = directory_index.buckets[i]; entry != NULL; entry = entry->next) {
+            if (entry->name[0] != '.') {
+                sorted[count++] = entry;
+                records_len += LIST_ENTRY_SIZE + entry->name_len;
+            }
+        }
+    }
+    qsort(sorted, count, sizeof(index_entry_t *), compare_entries);
+
+    snapshot->items = malloc((count + 1) * sizeof(index_item_t));
+    snapshot->records = malloc(records_len + 1);
+    if (snapshot->items == NULL || snapshot->records == NULL) {
+        free(snapshot->items);
+        free(snapshot->records);
+        free(snapshot);
+        free(sorted);
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        index_entry_t *entry = sorted[i];
+        unsigned char *p = snapshot->records + snapshot->records_len;
+
+        p[0] = entry->type;
+        put_u64(p + 1, entry->size);
+        put_u64(p + 9, entry->mtime);
+        put_u16(p + 17, entry->name_len);
+        memcpy(p + LIST_ENTRY_SIZE, entry->name, entry->name_len);
+
+        snapshot->items[i].name = (const char *)p + LIST_ENTRY_SIZE;
+        snapshot->items[i].name_len = entry->name_len;
+        snapshot->items[i].offset = snapshot->records_len;
+        snapshot->items[i].length = LIST_ENTRY_SIZE + entry->name_len;
+        snapshot->records_len += LIST_ENTRY_SIZE + entry->name_len;
+    }
+    snapshot->count = count;
+    atomic_init(&snapshot->refs, 1);    // Held by the index
+
+    free(sorted);
+    return snapshot;
+}
+
+// Apply a batch of inotify events to the table
+static void index_apply_events(const char *buffer, ssize_t length) {
+    const char *p = buffer;
+
+    pthread_rwlock_wrlock(&directory_index.lock);
+    while (p < buffer + length) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Events were lost, so nothing short of a rescan is reliable
+            index_rescan();
+        } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            fprintf(stderr, "Shared directory was moved or deleted; listings will rescan it\n");
+            directory_index.watching = 0;
+        } else if (event->len > 0) {
+            index_update(event->name);
+        }
+        p += sizeof(struct inotify_event) + event->len;
+    }
+    index_invalidate();
+    pthread_rwlock_unlock(&directory_index.lock);
+}
+
+// Watcher thread: keep the table in step with the directory
+static void *index_watch(void *arg) {
+    char *buffer = malloc(INOTIFY_BUFFER_SIZE);
+
+    (void)arg;
+    if (buffer == NULL) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+
+    while (directory_index.watching) {
+        ssize_t length = read(directory_index.inotify_fd, buffer, INOTIFY_BUFFER_SIZE);
+        if (length == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading directory changes");
+            break;
+        }
+        index_apply_events(buffer, length);
+    }
+
+    pthread_rwlock_wrlock(&directory_index.lock);
+    directory_index.watching = 0;
+    pthread_rwlock_unlock(&directory_index.lock);
+    close(directory_index.inotify_fd);
+    free(buffer);
+    return NULL;
+}
+
+// Scan the shared directory and start watching it for changes
+int index_init(const char *directory) {
+    pthread_t thread_id;
+
+    directory_index.dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_index.dir_fd == -1) {
+        fprintf(stderr, "Error opening directory %s: %s\n", directory, strerror(errno));
+        return -1;
+    }
+
+    directory_index.bucket_count = INDEX_INITIAL_BUCKETS;
+    directory_index.buckets = calloc(directory_index.bucket_count, sizeof(index_entry_t *));
+    if (directory_index.buckets == NULL) {
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    // Watch before scanning so no change slips in between
+    directory_index.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (directory_index.inotify_fd != -1 &&
+        inotify_add_watch(directory_index.inotify_fd, directory, INDEX_WATCH_MASK) != -1) {
+        directory_index.watching = 1;
+    } else {
+        perror("Warning: cannot watch shared directory, listings will rescan it");
+    }
+
+    if (index_rescan() == -1) {
+        return -1;
+    }
+
+    if (directory_index.watching) {
+        if (pthread_create(&thread_id, NULL, index_watch, NULL) != 0) {
+            perror("Warning: cannot start directory watcher, listings will rescan it");
+            directory_index.watching = 0;
+            close(directory_index.inotify_fd);
+        } else {
+            pthread_detach(thread_id);
+        }
+    } else if (directory_index.inotify_fd != -1) {
+        close(directory_index.inotify_fd);
+    }
+
+    printf("Indexed %zu entries of %s\n", directory_index.count, directory);
+    return 0;
+}
+
+// Take a reference to the current snapshot
+index_snapshot_t *index_snapshot(void) {
+    index_snapshot_t *snapshot;
+
+    pthread_rwlock_rdlock(&directory_index.lock);
+    snapshot = directory_index.snapshot;
+    if (snapshot != NULL && directory_index.watching) {
+        atomic_fetch_add(&snapshot->refs, 1);
+        pthread_rwlock_unlock(&directory_index.lock);
+        return snapshot;
+    }
+    pthread_rwlock_unlock(&directory_index.lock);
+
+    // Stale: the first reader to get here rebuilds it for everyone
+    pthread_rwlock_wrlock(&directory_index.lock);
+    if (!directory_index.watching) {
+        index_rescan();
+    }
+    if (directory_index.snapshot == NULL) {
+        directory_index.snapshot = index_build_snapshot();
+    }
+    snapshot = directory_index.snapshot;
+    if (snapshot != NULL) {
+        atomic_fetch_add(&snapshot->refs, 1);
+    }
+    pthread_rwlock_unlock(&directory_index.lock);
+    return snapshot;
+}
+
+// Drop a reference taken with index_snapshot()
+void index_snapshot_release(index_snapshot_t *snapshot) {
+    if (atomic_fetch_sub(&snapshot->refs, 1) == 1) {
+        free(snapshot->items);
+        free(snapshot->records);
+        free(snapshot);
+    }
+}
+
+// Open a regular file of the shared tree for reading and stat it
+int index_open(const char *name, struct stat *st) {
+    int fd;
+
+    // Top-level names are checked against the index first so requests
+    // for missing files cost no system call
+    if (strchr(name, '/') == NULL) {
+        index_entry_t *entry;
+        int known;
+
+        pthread_rwlock_rdlock(&directory_index.lock);
+        entry = directory_index.watching ? *index_slot(name, strlen(name)) : NULL;
+        known = !directory_index.watching || (entry != NULL && entry->type == ENTRY_FILE);
+        pthread_rwlock_unlock(&directory_index.lock);
+
+        if (!known) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    fd = openat(directory_index.dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // The file may have changed since it was indexed
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return -1;
+    }
+    return fd;
+}
+
+// Version of a file as far as the index can vouch for it
+int index_generation(const char *name, uint64_t *generation) {
+    index_entry_t *entry;
+    int known;
+
+    if (strchr(name, '/') != NULL) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&directory_index.lock);
+    if (!directory_index.watching) {
+        known = 0;
+    } else if ((entry = *index_slot(name, strlen(name))) != NULL && entry->type == ENTRY_FILE) {
+        *generation = entry->generation;
+        known = 1;
+    } else {
+        known = -1;
+    }
+    pthread_rwlock_unlock(&directory_index.lock);
+    return known;
+}
+
+// Version of the whole listing
+uint64_t index_catalog_version(void) {
+    uint64_t version;
+
+    pthread_rwlock_rdlock(&directory_index.lock);
+    version = directory_index.watching ? directory_index.generation : 0;
+    pthread_rwlock_unlock(&directory_index.lock);
+    return version;
+}
+
+// Stat a file of the shared tree without opening it
+int index_stat(const char *name, struct stat *st) {
+    return fstatat(directory_index.dir_fd, name, st, 0);
+}
+
+// Open a directory of the shared tree for walking
+int index_open_directory(const char *name) {
+    return openat(directory_index.dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
@@ -0,0 +1,63 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+// One visible entry of a listing snapshot
+typedef struct {
+    const char *name;       // Points into the serialized record, not NUL terminated
+    size_t name_len;
+    size_t offset;          // Offset of the LIST record in the snapshot records
+    size_t length;          // Length of the LIST record
+} index_item_t;
+
+// Immutable view of the shared directory as a LIST reply would show it:
+// visible entries sorted by name, already serialized as LIST records.
+// Snapshots are reference counted so a slow client can keep paging
+// through one while the index moves on.
+typedef struct {
+    atomic_int refs;
+    size_t count;
+    index_item_t *items;
+    unsigned char *records;
+    size_t records_len;
+} index_snapshot_t;
+
+// Scan the shared directory and start watching it for changes.
+// Returns 0 or -1 when the directory cannot be opened.
+int index_init(const char *directory);
+
+// Take a reference to the current snapshot, building it if the
+// directory changed since the last one. Returns NULL on error.
+index_snapshot_t *index_snapshot(void);
+
+// Drop a reference taken with index_snapshot()
+void index_snapshot_release(index_snapshot_t *snapshot);
+
+// Open a regular file of the shared tree for reading and stat it.
+// Returns the descriptor, or -1 with errno set (ENOENT for files that
+// do not exist or are not regular files).
+int index_open(const char *name, struct stat *st);
+
+// Version of a file for caches: the generation of its index entry,
+// which changes as soon as inotify reports the file changed. Returns 1
+// with *generation set, 0 when the index cannot vouch for the name
+// (nested paths, or the directory is not watched) and the caller must
+// stat it, or -1 when the file is known not to exist.
+int index_generation(const char *name, uint64_t *generation);
+
+// Version of the listing as a whole, which changes whenever an entry is
+// added, changed or removed, or 0 when the directory is not watched
+uint64_t index_catalog_version(void);
+
+// Stat a file of the shared tree without opening it. Returns 0 or -1.
+int index_stat(const char *name, struct stat *st);
+
+// Open a directory of the shared tree ("." for the top) for walking.
+// Returns the descriptor, or -1 with errno set.
+int index_open_directory(const char *name);
+
+#endif /* INDEX_H */
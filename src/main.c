@@ -1,17 +1,558 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #include "cupid.h"
 
 void print_usage() {
     printf("Cupid - LAN File Sharing Program\n\n");
     printf("Usage:\n");
-    printf("  Server mode: cupid server [directory_to_share] [bind_ip]\n");
-    printf("  List files:  cupid list [server_ip]\n");
-    printf("  Get file:    cupid get [server_ip] [filename]\n");
+    printf("  Server mode: cupid server [options] [directory_to_share] [bind_ip]\n");
+    printf("  List files:  cupid list [options] [server_ip] [pattern]\n");
+    printf("               (without server_ip, on every server found on the LAN)\n");
+    printf("  Get files:   cupid get [options] [server_ip] [filename...]\n");
+    printf("  Metrics:     cupid stats [server_ip]\n");
+    printf("               (server_ip may be ip:port for a server started with --port)\n");
+    printf("\nServer options:\n");
+    printf("  --no-zerocopy   Send files with read/send instead of sendfile/splice\n");
+    printf("  --no-compress   Ignore requests for compressed transfers\n");
+    printf("  --engine NAME   Connection engine: threads (default), pool, epoll or uring\n");
+    printf("  --loops N       Number of event loops for the epoll engine (default 1)\n");
+    printf("  --workers N     Worker threads for the pool engine (default: CPU count)\n");
+    printf("  --queue N       Connections queued for the pool engine (default 256)\n");
+    printf("  --overload MODE When the pool queue is full: wait (default) or reject\n");
+    printf("  --backlog N     listen() backlog (default %d)\n", SOMAXCONN);
+    printf("  --port N        Listen on port N (default %d)\n", CUPID_PORT);
+    printf("  --rate R        Cap total sending at R bytes/s (K, M or G suffix)\n");
+    printf("  --client-rate R Cap sending to each client address at R bytes/s\n");
+    printf("  --metrics-port N Serve Prometheus metrics on 127.0.0.1:N\n");
+    printf("  --cache-size N  Keep up to N bytes of small files in memory (default 64M, 0 for none)\n");
+    printf("  --cache-max-file N Largest file kept in memory (default 64K)\n");
+    printf("  --cc NAME       TCP congestion control for clients (e.g. cubic, bbr)\n");
+    printf("  --wan-cc NAME   Congestion control for clients beyond a gateway\n");
+    printf("  --notsent-lowat N Most unsent bytes queued per client (default 128K, 0 for no limit)\n");
+    printf("  --multicast G[:P] Send files asked for with get --multicast to group G (port %d)\n",
+           MULTICAST_PORT);
+    printf("  --multicast-rate R Send multicast sessions at R bytes/s (default 50M)\n");
+    printf("  --multicast-wait S Hold a new session S seconds for more receivers (default 2)\n");
+    printf("  --name NAME     Share name announced to clients (default host:directory)\n");
+    printf("  --no-announce   Do not announce the server on the LAN\n");
+    printf("\nList options:\n");
+    printf("  --limit N       Show at most N entries (default: all)\n");
+    printf("  --cursor C      Continue a listing from the cursor printed by --limit\n");
+    printf("\nGet options:\n");
+    printf("  --resume        Continue partial downloads if the server's file is unchanged\n");
+    printf("  --streams N     Fetch each file over N parallel connections (max %d)\n", MAX_STREAMS);
+    printf("  --delta         Update existing local copies by fetching only changed blocks\n");
+    printf("  --compress      Ask for compressed transfers (for slow links)\n");
+    printf("  -r, --recursive Mirror the named directories with everything below them\n");
+    printf("  --connections N Spread many files over N connections (default %d, max %d)\n",
+           DEFAULT_CONNECTIONS, MAX_STREAMS);
+    printf("  --from-list F   Also get the files named in F, one per line ('-' for stdin)\n");
+    printf("  --no-zerocopy   Receive with recv/write instead of splicing into preallocated files\n");
+    printf("  --multicast     Receive from the server's multicast group, repairing losses over TCP\n");
+    printf("  --sources LIST  Fetch from several servers with identical copies at once\n");
+    printf("                  (LIST is ip[:port],ip[:port],...; no server IP is given)\n");
     printf("\nExamples:\n");
     printf("  cupid server ./shared_files 192.168.1.5  # Bind to specific IP\n");
     printf("  cupid server ./shared_files              # Bind to all interfaces\n");
+    printf("  cupid list --limit 100 192.168.1.5 '*.iso'  # First 100 ISO images\n");
+    printf("  cupid list '*.iso'                          # ISO images on every server\n");
+    printf("  cupid get -r 192.168.1.5 projects/site     # Mirror a directory tree\n");
+    printf("  cupid server --multicast 239.255.0.1 ./images  # One send for a whole lab\n");
+    printf("  cupid get --sources 10.0.0.1,10.0.0.2 disk.img  # Pull from two mirrors\n");
+}
+
+// Parse an amount of bytes or bytes per second such as 500K, 40M or 1G
+// (powers of 1000). Returns 0, or -1 when it is not a positive amount.
+static int parse_amount(const char *text, uint64_t *amount) {
+    char *end;
+    uint64_t value = strtoull(text, &end, 10);
+
+    if (end == text) {
+        return -1;
+    }
+    switch (*end) {
+        case 'K': case 'k':
+            value *= 1000;
+            end++;
+            break;
+        case 'M': case 'm':
+            value *= 1000000;
+            end++;
+            break;
+        case 'G': case 'g':
+            value *= 1000000000;
+            end++;
+            break;
+    }
+    if (*end != '\0' || value == 0) {
+        return -1;
+    }
+    *amount = value;
+    return 0;
+}
+
+// Parse server options and positional arguments, then run the server
+static int run_server(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"no-zerocopy", no_argument, NULL, 'Z'},
+        {"no-compress", no_argument, NULL, 'C'},
+        {"engine", required_argument, NULL, 'e'},
+        {"loops", required_argument, NULL, 'l'},
+        {"workers", required_argument, NULL, 'w'},
+        {"queue", required_argument, NULL, 'q'},
+        {"overload", required_argument, NULL, 'o'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"rate", required_argument, NULL, 'L'},
+        {"client-rate", required_argument, NULL, 'P'},
+        {"metrics-port", required_argument, NULL, 'm'},
+        {"port", required_argument, NULL, 'p'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"cache-max-file", required_argument, NULL, 'M'},
+        {"cc", required_argument, NULL, 'T'},
+        {"wan-cc", required_argument, NULL, 'W'},
+        {"notsent-lowat", required_argument, NULL, 'N'},
+        {"multicast", required_argument, NULL, 'g'},
+        {"multicast-rate", required_argument, NULL, 'R'},
+        {"multicast-wait", required_argument, NULL, 'G'},
+        {"name", required_argument, NULL, 'n'},
+        {"no-announce", no_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0}
+    };
+    server_options_t options;
+    char *directory = ".";  // Default to current directory
+    char *bind_ip = NULL;   // Default to all interfaces
+    uint64_t amount;
+    char *end;
+    int opt;
+
+    memset(&options, 0, sizeof(options));
+    options.zero_copy = 1;
+    options.compress = 1;
+    options.engine = ENGINE_THREADS;
+    options.event_loops = 1;
+    options.workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (options.workers < 1) {
+        options.workers = 1;
+    }
+    options.queue_size = 256;
+    options.overload = OVERLOAD_WAIT;
+    options.backlog = SOMAXCONN;
+    options.port = CUPID_PORT;
+    options.cache_size = 64000000;
+    options.cache_max_file = 64000;
+    options.notsent_lowat = 128000;
+    options.multicast_rate = 50000000;
+    options.multicast_wait = 2;
+    options.announce = 1;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'Z':
+                options.zero_copy = 0;
+                break;
+            case 'C':
+                options.compress = 0;
+                break;
+            case 'e':
+                if (strcmp(optarg, "threads") == 0) {
+                    options.engine = ENGINE_THREADS;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    options.engine = ENGINE_EPOLL;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    options.engine = ENGINE_POOL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    options.engine = ENGINE_URING;
+                } else {
+                    printf("Unknown engine: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                options.event_loops = atoi(optarg);
+                if (options.event_loops < 1) {
+                    printf("Invalid number of loops: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                options.workers = atoi(optarg);
+                if (options.workers < 1) {
+                    printf("Invalid number of workers: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'q':
+                options.queue_size = atoi(optarg);
+                if (options.queue_size < 1) {
+                    printf("Invalid queue size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                if (strcmp(optarg, "wait") == 0) {
+                    options.overload = OVERLOAD_WAIT;
+                } else if (strcmp(optarg, "reject") == 0) {
+                    options.overload = OVERLOAD_REJECT;
+                } else {
+                    printf("Unknown overload mode: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                options.backlog = atoi(optarg);
+                if (options.backlog < 1) {
+                    printf("Invalid backlog: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                if (parse_amount(optarg, &options.rate) == -1) {
+                    printf("Invalid rate: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'P':
+                if (parse_amount(optarg, &options.client_rate) == -1) {
+                    printf("Invalid client rate: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                options.metrics_port = atoi(optarg);
+                if (options.metrics_port < 1 || options.metrics_port > 65535) {
+                    printf("Invalid metrics port: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                options.port = atoi(optarg);
+                if (options.port < 1 || options.port > 65535) {
+                    printf("Invalid port: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                if (strcmp(optarg, "0") == 0) {
+                    options.cache_size = 0;
+                } else if (parse_amount(optarg, &options.cache_size) == -1) {
+                    printf("Invalid cache size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'M':
+                if (parse_amount(optarg, &options.cache_max_file) == -1) {
+                    printf("Invalid cache file size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                options.congestion = optarg;
+                break;
+            case 'W':
+                options.wan_congestion = optarg;
+                break;
+            case 'N':
+                if (strcmp(optarg, "0") == 0) {
+                    options.notsent_lowat = 0;
+                } else if (parse_amount(optarg, &amount) == -1 || amount > INT_MAX) {
+                    printf("Invalid unsent limit: %s\n", optarg);
+                    return EXIT_FAILURE;
+                } else {
+                    options.notsent_lowat = amount;
+                }
+                break;
+            case 'g':
+                options.multicast = optarg;
+                break;
+            case 'R':
+                if (parse_amount(optarg, &options.multicast_rate) == -1) {
+                    printf("Invalid multicast rate: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'G':
+                options.multicast_wait = strtol(optarg, &end, 10);
+                if (*end != '\0' || options.multicast_wait < 0 || options.multicast_wait > 3600) {
+                    printf("Invalid multicast wait: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                if (strlen(optarg) == 0 || strlen(optarg) > DISCOVERY_NAME_MAX) {
+                    printf("Invalid share name: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                options.name = optarg;
+                break;
+            case 'A':
+                options.announce = 0;
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc) {
+        directory = argv[optind++];
+    }
+
+    if (optind < argc) {
+        bind_ip = argv[optind++];
+    }
+
+    return start_server(directory, bind_ip, &options);
+}
+
+// Parse list options and positional arguments, then list the server
+static int run_list(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"limit", required_argument, NULL, 'n'},
+        {"cursor", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *pattern = NULL, *cursor = NULL;
+    struct in_addr address;
+    uint16_t port;
+    uint32_t limit = 0;
+    char *end;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                limit = strtoul(optarg, &end, 10);
+                if (*end != '\0' || limit < 1) {
+                    printf("Invalid limit: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                cursor = optarg;
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    // Without an address, everything after the options is the pattern
+    // and every server found on the LAN is listed
+    if (optind >= argc || parse_server_address(argv[optind], &address, &port) == -1) {
+        if (cursor != NULL) {
+            printf("Error: --cursor needs a server IP address\n");
+            return EXIT_FAILURE;
+        }
+        if (optind + 1 < argc) {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        return list_discovered(optind < argc ? argv[optind] : NULL, limit);
+    }
+
+    if (optind + 1 < argc) {
+        pattern = argv[optind + 1];
+    }
+
+    return list_files(argv[optind], pattern, cursor, limit);
+}
+
+// Append the names in a manifest, one per line, to the count names in
+// *names, which must have been allocated with malloc(). Blank lines and
+// lines starting with '#' are skipped. Returns the new count, or -1.
+static int read_name_list(const char *path, char ***names, int count) {
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    int capacity = count;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while ((length = getline(&line, &size, fp)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        if (count == capacity) {
+            char **grown;
+
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(*names, capacity * sizeof(char *));
+            if (grown == NULL) {
+                perror("Error allocating memory");
+                count = -1;
+                break;
+            }
+            *names = grown;
+        }
+        if (((*names)[count] = strdup(line)) == NULL) {
+            perror("Error allocating memory");
+            count = -1;
+            break;
+        }
+        count++;
+    }
+
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return count;
+}
+
+// Parse get options and positional arguments, then download the files
+static int run_get(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"resume", no_argument, NULL, 'R'},
+        {"recursive", no_argument, NULL, 'r'},
+        {"streams", required_argument, NULL, 's'},
+        {"delta", no_argument, NULL, 'd'},
+        {"compress", no_argument, NULL, 'c'},
+        {"connections", required_argument, NULL, 'n'},
+        {"from-list", required_argument, NULL, 'f'},
+        {"no-zerocopy", no_argument, NULL, 'Z'},
+        {"multicast", no_argument, NULL, 'm'},
+        {"sources", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0}
+    };
+    client_options_t options;
+    const char *list = NULL, *server_ip;
+    char **names;
+    int opt, count, listed, status, first, i;
+
+    memset(&options, 0, sizeof(options));
+    options.streams = 1;
+    options.zero_copy = 1;
+
+    while ((opt = getopt_long(argc, argv, "r", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'R':
+                options.resume = 1;
+                break;
+            case 'r':
+                options.recursive = 1;
+                break;
+            case 'd':
+                options.delta = 1;
+                break;
+            case 'c':
+                options.compress = 1;
+                break;
+            case 's':
+                options.streams = atoi(optarg);
+                if (options.streams < 1 || options.streams > MAX_STREAMS) {
+                    printf("Invalid number of streams: %s (1-%d)\n", optarg, MAX_STREAMS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                options.connections = atoi(optarg);
+                if (options.connections < 1 || options.connections > MAX_STREAMS) {
+                    printf("Invalid number of connections: %s (1-%d)\n", optarg, MAX_STREAMS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                list = optarg;
+                break;
+            case 'Z':
+                options.zero_copy = 0;
+                break;
+            case 'm':
+                options.multicast = 1;
+                break;
+            case 'S':
+                options.sources = optarg;
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    // With --sources every argument is a file name
+    first = optind + (options.sources == NULL);
+    server_ip = options.sources == NULL ? argv[optind] : NULL;
+    if (first > argc || argc - first < (list != NULL ? 0 : 1)) {
+        printf("Error: Missing server IP address or filename\n");
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (options.resume + (options.streams > 1) + options.delta > 1) {
+        printf("Error: --resume, --streams and --delta cannot be combined\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.recursive && (options.resume || options.streams > 1 || options.delta ||
+                              options.compress)) {
+        printf("Error: -r cannot be combined with other get options\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.compress && (options.streams > 1 || options.delta)) {
+        printf("Error: --compress cannot be combined with --streams or --delta\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.connections > 0 && (options.streams > 1 || options.delta || options.recursive)) {
+        printf("Error: --connections cannot be combined with --streams, --delta or -r\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.multicast && (options.resume || options.streams > 1 || options.delta ||
+                              options.compress || options.recursive || options.connections > 0)) {
+        printf("Error: --multicast cannot be combined with other get options\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.sources != NULL && (options.resume || options.streams > 1 || options.delta ||
+                                    options.compress || options.recursive ||
+                                    options.connections > 0 || options.multicast)) {
+        printf("Error: --sources cannot be combined with other get options\n");
+        return EXIT_FAILURE;
+    }
+
+    if (list == NULL) {
+        return get_files(server_ip, argv + first, argc - first, &options);
+    }
+
+    // Names on the command line come first, then the manifest's
+    count = argc - first;
+    names = malloc((count > 0 ? count : 1) * sizeof(char *));
+    if (names == NULL) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+    }
+    memcpy(names, argv + first, count * sizeof(char *));
+    listed = read_name_list(list, &names, count);
+    if (listed == -1) {
+        status = EXIT_FAILURE;
+    } else if (listed == 0) {
+        printf("Error: No files to get in %s\n", list);
+        status = EXIT_FAILURE;
+    } else {
+        status = get_files(server_ip, names, listed, &options);
+    }
+
+    for (i = count; i < listed; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return status;
 }
 
 int main(int argc, char *argv[]) {
@@ -22,38 +563,25 @@ int main(int argc, char *argv[]) {
 
     // Parse command
     if (strcmp(argv[1], "server") == 0) {
-        char *directory = ".";  // Default to current directory
-        char *bind_ip = NULL;   // Default to all interfaces
-        
-        if (argc >= 3) {
-            directory = argv[2];
-        }
-        
-        if (argc >= 4) {
-            bind_ip = argv[3];
-        }
-        
-        return start_server(directory, bind_ip);
-    } 
+        return run_server(argc - 1, argv + 1);
+    }
     else if (strcmp(argv[1], "list") == 0) {
+        return run_list(argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "get") == 0) {
+        return run_get(argc - 1, argv + 1);
+    }
+    else if (strcmp(argv[1], "stats") == 0) {
         if (argc < 3) {
             printf("Error: Missing server IP address\n");
             print_usage();
             return EXIT_FAILURE;
         }
-        return list_files(argv[2]);
-    } 
-    else if (strcmp(argv[1], "get") == 0) {
-        if (argc < 4) {
-            printf("Error: Missing server IP address or filename\n");
-            print_usage();
-            return EXIT_FAILURE;
-        }
-        return get_file(argv[2], argv[3]);
-    } 
+        return show_stats(argv[2]);
+    }
     else {
         printf("Unknown command: %s\n", argv[1]);
         print_usage();
         return EXIT_FAILURE;
     }
-} 
\ No newline at end of file
+}
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "cupid.h"
+#include "metrics.h"
+#include "cache.h"
+
+// Histograms are log-linear like HdrHistogram: values (in microseconds)
+// below 2^SUB_BITS get a bucket each, and every power of two above is
+// split into 2^SUB_BITS buckets, so a bucket is within 1/16 of its values.
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_MAX_EXP 36         // 2^36 us is about 19 hours; longer is clamped
+#define HIST_BUCKETS ((HIST_MAX_EXP - SUB_BITS + 2) << SUB_BITS)
+
+// Counters owned by one thread. Only the owner writes them; readers sum
+// all blocks. A block outlives its thread and is handed to the next new
+// thread, so totals never go backwards.
+typedef struct metrics_block {
+    uint64_t requests[256];
+    uint64_t errors;
+    uint64_t sent;
+    uint64_t opened;
+    uint64_t closed;
+    uint64_t grown;
+    uint64_t retransmits;
+    uint64_t multicast;
+    uint64_t buckets[HIST_COUNT][HIST_BUCKETS];
+    uint64_t sum[HIST_COUNT];
+    uint64_t max[HIST_COUNT];
+    struct metrics_block *next;         // Every block ever created
+    struct metrics_block *next_free;    // Blocks whose thread has exited
+} metrics_block_t;
+
+static metrics_block_t *all_blocks;
+static metrics_block_t *free_blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+static __thread metrics_block_t *local_block;
+
+// Request opcodes reported by name; the rest count as "unknown"
+static const struct {
+    uint8_t opcode;
+    const char *name;
+} request_names[] = {
+    { CMD_LIST_FILES, "list" },
+    { CMD_GET_FILE, "get" },
+    { CMD_GET_SIGNATURES, "signatures" },
+    { CMD_GET_TREE, "tree" },
+    { CMD_GET_STATS, "stats" },
+    { CMD_MULTICAST_JOIN, "multicast" },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} histogram_names[HIST_COUNT] = {
+    { "cupid_time_to_first_byte_seconds", "Time from a request to the first byte of its response." },
+    { "cupid_response_duration_seconds", "Time from a request to the last byte of its response." },
+    { "cupid_tcp_rtt_seconds", "Smoothed TCP round-trip time at the end of each transfer of 4 MB or more." },
+};
+
+// Reported quantiles
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// A thread ended: its block waits for the next thread
+static void release_block(void *block) {
+    pthread_mutex_lock(&blocks_lock);
+    ((metrics_block_t *)block)->next_free = free_blocks;
+    free_blocks = block;
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+static void create_block_key(void) {
+    pthread_key_create(&block_key, release_block);
+}
+
+// This thread's block, taken on first use. NULL only when out of memory.
+static metrics_block_t *thread_block(void) {
+    metrics_block_t *block = local_block;
+
+    if (block != NULL)
+        return block;
+
+    pthread_once(&block_key_once, create_block_key);
+    pthread_mutex_lock(&blocks_lock);
+    if (free_blocks != NULL) {
+        block = free_blocks;
+        free_blocks = block->next_free;
+    } else if ((block = calloc(1, sizeof(metrics_block_t))) != NULL) {
+        block->next = all_blocks;
+        all_blocks = block;
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    if (block != NULL)
+        pthread_setspecific(block_key, block);
+    local_block = block;
+    return block;
+}
+
+// Add to a counter of this thread's block. Relaxed atomics keep readers
+// from seeing torn values without a locked instruction on the hot path.
+static inline void bump(uint64_t *counter, uint64_t amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount,
+                     __ATOMIC_RELAXED);
+}
+
+static inline uint64_t peek(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void metrics_request(uint8_t opcode) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->requests[opcode], 1);
+}
+
+void metrics_error(void) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->errors, 1);
+}
+
+void metrics_sent(uint64_t bytes) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->sent, bytes);
+}
+
+void metrics_connection_opened(void) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->opened, 1);
+}
+
+void metrics_connection_closed(void) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->closed, 1);
+}
+
+void metrics_buffer_grown(void) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->grown, 1);
+}
+
+void metrics_retransmits(uint64_t segments) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->retransmits, segments);
+}
+
+void metrics_multicast_sent(uint64_t bytes) {
+    metrics_block_t *block = thread_block();
+
+    if (block != NULL)
+        bump(&block->multicast, bytes);
+}
+
+// Histogram bucket of a value in microseconds
+static int bucket_of(uint64_t value) {
+    int shift;
+
+    if (value < SUB_COUNT)
+        return value;
+    if (value >= (uint64_t)1 << (HIST_MAX_EXP + 1))
+        return HIST_BUCKETS - 1;
+    shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) + ((value >> shift) & (SUB_COUNT - 1));
+}
+
+// Largest value in microseconds that falls in a bucket
+static uint64_t bucket_top(int bucket) {
+    int shift = (bucket >> SUB_BITS) - 1;
+
+    if (shift < 0)
+        return bucket;
+    return ((uint64_t)(SUB_COUNT + (bucket & (SUB_COUNT - 1)) + 1) << shift) - 1;
+}
+
+// Add a latency in nanoseconds to a histogram
+void metrics_record(int histogram, uint64_t nanoseconds) {
+    metrics_block_t *block = thread_block();
+    uint64_t micros = nanoseconds / 1000;
+
+    if (block == NULL)
+        return;
+    bump(&block->buckets[histogram][bucket_of(micros)], 1);
+    bump(&block->sum[histogram], micros);
+    if (micros > peek(&block->max[histogram]))
+        __atomic_store_n(&block->max[histogram], micros, __ATOMIC_RELAXED);
+}
+
+// Append formatted text, keeping *length short of size
+static void append(char *buffer, size_t size, size_t *length, const char *format, ...) {
+    va_list args;
+    int written;
+
+    if (*length + 1 >= size)
+        return;
+    va_start(args, format);
+    written = vsnprintf(buffer + *length, size - *length, format, args);
+    va_end(args);
+    if (written > 0)
+        *length += (size_t)written < size - *length ? (size_t)written : size - *length - 1;
+}
+
+// Write one summary from merged histogram buckets
+static void format_histogram(char *buffer, size_t size, size_t *length, int histogram,
+                             const uint64_t *buckets, uint64_t sum, uint64_t max) {
+    const char *name = histogram_names[histogram].name;
+    uint64_t count = 0, seen = 0;
+    size_t q = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        count += buckets[i];
+
+    append(buffer, size, length, "# HELP %s %s\n# TYPE %s summary\n",
+           name, histogram_names[histogram].help, name);
+    for (int i = 0; i < HIST_BUCKETS && count > 0 && q < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        seen += buckets[i];
+        while (q < sizeof(quantiles) / sizeof(quantiles[0]) && seen >= quantiles[q] * count) {
+            uint64_t top = bucket_top(i) < max ? bucket_top(i) : max;
+            append(buffer, size, length, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[q], top / 1e6);
+            q++;
+        }
+    }
+    append(buffer, size, length, "%s_sum %.6f\n%s_count %llu\n",
+           name, sum / 1e6, name, (unsigned long long)count);
+}
+
+// Write every metric in the Prometheus text format
+size_t metrics_format(char *buffer, size_t size) {
+    static uint64_t buckets[HIST_COUNT][HIST_BUCKETS];
+    static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t requests[256] = { 0 };
+    uint64_t errors = 0, sent = 0, opened = 0, closed = 0, grown = 0, retransmits = 0, multicast = 0;
+    uint64_t other;
+    uint64_t sum[HIST_COUNT] = { 0 }, max[HIST_COUNT] = { 0 };
+    cache_stats_t cache;
+    size_t length = 0;
+
+    if (size == 0)
+        return 0;
+    buffer[0] = '\0';
+
+    // The merged histograms are too big for the stack of a small thread
+    pthread_mutex_lock(&format_lock);
+    memset(buckets, 0, sizeof(buckets));
+
+    pthread_mutex_lock(&blocks_lock);
+    for (metrics_block_t *block = all_blocks; block != NULL; block = block->next) {
+        for (int i = 0; i < 256; i++)
+            requests[i] += peek(&block->requests[i]);
+        errors += peek(&block->errors);
+        sent += peek(&block->sent);
+        opened += peek(&block->opened);
+        closed += peek(&block->closed);
+        grown += peek(&block->grown);
+        retransmits += peek(&block->retransmits);
+        multicast += peek(&block->multicast);
+        for (int h = 0; h < HIST_COUNT; h++) {
+            for (int i = 0; i < HIST_BUCKETS; i++)
+                buckets[h][i] += peek(&block->buckets[h][i]);
+            sum[h] += peek(&block->sum[h]);
+            if (peek(&block->max[h]) > max[h])
+                max[h] = peek(&block->max[h]);
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    append(buffer, size, &length, "# HELP cupid_requests_total Requests received, by command.\n"
+                                  "# TYPE cupid_requests_total counter\n");
+    for (size_t i = 0; i < sizeof(request_names) / sizeof(request_names[0]); i++) {
+        append(buffer, size, &length, "cupid_requests_total{command=\"%s\"} %llu\n",
+               request_names[i].name, (unsigned long long)requests[request_names[i].opcode]);
+        requests[request_names[i].opcode] = 0;
+    }
+    other = 0;
+    for (int i = 0; i < 256; i++)
+        other += requests[i];
+    append(buffer, size, &length, "cupid_requests_total{command=\"unknown\"} %llu\n",
+           (unsigned long long)other);
+
+    append(buffer, size, &length,
+           "# HELP cupid_errors_total Error responses sent.\n"
+           "# TYPE cupid_errors_total counter\n"
+           "cupid_errors_total %llu\n"
+           "# HELP cupid_sent_bytes_total Response bytes written to clients.\n"
+           "# TYPE cupid_sent_bytes_total counter\n"
+           "cupid_sent_bytes_total %llu\n"
+           "# HELP cupid_connections_total Connections accepted.\n"
+           "# TYPE cupid_connections_total counter\n"
+           "cupid_connections_total %llu\n"
+           "# HELP cupid_connections_active Connections open now.\n"
+           "# TYPE cupid_connections_active gauge\n"
+           "cupid_connections_active %llu\n",
+           (unsigned long long)errors, (unsigned long long)sent, (unsigned long long)opened,
+           (unsigned long long)(opened > closed ? opened - closed : 0));
+
+    append(buffer, size, &length,
+           "# HELP cupid_tcp_buffers_grown_total Send buffers grown to the bandwidth-delay product.\n"
+           "# TYPE cupid_tcp_buffers_grown_total counter\n"
+           "cupid_tcp_buffers_grown_total %llu\n"
+           "# HELP cupid_tcp_retransmits_total Segments retransmitted during transfers of 4 MB or more.\n"
+           "# TYPE cupid_tcp_retransmits_total counter\n"
+           "cupid_tcp_retransmits_total %llu\n"
+           "# HELP cupid_multicast_sent_bytes_total File bytes sent to the multicast group.\n"
+           "# TYPE cupid_multicast_sent_bytes_total counter\n"
+           "cupid_multicast_sent_bytes_total %llu\n",
+           (unsigned long long)grown, (unsigned long long)retransmits,
+           (unsigned long long)multicast);
+
+    cache_stats(&cache);
+    append(buffer, size, &length,
+           "# HELP cupid_cache_hits_total GETs of small files answered from memory.\n"
+           "# TYPE cupid_cache_hits_total counter\n"
+           "cupid_cache_hits_total %llu\n"
+           "# HELP cupid_cache_misses_total GETs of small files read from disk.\n"
+           "# TYPE cupid_cache_misses_total counter\n"
+           "cupid_cache_misses_total %llu\n"
+           "# HELP cupid_cache_hit_ratio Share of small-file GETs answered from memory.\n"
+           "# TYPE cupid_cache_hit_ratio gauge\n"
+           "cupid_cache_hit_ratio %.4f\n"
+           "# HELP cupid_cache_bytes Bytes of replies held in memory.\n"
+           "# TYPE cupid_cache_bytes gauge\n"
+           "cupid_cache_bytes %llu\n"
+           "# HELP cupid_cache_entries Files held in memory.\n"
+           "# TYPE cupid_cache_entries gauge\n"
+           "cupid_cache_entries %llu\n",
+           (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+           cache.hits + cache.misses > 0 ? (double)cache.hits / (cache.hits + cache.misses) : 0.0,
+           (unsigned long long)cache.bytes, (unsigned long long)cache.entries);
+
+    for (int h = 0; h < HIST_COUNT; h++)
+        format_histogram(buffer, size, &length, h, buckets[h], sum[h], max[h]);
+    pthread_mutex_unlock(&format_lock);
+
+    return length;
+}
+
+// Answer scrapes one at a time; each is a single short HTTP/1.0 exchange
+static void *metrics_thread(void *arg) {
+    int server_socket = (int)(intptr_t)arg;
+    struct timeval timeout = { 1, 0 };
+    char request[1024];
+    char body[MAX_PACKET_SIZE];
+    char head[256];
+
+    while (1) {
+        int client_socket = accept(server_socket, NULL, NULL);
+        size_t body_len = 0;
+        ssize_t n;
+        int found;
+
+        if (client_socket == -1) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("Error accepting metrics connection");
+            continue;
+        }
+
+        // A stuck scraper must not block the next one for long
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        n = recv(client_socket, request, sizeof(request) - 1, 0);
+        if (n <= 0) {
+            close(client_socket);
+            continue;
+        }
+        request[n] = '\0';
+
+        found = strncmp(request, "GET / ", 6) == 0 || strncmp(request, "GET /metrics ", 13) == 0;
+        if (found)
+            body_len = metrics_format(body, sizeof(body));
+        snprintf(head, sizeof(head),
+                 "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                 found ? "200 OK" : "404 Not Found", body_len);
+        if (send(client_socket, head, strlen(head), MSG_NOSIGNAL) > 0 && body_len > 0)
+            send(client_socket, body, body_len, MSG_NOSIGNAL);
+        close(client_socket);
+    }
+
+    return NULL;
+}
+
+// Serve metrics over HTTP on 127.0.0.1:port
+int metrics_serve(int port) {
+    struct sockaddr_in addr;
+    pthread_t thread_id;
+    int server_socket, opt = 1;
+
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_socket == -1) {
+        perror("Error creating metrics socket");
+        return -1;
+    }
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(server_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(server_socket, 16) == -1) {
+        perror("Error opening metrics port");
+        close(server_socket);
+        return -1;
+    }
+
+    if (pthread_create(&thread_id, NULL, metrics_thread, (void *)(intptr_t)server_socket) != 0) {
+        perror("Error creating metrics thread");
+        close(server_socket);
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Latency histograms
+#define HIST_FIRST_BYTE 0       // Request received to first response byte sent
+#define HIST_DURATION 1         // Request received to last response byte sent
+#define HIST_TCP_RTT 2          // Smoothed RTT at the end of each large transfer
+#define HIST_COUNT 3
+
+// Counters are kept per thread and only summed when read, so recording
+// costs a plain add to memory no other thread writes.
+void metrics_request(uint8_t opcode);
+void metrics_error(void);
+void metrics_sent(uint64_t bytes);
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+void metrics_buffer_grown(void);
+void metrics_retransmits(uint64_t segments);
+void metrics_multicast_sent(uint64_t bytes);
+
+// Add a latency in nanoseconds to a histogram
+void metrics_record(int histogram, uint64_t nanoseconds);
+
+// Write every metric in the Prometheus text format into buffer.
+// Returns the length written, which stops short of size.
+size_t metrics_format(char *buffer, size_t size);
+
+// Serve metrics_format() over HTTP on 127.0.0.1:port from a background
+// thread. Returns 0 or -1 when the port cannot be opened.
+int metrics_serve(int port);
+
+#endif /* METRICS_H */
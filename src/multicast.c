@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "cupid.h"
+#include "multicast.h"
+#include "protocol.h"
+#include "checksum.h"
+#include "scheduler.h"
+#include "metrics.h"
+
+// A file queued for or being sent to the group
+typedef struct multicast_session {
+    uint32_t id;
+    char name[MAX_PATH_LENGTH];
+    int file_fd;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t start;             // sched_now() at which sending begins
+    struct multicast_session *next;
+} multicast_session_t;
+
+// Sender state. Sessions are sent one at a time in the order they were
+// opened; the head of the queue is the one being sent once sending is set.
+static int sender_sock = -1;
+static struct sockaddr_in group_addr;
+static uint64_t send_rate;
+static uint64_t gather_ns;
+static multicast_session_t *sessions;
+static int sending;
+static uint32_t next_session;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_changed = PTHREAD_COND_INITIALIZER;
+
+// Pack a CMD_MULTICAST_INFO payload
+void multicast_info_encode(const multicast_info_t *info, unsigned char *out) {
+    memcpy(out, &info->group.s_addr, 4);
+    put_u16(out + 4, info->port);
+    put_u16(out + 6, 0);
+    put_u32(out + 8, info->session);
+    put_u32(out + 12, info->start_ms);
+    put_u64(out + 16, info->size);
+    put_u64(out + 24, info->mtime);
+}
+
+// Unpack a CMD_MULTICAST_INFO payload
+void multicast_info_decode(const unsigned char *in, multicast_info_t *info) {
+    memcpy(&info->group.s_addr, in, 4);
+    info->port = get_u16(in + 4);
+    info->session = get_u32(in + 8);
+    info->start_ms = get_u32(in + 12);
+    info->size = get_u64(in + 16);
+    info->mtime = get_u64(in + 24);
+}
+
+// Fill in a datagram header
+static void encode_datagram_header(unsigned char *out, uint32_t session, uint8_t type,
+                                   uint64_t offset) {
+    put_u32(out, MULTICAST_MAGIC);
+    put_u32(out + 4, session);
+    out[8] = type;
+    out[9] = out[10] = out[11] = 0;
+    put_u64(out + 12, offset);
+}
+
+// Sleep until sched_now() reaches deadline
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = sched_now();
+    struct timespec pause;
+
+    if (now >= deadline) {
+        return;
+    }
+    pause.tv_sec = (deadline - now) / 1000000000;
+    pause.tv_nsec = (deadline - now) % 1000000000;
+    while (nanosleep(&pause, &pause) == -1 && errno == EINTR) {
+    }
+}
+
+// Nanoseconds sending bytes takes at send_rate
+static uint64_t send_time(uint64_t bytes) {
+    return (uint64_t)((double)bytes * 1e9 / send_rate);
+}
+
+// Hand count prepared datagrams to the kernel. A datagram the kernel
+// refuses is dropped like one lost on the wire; receivers repair it.
+static void send_batch(struct mmsghdr *messages, unsigned int count) {
+    unsigned int done = 0;
+
+    while (done < count) {
+        int sent = sendmmsg(sender_sock, messages + done, count - done, 0);
+
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            done++;
+            continue;
+        }
+        done += sent;
+    }
+}
+
+// Send one file to the group at send_rate, then its MULTICAST_END
+static void send_session(multicast_session_t *session, unsigned char *buffer) {
+    struct mmsghdr messages[MULTICAST_BATCH];
+    struct iovec iov[MULTICAST_BATCH][2];
+    unsigned char headers[MULTICAST_BATCH][MULTICAST_HEADER_SIZE];
+    unsigned char end[MULTICAST_HEADER_SIZE + 4];
+    uint64_t offset = 0, started = sched_now();
+    uint32_t crc = 0;
+    unsigned int count, i;
+
+    printf("Multicast session %u: sending %s (%llu bytes)\n", session->id, session->name,
+           (unsigned long long)session->size);
+
+    memset(messages, 0, sizeof(messages));
+    for (i = 0; i < MULTICAST_BATCH; i++) {
+        messages[i].msg_hdr.msg_name = &group_addr;
+        messages[i].msg_hdr.msg_namelen = sizeof(group_addr);
+        messages[i].msg_hdr.msg_iov = iov[i];
+        messages[i].msg_hdr.msg_iovlen = 2;
+        iov[i][0].iov_base = headers[i];
+        iov[i][0].iov_len = MULTICAST_HEADER_SIZE;
+    }
+
+    while (offset < session->size) {
+        uint64_t remaining = session->size - offset;
+        size_t want = remaining < MULTICAST_BATCH * MULTICAST_PAYLOAD ?
+                      remaining : MULTICAST_BATCH * MULTICAST_PAYLOAD;
+        ssize_t got = pread(session->file_fd, buffer, want, offset);
+
+        if (got <= 0) {
+            // Shrunk or unreadable: receivers time out and repair over TCP,
+            // where the changed file is noticed
+            perror("Error reading file for multicast");
+            break;
+        }
+        crc = crc32c(crc, buffer, got);
+
+        for (count = 0; count * MULTICAST_PAYLOAD < (size_t)got; count++) {
+            size_t start = count * MULTICAST_PAYLOAD;
+
+            encode_datagram_header(headers[count], session->id, MULTICAST_DATA, offset + start);
+            iov[count][1].iov_base = buffer + start;
+            iov[count][1].iov_len = (size_t)got - start < MULTICAST_PAYLOAD ?
+                                    (size_t)got - start : MULTICAST_PAYLOAD;
+        }
+        send_batch(messages, count);
+        offset += got;
+        metrics_multicast_sent(got);
+
+        // Paced against the start so short stalls are caught up smoothly
+        sleep_until(started + send_time(offset));
+    }
+
+    if (offset == session->size) {
+        encode_datagram_header(end, session->id, MULTICAST_END, offset);
+        put_u32(end + MULTICAST_HEADER_SIZE, crc);
+        for (i = 0; i < MULTICAST_END_REPEAT; i++) {
+            if (sendto(sender_sock, end, sizeof(end), 0, (struct sockaddr *)&group_addr,
+                       sizeof(group_addr)) == -1) {
+                perror("Error sending multicast end");
+            }
+            sleep_until(sched_now() + MULTICAST_END_GAP_MS * 1000000ULL);
+        }
+    }
+
+    printf("Multicast session %u: sent %llu bytes of %s in %.1f s\n", session->id,
+           (unsigned long long)offset, session->name, (sched_now() - started) / 1e9);
+}
+
+// Send queued sessions, each once its gathering window has passed
+static void *sender_run(void *arg) {
+    unsigned char *buffer = arg;
+    multicast_session_t *session;
+
+    while (1) {
+        pthread_mutex_lock(&sessions_lock);
+        while (sessions == NULL) {
+            pthread_cond_wait(&sessions_changed, &sessions_lock);
+        }
+        session = sessions;
+        pthread_mutex_unlock(&sessions_lock);
+
+        // Joins only append, so the head stays put while we wait
+        sleep_until(session->start);
+
+        pthread_mutex_lock(&sessions_lock);
+        sending = 1;
+        pthread_mutex_unlock(&sessions_lock);
+
+        send_session(session, buffer);
+
+        pthread_mutex_lock(&sessions_lock);
+        sessions = session->next;
+        sending = 0;
+        pthread_mutex_unlock(&sessions_lock);
+
+        close(session->file_fd);
+        free(session);
+    }
+    return NULL;
+}
+
+// Set up the sending socket and start the sender thread
+int multicast_init(const char *group, struct in_addr local, uint64_t rate, int wait) {
+    char address[INET_ADDRSTRLEN];
+    const char *colon = strchr(group, ':');
+    size_t length = colon != NULL ? (size_t)(colon - group) : strlen(group);
+    int port = MULTICAST_PORT;
+    unsigned char ttl = MULTICAST_TTL, loop = 1;
+    int buffer_size = MULTICAST_BATCH * MULTICAST_DATAGRAM_SIZE * 4;
+    unsigned char *buffer;
+    pthread_t thread;
+
+    memset(&group_addr, 0, sizeof(group_addr));
+    group_addr.sin_family = AF_INET;
+    if (colon != NULL) {
+        char *end;
+
+        port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port < 1 || port > 65535) {
+            fprintf(stderr, "Invalid multicast port: %s\n", colon + 1);
+            return -1;
+        }
+    }
+    if (length >= sizeof(address)) {
+        fprintf(stderr, "Invalid multicast group: %s\n", group);
+        return -1;
+    }
+    memcpy(address, group, length);
+    address[length] = '\0';
+    if (inet_pton(AF_INET, address, &group_addr.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(group_addr.sin_addr.s_addr))) {
+        fprintf(stderr, "Not a multicast group address: %s\n", address);
+        return -1;
+    }
+    group_addr.sin_port = htons(port);
+
+    sender_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sender_sock == -1) {
+        perror("Error creating multicast socket");
+        return -1;
+    }
+
+    // Loopback delivery lets receivers on this host join in too
+    if (setsockopt(sender_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1 ||
+        setsockopt(sender_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1 ||
+        (local.s_addr != INADDR_ANY &&
+         setsockopt(sender_sock, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == -1)) {
+        perror("Error setting multicast socket options");
+        close(sender_sock);
+        sender_sock = -1;
+        return -1;
+    }
+    // Room for a few batches; without it a batch overruns the default
+    setsockopt(sender_sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    buffer = malloc(MULTICAST_BATCH * MULTICAST_PAYLOAD);
+    if (buffer == NULL) {
+        perror("Error allocating memory");
+        close(sender_sock);
+        sender_sock = -1;
+        return -1;
+    }
+
+    send_rate = rate;
+    gather_ns = (uint64_t)wait * 1000000000;
+    next_session = (uint32_t)time(NULL);    // Sessions of an earlier run are told apart
+
+    if (pthread_create(&thread, NULL, sender_run, buffer) != 0) {
+        perror("Error creating multicast thread");
+        free(buffer);
+        close(sender_sock);
+        sender_sock = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Whether multicast_init() succeeded
+int multicast_enabled(void) {
+    return sender_sock != -1;
+}
+
+// Describe a session to a receiver joining now, which expects the first
+// datagram at begin
+static void describe_session(const multicast_session_t *session, uint64_t begin,
+                             multicast_info_t *info) {
+    uint64_t now = sched_now();
+
+    info->group = group_addr.sin_addr;
+    info->port = ntohs(group_addr.sin_port);
+    info->session = session->id;
+    info->start_ms = begin > now ? (begin - now) / 1000000 : 0;
+    info->size = session->size;
+    info->mtime = session->mtime;
+}
+
+// Schedule a file for sending or join the session already sending it
+int multicast_join(const char *name, int file_fd, const struct stat *st, multicast_info_t *info) {
+    multicast_session_t *session, **tail;
+    uint64_t ready = sched_now(), begin;
+
+    // A session starts after its gathering window and after the sessions
+    // ahead of it, which take about their size over the rate
+    pthread_mutex_lock(&sessions_lock);
+    for (tail = &sessions; *tail != NULL; tail = &(*tail)->next) {
+        session = *tail;
+        begin = session->start > ready || (session == sessions && sending) ?
+                session->start : ready;
+        if (strcmp(session->name, name) == 0 && session->size == (uint64_t)st->st_size &&
+            session->mtime == (uint64_t)st->st_mtime) {
+            describe_session(session, begin, info);
+            pthread_mutex_unlock(&sessions_lock);
+            close(file_fd);
+            return 0;
+        }
+        ready = begin + send_time(session->size);
+    }
+
+    session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        pthread_mutex_unlock(&sessions_lock);
+        close(file_fd);
+        return -1;
+    }
+    session->id = next_session++;
+    snprintf(session->name, sizeof(session->name), "%s", name);
+    session->file_fd = file_fd;
+    session->size = st->st_size;
+    session->mtime = st->st_mtime;
+    session->start = sched_now() + gather_ns;
+    begin = session->start > ready ? session->start : ready;
+    *tail = session;
+    describe_session(session, begin, info);
+    pthread_cond_signal(&sessions_changed);
+    pthread_mutex_unlock(&sessions_lock);
+    return 0;
+}
+
+// Monotonic clock in milliseconds
+static uint64_t now_ms(void) {
+    return sched_now() / 1000000;
+}
+
+// Store one datagram of the session. Returns 1 for new data, 2 for the
+// end of the session, 0 for anything to ignore, -1 when writing failed.
+static int store_datagram(const multicast_info_t *info, int file_fd, const unsigned char *data,
+                          ssize_t length, multicast_reception_t *reception) {
+    uint64_t offset, chunk;
+    size_t expected;
+
+    if (length < MULTICAST_HEADER_SIZE || get_u32(data) != MULTICAST_MAGIC ||
+        get_u32(data + 4) != info->session) {
+        return 0;
+    }
+    offset = get_u64(data + 12);
+
+    if (data[8] == MULTICAST_END && length >= MULTICAST_HEADER_SIZE + 4) {
+        reception->ended = 1;
+        reception->crc = get_u32(data + MULTICAST_HEADER_SIZE);
+        return 2;
+    }
+    if (data[8] != MULTICAST_DATA || offset % MULTICAST_PAYLOAD != 0) {
+        return 0;
+    }
+    chunk = offset / MULTICAST_PAYLOAD;
+    if (chunk >= reception->chunks || reception->received[chunk]) {
+        return 0;
+    }
+    expected = info->size - offset < MULTICAST_PAYLOAD ? info->size - offset : MULTICAST_PAYLOAD;
+    if ((size_t)(length - MULTICAST_HEADER_SIZE) != expected) {
+        return 0;
+    }
+
+    if (pwrite(file_fd, data + MULTICAST_HEADER_SIZE, expected, offset) != (ssize_t)expected) {
+        perror("Error writing to file");
+        return -1;
+    }
+    reception->received[chunk] = 1;
+    reception->received_count++;
+    return 1;
+}
+
+// Receive one session from the group into file_fd
+int multicast_receive(const multicast_info_t *info, struct in_addr local, int file_fd,
+                      multicast_reception_t *reception) {
+    struct sockaddr_in addr;
+    struct ip_mreq membership;
+    unsigned char datagram[MULTICAST_DATAGRAM_SIZE];
+    int buffer_size = MULTICAST_RECEIVE_BUFFER / 2;
+    int sock, opt = 1, status = 0;
+    uint64_t deadline;
+
+    memset(reception, 0, sizeof(*reception));
+    reception->chunks = info->size / MULTICAST_PAYLOAD + (info->size % MULTICAST_PAYLOAD != 0);
+    reception->received = calloc(reception->chunks + 1, 1);
+    if (reception->received == NULL) {
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    // Every receiver on a host binds the same port
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == -1) {
+        perror("Error creating multicast socket");
+        free(reception->received);
+        reception->received = NULL;
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) == -1) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = info->group;
+    addr.sin_port = htons(info->port);
+    membership.imr_multiaddr = info->group;
+    membership.imr_interface = local;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == -1) {
+        perror("Error joining multicast group");
+        close(sock);
+        free(reception->received);
+        reception->received = NULL;
+        return -1;
+    }
+
+    // Wait out the gathering window, then for as long as datagrams keep coming
+    deadline = now_ms() + info->start_ms + MULTICAST_IDLE_TIMEOUT * 1000;
+    while (1) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        uint64_t now = now_ms();
+        ssize_t length;
+        int stored;
+
+        if (now >= deadline) {
+            break;
+        }
+        if (poll(&pfd, 1, deadline - now) == -1 && errno != EINTR) {
+            perror("Error waiting for multicast data");
+            break;
+        }
+
+        // Drain what is queued before looking at the clock again
+        while ((length = recv(sock, datagram, sizeof(datagram), MSG_DONTWAIT)) >= 0) {
+            stored = store_datagram(info, file_fd, datagram, length, reception);
+            if (stored == -1) {
+                status = -1;
+                break;
+            }
+            if (stored == 2) {
+                break;
+            }
+            if (stored == 1) {
+                deadline = now_ms() + MULTICAST_IDLE_TIMEOUT * 1000;
+            }
+        }
+        if (status == -1 || reception->ended) {
+            break;
+        }
+        // Everything arrived: only the end is missing, and it follows closely
+        if (reception->chunks > 0 && reception->received_count == reception->chunks) {
+            uint64_t soon = now_ms() + MULTICAST_END_REPEAT * MULTICAST_END_GAP_MS * 2;
+
+            if (soon < deadline) {
+                deadline = soon;
+            }
+        }
+    }
+
+    close(sock);
+    if (status == -1) {
+        free(reception->received);
+        reception->received = NULL;
+    }
+    return status;
+}
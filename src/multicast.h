@@ -0,0 +1,69 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+// Datagrams handed to the kernel per sendmmsg()
+#define MULTICAST_BATCH 64
+
+// Times the MULTICAST_END datagram is sent, and the gap between sends
+#define MULTICAST_END_REPEAT 3
+#define MULTICAST_END_GAP_MS 20
+
+// Seconds a receiver waits for the next datagram before it gives up on
+// the rest of the session and repairs over TCP
+#define MULTICAST_IDLE_TIMEOUT 3
+
+// Receive buffer a receiver asks for, to ride out bursts while it writes
+#define MULTICAST_RECEIVE_BUFFER (8 * 1024 * 1024)
+
+// Hops multicast datagrams may cross; the LAN only
+#define MULTICAST_TTL 1
+
+// A multicast session as announced in CMD_MULTICAST_INFO
+typedef struct {
+    struct in_addr group;
+    uint16_t port;
+    uint32_t session;
+    uint32_t start_ms;          // Until the first datagram, 0 if already sending
+    uint64_t size;
+    uint64_t mtime;
+} multicast_info_t;
+
+// Pack and unpack CMD_MULTICAST_INFO payloads of MULTICAST_INFO_SIZE bytes
+void multicast_info_encode(const multicast_info_t *info, unsigned char *out);
+void multicast_info_decode(const unsigned char *in, multicast_info_t *info);
+
+// Start distributing to group "address[:port]" from the interface with
+// address local (INADDR_ANY for the routing default) at rate bytes per
+// second, holding each new session wait seconds for more receivers.
+// Returns 0, or -1 after printing why the group cannot be used.
+int multicast_init(const char *group, struct in_addr local, uint64_t rate, int wait);
+
+// Whether multicast_init() succeeded
+int multicast_enabled(void);
+
+// Schedule file_fd, the open file name described by st, for sending, or
+// join the session already sending it, and describe the session in info.
+// Takes ownership of file_fd. Returns 0, or -1 when out of memory.
+int multicast_join(const char *name, int file_fd, const struct stat *st, multicast_info_t *info);
+
+// What a receiver got of one session
+typedef struct {
+    uint64_t chunks;            // MULTICAST_PAYLOAD pieces in the file
+    unsigned char *received;    // One flag per chunk
+    uint64_t received_count;
+    int ended;                  // MULTICAST_END arrived and crc is valid
+    uint32_t crc;               // CRC-32C of the whole file from MULTICAST_END
+} multicast_reception_t;
+
+// Join the session's group on the interface with address local and write
+// what arrives into file_fd until the session ends or goes quiet. On
+// success the caller frees reception->received. Returns 0, or -1 when the
+// group cannot be joined or the file written, with received left NULL.
+int multicast_receive(const multicast_info_t *info, struct in_addr local, int file_fd,
+                      multicast_reception_t *reception);
+
+#endif /* MULTICAST_H */
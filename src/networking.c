@@ -2,95 +2,555 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <fcntl.h>
 #include <errno.h>
 #include "networking.h"
 
-// Function to extract network portion of an IP
-void get_network_address(const char *ip_address, char *network, const char *netmask) {
-    struct in_addr ip, mask, net;
-    
-    if (inet_pton(AF_INET, ip_address, &ip) <= 0 ||
-        inet_pton(AF_INET, netmask, &mask) <= 0) {
-        // Error in conversion
-        strcpy(network, "0.0.0.0");
+// Size of the buffer netlink replies and events are read into
+#define NETLINK_BUFFER_SIZE 32768
+
+// Route requests waiting for the topology thread
+#define ROUTE_QUEUE_SIZE 16
+
+// Networks remembered as already tried, oldest forgotten first
+#define ROUTE_TRIED_SIZE 64
+
+// A local IPv4 address and its real netmask
+typedef struct {
+    in_addr_t addr;
+    int prefix_len;
+    int ifindex;
+} topology_address_t;
+
+// An IPv4 route of the main table
+typedef struct {
+    in_addr_t dst;
+    int prefix_len;
+    in_addr_t gateway;
+    int ifindex;
+} topology_route_t;
+
+// Everything a lookup needs, replaced as a whole on every change
+typedef struct {
+    topology_address_t *addresses;
+    size_t address_count;
+    topology_route_t *routes;
+    size_t route_count;
+} topology_table_t;
+
+// A route for the topology thread to install
+typedef struct {
+    in_addr_t network;
+    int prefix_len;
+    in_addr_t gateway;
+} route_request_t;
+
+// The topology cache. Lookups take the read lock; the topology thread
+// swaps in a freshly dumped table whenever netlink reports a change.
+static struct {
+    pthread_rwlock_t lock;
+    topology_table_t table;
+    int loaded;
+    int watching;
+    int event_fd;               // Netlink socket subscribed to changes
+    int wake_fd;                // eventfd counting queued route requests
+    pthread_mutex_t queue_lock;
+    route_request_t queue[ROUTE_QUEUE_SIZE];
+    size_t queued;
+    route_request_t tried[ROUTE_TRIED_SIZE];
+    size_t tried_next;
+} topology = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .event_fd = -1,
+    .wake_fd = -1,
+    .queue_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Network mask of a prefix length, in network byte order
+in_addr_t prefix_mask(int prefix_len) {
+    if (prefix_len <= 0) {
+        return 0;
+    }
+    if (prefix_len >= 32) {
+        return 0xffffffff;
+    }
+    return htonl(0xffffffffU << (32 - prefix_len));
+}
+
+// Open a route netlink socket listening to groups (0 for none)
+static int netlink_open(unsigned groups) {
+    struct sockaddr_nl addr;
+    int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+    if (sock == -1) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Append an attribute to a netlink message with room for size bytes
+static void netlink_attr(struct nlmsghdr *message, size_t size, int type, const void *data, size_t len) {
+    struct rtattr *attr = (struct rtattr *)((char *)message + NLMSG_ALIGN(message->nlmsg_len));
+
+    if (NLMSG_ALIGN(message->nlmsg_len) + RTA_LENGTH(len) > size) {
         return;
     }
-    
-    // Calculate network address
-    net.s_addr = ip.s_addr & mask.s_addr;
-    
-    // Convert back to string
-    inet_ntop(AF_INET, &net, network, INET_ADDRSTRLEN);
+    attr->rta_type = type;
+    attr->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(attr), data, len);
+    message->nlmsg_len = NLMSG_ALIGN(message->nlmsg_len) + RTA_ALIGN(attr->rta_len);
+}
+
+// Record an RTM_NEWADDR message of a dump
+static int parse_address(const struct nlmsghdr *message, topology_table_t *table) {
+    const struct ifaddrmsg *ifa = NLMSG_DATA(message);
+    const struct rtattr *attr = IFA_RTA(ifa);
+    int len = IFA_PAYLOAD(message);
+    topology_address_t address;
+    int found = 0;
+
+    if (ifa->ifa_family != AF_INET) {
+        return 0;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.prefix_len = ifa->ifa_prefixlen;
+    address.ifindex = ifa->ifa_index;
+    for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+        // IFA_ADDRESS is the far end on point-to-point links
+        if (attr->rta_type == IFA_LOCAL || (attr->rta_type == IFA_ADDRESS && !found)) {
+            memcpy(&address.addr, RTA_DATA(attr), sizeof(in_addr_t));
+            found = attr->rta_type == IFA_LOCAL;
+        }
+    }
+
+    if ((table->address_count & (table->address_count + 1)) == 0) {
+        topology_address_t *grown = realloc(table->addresses,
+                                            (table->address_count * 2 + 1) * sizeof(topology_address_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        table->addresses = grown;
+    }
+    table->addresses[table->address_count++] = address;
+    return 0;
+}
+
+// Record an RTM_NEWROUTE message of a dump, keeping unicast routes of
+// the main table
+static int parse_route(const struct nlmsghdr *message, topology_table_t *table) {
+    const struct rtmsg *rtm = NLMSG_DATA(message);
+    const struct rtattr *attr = RTM_RTA(rtm);
+    int len = RTM_PAYLOAD(message);
+    unsigned routing_table = rtm->rtm_table;
+    topology_route_t route;
+
+    if (rtm->rtm_family != AF_INET || rtm->rtm_type != RTN_UNICAST) {
+        return 0;
+    }
+
+    memset(&route, 0, sizeof(route));
+    route.prefix_len = rtm->rtm_dst_len;
+    for (; RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+        switch (attr->rta_type) {
+            case RTA_DST:
+                memcpy(&route.dst, RTA_DATA(attr), sizeof(in_addr_t));
+                break;
+            case RTA_GATEWAY:
+                memcpy(&route.gateway, RTA_DATA(attr), sizeof(in_addr_t));
+                break;
+            case RTA_OIF:
+                memcpy(&route.ifindex, RTA_DATA(attr), sizeof(int));
+                break;
+            case RTA_TABLE:
+                memcpy(&routing_table, RTA_DATA(attr), sizeof(unsigned));
+                break;
+        }
+    }
+    if (routing_table != RT_TABLE_MAIN) {
+        return 0;
+    }
+
+    if ((table->route_count & (table->route_count + 1)) == 0) {
+        topology_route_t *grown = realloc(table->routes,
+                                          (table->route_count * 2 + 1) * sizeof(topology_route_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        table->routes = grown;
+    }
+    table->routes[table->route_count++] = route;
+    return 0;
+}
+
+// Dump every IPv4 address or route into table. Returns 0 or -1.
+static int netlink_dump(int sock, uint16_t type, topology_table_t *table) {
+    struct {
+        struct nlmsghdr header;
+        struct rtmsg body;      // Family first, like struct ifaddrmsg
+    } request;
+    char *buffer;
+    int status = -1, done = 0;
+
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(type == RTM_GETADDR ? sizeof(struct ifaddrmsg) :
+                                                                  sizeof(struct rtmsg));
+    request.header.nlmsg_type = type;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = type;
+    request.body.rtm_family = AF_INET;
+    if (send(sock, &request, request.header.nlmsg_len, 0) == -1) {
+        return -1;
+    }
+
+    buffer = malloc(NETLINK_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    while (!done) {
+        ssize_t length = recv(sock, buffer, NETLINK_BUFFER_SIZE, 0);
+        struct nlmsghdr *message = (struct nlmsghdr *)buffer;
+
+        if (length == -1 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            goto out;
+        }
+
+        for (; NLMSG_OK(message, (size_t)length); message = NLMSG_NEXT(message, length)) {
+            if (message->nlmsg_type == NLMSG_DONE) {
+                done = 1;
+                break;
+            }
+            if (message->nlmsg_type == NLMSG_ERROR) {
+                goto out;
+            }
+            if ((message->nlmsg_type == RTM_NEWADDR && parse_address(message, table) == -1) ||
+                (message->nlmsg_type == RTM_NEWROUTE && parse_route(message, table) == -1)) {
+                goto out;
+            }
+        }
+    }
+    status = 0;
+
+out:
+    free(buffer);
+    return status;
+}
+
+// Free the arrays of a table
+static void table_free(topology_table_t *table) {
+    free(table->addresses);
+    free(table->routes);
+}
+
+// Dump addresses and routes and make them the current topology
+static int topology_load(void) {
+    topology_table_t table, old;
+    int sock = netlink_open(0);
+
+    if (sock == -1) {
+        return -1;
+    }
+
+    memset(&table, 0, sizeof(table));
+    if (netlink_dump(sock, RTM_GETADDR, &table) == -1 ||
+        netlink_dump(sock, RTM_GETROUTE, &table) == -1) {
+        close(sock);
+        table_free(&table);
+        return -1;
+    }
+    close(sock);
+
+    pthread_rwlock_wrlock(&topology.lock);
+    old = topology.table;
+    topology.table = table;
+    topology.loaded = 1;
+    pthread_rwlock_unlock(&topology.lock);
+
+    table_free(&old);
+    return 0;
+}
+
+// Topology thread: reload on every batch of netlink events and install
+// queued routes
+static void *topology_watch(void *arg) {
+    struct pollfd fds[2];
+    char *buffer = malloc(NETLINK_BUFFER_SIZE);
+
+    (void)arg;
+    if (buffer == NULL) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+
+    fds[0].fd = topology.event_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = topology.wake_fd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for network changes");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            ssize_t length;
+
+            // Drain the whole batch, then dump once. A lost event
+            // (ENOBUFS) needs no special care since the dump is complete.
+            do {
+                length = recv(topology.event_fd, buffer, NETLINK_BUFFER_SIZE, MSG_DONTWAIT);
+            } while (length > 0 || (length == -1 && (errno == ENOBUFS || errno == EINTR)));
+            if (topology_load() == -1) {
+                perror("Warning: cannot reload network topology");
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            route_request_t requests[ROUTE_QUEUE_SIZE];
+            uint64_t count;
+            size_t queued, i;
+
+            if (read(topology.wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("Error reading route queue");
+            }
+            pthread_mutex_lock(&topology.queue_lock);
+            queued = topology.queued;
+            memcpy(requests, topology.queue, queued * sizeof(route_request_t));
+            topology.queued = 0;
+            pthread_mutex_unlock(&topology.queue_lock);
+
+            for (i = 0; i < queued; i++) {
+                add_route(requests[i].network, requests[i].prefix_len, requests[i].gateway);
+            }
+        }
+    }
+
+    pthread_rwlock_wrlock(&topology.lock);
+    topology.watching = 0;
+    pthread_rwlock_unlock(&topology.lock);
+    free(buffer);
+    return NULL;
+}
+
+// Load the topology and optionally start following it
+int topology_init(int watch) {
+    pthread_t thread_id;
+
+    if (topology.loaded) {
+        return 0;
+    }
+
+    // Subscribe before dumping so no change slips in between
+    if (watch) {
+        topology.event_fd = netlink_open(RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE);
+        if (topology.event_fd == -1) {
+            return -1;
+        }
+    }
+
+    if (topology_load() == -1) {
+        if (topology.event_fd != -1) {
+            close(topology.event_fd);
+            topology.event_fd = -1;
+        }
+        return -1;
+    }
+
+    if (watch) {
+        topology.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (topology.wake_fd == -1 ||
+            pthread_create(&thread_id, NULL, topology_watch, NULL) != 0) {
+            perror("Warning: cannot follow network changes");
+            close(topology.event_fd);
+            topology.event_fd = -1;
+            if (topology.wake_fd != -1) {
+                close(topology.wake_fd);
+                topology.wake_fd = -1;
+            }
+            return 0;
+        }
+        pthread_detach(thread_id);
+        topology.watching = 1;
+    }
+    return 0;
+}
+
+// Look up how a peer is reached
+int topology_lookup(in_addr_t peer, topology_path_t *path) {
+    const topology_table_t *table = &topology.table;
+    int best = -1, ifindex = 0;
+    size_t i;
+
+    path->on_link = 0;
+    path->routed = 0;
+    path->prefix_len = -1;
+    path->local = 0;
+    path->gateway = 0;
+
+    pthread_rwlock_rdlock(&topology.lock);
+    if (!topology.loaded) {
+        pthread_rwlock_unlock(&topology.lock);
+        return -1;
+    }
+
+    for (i = 0; i < table->address_count; i++) {
+        const topology_address_t *address = &table->addresses[i];
+
+        if (((peer ^ address->addr) & prefix_mask(address->prefix_len)) == 0) {
+            path->on_link = 1;
+            path->prefix_len = address->prefix_len;
+            path->local = address->addr;
+            break;
+        }
+    }
+
+    // Longest prefix match, as the kernel would choose
+    for (i = 0; i < table->route_count; i++) {
+        const topology_route_t *route = &table->routes[i];
+
+        if (((peer ^ route->dst) & prefix_mask(route->prefix_len)) != 0) {
+            continue;
+        }
+        if (route->prefix_len == 0 && path->gateway == 0) {
+            path->gateway = route->gateway;
+        }
+        if (route->prefix_len > best) {
+            best = route->prefix_len;
+            ifindex = route->ifindex;
+        }
+    }
+    path->routed = best > 0;
+
+    // Otherwise describe the interface the peer is reached through
+    if (!path->on_link) {
+        for (i = 0; i < table->address_count; i++) {
+            if (table->addresses[i].ifindex == ifindex) {
+                path->prefix_len = table->addresses[i].prefix_len;
+                path->local = table->addresses[i].addr;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&topology.lock);
+    return 0;
 }
 
 // Add routing table entry for cross-subnet communication
-int add_route(const char *target_network, const char *netmask, const char *gateway) {
-    char cmd[256];
-    int result;
-    
-    // Check if running as root
-    if (geteuid() != 0) {
+int add_route(in_addr_t network, int prefix_len, in_addr_t gateway) {
+    struct {
+        struct nlmsghdr header;
+        struct rtmsg body;
+        char attrs[64];
+    } request;
+    char reply[NETLINK_BUFFER_SIZE / 8];
+    char target[INET_ADDRSTRLEN], via[INET_ADDRSTRLEN];
+    struct nlmsghdr *message = (struct nlmsghdr *)reply;
+    ssize_t length;
+    int sock, error = EIO;
+
+    inet_ntop(AF_INET, &network, target, sizeof(target));
+    inet_ntop(AF_INET, &gateway, via, sizeof(via));
+
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    request.header.nlmsg_type = RTM_NEWROUTE;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
+    request.body.rtm_family = AF_INET;
+    request.body.rtm_dst_len = prefix_len;
+    request.body.rtm_table = RT_TABLE_MAIN;
+    request.body.rtm_protocol = RTPROT_BOOT;
+    request.body.rtm_scope = RT_SCOPE_UNIVERSE;
+    request.body.rtm_type = RTN_UNICAST;
+    netlink_attr(&request.header, sizeof(request), RTA_DST, &network, sizeof(network));
+    netlink_attr(&request.header, sizeof(request), RTA_GATEWAY, &gateway, sizeof(gateway));
+
+    sock = netlink_open(0);
+    if (sock != -1 && send(sock, &request, request.header.nlmsg_len, 0) != -1) {
+        do {
+            length = recv(sock, reply, sizeof(reply), 0);
+        } while (length == -1 && errno == EINTR);
+        if (length > 0 && NLMSG_OK(message, (size_t)length) && message->nlmsg_type == NLMSG_ERROR) {
+            error = -((struct nlmsgerr *)NLMSG_DATA(message))->error;
+        }
+    } else {
+        error = errno;
+    }
+    if (sock != -1) {
+        close(sock);
+    }
+
+    if (error == EPERM || error == EACCES) {
         fprintf(stderr, "Warning: Adding routes requires root privileges.\n");
-        fprintf(stderr, "To add route manually: sudo ip route add %s/%s via %s\n", 
-                target_network, netmask, gateway);
+        fprintf(stderr, "To add route manually: sudo ip route add %s/%d via %s\n",
+                target, prefix_len, via);
         return -1;
     }
-    
-    // Prepare and execute route command
-    snprintf(cmd, sizeof(cmd), "ip route add %s/%s via %s 2>/dev/null", 
-             target_network, netmask, gateway);
-    result = system(cmd);
-    
-    if (result != 0) {
+    if (error != 0) {
         // Route might already exist or other error
         fprintf(stderr, "Note: Route may already exist or could not be added.\n");
         return -1;
     }
-    
-    printf("Added route to %s/%s via %s\n", target_network, netmask, gateway);
+
+    printf("Added route to %s/%d via %s\n", target, prefix_len, via);
     return 0;
 }
 
-// Get default gateway IP
-char *get_default_gateway() {
-    FILE *fp;
-    static char gateway[INET_ADDRSTRLEN];
-    char line[256], *p;
-    
-    gateway[0] = '\0';
-    
-    // Read route table
-    fp = fopen("/proc/net/route", "r");
-    if (fp == NULL) {
-        perror("Error opening route table");
-        return NULL;
-    }
-    
-    // Skip header line
-    if (fgets(line, sizeof(line), fp) == NULL) {
-        fclose(fp);
-        return NULL;
+// Queue a route for the topology thread, once per network
+int topology_add_route_async(in_addr_t network, int prefix_len, in_addr_t gateway) {
+    uint64_t one = 1;
+    size_t i;
+
+    if (!topology.watching) {
+        return 0;
     }
-    
-    // Look for default route (destination 0.0.0.0)
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        // Find the gateway field (3rd field)
-        char iface[16], dest[9], gate[9], flags[9];
-        int count = sscanf(line, "%s %s %s %s", iface, dest, gate, flags);
-        
-        if (count == 4 && strcmp(dest, "00000000") == 0) {
-            // Convert hex gateway to IP format
-            unsigned int g1, g2, g3, g4;
-            sscanf(gate, "%02x%02x%02x%02x", &g1, &g2, &g3, &g4);
-            snprintf(gateway, sizeof(gateway), "%u.%u.%u.%u", g4, g3, g2, g1);
-            break;
+
+    pthread_mutex_lock(&topology.queue_lock);
+    for (i = 0; i < ROUTE_TRIED_SIZE; i++) {
+        if (topology.tried[i].network == network && topology.tried[i].prefix_len == prefix_len) {
+            pthread_mutex_unlock(&topology.queue_lock);
+            return 0;
         }
     }
-    
-    fclose(fp);
-    return gateway[0] != '\0' ? gateway : NULL;
-} 
\ No newline at end of file
+    topology.tried[topology.tried_next].network = network;
+    topology.tried[topology.tried_next].prefix_len = prefix_len;
+    topology.tried_next = (topology.tried_next + 1) % ROUTE_TRIED_SIZE;
+
+    if (topology.queued == ROUTE_QUEUE_SIZE) {
+        pthread_mutex_unlock(&topology.queue_lock);
+        return 0;
+    }
+    topology.queue[topology.queued].network = network;
+    topology.queue[topology.queued].prefix_len = prefix_len;
+    topology.queue[topology.queued].gateway = gateway;
+    topology.queued++;
+    pthread_mutex_unlock(&topology.queue_lock);
+
+    if (write(topology.wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("Error queueing route");
+    }
+    return 1;
+}
@@ -1,13 +1,38 @@
 #ifndef NETWORKING_H
 #define NETWORKING_H
 
-// Function to extract network portion of an IP
-void get_network_address(const char *ip_address, char *network, const char *netmask);
+#include <netinet/in.h>
 
-// Add routing table entry for cross-subnet communication
-int add_route(const char *target_network, const char *netmask, const char *gateway);
+// How this host reaches a peer, as far as the topology cache knows.
+// Addresses are in network byte order.
+typedef struct {
+    int on_link;            // Peer is inside the subnet of a local address
+    int routed;             // A route more specific than the default covers it
+    int prefix_len;         // Prefix of the local address on the way out, -1 if none
+    in_addr_t local;        // That local address, 0 if none
+    in_addr_t gateway;      // Default gateway, 0 if none
+} topology_path_t;
 
-// Get default gateway IP
-char *get_default_gateway();
+// Load interface addresses, netmasks and IPv4 routes over rtnetlink.
+// With watch set, a background thread keeps them current from netlink
+// events and installs routes queued with topology_add_route_async().
+// Returns 0 or -1 when netlink is unavailable.
+int topology_init(int watch);
 
-#endif /* NETWORKING_H */ 
\ No newline at end of file
+// Look up how a peer is reached. Takes no system call.
+// Returns 0, or -1 when the topology was never loaded.
+int topology_lookup(in_addr_t peer, topology_path_t *path);
+
+// Network mask of a prefix length, in network byte order
+in_addr_t prefix_mask(int prefix_len);
+
+// Add a route to network/prefix_len via gateway over rtnetlink.
+// Returns 0 or -1.
+int add_route(in_addr_t network, int prefix_len, in_addr_t gateway);
+
+// Queue add_route() for the topology thread so the caller never waits
+// on the kernel. A network already tried recently is not queued again.
+// Returns 1 when queued, 0 otherwise.
+int topology_add_route_async(in_addr_t network, int prefix_len, in_addr_t gateway);
+
+#endif /* NETWORKING_H */
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include "protocol.h"
+
+// Store a 16-bit value big-endian
+void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+// Store a 32-bit value big-endian
+void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Store a 64-bit value big-endian
+void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, (uint32_t)v);
+}
+
+// Load a big-endian 16-bit value
+uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Load a big-endian 32-bit value
+uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+// Load a big-endian 64-bit value
+uint64_t get_u64(const unsigned char *p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+// Serialize a frame header into CUPID_HEADER_SIZE bytes
+void encode_header(const cupid_header_t *header, unsigned char *out) {
+    out[0] = header->version;
+    out[1] = header->opcode;
+    put_u16(out + 2, header->flags);
+    put_u32(out + 4, header->request_id);
+    put_u64(out + 8, header->length);
+}
+
+// Parse CUPID_HEADER_SIZE bytes into a frame header
+void decode_header(const unsigned char *in, cupid_header_t *header) {
+    header->version = in[0];
+    header->opcode = in[1];
+    header->flags = get_u16(in + 2);
+    header->request_id = get_u32(in + 4);
+    header->length = get_u64(in + 8);
+}
+
+// Send the whole buffer, retrying on short writes
+int send_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+
+    return 0;
+}
+
+// Receive up to len bytes, stopping early only at end of stream
+ssize_t recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    size_t total = 0;
+
+    while (total < len) {
+        ssize_t received = recv(sock, p + total, len - total, 0);
+        if (received == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (received == 0)
+            break;
+        total += received;
+    }
+
+    return total;
+}
+
+// Read and validate one frame header
+int recv_header(int sock, cupid_header_t *header) {
+    unsigned char raw[CUPID_HEADER_SIZE];
+    ssize_t received;
+
+    received = recv_all(sock, raw, sizeof(raw));
+    if (received == 0)
+        return 1;
+    if (received != sizeof(raw)) {
+        if (received > 0)
+            errno = ECONNRESET;
+        return -1;
+    }
+
+    decode_header(raw, header);
+    if (header->version != CUPID_PROTO_VERSION) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Send a frame header followed by an optional payload
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t request_id,
+               const void *payload, uint64_t length) {
+    cupid_header_t header;
+    unsigned char raw[CUPID_HEADER_SIZE];
+
+    memset(&header, 0, sizeof(header));
+    header.version = CUPID_PROTO_VERSION;
+    header.opcode = opcode;
+    header.flags = flags;
+    header.request_id = request_id;
+    header.length = length;
+    encode_header(&header, raw);
+
+    if (send_all(sock, raw, sizeof(raw)) == -1)
+        return -1;
+    if (payload != NULL && length > 0)
+        return send_all(sock, payload, length);
+    return 0;
+}
+
+// Send a CMD_ERROR frame that answers no particular request
+int send_error(int sock, uint16_t code, const char *message) {
+    return send_frame(sock, CMD_ERROR, code, 0, message, strlen(message));
+}
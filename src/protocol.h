@@ -0,0 +1,40 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "cupid.h"
+
+// Big-endian field packing used by frame headers and payloads
+void put_u16(unsigned char *p, uint16_t v);
+void put_u32(unsigned char *p, uint32_t v);
+void put_u64(unsigned char *p, uint64_t v);
+uint16_t get_u16(const unsigned char *p);
+uint32_t get_u32(const unsigned char *p);
+uint64_t get_u64(const unsigned char *p);
+
+// Serialize a frame header into CUPID_HEADER_SIZE bytes
+void encode_header(const cupid_header_t *header, unsigned char *out);
+
+// Parse CUPID_HEADER_SIZE bytes into a frame header
+void decode_header(const unsigned char *in, cupid_header_t *header);
+
+// Send the whole buffer, retrying on short writes. Returns 0 or -1.
+int send_all(int sock, const void *buf, size_t len);
+
+// Receive up to len bytes, stopping early only at end of stream.
+// Returns the number of bytes received or -1 on error.
+ssize_t recv_all(int sock, void *buf, size_t len);
+
+// Read and validate one frame header.
+// Returns 0 on success, 1 on a clean end of stream, -1 on error.
+int recv_header(int sock, cupid_header_t *header);
+
+// Send a frame header followed by an optional payload
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t request_id,
+               const void *payload, uint64_t length);
+
+// Send a CMD_ERROR frame that answers no particular request
+int send_error(int sock, uint16_t code, const char *message);
+
+#endif /* PROTOCOL_H */
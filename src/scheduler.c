@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "scheduler.h"
+
+// Hash buckets of the per-client bucket table
+#define CLIENT_TABLE_SIZE 256
+
+// A token bucket holds up to a tenth of a second of its rate, and never
+// less than a quantum so one turn always fits
+#define BURST_DIVISOR 10
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// Bandwidth cap. Sends are charged after the fact, so tokens may go
+// negative; the debt is paid off by waiting before the next send.
+typedef struct {
+    uint64_t rate;          // Bytes per second, 0 when uncapped
+    int64_t tokens;
+    uint64_t updated;       // sched_now() of the last refill
+} token_bucket_t;
+
+// Bucket shared by every connection from one client address
+struct sched_client {
+    in_addr_t addr;
+    int refs;
+    token_bucket_t bucket;
+    struct sched_client *next;
+};
+
+static token_bucket_t global_bucket;
+static uint64_t client_rate;
+static sched_client_t *client_table[CLIENT_TABLE_SIZE];
+
+// Guards both caps; taken once per quantum, so contention stays low
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Monotonic clock in nanoseconds
+uint64_t sched_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+// Largest balance a bucket may save up
+static int64_t bucket_burst(const token_bucket_t *bucket) {
+    uint64_t burst = bucket->rate / BURST_DIVISOR;
+
+    return burst < SCHED_QUANTUM ? SCHED_QUANTUM : (int64_t)burst;
+}
+
+// Start a bucket full
+static void bucket_init(token_bucket_t *bucket, uint64_t rate) {
+    bucket->rate = rate;
+    bucket->tokens = bucket_burst(bucket);
+    bucket->updated = sched_now();
+}
+
+// Add the tokens earned since the last refill, then take bytes.
+// Returns the nanoseconds until the balance is back to zero.
+static uint64_t bucket_charge(token_bucket_t *bucket, uint64_t now, uint64_t bytes) {
+    uint64_t elapsed = now - bucket->updated;
+    int64_t burst = bucket_burst(bucket);
+
+    // Whole microseconds keep the product in range for any sane rate
+    if (elapsed >= NSEC_PER_SEC) {
+        bucket->tokens = burst;
+        bucket->updated = now;
+    } else {
+        bucket->tokens += elapsed / 1000 * bucket->rate / 1000000;
+        bucket->updated += elapsed / 1000 * 1000;
+        if (bucket->tokens > burst)
+            bucket->tokens = burst;
+    }
+
+    bucket->tokens -= bytes;
+    if (bucket->tokens >= 0)
+        return 0;
+    return (uint64_t)-bucket->tokens * NSEC_PER_SEC / bucket->rate;
+}
+
+// Set the global and per-client bandwidth caps
+void sched_set_rates(uint64_t rate, uint64_t per_client) {
+    pthread_mutex_lock(&sched_lock);
+    bucket_init(&global_bucket, rate);
+    client_rate = per_client;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Prepare the flow of a new connection
+void sched_flow_init(sched_flow_t *flow, const struct sockaddr_in *addr, void *owner) {
+    sched_client_t *client;
+    unsigned slot;
+
+    flow->finish = 0;
+    flow->client = NULL;
+    flow->owner = owner;
+    if (client_rate == 0)
+        return;
+
+    slot = addr->sin_addr.s_addr % CLIENT_TABLE_SIZE;
+    pthread_mutex_lock(&sched_lock);
+    for (client = client_table[slot]; client != NULL; client = client->next) {
+        if (client->addr == addr->sin_addr.s_addr)
+            break;
+    }
+    if (client == NULL) {
+        client = malloc(sizeof(sched_client_t));
+        if (client == NULL) {
+            pthread_mutex_unlock(&sched_lock);
+            return;
+        }
+        client->addr = addr->sin_addr.s_addr;
+        client->refs = 0;
+        bucket_init(&client->bucket, client_rate);
+        client->next = client_table[slot];
+        client_table[slot] = client;
+    }
+    client->refs++;
+    flow->client = client;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Drop the flow's hold on its client's bucket
+void sched_flow_release(sched_flow_t *flow) {
+    sched_client_t **link;
+
+    if (flow->client == NULL)
+        return;
+
+    pthread_mutex_lock(&sched_lock);
+    if (--flow->client->refs == 0) {
+        link = &client_table[flow->client->addr % CLIENT_TABLE_SIZE];
+        while (*link != flow->client)
+            link = &(*link)->next;
+        *link = flow->client->next;
+        free(flow->client);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    flow->client = NULL;
+}
+
+// Charge bytes just sent against the token buckets
+uint64_t sched_charge(sched_flow_t *flow, uint64_t bytes) {
+    uint64_t wait = 0, now;
+
+    if ((global_bucket.rate == 0 && flow->client == NULL) || bytes == 0)
+        return 0;
+
+    now = sched_now();
+    pthread_mutex_lock(&sched_lock);
+    if (global_bucket.rate != 0)
+        wait = bucket_charge(&global_bucket, now, bytes);
+    if (flow->client != NULL) {
+        uint64_t client_wait = bucket_charge(&flow->client->bucket, now, bytes);
+        if (client_wait > wait)
+            wait = client_wait;
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return wait;
+}
+
+// Charge bytes and sleep off any debt
+void sched_pace(sched_flow_t *flow, uint64_t bytes) {
+    uint64_t wait = sched_charge(flow, bytes);
+    struct timespec delay;
+
+    if (wait == 0)
+        return;
+
+    delay.tv_sec = wait / NSEC_PER_SEC;
+    delay.tv_nsec = wait % NSEC_PER_SEC;
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+}
+
+// Swap two heap slots
+static void heap_swap(sched_queue_t *queue, size_t a, size_t b) {
+    sched_flow_t *flow = queue->heap[a];
+
+    queue->heap[a] = queue->heap[b];
+    queue->heap[b] = flow;
+}
+
+// Queue a flow that just sent bytes in its turn. Its virtual finish
+// advances by the bytes over its weight from where it, or the queue,
+// last stood, so a flow idle for a while cannot claim a backlog of turns.
+int sched_queue_push(sched_queue_t *queue, sched_flow_t *flow, int class, uint64_t bytes) {
+    uint64_t start = flow->finish > queue->virtual_time ? flow->finish : queue->virtual_time;
+    size_t slot;
+
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        sched_flow_t **heap = realloc(queue->heap, capacity * sizeof(sched_flow_t *));
+        if (heap == NULL)
+            return -1;
+        queue->heap = heap;
+        queue->capacity = capacity;
+    }
+
+    flow->finish = start + (class == SCHED_BULK ? bytes * SCHED_INTERACTIVE_WEIGHT : bytes);
+
+    slot = queue->count++;
+    queue->heap[slot] = flow;
+    while (slot > 0 && queue->heap[(slot - 1) / 2]->finish > flow->finish) {
+        heap_swap(queue, slot, (slot - 1) / 2);
+        slot = (slot - 1) / 2;
+    }
+    return 0;
+}
+
+// Take the flow whose turn comes next. The queue's virtual time moves to
+// that flow's finish, as in self-clocked fair queueing.
+sched_flow_t *sched_queue_pop(sched_queue_t *queue) {
+    sched_flow_t *next;
+    size_t slot = 0;
+
+    if (queue->count == 0)
+        return NULL;
+
+    next = queue->heap[0];
+    queue->heap[0] = queue->heap[--queue->count];
+    while (1) {
+        size_t child = slot * 2 + 1;
+
+        if (child >= queue->count)
+            break;
+        if (child + 1 < queue->count && queue->heap[child + 1]->finish < queue->heap[child]->finish)
+            child++;
+        if (queue->heap[slot]->finish <= queue->heap[child]->finish)
+            break;
+        heap_swap(queue, slot, child);
+        slot = child;
+    }
+
+    queue->virtual_time = next->finish;
+    return next;
+}
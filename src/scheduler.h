@@ -0,0 +1,65 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Traffic classes. An interactive response (listing, signatures, small
+// file) gets SCHED_INTERACTIVE_WEIGHT times the share of a bulk one.
+#define SCHED_INTERACTIVE 0
+#define SCHED_BULK 1
+#define SCHED_INTERACTIVE_WEIGHT 8
+
+// File bodies up to this size are interactive
+#define SCHED_SMALL_FILE (1024 * 1024)
+
+// Bytes a response may send per turn before other transfers get theirs
+#define SCHED_QUANTUM (256 * 1024)
+
+typedef struct sched_client sched_client_t;
+
+// Scheduling state of one connection
+typedef struct {
+    uint64_t finish;            // Virtual time at which its last quantum ended
+    sched_client_t *client;     // Per-client token bucket, NULL when uncapped
+    void *owner;                // Connection the flow belongs to
+} sched_flow_t;
+
+// Transfers waiting for their next quantum, earliest virtual finish first
+typedef struct {
+    sched_flow_t **heap;
+    size_t count;
+    size_t capacity;
+    uint64_t virtual_time;
+} sched_queue_t;
+
+// Set the global and per-client bandwidth caps in bytes per second;
+// 0 leaves that cap off
+void sched_set_rates(uint64_t rate, uint64_t client_rate);
+
+// Monotonic clock in nanoseconds
+uint64_t sched_now(void);
+
+// Prepare the flow of a new connection from addr. Without memory for a
+// new client's bucket the flow goes without a per-client cap.
+void sched_flow_init(sched_flow_t *flow, const struct sockaddr_in *addr, void *owner);
+
+// Drop the flow's hold on its client's bucket
+void sched_flow_release(sched_flow_t *flow);
+
+// Charge bytes just sent against the token buckets. Returns how many
+// nanoseconds the flow must wait before sending again, 0 when it may go on.
+uint64_t sched_charge(sched_flow_t *flow, uint64_t bytes);
+
+// Charge bytes and sleep off any debt; for blocking engines
+void sched_pace(sched_flow_t *flow, uint64_t bytes);
+
+// Queue a flow of the given class that just sent bytes in its turn.
+// Returns 0 or -1 when out of memory.
+int sched_queue_push(sched_queue_t *queue, sched_flow_t *flow, int class, uint64_t bytes);
+
+// Take the flow whose turn comes next, or NULL when the queue is empty
+sched_flow_t *sched_queue_pop(sched_queue_t *queue);
+
+#endif /* SCHEDULER_H */
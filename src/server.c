@@ -4,20 +4,52 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
-#include <dirent.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <errno.h>
+#include <signal.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <limits.h>
 #include "cupid.h"
+#include "server.h"
 #include "networking.h"
+#include "protocol.h"
+#include "transfer.h"
+#include "index.h"
+#include "checksum.h"
+#include "compress.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "cache.h"
+#include "multicast.h"
+#include "discovery.h"
 
 // Shared directory path
 static char shared_directory[MAX_PATH_LENGTH];
 
+// Most file bytes read to fill one CMD_SIGNATURES frame
+#define SIGNATURE_READ_BUDGET (4 * 1024 * 1024)
+
+// Deepest directory nesting a tree response descends into
+#define TREE_MAX_DEPTH 64
+
+// Most records packed into one CMD_TREE_ENTRIES frame, bounding the
+// directory work done per frame
+#define TREE_BATCH_ENTRIES 1024
+
+// Most blocks sent raw without trying after repeated compression misses
+#define COMPRESS_MAX_BACKOFF 16
+
+// Options the server was started with
+static server_options_t server_options;
+
 // Function to display server's network interfaces and IP addresses
 void display_server_ip() {
     struct ifaddrs *ifaddr, *ifa;
@@ -191,171 +223,1276 @@ char *get_best_bind_ip() {
     return best_ip[0] != '\0' ? best_ip : NULL;
 }
 
-// Structure to pass data to client handler thread
+// State of a LIST response being streamed
 typedef struct {
-    int client_socket;
-    struct sockaddr_in client_addr;
-} client_data_t;
+    index_snapshot_t *snapshot;
+    size_t position;            // Next snapshot item to consider
+    int limited;
+    uint32_t remaining;         // Entries still allowed when limited
+    int finished;               // CMD_LIST_END has been queued
+    char pattern[MAX_PATH_LENGTH];
+} list_source_t;
 
-// Handle list files request
-void handle_list_files(int client_socket) {
-    DIR *dir;
-    struct dirent *entry;
-    char response[MAX_PACKET_SIZE];
-    int response_len = 0;
-    
-    // Set command code for response
-    response[0] = CMD_LIST_FILES;
-    response_len = 1;
-    
-    dir = opendir(shared_directory);
-    if (dir == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", strerror(errno));
-        response[0] = CMD_ERROR;
-        strcpy(response + 1, "Error opening directory");
-        send(client_socket, response, strlen(response + 1) + 1, 0);
+// Write a frame header into the response head at offset
+static void response_header_at(response_t *response, size_t offset, uint8_t opcode,
+                               uint16_t flags, uint64_t length) {
+    cupid_header_t header;
+    
+    memset(&header, 0, sizeof(header));
+    header.version = CUPID_PROTO_VERSION;
+    header.opcode = opcode;
+    header.flags = flags;
+    header.request_id = response->request_id;
+    header.length = length;
+    encode_header(&header, (unsigned char *)response->head + offset);
+}
+
+// Queue a frame header and payload at the end of the response head
+static void response_frame(response_t *response, uint8_t opcode, uint16_t flags,
+                           const void *payload, size_t payload_len, uint64_t length) {
+    response_header_at(response, response->head_len, opcode, flags, length);
+    response->head_len += CUPID_HEADER_SIZE;
+    
+    memcpy(response->head + response->head_len, payload, payload_len);
+    response->head_len += payload_len;
+}
+
+// Reset a response to empty, answering request_id
+void response_init(response_t *response, uint32_t request_id) {
+    response->head = response->head_buffer;
+    response->head_len = 0;
+    response->head_sent = 0;
+    response->request_id = request_id;
+    response->sched_class = SCHED_INTERACTIVE;
+    response->allowance = UINT64_MAX;
+    response->started = 0;
+    response->first_byte_sent = 0;
+    response->sent = 0;
+    response->file_fd = -1;
+    response->refill = NULL;
+    response->release = NULL;
+    response->source = NULL;
+}
+
+// Build a CMD_ERROR response
+void response_error(response_t *response, uint16_t code, const char *message) {
+    size_t len = strlen(message);
+    
+    metrics_error();
+    response_frame(response, CMD_ERROR, code, message, len, len);
+}
+
+// Queue the next CMD_LIST_ENTRIES frame, and CMD_LIST_END once the
+// snapshot or the requested page is exhausted
+static int list_refill(response_t *response) {
+    list_source_t *source = response->source;
+    index_snapshot_t *snapshot = source->snapshot;
+    const index_item_t *next_cursor = NULL;
+    size_t frame_start, capacity;
+    int done = 0;
+    
+    if (source->finished) {
+        return 0;
+    }
+    
+    // Always leave room for the end frame
+    capacity = RESPONSE_HEAD_SIZE - CUPID_HEADER_SIZE - LIST_CURSOR_MAX;
+    frame_start = response->head_len;
+    response->head_len += CUPID_HEADER_SIZE;
+    
+    while (1) {
+        const index_item_t *item;
+        
+        if (source->position == snapshot->count) {
+            done = 1;
+            break;
+        }
+        item = &snapshot->items[source->position];
+        
+        if (source->pattern[0] != '\0') {
+            char name[MAX_PATH_LENGTH];
+            
+            memcpy(name, item->name, item->name_len);
+            name[item->name_len] = '\0';
+            if (fnmatch(source->pattern, name, 0) != 0) {
+                source->position++;
+                continue;
+            }
+        }
+        
+        // Page full: the next page starts after the last name covered
+        if (source->limited && source->remaining == 0) {
+            next_cursor = &snapshot->items[source->position - 1];
+            done = 1;
+            break;
+        }
+        
+        // Frame full: pick this entry up again on the next refill
+        if (response->head_len + item->length > capacity) {
+            break;
+        }
+        
+        // Records are pre-serialized in the snapshot
+        memcpy(response->head + response->head_len, snapshot->records + item->offset, item->length);
+        response->head_len += item->length;
+        source->position++;
+        source->remaining--;
+    }
+    
+    if (response->head_len == frame_start + CUPID_HEADER_SIZE) {
+        // No entries in this frame
+        response->head_len = frame_start;
+    } else {
+        response_header_at(response, frame_start, CMD_LIST_ENTRIES, 0,
+                           response->head_len - frame_start - CUPID_HEADER_SIZE);
+    }
+    
+    if (done) {
+        size_t cursor_len = next_cursor != NULL ? next_cursor->name_len : 0;
+        
+        response_frame(response, CMD_LIST_END, 0, next_cursor != NULL ? next_cursor->name : NULL,
+                       cursor_len, cursor_len);
+        source->finished = 1;
+    }
+    
+    return 1;
+}
+
+// Drop the snapshot held by a LIST response
+static void list_release(response_t *response) {
+    list_source_t *source = response->source;
+    
+    index_snapshot_release(source->snapshot);
+    free(source);
+}
+
+// Index of the first snapshot item whose name sorts after name, found by
+// binary search since snapshots are sorted by name
+static size_t list_position_after(const index_snapshot_t *snapshot, const char *name, size_t len) {
+    size_t low = 0, high = snapshot->count;
+    
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const index_item_t *item = &snapshot->items[middle];
+        int order = memcmp(item->name, name, item->name_len < len ? item->name_len : len);
+        
+        if (order < 0 || (order == 0 && item->name_len <= len)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Handle list files request: stream the current index snapshot
+// starting after the requested cursor
+void handle_list_files(response_t *response, const char *payload, size_t length) {
+    list_source_t *source;
+    const char *cursor = NULL;
+    size_t cursor_len = 0;
+    
+    source = calloc(1, sizeof(list_source_t));
+    if (source == NULL) {
+        response_error(response, ERR_GENERIC, "Out of memory");
         return;
     }
     
-    // List files in the directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip directories and hidden files
-        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) {
-            continue;
+    if (length >= LIST_REQUEST_SIZE) {
+        size_t pattern_len;
+        
+        source->remaining = get_u32((const unsigned char *)payload);
+        source->limited = source->remaining > 0;
+        cursor_len = get_u16((const unsigned char *)payload + 4);
+        if (cursor_len > LIST_CURSOR_MAX || cursor_len > length - LIST_REQUEST_SIZE) {
+            response_error(response, ERR_BAD_REQUEST, "Malformed list cursor");
+            free(source);
+            return;
+        }
+        cursor = payload + LIST_REQUEST_SIZE;
+        pattern_len = length - LIST_REQUEST_SIZE - cursor_len;
+        if (pattern_len >= sizeof(source->pattern)) {
+            response_error(response, ERR_BAD_REQUEST, "Pattern too long");
+            free(source);
+            return;
+        }
+        memcpy(source->pattern, cursor + cursor_len, pattern_len);
+        source->pattern[pattern_len] = '\0';
+    } else if (length != 0) {
+        response_error(response, ERR_BAD_REQUEST, "Malformed list request");
+        free(source);
+        return;
+    }
+    
+    source->snapshot = index_snapshot();
+    if (source->snapshot == NULL) {
+        response_error(response, ERR_GENERIC, "Error reading directory");
+        free(source);
+        return;
+    }
+    // The snapshot may have changed since the previous page; names do not
+    source->position = cursor_len > 0 ? list_position_after(source->snapshot, cursor, cursor_len) : 0;
+    
+    response->source = source;
+    response->refill = list_refill;
+    response->release = list_release;
+    list_refill(response);
+}
+
+// Check a file name taken from a request; length excludes the NUL
+static int valid_filename(const char *filename, size_t length) {
+    // Reject embedded NULs, absolute paths and path traversal attacks
+    return length > 0 && strlen(filename) == length && filename[0] != '/' &&
+           strstr(filename, "..") == NULL;
+}
+
+// Queue the CMD_FILE_CHECKSUM trailer once the file body has gone out
+static int checksum_refill(response_t *response) {
+    unsigned char trailer[FILE_CHECKSUM_SIZE];
+    
+    put_u32(trailer, response->body.crc);
+    response_frame(response, CMD_FILE_CHECKSUM, 0, trailer, sizeof(trailer), sizeof(trailer));
+    response->refill = NULL;
+    return 1;
+}
+
+// State of a file body being streamed as compressed blocks
+typedef struct {
+    int file_fd;
+    uint64_t offset;            // Next file byte to send
+    uint64_t remaining;
+    int codec;
+    codec_state_t *codecs;
+    uint32_t crc;               // CRC-32C of the raw bytes queued so far
+    unsigned skip;              // Blocks still to send raw without trying
+    unsigned backoff;           // Blocks to skip after the next miss
+    int finished;
+    unsigned char *raw;
+    unsigned char *frame;       // Frame header, raw length and block data
+} compress_source_t;
+
+// Queue the next CMD_FILE_BLOCK, and the CMD_FILE_CHECKSUM trailer after
+// the last one. A block that does not shrink by at least an eighth goes
+// out raw, and each miss in a row doubles the number of blocks sent raw
+// before trying again, so media files cost almost no compression time.
+static int compress_refill(response_t *response) {
+    compress_source_t *source = response->source;
+    unsigned char *data = source->frame + CUPID_HEADER_SIZE + FILE_BLOCK_HEADER_SIZE;
+    unsigned char *target = source->skip > 0 ? data : source->raw;
+    size_t want, got = 0;
+    ssize_t packed = -1;
+    
+    if (source->finished) {
+        return 0;
+    }
+    if (source->remaining == 0) {
+        unsigned char trailer[FILE_CHECKSUM_SIZE];
+        
+        put_u32(trailer, source->crc);
+        response_frame(response, CMD_FILE_CHECKSUM, 0, trailer, sizeof(trailer), sizeof(trailer));
+        source->finished = 1;
+        return 1;
+    }
+    
+    want = source->remaining < COMPRESS_BLOCK_SIZE ? source->remaining : COMPRESS_BLOCK_SIZE;
+    while (got < want) {
+        ssize_t n = pread(source->file_fd, target + got, want - got, source->offset + got);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            // The file shrank or failed under us
+            response_error(response, ERR_GENERIC, "Error reading file");
+            source->finished = 1;
+            return 1;
+        }
+        got += n;
+    }
+    source->crc = crc32c(source->crc, target, got);
+    
+    if (source->skip > 0) {
+        source->skip--;
+    } else {
+        packed = codec_compress(source->codecs, source->codec, source->raw, got, data,
+                                got - got / 8);
+        if (packed > 0) {
+            source->backoff = 1;
+        } else {
+            source->skip = source->backoff;
+            source->backoff = source->backoff < COMPRESS_MAX_BACKOFF ? source->backoff * 2 :
+                              COMPRESS_MAX_BACKOFF;
+            memcpy(data, source->raw, got);
+        }
+    }
+    
+    // The block frame is sent straight from the source's buffer
+    put_u32(source->frame + CUPID_HEADER_SIZE, got);
+    response->head = (char *)source->frame;
+    response->head_len = CUPID_HEADER_SIZE + FILE_BLOCK_HEADER_SIZE +
+                         (packed > 0 ? (size_t)packed : got);
+    response_header_at(response, 0, CMD_FILE_BLOCK, packed > 0 ? source->codec : CODEC_NONE,
+                       response->head_len - CUPID_HEADER_SIZE);
+    source->offset += got;
+    source->remaining -= got;
+    return 1;
+}
+
+// Close the file of a compressed body
+static void compress_release(response_t *response) {
+    compress_source_t *source = response->source;
+    
+    close(source->file_fd);
+    codec_state_free(source->codecs);
+    free(source->raw);
+    free(source->frame);
+    free(source);
+}
+
+// Send a file range as compressed blocks after the queued head.
+// Returns 0, or -1 when out of memory and the body must go out plain.
+static int start_compressed_body(response_t *response, int file_fd, uint64_t offset,
+                                 uint64_t length, int codec) {
+    compress_source_t *source = calloc(1, sizeof(compress_source_t));
+    
+    if (source == NULL ||
+        (source->codecs = codec_state_new()) == NULL ||
+        (source->raw = malloc(COMPRESS_BLOCK_SIZE)) == NULL ||
+        (source->frame = malloc(CUPID_HEADER_SIZE + FILE_BLOCK_HEADER_SIZE +
+                                COMPRESS_BLOCK_SIZE)) == NULL) {
+        if (source != NULL) {
+            codec_state_free(source->codecs);
+            free(source->raw);
+            free(source);
+        }
+        return -1;
+    }
+    source->file_fd = file_fd;
+    source->offset = offset;
+    source->remaining = length;
+    source->codec = codec;
+    source->backoff = 1;
+    
+    response->source = source;
+    response->refill = compress_refill;
+    response->release = compress_release;
+    return 0;
+}
+
+// Free a cached reply copied out for one response
+static void cached_release(response_t *response) {
+    free(response->source);
+}
+
+// Queue a cached reply to a whole-file GET, stamped with the request's
+// ID, so it goes out in one send. Replies that do not fit in head_buffer
+// are sent from a copy the response owns.
+static void response_cached(response_t *response, cache_entry_t *entry) {
+    unsigned char *frames;
+    
+    if (entry->frames_len > RESPONSE_HEAD_SIZE - response->head_len) {
+        char *copy = malloc(response->head_len + entry->frames_len);
+        
+        if (copy == NULL) {
+            cache_release(entry);
+            response_error(response, ERR_GENERIC, "Out of memory");
+            return;
         }
+        memcpy(copy, response->head, response->head_len);
+        response->head = copy;
+        response->source = copy;
+        response->release = cached_release;
+    }
+    
+    // The request ID follows version, opcode and flags in each header
+    frames = (unsigned char *)response->head + response->head_len;
+    memcpy(frames, entry->frames, entry->frames_len);
+    put_u32(frames + CACHE_INFO_OFFSET + 4, response->request_id);
+    put_u32(frames + CACHE_DATA_OFFSET + 4, response->request_id);
+    put_u32(frames + CACHE_CHECKSUM_OFFSET(entry->size) + 4, response->request_id);
+    response->head_len += entry->frames_len;
+    cache_release(entry);
+}
+
+// Handle get file request, optionally for a byte range of the file
+void handle_get_file(response_t *response, uint16_t flags, const char *payload, size_t length) {
+    const char *filename = payload;
+    uint64_t offset = 0, range_length = 0;
+    uint64_t seen_size = 0, seen_mtime = 0;
+    unsigned char info[FILE_INFO_SIZE];
+    cache_entry_t *entry;
+    int file_fd, cacheable;
+    struct stat st;
+    
+    // The size and mtime to compare travel in the range header
+    if ((flags & GET_IF_UNCHANGED) && !(flags & GET_RANGE)) {
+        response_error(response, ERR_BAD_REQUEST, "Unchanged check without a range");
+        return;
+    }
+    
+    // Only whole, uncompressed files are served from the cache
+    cacheable = !(flags & GET_RANGE) && !((flags & GET_COMPRESS) && server_options.compress);
+    if (flags & GET_RANGE) {
+        if (length <= GET_RANGE_SIZE) {
+            response_error(response, ERR_BAD_REQUEST, "Malformed range request");
+            return;
+        }
+        offset = get_u64((const unsigned char *)payload);
+        range_length = get_u64((const unsigned char *)payload + 8);
+        seen_size = get_u64((const unsigned char *)payload + 16);
+        seen_mtime = get_u64((const unsigned char *)payload + 24);
+        filename = payload + GET_RANGE_SIZE;
+        length -= GET_RANGE_SIZE;
+    }
+    
+    if (!valid_filename(filename, length)) {
+        response_error(response, ERR_BAD_REQUEST, "Invalid filename");
+        return;
+    }
+    
+    if (cacheable && (entry = cache_lookup(filename)) != NULL) {
+        response_cached(response, entry);
+        return;
+    }
+    
+    // Only regular files can be served; the size is sent up front
+    file_fd = index_open(filename, &st);
+    if (file_fd == -1) {
+        response_error(response, ERR_NOT_FOUND, "File not found or cannot be accessed");
+        return;
+    }
+    
+    // A resumed download whose file changed starts over
+    if ((flags & GET_IF_UNCHANGED) &&
+        ((uint64_t)st.st_size != seen_size || (uint64_t)st.st_mtime != seen_mtime)) {
+        offset = 0;
+        range_length = 0;
+    }
+    
+    if (offset > (uint64_t)st.st_size) {
+        response_error(response, ERR_RANGE, "Requested range is past the end of the file");
+        close(file_fd);
+        return;
+    }
+    if (range_length == 0 || range_length > st.st_size - offset) {
+        range_length = st.st_size - offset;
+    }
+    if (range_length > SCHED_SMALL_FILE) {
+        response->sched_class = SCHED_BULK;
+    }
+    
+    // A small file read now is kept for the next request
+    if (cacheable && (entry = cache_fill(filename, file_fd, st.st_size)) != NULL) {
+        close(file_fd);
+        response_cached(response, entry);
+        return;
+    }
+    
+    // File info, then the header announcing the range, then the raw body
+    put_u64(info, st.st_size);
+    put_u64(info + 8, st.st_mtime);
+    put_u64(info + 16, offset);
+    response_frame(response, CMD_FILE_INFO, 0, info, sizeof(info), sizeof(info));
+    
+    // Compressed blocks when the client asked and a codec is shared
+    if ((flags & GET_COMPRESS) && server_options.compress && range_length > 0) {
+        int codec = codec_choose(flags >> GET_CODECS_SHIFT);
         
-        // Add filename to response
-        int name_len = strlen(entry->d_name);
-        if (response_len + name_len + 1 >= MAX_PACKET_SIZE) {
-            break; // Prevent buffer overflow
+        if (codec != CODEC_NONE &&
+            start_compressed_body(response, file_fd, offset, range_length, codec) == 0) {
+            return;
         }
+    }
+    
+    response_frame(response, CMD_FILE_DATA, 0, NULL, 0, range_length);
+    response->file_fd = file_fd;
+    file_body_init(&response->body, file_fd, offset, range_length, server_options.zero_copy);
+    response->refill = checksum_refill;
+}
+
+// State of a block signature response being streamed
+typedef struct {
+    int file_fd;
+    uint32_t block_size;
+    uint64_t offset;            // Start of the next block to sign
+    uint64_t size;
+    xxh64_state_t whole;        // Hash of the file so far
+    unsigned char *buffer;
+    int finished;
+} signature_source_t;
+
+// Queue the next CMD_SIGNATURES frame, and CMD_SIGNATURES_END after the
+// last block. Reading is capped per frame so one large file cannot stall
+// an event loop for long.
+static int signature_refill(response_t *response) {
+    signature_source_t *source = response->source;
+    size_t frame_start, capacity, blocks_per_read;
+    uint64_t read_budget = SIGNATURE_READ_BUDGET;
+    
+    if (source->finished) {
+        return 0;
+    }
+    
+    capacity = RESPONSE_HEAD_SIZE - CUPID_HEADER_SIZE - SIGNATURES_END_SIZE;
+    blocks_per_read = TRANSFER_CHUNK_SIZE / source->block_size;
+    frame_start = response->head_len;
+    response->head_len += CUPID_HEADER_SIZE;
+    
+    while (source->offset < source->size && read_budget > 0 &&
+           response->head_len + SIGNATURE_SIZE <= capacity) {
+        uint64_t want = source->size - source->offset;
+        size_t blocks, i;
+        ssize_t got = 0;
         
-        strcpy(response + response_len, entry->d_name);
-        response_len += name_len;
-        response[response_len++] = '\n';
+        // Read whole blocks, as many as fit in the buffer, frame and budget
+        blocks = (capacity - response->head_len) / SIGNATURE_SIZE;
+        if (blocks > blocks_per_read) {
+            blocks = blocks_per_read;
+        }
+        if (want > (uint64_t)blocks * source->block_size) {
+            want = (uint64_t)blocks * source->block_size;
+        }
+        while ((uint64_t)got < want) {
+            ssize_t n = pread(source->file_fd, source->buffer + got, want - got,
+                              source->offset + got);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR)
+                    continue;
+                break;
+            }
+            got += n;
+        }
+        if ((uint64_t)got != want) {
+            // The file shrank or failed under us: drop this frame
+            response->head_len = frame_start;
+            response_error(response, ERR_GENERIC, "Error reading file");
+            source->finished = 1;
+            return 1;
+        }
+        
+        xxh64_update(&source->whole, source->buffer, want);
+        for (i = 0; i * source->block_size < want; i++) {
+            unsigned char *block = source->buffer + i * source->block_size;
+            size_t len = want - i * source->block_size;
+            unsigned char *p = (unsigned char *)response->head + response->head_len;
+            
+            if (len > source->block_size) {
+                len = source->block_size;
+            }
+            put_u32(p, rolling_checksum(block, len));
+            put_u64(p + 4, xxh64(block, len, 0));
+            response->head_len += SIGNATURE_SIZE;
+        }
+        source->offset += want;
+        read_budget = read_budget > want ? read_budget - want : 0;
     }
     
-    if (response_len == 1) {
-        // No files found
-        strcpy(response + response_len, "No files available");
-        response_len += strlen("No files available");
+    if (response->head_len == frame_start + CUPID_HEADER_SIZE) {
+        response->head_len = frame_start;
     } else {
-        // Replace last newline with null terminator
-        response[response_len - 1] = '\0';
+        response_header_at(response, frame_start, CMD_SIGNATURES, 0,
+                           response->head_len - frame_start - CUPID_HEADER_SIZE);
+    }
+    
+    if (source->offset >= source->size) {
+        unsigned char hash[SIGNATURES_END_SIZE];
+        
+        put_u64(hash, xxh64_digest(&source->whole));
+        response_frame(response, CMD_SIGNATURES_END, 0, hash, sizeof(hash), sizeof(hash));
+        source->finished = 1;
     }
     
-    // Send response
-    send(client_socket, response, response_len, 0);
-    closedir(dir);
+    return 1;
+}
+
+// Close the file of a signature response
+static void signature_release(response_t *response) {
+    signature_source_t *source = response->source;
+    
+    close(source->file_fd);
+    free(source->buffer);
+    free(source);
 }
 
-// Handle get file request
-void handle_get_file(int client_socket, const char *filename) {
-    char filepath[MAX_PATH_LENGTH];
-    char buffer[MAX_PACKET_SIZE];
+// Handle get signatures request: stream per-block checksums of a file
+// so the client can work out which blocks it is missing
+void handle_get_signatures(response_t *response, const char *payload, size_t length) {
+    signature_source_t *source;
+    unsigned char info[FILE_INFO_SIZE];
+    uint32_t block_size;
+    struct stat st;
     int file_fd;
-    ssize_t bytes_read;
     
-    // Check for path traversal attacks
-    if (strstr(filename, "..") != NULL) {
-        buffer[0] = CMD_ERROR;
-        strcpy(buffer + 1, "Invalid filename");
-        send(client_socket, buffer, strlen(buffer + 1) + 1, 0);
+    if (length <= SIGNATURE_REQUEST_SIZE) {
+        response_error(response, ERR_BAD_REQUEST, "Malformed signature request");
+        return;
+    }
+    block_size = get_u32((const unsigned char *)payload);
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) {
+        response_error(response, ERR_BAD_REQUEST, "Unsupported block size");
+        return;
+    }
+    if (!valid_filename(payload + SIGNATURE_REQUEST_SIZE, length - SIGNATURE_REQUEST_SIZE)) {
+        response_error(response, ERR_BAD_REQUEST, "Invalid filename");
+        return;
+    }
+    
+    file_fd = index_open(payload + SIGNATURE_REQUEST_SIZE, &st);
+    if (file_fd == -1) {
+        response_error(response, ERR_NOT_FOUND, "File not found or cannot be accessed");
+        return;
+    }
+    
+    source = calloc(1, sizeof(signature_source_t));
+    if (source == NULL || (source->buffer = malloc(TRANSFER_CHUNK_SIZE)) == NULL) {
+        response_error(response, ERR_GENERIC, "Out of memory");
+        free(source);
+        close(file_fd);
+        return;
+    }
+    source->file_fd = file_fd;
+    source->block_size = block_size;
+    source->size = st.st_size;
+    if (st.st_size > SCHED_SMALL_FILE) {
+        response->sched_class = SCHED_BULK;
+    }
+    xxh64_init(&source->whole, 0);
+    
+    put_u64(info, st.st_size);
+    put_u64(info + 8, st.st_mtime);
+    put_u64(info + 16, 0);
+    response_frame(response, CMD_FILE_INFO, 0, info, sizeof(info), sizeof(info));
+    
+    response->source = source;
+    response->refill = signature_refill;
+    response->release = signature_release;
+    signature_refill(response);
+}
+
+// A directory being walked for a tree response
+typedef struct {
+    DIR *dir;
+    size_t path_len;            // Length of the directory's path
+} tree_dir_t;
+
+// State of a tree response being streamed
+typedef struct {
+    tree_dir_t stack[TREE_MAX_DEPTH];
+    int depth;
+    char path[TREE_PATH_MAX];   // Path of the current entry
+    size_t path_len;
+    int pending;                // The current entry did not fit the last frame
+    uint8_t type;
+    int file_fd;                // Open current file, -1 otherwise
+    struct stat st;
+    int trailer;                // A file body went out and needs its checksum
+    int finished;
+    uint64_t files;
+    uint64_t bytes;
+    unsigned char *frame;       // Frame header, records and CRC
+} tree_source_t;
+
+// Step the walk to the next visible directory or regular file, opening
+// files and descending into directories as they are met.
+// Returns 1 with the entry in source, or 0 once the walk is over.
+static int tree_next(tree_source_t *source) {
+    while (source->depth > 0) {
+        tree_dir_t *top = &source->stack[source->depth - 1];
+        struct dirent *entry = readdir(top->dir);
+        size_t name_len, path_len;
+        int fd;
+        
+        if (entry == NULL) {
+            closedir(top->dir);
+            source->depth--;
+            continue;
+        }
+        
+        // Hidden names (and . and ..) are not shared
+        name_len = strlen(entry->d_name);
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        path_len = top->path_len + (top->path_len > 0) + name_len;
+        if (path_len >= TREE_PATH_MAX) {
+            continue;
+        }
+        if (top->path_len > 0) {
+            source->path[top->path_len] = '/';
+        }
+        memcpy(source->path + path_len - name_len, entry->d_name, name_len + 1);
+        source->path_len = path_len;
+        
+        // Never follow links: they could lead out of the shared tree
+        fd = openat(dirfd(top->dir), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        if (fstat(fd, &source->st) == -1) {
+            close(fd);
+            continue;
+        }
+        
+        if (S_ISDIR(source->st.st_mode)) {
+            DIR *dir;
+            
+            if (source->depth == TREE_MAX_DEPTH || (dir = fdopendir(fd)) == NULL) {
+                close(fd);
+                continue;
+            }
+            source->stack[source->depth].dir = dir;
+            source->stack[source->depth].path_len = path_len;
+            source->depth++;
+            source->type = ENTRY_DIR;
+            return 1;
+        }
+        if (S_ISREG(source->st.st_mode)) {
+            source->type = ENTRY_FILE;
+            source->file_fd = fd;
+            return 1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// Queue the next part of a tree response: a CMD_TREE_ENTRIES frame of
+// as many records as fit, possibly followed by the body of one large
+// file, then the checksum of that body, and CMD_TREE_END at the end
+static int tree_refill(response_t *response) {
+    tree_source_t *source = response->source;
+    unsigned char *records = source->frame + CUPID_HEADER_SIZE;
+    size_t used = 0;
+    int count = 0, large = 0;
+    
+    if (source->trailer) {
+        unsigned char trailer[FILE_CHECKSUM_SIZE];
+        
+        put_u32(trailer, response->body.crc);
+        response_frame(response, CMD_FILE_CHECKSUM, 0, trailer, sizeof(trailer), sizeof(trailer));
+        source->trailer = 0;
+        return 1;
+    }
+    if (source->finished) {
+        return 0;
+    }
+    
+    while (count < TREE_BATCH_ENTRIES && !large) {
+        uint64_t size, inline_size;
+        unsigned char *record;
+        
+        if (!source->pending && !tree_next(source)) {
+            break;
+        }
+        source->pending = 0;
+        
+        size = source->type == ENTRY_FILE ? (uint64_t)source->st.st_size : 0;
+        inline_size = size <= TREE_INLINE_MAX ? size : 0;
+        if (used + TREE_RECORD_SIZE + source->path_len + inline_size + FILE_CHECKSUM_SIZE >
+            TREE_BATCH_SIZE) {
+            source->pending = 1;
+            break;
+        }
+        
+        record = records + used;
+        if (inline_size > 0) {
+            unsigned char *data = record + TREE_RECORD_SIZE + source->path_len;
+            uint64_t got = 0;
+            
+            // Send what could be read; a file shrinking now is sent short
+            while (got < inline_size) {
+                ssize_t n = pread(source->file_fd, data + got, inline_size - got, got);
+                if (n <= 0) {
+                    if (n == -1 && errno == EINTR)
+                        continue;
+                    break;
+                }
+                got += n;
+            }
+            size = inline_size = got;
+        }
+        
+        record[0] = source->type;
+        put_u64(record + 1, size);
+        put_u64(record + 9, source->st.st_mtime);
+        put_u16(record + 17, source->path_len);
+        memcpy(record + TREE_RECORD_SIZE, source->path, source->path_len);
+        used += TREE_RECORD_SIZE + source->path_len + inline_size;
+        count++;
+        
+        if (source->type == ENTRY_FILE) {
+            source->files++;
+            source->bytes += size;
+            if (size > TREE_INLINE_MAX) {
+                large = 1;
+            } else {
+                close(source->file_fd);
+                source->file_fd = -1;
+            }
+        }
+    }
+    
+    if (count == 0) {
+        unsigned char end[TREE_END_SIZE];
+        
+        put_u64(end, source->files);
+        put_u64(end + 8, source->bytes);
+        response_frame(response, CMD_TREE_END, 0, end, sizeof(end), sizeof(end));
+        source->finished = 1;
+        return 1;
+    }
+    
+    put_u32(records + used, crc32c(0, records, used));
+    used += FILE_CHECKSUM_SIZE;
+    response->head = (char *)source->frame;
+    response->head_len = CUPID_HEADER_SIZE + used;
+    response_header_at(response, 0, CMD_TREE_ENTRIES, 0, used);
+    
+    // A large file's body follows its frame straight from the page cache
+    if (large) {
+        response_header_at(response, response->head_len, CMD_FILE_DATA, 0, source->st.st_size);
+        response->head_len += CUPID_HEADER_SIZE;
+        response->file_fd = source->file_fd;
+        file_body_init(&response->body, source->file_fd, 0, source->st.st_size,
+                       server_options.zero_copy);
+        source->file_fd = -1;
+        source->trailer = 1;
+    }
+    return 1;
+}
+
+// Close everything a tree response still holds
+static void tree_release(response_t *response) {
+    tree_source_t *source = response->source;
+    
+    while (source->depth > 0) {
+        closedir(source->stack[--source->depth].dir);
+    }
+    if (source->file_fd != -1) {
+        close(source->file_fd);
+    }
+    free(source->frame);
+    free(source);
+}
+
+// Handle get tree request: stream a whole directory subtree
+void handle_get_tree(response_t *response, const char *payload, size_t length) {
+    tree_source_t *source;
+    DIR *dir;
+    int dir_fd;
+    
+    if (!valid_filename(payload, length)) {
+        response_error(response, ERR_BAD_REQUEST, "Invalid directory name");
         return;
     }
     
-    // Construct full file path
-    snprintf(filepath, sizeof(filepath), "%s/%s", shared_directory, filename);
+    dir_fd = index_open_directory(payload);
+    if (dir_fd == -1) {
+        response_error(response, ERR_NOT_FOUND, "Directory not found or cannot be accessed");
+        return;
+    }
+    
+    source = calloc(1, sizeof(tree_source_t));
+    if (source == NULL ||
+        (source->frame = malloc(CUPID_HEADER_SIZE + TREE_BATCH_SIZE + CUPID_HEADER_SIZE)) == NULL ||
+        (dir = fdopendir(dir_fd)) == NULL) {
+        response_error(response, ERR_GENERIC, "Out of memory");
+        if (source != NULL) {
+            free(source->frame);
+            free(source);
+        }
+        close(dir_fd);
+        return;
+    }
+    source->stack[0].dir = dir;
+    source->stack[0].path_len = 0;
+    source->depth = 1;
+    source->file_fd = -1;
     
-    // Open the file
-    file_fd = open(filepath, O_RDONLY);
+    response->sched_class = SCHED_BULK;
+    response->source = source;
+    response->refill = tree_refill;
+    response->release = tree_release;
+    tree_refill(response);
+}
+
+// Handle stats request: the metrics as one frame of text
+static void handle_get_stats(response_t *response) {
+    size_t length = metrics_format(response->head + CUPID_HEADER_SIZE, MAX_PACKET_SIZE);
+    
+    response_header_at(response, 0, CMD_STATS, 0, length);
+    response->head_len = CUPID_HEADER_SIZE + length;
+}
+
+// Handle multicast join: schedule the file for the group, or join the
+// session already sending it, and tell the receiver where to listen
+static void handle_multicast_join(response_t *response, const char *payload, size_t length) {
+    unsigned char info[MULTICAST_INFO_SIZE];
+    multicast_info_t session;
+    struct stat st;
+    int file_fd;
+    
+    if (!multicast_enabled()) {
+        response_error(response, ERR_BAD_REQUEST, "Multicast is not enabled on this server");
+        return;
+    }
+    if (!valid_filename(payload, length)) {
+        response_error(response, ERR_BAD_REQUEST, "Invalid filename");
+        return;
+    }
+    
+    file_fd = index_open(payload, &st);
     if (file_fd == -1) {
-        buffer[0] = CMD_ERROR;
-        strcpy(buffer + 1, "File not found or cannot be accessed");
-        send(client_socket, buffer, strlen(buffer + 1) + 1, 0);
+        response_error(response, ERR_NOT_FOUND, "File not found or cannot be accessed");
+        return;
+    }
+    if (multicast_join(payload, file_fd, &st, &session) == -1) {
+        response_error(response, ERR_GENERIC, "Out of memory");
         return;
     }
     
-    // Send file data
-    buffer[0] = CMD_FILE_DATA;
+    multicast_info_encode(&session, info);
+    response_frame(response, CMD_MULTICAST_INFO, 0, info, sizeof(info), sizeof(info));
+}
+
+// Build the response to one request
+void handle_request(response_t *response, const cupid_header_t *header, const char *payload) {
+    response_init(response, header->request_id);
+    response->started = sched_now();
+    metrics_request(header->opcode);
     
-    while ((bytes_read = read(file_fd, buffer + 1, MAX_PACKET_SIZE - 1)) > 0) {
-        if (send(client_socket, buffer, bytes_read + 1, 0) <= 0) {
+    switch (header->opcode) {
+        case CMD_LIST_FILES:
+            handle_list_files(response, payload, header->length);
+            break;
+            
+        case CMD_GET_FILE:
+            handle_get_file(response, header->flags, payload, header->length);
+            break;
+            
+        case CMD_GET_SIGNATURES:
+            handle_get_signatures(response, payload, header->length);
+            break;
+            
+        case CMD_GET_TREE:
+            handle_get_tree(response, payload, header->length);
+            break;
+            
+        case CMD_GET_STATS:
+            handle_get_stats(response);
+            break;
+            
+        case CMD_MULTICAST_JOIN:
+            handle_multicast_join(response, payload, header->length);
             break;
+            
+        default:
+            // Unknown command
+            response_error(response, ERR_UNKNOWN_COMMAND, "Unknown command");
+            break;
+    }
+}
+
+// Close the file body of the current part, if any
+static void response_release_body(response_t *response) {
+    if (response->file_fd != -1) {
+        file_body_release(&response->body);
+        close(response->file_fd);
+        response->file_fd = -1;
+    }
+}
+
+// Queue the next part of a streamed response once head and body are drained
+int response_next(response_t *response) {
+    if (response->refill == NULL) {
+        return 0;
+    }
+    
+    response_release_body(response);
+    response->head = response->head_buffer;
+    response->head_len = 0;
+    response->head_sent = 0;
+    return response->refill(response);
+}
+
+// Account for bytes of a response that went out, and for its end
+void response_sent(response_t *response, uint64_t bytes, int finished) {
+    if (bytes > 0) {
+        metrics_sent(bytes);
+        if (!response->first_byte_sent && response->started != 0) {
+            metrics_record(HIST_FIRST_BYTE, sched_now() - response->started);
+        }
+        response->first_byte_sent = 1;
+        response->sent += bytes;
+        if (tcp_tune_progress(&response->tcp, bytes)) {
+            char tuning[256];
+            
+            tcp_tune_describe(&response->tcp, tuning, sizeof(tuning));
+            printf("Tuned %s: %s\n", response->tcp.peer, tuning);
+            metrics_buffer_grown();
         }
     }
+    if (finished && response->started != 0) {
+        metrics_record(HIST_DURATION, sched_now() - response->started);
+    }
     
-    close(file_fd);
+    // A transfer long enough for TCP to settle leaves its RTT and losses
+    // in the metrics
+    if (finished && response->sent >= TCP_TUNE_INTERVAL && tcp_tune_refresh(&response->tcp) == 0) {
+        metrics_record(HIST_TCP_RTT, (uint64_t)response->tcp.rtt_us * 1000);
+        metrics_retransmits(response->tcp.retransmits - response->tcp.retransmits_reported);
+        response->tcp.retransmits_reported = response->tcp.retransmits;
+    }
 }
 
-// Client handler thread function
-void *handle_client(void *arg) {
-    client_data_t *client_data = (client_data_t *)arg;
-    int client_socket = client_data->client_socket;
-    struct sockaddr_in client_addr = client_data->client_addr;
-    char buffer[MAX_PACKET_SIZE];
-    ssize_t bytes_received;
+// Write as much of the response as the socket and allowance accept
+static int response_write(response_t *response, int sock) {
+    do {
+        while (response->head_sent < response->head_len) {
+            size_t want = response->head_len - response->head_sent;
+            
+            if (response->allowance == 0) {
+                return RESPONSE_YIELD;
+            }
+            if (want > response->allowance) {
+                want = response->allowance;
+            }
+            ssize_t sent = send(sock, response->head + response->head_sent, want,
+                                MSG_NOSIGNAL | (response_has_body(response) ? MSG_MORE : 0));
+            if (sent == -1) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            response->head_sent += sent;
+            response->allowance -= sent;
+        }
+        
+        if (response->file_fd != -1) {
+            int status = file_body_send(&response->body, sock, &response->allowance);
+            if (status != 1)
+                return status;
+        }
+    } while (response_next(response));
+    
+    return 1;
+}
+
+// Write as much of the response as the socket and allowance accept
+int response_send(response_t *response, int sock) {
+    uint64_t allowance = response->allowance;
+    int status = response_write(response, sock);
+    
+    response_sent(response, allowance - response->allowance, status == 1);
+    return status;
+}
+
+// Release the file and buffers held by a response
+void response_release(response_t *response) {
+    response_release_body(response);
+    if (response->release != NULL) {
+        response->release(response);
+    }
+    response->refill = NULL;
+    response->release = NULL;
+    response->source = NULL;
+    response->head = response->head_buffer;
+}
+
+// Log a new connection, tune its socket and set up routing back to the client
+void client_connected(int client_socket, const struct sockaddr_in *client_addr,
+                      tcp_tuning_t *tcp) {
     char client_ip[INET_ADDRSTRLEN];
-    char server_ip[INET_ADDRSTRLEN];
-    char client_network[INET_ADDRSTRLEN];
-    char server_network[INET_ADDRSTRLEN];
-    struct sockaddr_in local_addr;
-    socklen_t addr_len = sizeof(local_addr);
+    char peer[INET_ADDRSTRLEN + 8];
+    topology_path_t path;
+    const char *congestion = server_options.congestion;
+    int nodelay = 1;
+    int known;
+    
+    // Frames are coalesced with MSG_MORE already; without this, the small
+    // trailer after a body waits for the client's delayed ACK
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
     
     // Get client IP
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, INET_ADDRSTRLEN);
+    snprintf(peer, sizeof(peer), "%s:%d", client_ip, ntohs(client_addr->sin_port));
+    
+    printf("Client connected from %s\n", peer);
+    metrics_connection_opened();
     
-    // Get server's local IP for this connection
-    if (getsockname(client_socket, (struct sockaddr*)&local_addr, &addr_len) == 0) {
-        inet_ntop(AF_INET, &local_addr.sin_addr, server_ip, INET_ADDRSTRLEN);
+    // Clients beyond a gateway may get a congestion control of their own
+    known = topology_lookup(client_addr->sin_addr.s_addr, &path) == 0;
+    if (known && !path.on_link && server_options.wan_congestion != NULL) {
+        congestion = server_options.wan_congestion;
+    }
+    tcp_tune_connected(tcp, client_socket, peer, 0, congestion, server_options.notsent_lowat);
+    
+    // A client outside every local subnet and every specific route gets a
+    // route to its network, sized like the subnet it arrived on. The
+    // decision is a lookup in the topology cache; the route itself is
+    // added by the topology thread.
+    if (known && !path.on_link && !path.routed) {
+        int prefix_len = path.prefix_len >= 0 ? path.prefix_len : 32;
+        in_addr_t network = client_addr->sin_addr.s_addr & prefix_mask(prefix_len);
+        char network_ip[INET_ADDRSTRLEN];
+        
+        if (topology_add_route_async(network, prefix_len, client_addr->sin_addr.s_addr)) {
+            inet_ntop(AF_INET, &network, network_ip, INET_ADDRSTRLEN);
+            printf("Client is on a different subnet (%s/%d)\n", network_ip, prefix_len);
+        }
+    }
+}
+
+// Log a closed connection, with its TCP state if it moved enough data
+// for that to mean something
+void client_disconnected(const struct sockaddr_in *client_addr, const tcp_tuning_t *tcp) {
+    char client_ip[INET_ADDRSTRLEN];
+    char tuning[256];
+    
+    inet_ntop(AF_INET, &client_addr->sin_addr, client_ip, INET_ADDRSTRLEN);
+    if (tcp->bytes >= TCP_TUNE_INTERVAL) {
+        tcp_tune_describe(tcp, tuning, sizeof(tuning));
+        printf("Client disconnected from %s:%d (%.1f MB sent; %s)\n", client_ip,
+               ntohs(client_addr->sin_port), tcp->bytes / 1e6, tuning);
     } else {
-        strcpy(server_ip, "unknown");
+        printf("Client disconnected from %s:%d\n", client_ip, ntohs(client_addr->sin_port));
+    }
+    metrics_connection_closed();
+}
+
+// Start a session on an accepted connection
+int session_open(client_session_t *session, int client_socket,
+                 const struct sockaddr_in *client_addr) {
+    session->client_socket = client_socket;
+    session->client_addr = *client_addr;
+    session->sending = 0;
+    session->response = malloc(sizeof(response_t));
+    if (session->response == NULL) {
+        perror("Error allocating memory");
+        close(client_socket);
+        return -1;
     }
     
-    printf("Client connected from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
+    client_connected(client_socket, client_addr, &session->response->tcp);
+    sched_flow_init(&session->flow, client_addr, NULL);
+    return 0;
+}
+
+// Read one request and build its response
+int session_read(client_session_t *session) {
+    int client_socket = session->client_socket;
+    response_t *response = session->response;
+    cupid_header_t header;
+    char payload[MAX_PACKET_SIZE];
+    int status;
     
-    // Check if on different subnets and try to add routes if needed
-    get_network_address(client_ip, client_network, "255.255.0.0");
-    get_network_address(server_ip, server_network, "255.255.0.0");
+    status = recv_header(client_socket, &header);
+    if (status == -1 && errno == EPROTO) {
+        send_error(client_socket, ERR_VERSION, "Unsupported protocol version");
+    }
+    if (status != 0) {
+        return 0;
+    }
+    if (header.length >= sizeof(payload)) {
+        response_init(response, header.request_id);
+        response_error(response, ERR_BAD_REQUEST, "Request too large");
+        response_send(response, client_socket);
+        return 0;
+    }
+    if (recv_all(client_socket, payload, header.length) != (ssize_t)header.length) {
+        return 0;
+    }
+    payload[header.length] = '\0';
     
-    if (strcmp(client_network, server_network) != 0) {
-        printf("Client is on a different subnet (%s vs %s)\n", 
-               client_network, server_network);
-        
-        // Try to add a route to the client's network
-        add_route(client_network, "16", client_ip);
+    handle_request(response, &header, payload);
+    session->sending = 1;
+    return 1;
+}
+
+// Write the next quantum of the response, pausing whenever a bandwidth
+// cap is exceeded
+int session_send(client_session_t *session) {
+    response_t *response = session->response;
+    int status;
+    
+    response->allowance = SCHED_QUANTUM;
+    status = response_send(response, session->client_socket);
+    sched_pace(&session->flow, SCHED_QUANTUM - response->allowance);
+    if (status == RESPONSE_YIELD) {
+        return RESPONSE_YIELD;
     }
+    response_release(response);
+    session->sending = 0;
+    return status == 1;
+}
+
+// Read and answer one request
+int session_serve(client_session_t *session) {
+    int status;
     
-    // Receive command from client
-    bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
-    if (bytes_received > 0) {
-        // Process command
-        switch (buffer[0]) {
-            case CMD_LIST_FILES:
-                handle_list_files(client_socket);
-                break;
-                
-            case CMD_GET_FILE:
-                handle_get_file(client_socket, buffer + 1);
-                break;
-                
-            default:
-                // Unknown command
-                buffer[0] = CMD_ERROR;
-                strcpy(buffer + 1, "Unknown command");
-                send(client_socket, buffer, strlen(buffer + 1) + 1, 0);
-                break;
-        }
+    if (!session_read(session)) {
+        return 0;
     }
+    while ((status = session_send(session)) == RESPONSE_YIELD)
+        ;
+    return status;
+}
+
+// Close the connection and release the session
+void session_close(client_session_t *session) {
+    if (session->sending) {
+        response_release(session->response);
+    }
+    close(session->client_socket);
+    client_disconnected(&session->client_addr, &session->response->tcp);
+    sched_flow_release(&session->flow);
+    free(session->response);
+}
+
+// Client handler thread function
+void *handle_client(void *arg) {
+    client_data_t *client_data = (client_data_t *)arg;
+    client_session_t session;
+    struct timeval idle_timeout = { SESSION_IDLE_TIMEOUT, 0 };
     
-    close(client_socket);
+    if (session_open(&session, client_data->client_socket, &client_data->client_addr) == 0) {
+        // Don't let an idle session hold this thread forever
+        setsockopt(session.client_socket, SOL_SOCKET, SO_RCVTIMEO, &idle_timeout,
+                   sizeof(idle_timeout));
+        
+        // Serve requests until the client closes the session
+        while (session_serve(&session))
+            ;
+        session_close(&session);
+    }
     free(client_data);
-    printf("Client disconnected from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
     return NULL;
 }
 
+// Name announced to clients: the one given, or host:directory, cut to
+// the announcement's size limit
+static void share_name(char *name, size_t size) {
+    char host[HOST_NAME_MAX + 1];
+    char *path, *base;
+    
+    if (server_options.name != NULL) {
+        snprintf(name, size, "%s", server_options.name);
+        return;
+    }
+    if (gethostname(host, sizeof(host)) == -1) {
+        strcpy(host, "cupid");
+    }
+    host[sizeof(host) - 1] = '\0';
+    path = realpath(shared_directory, NULL);
+    base = path != NULL ? strrchr(path, '/') : NULL;
+    if (snprintf(name, size, "%s:%s", host,
+                 base != NULL && base[1] != '\0' ? base + 1 : path != NULL ? path : shared_directory) >= (int)size) {
+        // Too long: keep the truncated prefix, it still tells shares apart
+        name[size - 1] = '\0';
+    }
+    free(path);
+}
+
 // Start the file sharing server
-int start_server(const char *directory, const char *bind_ip) {
+int start_server(const char *directory, const char *bind_ip, const server_options_t *options) {
     int server_socket, client_socket;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
@@ -365,6 +1502,31 @@ int start_server(const char *directory, const char *bind_ip) {
     // Store shared directory
     strncpy(shared_directory, directory, MAX_PATH_LENGTH - 1);
     shared_directory[MAX_PATH_LENGTH - 1] = '\0';
+    server_options = *options;
+    sched_set_rates(server_options.rate, server_options.client_rate);
+    cache_init(server_options.cache_size, server_options.cache_max_file);
+    
+    // A congestion control that cannot be used is a typo, not a fallback
+    if ((server_options.congestion != NULL &&
+         tcp_tune_check_congestion(server_options.congestion) == -1) ||
+        (server_options.wan_congestion != NULL &&
+         tcp_tune_check_congestion(server_options.wan_congestion) == -1)) {
+        return EXIT_FAILURE;
+    }
+    
+    // sendfile() and splice() cannot pass MSG_NOSIGNAL, so a client that
+    // goes away mid-transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Index the directory before taking any requests
+    if (index_init(shared_directory) == -1) {
+        return EXIT_FAILURE;
+    }
+    
+    // Routing decisions for new clients are lookups in this cache
+    if (topology_init(1) == -1) {
+        perror("Warning: cannot read network topology, no routes will be added for clients");
+    }
     
     // Create socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -428,7 +1590,7 @@ int start_server(const char *directory, const char *bind_ip) {
         }
     }
     
-    server_addr.sin_port = htons(CUPID_PORT);
+    server_addr.sin_port = htons(server_options.port);
     
     // Bind socket
     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
@@ -438,17 +1600,95 @@ int start_server(const char *directory, const char *bind_ip) {
     }
     
     // Listen for connections
-    if (listen(server_socket, 10) == -1) {
+    if (listen(server_socket, server_options.backlog) == -1) {
         perror("Error listening on socket");
         close(server_socket);
         return EXIT_FAILURE;
     }
     
+    // Datagrams leave from the address clients connect to
+    if (server_options.multicast != NULL &&
+        multicast_init(server_options.multicast, server_addr.sin_addr,
+                       server_options.multicast_rate, server_options.multicast_wait) == -1) {
+        close(server_socket);
+        return EXIT_FAILURE;
+    }
+    
     printf("Cupid server started. Sharing directory: %s\n", shared_directory);
     display_server_ip();
-    printf("Listening on port %d...\n", CUPID_PORT);
+    printf("File bodies are sent with %s\n",
+           server_options.zero_copy ? "sendfile/splice (zero-copy)" : "read/send (copy)");
+    if (server_options.compress && codec_supported() != 0) {
+        int codec;
+        
+        printf("Compressed transfers offered with:");
+        for (codec = CODEC_LZ4; codec <= CODEC_DEFLATE; codec++) {
+            if (codec_supported() & (1 << codec)) {
+                printf(" %s", codec_name(codec));
+            }
+        }
+        printf("\n");
+    }
+    if (server_options.rate != 0) {
+        printf("Total bandwidth capped at %.1f MB/s\n", server_options.rate / 1e6);
+    }
+    if (server_options.client_rate != 0) {
+        printf("Bandwidth per client capped at %.1f MB/s\n",
+               server_options.client_rate / 1e6);
+    }
+    if (server_options.congestion != NULL || server_options.wan_congestion != NULL) {
+        printf("Congestion control: %s", server_options.congestion != NULL ?
+               server_options.congestion : "system default");
+        if (server_options.wan_congestion != NULL) {
+            printf(", %s for clients beyond a gateway", server_options.wan_congestion);
+        }
+        printf("\n");
+    }
+    if (server_options.multicast != NULL) {
+        printf("Multicast distribution to %s at %.1f MB/s, sessions gather for %d s\n",
+               server_options.multicast, server_options.multicast_rate / 1e6,
+               server_options.multicast_wait);
+    }
+    if (server_options.announce) {
+        char name[DISCOVERY_NAME_MAX + 1];
+        
+        share_name(name, sizeof(name));
+        if (discovery_start(name, server_addr.sin_addr, server_options.port) == 0) {
+            printf("Announced on the LAN as %s\n", name);
+        } else {
+            fprintf(stderr, "Warning: clients will have to be given this server's address\n");
+        }
+    }
+    if (server_options.metrics_port != 0) {
+        if (metrics_serve(server_options.metrics_port) == -1) {
+            close(server_socket);
+            return EXIT_FAILURE;
+        }
+        printf("Metrics at http://127.0.0.1:%d/metrics\n", server_options.metrics_port);
+    }
+    printf("Listening on port %d...\n", server_options.port);
     
-    // Accept client connections
+    if (server_options.engine == ENGINE_EPOLL) {
+        int status = run_event_loops(server_socket, server_options.event_loops);
+        close(server_socket);
+        return status;
+    }
+    
+    if (server_options.engine == ENGINE_URING) {
+        int status = run_uring(server_socket);
+        if (status != URING_UNAVAILABLE) {
+            close(server_socket);
+            return status;
+        }
+    }
+    
+    if (server_options.engine == ENGINE_POOL) {
+        int status = run_thread_pool(server_socket, &server_options);
+        close(server_socket);
+        return status;
+    }
+    
+    // Accept client connections, one thread per client
     while (1) {
         client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
         if (client_socket == -1) {
@@ -482,4 +1722,4 @@ int start_server(const char *directory, const char *bind_ip) {
     // Never reached, but good practice
     close(server_socket);
     return EXIT_SUCCESS;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,130 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <netinet/in.h>
+#include "cupid.h"
+#include "transfer.h"
+#include "tcp_tune.h"
+#include "scheduler.h"
+
+// Seconds a blocking-engine session may sit idle between requests
+#define SESSION_IDLE_TIMEOUT 30
+
+// Room for framing and small payloads in a response
+#define RESPONSE_HEAD_SIZE (CUPID_HEADER_SIZE + MAX_PACKET_SIZE)
+
+// Structure to pass data to client handler thread
+typedef struct {
+    int client_socket;
+    struct sockaddr_in client_addr;
+} client_data_t;
+
+// Response being written to a client. Framing and small payloads are
+// queued in head; a file body, if any, follows it on the wire.
+typedef struct response {
+    char head_buffer[RESPONSE_HEAD_SIZE];
+    char *head;             // head_buffer, or a larger frame owned by source
+    size_t head_len;
+    size_t head_sent;
+    uint32_t request_id;    // Echoed in every frame of the response
+    int sched_class;        // SCHED_INTERACTIVE or SCHED_BULK
+    uint64_t allowance;     // Bytes response_send() may write before yielding
+    uint64_t started;       // sched_now() when the request arrived, 0 if never
+    int first_byte_sent;
+    uint64_t sent;          // Bytes of this response written so far
+    int file_fd;        // -1 when the response has no file body
+    file_body_t body;
+    // Streamed responses: refill queues the next part once head and body
+    // are drained and returns 0 when there is nothing left to send
+    int (*refill)(struct response *response);
+    void (*release)(struct response *response);
+    void *source;
+    tcp_tuning_t tcp;       // Tuning of the connection, kept across responses
+} response_t;
+
+// Whether file body bytes follow the head
+#define response_has_body(response) \
+    ((response)->file_fd != -1 && (response)->body.remaining > 0)
+
+// Reset a response to empty, answering request_id
+void response_init(response_t *response, uint32_t request_id);
+
+// Build the response to one request; payload must be NUL terminated
+void handle_request(response_t *response, const cupid_header_t *header, const char *payload);
+
+// Build a CMD_ERROR response
+void response_error(response_t *response, uint16_t code, const char *message);
+
+// Returned by response_send() when the allowance for this turn ran out
+#define RESPONSE_YIELD BODY_YIELD
+
+// Write as much of the response as the socket and allowance accept.
+// Returns 1 when finished, 0 when the socket would block, RESPONSE_YIELD
+// when the allowance is used up, -1 on error.
+int response_send(response_t *response, int sock);
+
+// Account for bytes of a response that went out, and for its end when
+// finished; engines that bypass response_send() call this themselves
+void response_sent(response_t *response, uint64_t bytes, int finished);
+
+// Queue the next part of a streamed response once head and body are
+// drained. Returns 1 when more output was queued, 0 when it is complete.
+int response_next(response_t *response);
+
+// Release the file and buffers held by a response
+void response_release(response_t *response);
+
+// Log a new connection, tune its socket into tcp and set up routing back
+// to the client
+void client_connected(int client_socket, const struct sockaddr_in *client_addr,
+                      tcp_tuning_t *tcp);
+
+// Log a closed connection with what tuning last saw of it
+void client_disconnected(const struct sockaddr_in *client_addr, const tcp_tuning_t *tcp);
+
+// A client connection on a blocking socket and what is kept across its
+// requests
+typedef struct {
+    int client_socket;
+    struct sockaddr_in client_addr;
+    response_t *response;
+    sched_flow_t flow;
+    int sending;        // A response is partly written
+} client_session_t;
+
+// Start a session on an accepted connection: log it, tune the socket and
+// set up pacing. Returns 0, or -1 with the connection closed.
+int session_open(client_session_t *session, int client_socket,
+                 const struct sockaddr_in *client_addr);
+
+// Read one request and build its response. Returns 1, or 0 when the
+// session is over.
+int session_read(client_session_t *session);
+
+// Write the next scheduler quantum of the response. Returns 1 when it is
+// finished, RESPONSE_YIELD when more is left, 0 when the session is over.
+int session_send(client_session_t *session);
+
+// Read and answer one request. Returns 1 while the session goes on, 0
+// when it is over.
+int session_serve(client_session_t *session);
+
+// Close the connection and release the session
+void session_close(client_session_t *session);
+
+// Serve one client on a blocking socket; frees client_data
+void *handle_client(void *arg);
+
+// Serve connections on the listening socket with a fixed worker pool
+int run_thread_pool(int server_socket, const server_options_t *options);
+
+// Returned by run_uring() when the kernel lacks io_uring support
+#define URING_UNAVAILABLE -1
+
+// Serve connections on the listening socket with io_uring
+int run_uring(int server_socket);
+
+// Serve connections on the listening socket with epoll event loops
+int run_event_loops(int server_socket, int loops);
+
+#endif /* SERVER_H */
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include "tcp_tune.h"
+
+// Ceilings the kernel puts on buffer sizes asked for without
+// CAP_NET_ADMIN, read once from /proc/sys/net/core
+static int wmem_max = 212992;
+static int rmem_max = 212992;
+static pthread_once_t limits_once = PTHREAD_ONCE_INIT;
+
+// Read one number from a sysctl file, or keep fallback
+static int read_sysctl(const char *path, int fallback) {
+    FILE *fp = fopen(path, "r");
+    int value;
+
+    if (fp == NULL) {
+        return fallback;
+    }
+    if (fscanf(fp, "%d", &value) != 1 || value <= 0) {
+        value = fallback;
+    }
+    fclose(fp);
+    return value;
+}
+
+static void load_limits(void) {
+    wmem_max = read_sysctl("/proc/sys/net/core/wmem_max", wmem_max);
+    rmem_max = read_sysctl("/proc/sys/net/core/rmem_max", rmem_max);
+}
+
+// Monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Size of the buffer tuning looks after, as the kernel reports it
+static int read_buffer(const tcp_tuning_t *tuning) {
+    int size = 0;
+    socklen_t len = sizeof(size);
+
+    getsockopt(tuning->sock, SOL_SOCKET, tuning->receiving ? SO_RCVBUF : SO_SNDBUF, &size, &len);
+    return size;
+}
+
+// Set up a new connection
+void tcp_tune_connected(tcp_tuning_t *tuning, int sock, const char *peer, int receiving,
+                        const char *congestion, int notsent_lowat) {
+    socklen_t len = sizeof(tuning->congestion);
+
+    memset(tuning, 0, sizeof(*tuning));
+    tuning->sock = sock;
+    tuning->receiving = receiving;
+    snprintf(tuning->peer, sizeof(tuning->peer), "%s", peer);
+    tuning->next_update = TCP_TUNE_INTERVAL;
+    tuning->last_time = now_ns();
+
+    // The name was checked at startup; should it fail now, the default stays
+    if (congestion != NULL) {
+        setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, congestion, strlen(congestion));
+    }
+    if (notsent_lowat > 0) {
+        setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat, sizeof(notsent_lowat));
+    }
+    if (getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, tuning->congestion, &len) == -1) {
+        strcpy(tuning->congestion, "unknown");
+    }
+    tuning->congestion[sizeof(tuning->congestion) - 1] = '\0';
+    tuning->buffer = read_buffer(tuning);
+}
+
+// Read TCP_INFO and estimate the bandwidth-delay product
+int tcp_tune_refresh(tcp_tuning_t *tuning) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    uint64_t now = now_ns();
+    uint64_t measured = 0;
+
+    if (tuning->sock == -1) {
+        return -1;
+    }
+    // Fields an older kernel does not know stay 0
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(tuning->sock, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return -1;
+    }
+
+    if (now > tuning->last_time) {
+        measured = (tuning->bytes - tuning->last_bytes) * 1000000000 / (now - tuning->last_time);
+    }
+    tuning->last_bytes = tuning->bytes;
+    tuning->last_time = now;
+
+    // A sender has the kernel's delivery rate and the path's minimum RTT.
+    // A receiver only sends requests, so it goes by what it took in and
+    // by the RTT the kernel infers from the data arriving.
+    if (tuning->receiving) {
+        tuning->rtt_us = info.tcpi_rcv_rtt != 0 ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+        tuning->min_rtt_us = tuning->rtt_us;
+        tuning->rate = measured;
+    } else {
+        tuning->rtt_us = info.tcpi_rtt;
+        tuning->min_rtt_us = info.tcpi_min_rtt != 0 ? info.tcpi_min_rtt : info.tcpi_rtt;
+        tuning->rate = info.tcpi_delivery_rate != 0 ? info.tcpi_delivery_rate : measured;
+    }
+    tuning->bdp = tuning->rate * tuning->min_rtt_us / 1000000;
+    tuning->cwnd = info.tcpi_snd_cwnd;
+    tuning->mss = info.tcpi_snd_mss;
+    tuning->retransmits = info.tcpi_total_retrans;
+    tuning->buffer = read_buffer(tuning);
+    return 0;
+}
+
+// Grow the buffer to twice the bandwidth-delay product if it is smaller.
+// Returns 1 when it was grown.
+static int grow_buffer(tcp_tuning_t *tuning) {
+    uint64_t wanted = 2 * tuning->bdp;
+    int request, limit;
+
+    if (wanted > TCP_TUNE_MAX_BUFFER) {
+        wanted = TCP_TUNE_MAX_BUFFER;
+    }
+    if (wanted <= (uint64_t)tuning->buffer) {
+        return 0;
+    }
+
+    // The kernel doubles a request to cover its own bookkeeping, which is
+    // also what it reports back
+    request = wanted / 2;
+    if (setsockopt(tuning->sock, SOL_SOCKET, tuning->receiving ? SO_RCVBUFFORCE : SO_SNDBUFFORCE,
+                   &request, sizeof(request)) == -1) {
+        // Without CAP_NET_ADMIN the request is capped; a capped one that
+        // would not grow the buffer would only switch autotuning off
+        pthread_once(&limits_once, load_limits);
+        limit = tuning->receiving ? rmem_max : wmem_max;
+        if (2 * (uint64_t)limit <= (uint64_t)tuning->buffer) {
+            return 0;
+        }
+        if (request > limit) {
+            request = limit;
+        }
+        if (setsockopt(tuning->sock, SOL_SOCKET, tuning->receiving ? SO_RCVBUF : SO_SNDBUF,
+                       &request, sizeof(request)) == -1) {
+            return 0;
+        }
+    }
+
+    tuning->buffer = read_buffer(tuning);
+    tuning->grown++;
+    return 1;
+}
+
+// Count bytes moved and retune every TCP_TUNE_INTERVAL of them
+int tcp_tune_progress(tcp_tuning_t *tuning, uint64_t bytes) {
+    if (tuning->sock == -1) {
+        return 0;
+    }
+    tuning->bytes += bytes;
+    if (tuning->bytes < tuning->next_update) {
+        return 0;
+    }
+    tuning->next_update = tuning->bytes + TCP_TUNE_INTERVAL;
+    if (tcp_tune_refresh(tuning) == -1) {
+        return 0;
+    }
+    return grow_buffer(tuning);
+}
+
+// One line on the state of a connection
+void tcp_tune_describe(const tcp_tuning_t *tuning, char *buffer, size_t size) {
+    snprintf(buffer, size, "%s, rtt %.2f ms, cwnd %u, %.1f MB/s, BDP %.2f MB, "
+             "%s buffer %.2f MB (%s), %u retransmits",
+             tuning->congestion, tuning->rtt_us / 1e3, tuning->cwnd, tuning->rate / 1e6,
+             tuning->bdp / 1e6, tuning->receiving ? "receive" : "send", tuning->buffer / 1e6,
+             tuning->grown > 0 ? "tuned" : "autotuned", tuning->retransmits);
+}
+
+// Try a congestion control on a scratch socket
+int tcp_tune_check_congestion(const char *name) {
+    char available[256];
+    FILE *fp;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int err;
+
+    if (sock == -1) {
+        return 0; // Nothing to check against; connections keep the default
+    }
+    if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, name, strlen(name)) == 0) {
+        close(sock);
+        return 0;
+    }
+    err = errno;
+    close(sock);
+    fprintf(stderr, "Congestion control %s cannot be used: %s\n", name, strerror(err));
+
+    fp = fopen(err == EPERM ? "/proc/sys/net/ipv4/tcp_allowed_congestion_control" :
+                              "/proc/sys/net/ipv4/tcp_available_congestion_control", "r");
+    if (fp != NULL) {
+        if (fgets(available, sizeof(available), fp) != NULL) {
+            fprintf(stderr, "Choose one of: %s", available);
+        }
+        fclose(fp);
+    }
+    return -1;
+}
@@ -0,0 +1,62 @@
+#ifndef TCP_TUNE_H
+#define TCP_TUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes a connection moves between looks at TCP_INFO
+#define TCP_TUNE_INTERVAL (4 * 1024 * 1024)
+
+// Largest socket buffer tuning asks for
+#define TCP_TUNE_MAX_BUFFER (64 * 1024 * 1024)
+
+// Longest congestion control name, NUL included
+#define TCP_CONGESTION_NAME_SIZE 16
+
+// What tuning measured and decided for one connection
+typedef struct {
+    int sock;                   // -1 when the connection is not tuned
+    int receiving;              // Size the receive buffer, not the send buffer
+    char peer[32];              // Who is at the other end, for the logs
+    char congestion[TCP_CONGESTION_NAME_SIZE];
+    uint64_t bytes;             // Bytes moved so far
+    uint64_t next_update;       // Value of bytes at which TCP_INFO is read again
+    uint64_t last_bytes;        // bytes and time of the previous reading
+    uint64_t last_time;
+    uint32_t rtt_us;            // Smoothed round-trip time
+    uint32_t min_rtt_us;        // Lowest seen, the delay of the path itself
+    uint32_t cwnd;              // Congestion window in segments
+    uint32_t mss;
+    uint32_t retransmits;       // Segments retransmitted since the connect
+    uint32_t retransmits_reported;  // Part of retransmits already in the metrics
+    uint64_t rate;              // Bytes per second
+    uint64_t bdp;               // Bandwidth-delay product in bytes
+    int buffer;                 // Size of the tuned buffer as the kernel reports it
+    int grown;                  // Times tuning grew it; autotuning is off after the first
+} tcp_tuning_t;
+
+// Set up a new connection to peer: ask for the congestion control named,
+// or the system default when NULL, and with notsent_lowat above 0 keep at
+// most that many unsent bytes queued so replies are not stuck behind a
+// full send buffer. receiving says which buffer later tuning sizes.
+void tcp_tune_connected(tcp_tuning_t *tuning, int sock, const char *peer, int receiving,
+                        const char *congestion, int notsent_lowat);
+
+// Count bytes moved. Every TCP_TUNE_INTERVAL bytes the bandwidth-delay
+// product is estimated again from TCP_INFO and the buffer grown to twice
+// it where the kernel's autotuning stops short. Buffers only ever grow:
+// the first explicit size switches autotuning off for good. Returns 1
+// when the buffer was just grown, 0 otherwise.
+int tcp_tune_progress(tcp_tuning_t *tuning, uint64_t bytes);
+
+// Read TCP_INFO now. Returns 0, or -1 when the connection is not tuned.
+int tcp_tune_refresh(tcp_tuning_t *tuning);
+
+// One line on the state of a connection, for the logs
+void tcp_tune_describe(const tcp_tuning_t *tuning, char *buffer, size_t size);
+
+// Whether the congestion control name may be used. Returns 0, or -1 after
+// printing what is available instead.
+int tcp_tune_check_congestion(const char *name);
+
+#endif /* TCP_TUNE_H */
@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include "cupid.h"
+#include "protocol.h"
+#include "server.h"
+
+// Keep the queue indices on separate cache lines
+#define CACHE_LINE_SIZE 64
+
+// Requests a worker serves on one connection before others get a turn
+#define POOL_TURN_REQUESTS 16
+
+// Seconds a worker waits for the rest of a request that has begun to arrive
+#define POOL_REQUEST_TIMEOUT 5
+
+// Readiness events the idle watcher handles per wakeup
+#define POOL_WATCH_EVENTS 64
+
+// One slot of the queue. The sequence number tells producers and
+// consumers whether the slot is free for the current lap.
+typedef struct {
+    atomic_size_t sequence;
+    client_data_t *client_data;
+} queue_cell_t;
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov)
+typedef struct {
+    queue_cell_t *cells;
+    size_t mask;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+} work_queue_t;
+
+// A session between turns on a worker
+typedef struct pool_session {
+    client_session_t session;
+    struct pool_session *prev;
+    struct pool_session *next;
+    time_t parked_at;   // When it went idle, in monotonic seconds
+} pool_session_t;
+
+// Doubly linked list of sessions, oldest first
+typedef struct {
+    pool_session_t *head;
+    pool_session_t *tail;
+} session_list_t;
+
+// Shared state of the pool
+typedef struct {
+    work_queue_t queue;
+    sem_t items;        // Connections waiting in the queue or ready list
+    sem_t slots;        // Free queue slots, used by OVERLOAD_WAIT
+    int overload;
+    pthread_mutex_t lock;       // Guards ready and parked
+    session_list_t ready;       // Sessions with a request waiting
+    session_list_t parked;      // Idle sessions the watcher waits on
+    int epoll_fd;
+} thread_pool_t;
+
+// Allocate a queue with at least the requested capacity
+static int queue_init(work_queue_t *queue, size_t capacity) {
+    size_t size = 2;
+
+    while (size < capacity)
+        size <<= 1;
+
+    queue->cells = malloc(size * sizeof(queue_cell_t));
+    if (queue->cells == NULL)
+        return -1;
+
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    return 0;
+}
+
+// Add a connection. Returns 0, or -1 when the queue is full.
+static int queue_push(work_queue_t *queue, client_data_t *client_data) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    queue_cell_t *cell;
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->client_data = client_data;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+// Take a connection, or NULL when the queue is empty
+static client_data_t *queue_pop(work_queue_t *queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    queue_cell_t *cell;
+
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    client_data_t *client_data = cell->client_data;
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return client_data;
+}
+
+// Add a session at the end of a list
+static void list_append(session_list_t *list, pool_session_t *session) {
+    session->prev = list->tail;
+    session->next = NULL;
+    if (list->tail != NULL)
+        list->tail->next = session;
+    else
+        list->head = session;
+    list->tail = session;
+}
+
+// Take a session out of a list
+static void list_remove(session_list_t *list, pool_session_t *session) {
+    if (session->prev != NULL)
+        session->prev->next = session->next;
+    else
+        list->head = session->next;
+    if (session->next != NULL)
+        session->next->prev = session->prev;
+    else
+        list->tail = session->prev;
+}
+
+// Seconds on the monotonic clock
+static time_t monotonic_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// Hand a session with a request waiting to the next free worker
+static void make_ready(thread_pool_t *pool, pool_session_t *session) {
+    pthread_mutex_lock(&pool->lock);
+    list_append(&pool->ready, session);
+    pthread_mutex_unlock(&pool->lock);
+    sem_post(&pool->items);
+}
+
+// End a session and free it
+static void end_session(pool_session_t *session) {
+    session_close(&session->session);
+    free(session);
+}
+
+// Leave an idle session with the watcher until its next request arrives
+static void park_session(thread_pool_t *pool, pool_session_t *session) {
+    struct epoll_event event;
+
+    pthread_mutex_lock(&pool->lock);
+    session->parked_at = monotonic_seconds();
+    list_append(&pool->parked, session);
+    pthread_mutex_unlock(&pool->lock);
+
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = session;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, session->session.client_socket, &event) == -1) {
+        perror("Error watching connection");
+        pthread_mutex_lock(&pool->lock);
+        list_remove(&pool->parked, session);
+        pthread_mutex_unlock(&pool->lock);
+        end_session(session);
+    }
+}
+
+// Whether other sessions or connections are waiting for a worker
+static int others_waiting(thread_pool_t *pool) {
+    int waiting;
+
+    return sem_getvalue(&pool->items, &waiting) == 0 && waiting > 0;
+}
+
+// Serve the requests a session has waiting, then park it. Between quanta
+// of a long response, and after POOL_TURN_REQUESTS requests, the session
+// goes to the back of the line when others are waiting, so a worker is
+// only ever held for work that is actually there and is shared fairly.
+static void serve_turn(thread_pool_t *pool, pool_session_t *session) {
+    struct pollfd pfd = { session->session.client_socket, POLLIN, 0 };
+    int served = 0, status;
+
+    while (1) {
+        if (session->session.sending) {
+            status = session_send(&session->session);
+            if (status == 0) {
+                end_session(session);
+                return;
+            }
+            if (status == RESPONSE_YIELD && others_waiting(pool)) {
+                make_ready(pool, session);
+                return;
+            }
+            served += status == 1;
+            continue;
+        }
+        if (poll(&pfd, 1, 0) != 1) {
+            park_session(pool, session);
+            return;
+        }
+        if (served >= POOL_TURN_REQUESTS && others_waiting(pool)) {
+            make_ready(pool, session);
+            return;
+        }
+        if (!session_read(&session->session)) {
+            end_session(session);
+            return;
+        }
+    }
+}
+
+// Watcher thread: hand parked sessions back to the workers when a request
+// arrives, and close those idle for SESSION_IDLE_TIMEOUT
+static void *watcher_run(void *arg) {
+    thread_pool_t *pool = arg;
+    struct epoll_event events[POOL_WATCH_EVENTS];
+    pool_session_t *session, *expired;
+
+    while (1) {
+        int count = epoll_wait(pool->epoll_fd, events, POOL_WATCH_EVENTS, 1000);
+
+        for (int i = 0; i < count; i++) {
+            session = events[i].data.ptr;
+            epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, session->session.client_socket, NULL);
+            pthread_mutex_lock(&pool->lock);
+            list_remove(&pool->parked, session);
+            pthread_mutex_unlock(&pool->lock);
+            make_ready(pool, session);
+        }
+
+        // Parked sessions are in the order they went idle
+        while (1) {
+            pthread_mutex_lock(&pool->lock);
+            expired = pool->parked.head;
+            if (expired != NULL && monotonic_seconds() - expired->parked_at >= SESSION_IDLE_TIMEOUT)
+                list_remove(&pool->parked, expired);
+            else
+                expired = NULL;
+            pthread_mutex_unlock(&pool->lock);
+            if (expired == NULL)
+                break;
+            epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, expired->session.client_socket, NULL);
+            end_session(expired);
+        }
+    }
+
+    return NULL;
+}
+
+// Start a session on a connection taken from the queue. Returns it, or
+// NULL when it could not be started.
+static pool_session_t *open_session(client_data_t *client_data) {
+    struct timeval request_timeout = { POOL_REQUEST_TIMEOUT, 0 };
+    pool_session_t *session = malloc(sizeof(pool_session_t));
+
+    if (session == NULL) {
+        perror("Error allocating memory");
+        close(client_data->client_socket);
+    } else if (session_open(&session->session, client_data->client_socket,
+                            &client_data->client_addr) == -1) {
+        free(session);
+        session = NULL;
+    } else {
+        // A worker only reads requests that have begun to arrive
+        setsockopt(session->session.client_socket, SOL_SOCKET, SO_RCVTIMEO,
+                   &request_timeout, sizeof(request_timeout));
+    }
+    free(client_data);
+    return session;
+}
+
+// Take the session at the head of the ready list, or NULL
+static pool_session_t *take_ready(thread_pool_t *pool) {
+    pool_session_t *session;
+
+    pthread_mutex_lock(&pool->lock);
+    session = pool->ready.head;
+    if (session != NULL)
+        list_remove(&pool->ready, session);
+    pthread_mutex_unlock(&pool->lock);
+    return session;
+}
+
+// Worker thread: serve sessions with requests waiting, new connections
+// from the queue and parked ones handed back by the watcher, a turn at a
+// time. The two sources take turns so neither can starve the other.
+static void *worker_run(void *arg) {
+    thread_pool_t *pool = arg;
+    int queue_first = 0;
+
+    while (1) {
+        client_data_t *client_data = NULL;
+        pool_session_t *session = NULL;
+
+        while (sem_wait(&pool->items) == -1 && errno == EINTR)
+            ;
+
+        // Every token matches a finished push, so this only spins briefly
+        while (1) {
+            if (queue_first && (client_data = queue_pop(&pool->queue)) != NULL)
+                break;
+            if ((session = take_ready(pool)) != NULL)
+                break;
+            if ((client_data = queue_pop(&pool->queue)) != NULL)
+                break;
+            sched_yield();
+        }
+        queue_first = session != NULL;
+
+        if (session == NULL) {
+            if (pool->overload == OVERLOAD_WAIT)
+                sem_post(&pool->slots);
+            session = open_session(client_data);
+            if (session == NULL)
+                continue;
+        }
+
+        serve_turn(pool, session);
+    }
+
+    return NULL;
+}
+
+// Turn a client away without tying up a worker
+static void reject_busy(int client_socket) {
+    char discard[MAX_PACKET_SIZE];
+
+    send_error(client_socket, ERR_BUSY, "Server busy, try again later");
+    shutdown(client_socket, SHUT_WR);
+
+    // Drain any request already received so close() doesn't reset the
+    // connection before the client reads the error
+    while (recv(client_socket, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+        ;
+    close(client_socket);
+}
+
+// Serve connections on the listening socket with a fixed worker pool
+int run_thread_pool(int server_socket, const server_options_t *options) {
+    thread_pool_t *pool;
+    pthread_t watcher_id;
+
+    pool = calloc(1, sizeof(thread_pool_t));
+    if (pool == NULL || queue_init(&pool->queue, options->queue_size) == -1) {
+        perror("Error allocating memory");
+        free(pool);
+        return EXIT_FAILURE;
+    }
+
+    pool->overload = options->overload;
+    sem_init(&pool->items, 0, 0);
+    sem_init(&pool->slots, 0, pool->queue.mask + 1);
+    pthread_mutex_init(&pool->lock, NULL);
+
+    // Idle connections wait on the watcher rather than on a worker
+    pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epoll_fd == -1) {
+        perror("Error creating epoll instance");
+        return EXIT_FAILURE;
+    }
+    if (pthread_create(&watcher_id, NULL, watcher_run, pool) != 0) {
+        perror("Error creating watcher thread");
+        return EXIT_FAILURE;
+    }
+    pthread_detach(watcher_id);
+
+    for (int i = 0; i < options->workers; i++) {
+        pthread_t thread_id;
+
+        if (pthread_create(&thread_id, NULL, worker_run, pool) != 0) {
+            perror("Error creating worker thread");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread_id);
+    }
+
+    printf("Serving with %d worker thread%s, queue of %zu (%s when full)\n",
+           options->workers, options->workers == 1 ? "" : "s", pool->queue.mask + 1,
+           options->overload == OVERLOAD_WAIT ? "pause accepting" : "reject");
+
+    // Accept client connections and hand them to the workers
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        client_data_t *client_data;
+        int client_socket;
+
+        // Backpressure: leave new connections in the kernel backlog
+        if (options->overload == OVERLOAD_WAIT) {
+            while (sem_wait(&pool->slots) == -1 && errno == EINTR)
+                ;
+        }
+
+        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+        if (client_socket == -1) {
+            perror("Error accepting connection");
+            if (options->overload == OVERLOAD_WAIT)
+                sem_post(&pool->slots);
+            continue;
+        }
+
+        client_data = malloc(sizeof(client_data_t));
+        if (client_data == NULL) {
+            perror("Error allocating memory");
+            close(client_socket);
+            if (options->overload == OVERLOAD_WAIT)
+                sem_post(&pool->slots);
+            continue;
+        }
+
+        client_data->client_socket = client_socket;
+        client_data->client_addr = client_addr;
+
+        if (queue_push(&pool->queue, client_data) == -1) {
+            // Only reachable with OVERLOAD_REJECT
+            free(client_data);
+            reject_busy(client_socket);
+            continue;
+        }
+        sem_post(&pool->items);
+    }
+
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "cupid.h"
+#include "protocol.h"
+#include "transfer.h"
+#include "checksum.h"
+
+// Largest amount handed to a single sendfile()/splice() call
+#define ZERO_COPY_CHUNK (4 * 1024 * 1024)
+
+// Zero-copy bodies are checksummed in aligned chunks of this size, whose
+// CRCs are remembered per file version so a file is only read once
+#define CRC_CHUNK_SIZE (1024 * 1024)
+
+// Files whose chunk CRCs are remembered; each file maps to one slot
+#define CRC_CACHE_SLOTS 256
+
+// Chunk CRCs of one version of a file
+typedef struct {
+    struct stat st;         // The version
+    uint64_t chunks;
+    uint32_t *crc;
+    unsigned char *known;   // One flag per chunk
+} crc_cache_entry_t;
+
+static crc_cache_entry_t crc_cache[CRC_CACHE_SLOTS];
+static pthread_mutex_t crc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether an error means this descriptor pair cannot be spliced at all
+static int zero_copy_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+// Whether an error only means the socket buffer is full
+static int would_block(int err) {
+    return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+// Whether two stats describe the same version of the same file
+static int same_version(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+// Slot a file's chunk CRCs live in
+static crc_cache_entry_t *crc_cache_slot(const struct stat *st) {
+    return &crc_cache[((uint64_t)st->st_ino * 31 + st->st_dev) % CRC_CACHE_SLOTS];
+}
+
+// Look up the CRC of a chunk of this version of the file. Returns 1 if known.
+static int crc_cache_get(const struct stat *st, uint64_t chunk, uint32_t *crc) {
+    crc_cache_entry_t *entry = crc_cache_slot(st);
+    int found = 0;
+
+    pthread_mutex_lock(&crc_cache_lock);
+    if (entry->crc != NULL && same_version(&entry->st, st) && chunk < entry->chunks &&
+        entry->known[chunk]) {
+        *crc = entry->crc[chunk];
+        found = 1;
+    }
+    pthread_mutex_unlock(&crc_cache_lock);
+    return found;
+}
+
+// Remember the CRC of a chunk, replacing whatever version or file held the slot
+static void crc_cache_put(const struct stat *st, uint64_t chunk, uint32_t crc) {
+    crc_cache_entry_t *entry = crc_cache_slot(st);
+
+    pthread_mutex_lock(&crc_cache_lock);
+    if (entry->crc == NULL || !same_version(&entry->st, st)) {
+        free(entry->crc);
+        free(entry->known);
+        entry->st = *st;
+        entry->chunks = (st->st_size + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE;
+        entry->crc = malloc(entry->chunks * sizeof(uint32_t) + 1);
+        entry->known = calloc(entry->chunks + 1, 1);
+        if (entry->crc == NULL || entry->known == NULL) {
+            free(entry->crc);
+            free(entry->known);
+            entry->crc = NULL;
+            entry->known = NULL;
+        }
+    }
+    if (entry->crc != NULL && chunk < entry->chunks) {
+        entry->crc[chunk] = crc;
+        entry->known[chunk] = 1;
+    }
+    pthread_mutex_unlock(&crc_cache_lock);
+}
+
+// Prepare to send length bytes of file_fd starting at offset
+void file_body_init(file_body_t *body, int file_fd, off_t offset, uint64_t length,
+                    int zero_copy) {
+    memset(body, 0, sizeof(*body));
+    body->file_fd = file_fd;
+    body->offset = offset;
+    body->remaining = length;
+    body->mode = zero_copy ? BODY_SENDFILE : BODY_COPY;
+    body->pipefd[0] = -1;
+    body->pipefd[1] = -1;
+    body->checked = offset;
+    body->end = offset + length;
+}
+
+// Free buffers and pipes held by the sender
+void file_body_release(file_body_t *body) {
+    if (body->pipefd[0] != -1) {
+        close(body->pipefd[0]);
+        close(body->pipefd[1]);
+        body->pipefd[0] = body->pipefd[1] = -1;
+    }
+    free(body->buffer);
+    body->buffer = NULL;
+}
+
+// Allocate the bounce buffer on first use
+static int body_buffer(file_body_t *body) {
+    if (body->buffer == NULL) {
+        body->buffer = malloc(TRANSFER_CHUNK_SIZE);
+        if (body->buffer == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+// Extend crc over the file bytes from start to end by reading them
+static int checksum_range(file_body_t *body, off_t start, off_t end, uint32_t *crc) {
+    if (body_buffer(body) == -1)
+        return -1;
+
+    while (start < end) {
+        size_t want = end - start < TRANSFER_CHUNK_SIZE ? end - start : TRANSFER_CHUNK_SIZE;
+        ssize_t bytes_read = pread(body->file_fd, body->buffer, want, start);
+        if (bytes_read == -1 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            return -1; // Error, or the file shrank underneath us
+        *crc = crc32c(*crc, body->buffer, bytes_read);
+        start += bytes_read;
+    }
+
+    return 0;
+}
+
+// Fold file bytes up to at least end into the checksum before a
+// zero-copy send. Whole chunks take their CRC from the cache when this
+// version of the file was sent before; only chunks it cannot vouch for,
+// and the partial chunks at the ends of a range, are read.
+static int checksum_ahead(file_body_t *body, off_t end) {
+    struct stat now;
+    uint32_t crc;
+
+    if (body->versioned == 0)
+        body->versioned = fstat(body->file_fd, &body->st) == 0 && S_ISREG(body->st.st_mode) ? 1 : -1;
+
+    while (body->checked < end) {
+        off_t chunk_start = body->checked - body->checked % CRC_CHUNK_SIZE;
+        off_t chunk_end = chunk_start + CRC_CHUNK_SIZE;
+        uint64_t chunk = chunk_start / CRC_CHUNK_SIZE;
+
+        if (body->versioned == 1 && chunk_end > body->st.st_size)
+            chunk_end = body->st.st_size;
+        if (chunk_end <= body->checked)
+            return -1; // The file shrank underneath us
+
+        if (body->versioned == 1 && body->checked == chunk_start && chunk_end <= body->end) {
+            if (!crc_cache_get(&body->st, chunk, &crc)) {
+                crc = 0;
+                if (checksum_range(body, chunk_start, chunk_end, &crc) == -1)
+                    return -1;
+
+                // Only remember what was read from the version that was looked up
+                if (fstat(body->file_fd, &now) == 0 && same_version(&now, &body->st))
+                    crc_cache_put(&body->st, chunk, crc);
+            }
+            body->crc = crc32c_combine(body->crc, crc, chunk_end - chunk_start);
+            body->checked = chunk_end;
+        } else {
+            if (chunk_end > body->end)
+                chunk_end = body->end;
+            if (checksum_range(body, body->checked, chunk_end, &body->crc) == -1)
+                return -1;
+            body->checked = chunk_end;
+        }
+    }
+
+    return 0;
+}
+
+// Largest part of want the allowance still covers
+static size_t allowed(size_t want, const uint64_t *allowance) {
+    return want < *allowance ? want : *allowance;
+}
+
+// Copy path: read a chunk into the bounce buffer and send it
+static int send_copy(file_body_t *body, int sock, uint64_t *allowance) {
+    if (body_buffer(body) == -1)
+        return -1;
+
+    while (body->remaining > 0 || body->buffer_sent < body->buffered) {
+        if (body->buffer_sent == body->buffered) {
+            size_t want = body->remaining < TRANSFER_CHUNK_SIZE ? body->remaining : TRANSFER_CHUNK_SIZE;
+            ssize_t bytes_read = pread(body->file_fd, body->buffer, want, body->offset);
+            if (bytes_read == -1 && errno == EINTR)
+                continue;
+            if (bytes_read <= 0)
+                return -1; // Error, or the file shrank underneath us
+
+            // A zero-copy attempt may already have summed part of this chunk
+            if (body->offset + bytes_read > body->checked) {
+                size_t skip = body->checked > body->offset ? body->checked - body->offset : 0;
+                body->crc = crc32c(body->crc, body->buffer + skip, bytes_read - skip);
+                body->checked = body->offset + bytes_read;
+            }
+            body->offset += bytes_read;
+            body->remaining -= bytes_read;
+            body->buffered = bytes_read;
+            body->buffer_sent = 0;
+        }
+
+        if (*allowance == 0)
+            return BODY_YIELD;
+        ssize_t sent = send(sock, body->buffer + body->buffer_sent,
+                            allowed(body->buffered - body->buffer_sent, allowance), MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            return would_block(errno) ? 0 : -1;
+        }
+        body->buffer_sent += sent;
+        *allowance -= sent;
+    }
+
+    return 1;
+}
+
+// Splice path: move the file through a pipe into the socket
+static int send_splice(file_body_t *body, int sock, uint64_t *allowance) {
+    if (body->pipefd[0] == -1 && pipe2(body->pipefd, O_NONBLOCK) == -1)
+        return -1;
+
+    while (body->remaining > 0 || body->in_pipe > 0) {
+        if (body->in_pipe == 0) {
+            size_t want = body->remaining < ZERO_COPY_CHUNK ? body->remaining : ZERO_COPY_CHUNK;
+            if (checksum_ahead(body, body->offset + want) == -1)
+                return -1;
+            ssize_t filled = splice(body->file_fd, &body->offset, body->pipefd[1], NULL,
+                                    want, SPLICE_F_MOVE);
+            if (filled == -1 && errno == EINTR)
+                continue;
+            if (filled == -1 && zero_copy_unsupported(errno)) {
+                body->mode = BODY_COPY;
+                return send_copy(body, sock, allowance);
+            }
+            if (filled <= 0)
+                return -1;
+            body->in_pipe = filled;
+            body->remaining -= filled;
+        }
+
+        if (*allowance == 0)
+            return BODY_YIELD;
+        ssize_t sent = splice(body->pipefd[0], NULL, sock, NULL, allowed(body->in_pipe, allowance),
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                              (body->remaining > 0 ? SPLICE_F_MORE : 0));
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            return would_block(errno) ? 0 : -1;
+        }
+        body->in_pipe -= sent;
+        *allowance -= sent;
+    }
+
+    return 1;
+}
+
+// Send as much of the body as the socket accepts
+int file_body_send(file_body_t *body, int sock, uint64_t *allowance) {
+    if (body->mode == BODY_COPY)
+        return send_copy(body, sock, allowance);
+    if (body->mode == BODY_SPLICE)
+        return send_splice(body, sock, allowance);
+
+    while (body->remaining > 0) {
+        if (*allowance == 0)
+            return BODY_YIELD;
+        size_t want = body->remaining < ZERO_COPY_CHUNK ? body->remaining : ZERO_COPY_CHUNK;
+        want = allowed(want, allowance);
+        if (checksum_ahead(body, body->offset + want) == -1)
+            return -1;
+        ssize_t sent = sendfile(sock, body->file_fd, &body->offset, want);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (would_block(errno))
+                return 0;
+            if (zero_copy_unsupported(errno)) {
+                // sendfile() refused this file; try a pipe, then plain copies
+                body->mode = BODY_SPLICE;
+                return send_splice(body, sock, allowance);
+            }
+            return -1;
+        }
+        if (sent == 0)
+            return -1; // The file shrank underneath us
+        body->remaining -= sent;
+        *allowance -= sent;
+    }
+
+    return 1;
+}
+
+// Send a whole file range on a blocking socket
+int send_file_body(int sock, int file_fd, off_t offset, uint64_t length, int zero_copy) {
+    file_body_t body;
+    uint64_t allowance = UINT64_MAX;
+    int status;
+
+    file_body_init(&body, file_fd, offset, length, zero_copy);
+    status = file_body_send(&body, sock, &allowance);
+    file_body_release(&body);
+    return status == 1 ? 0 : -1;
+}
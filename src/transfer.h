@@ -0,0 +1,57 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// How a file body is moved to the socket
+#define BODY_SENDFILE 0
+#define BODY_SPLICE 1
+#define BODY_COPY 2
+
+// Progress of a file body being written to a socket. The sender starts
+// with sendfile(), drops to splice() through a pipe when sendfile()
+// rejects the source, and to a read/send copy loop only when the file
+// cannot be spliced at all. State survives EAGAIN so the same sender
+// drives blocking and non-blocking sockets.
+// A CRC-32C of the body is kept as it goes. Zero-copy modes take it
+// from per-chunk CRCs remembered for each version of a file, reading
+// ahead of the kernel only what a previous send did not cover.
+typedef struct {
+    int file_fd;
+    off_t offset;
+    uint64_t remaining;
+    int mode;
+    int pipefd[2];
+    size_t in_pipe;
+    char *buffer;
+    size_t buffered;
+    size_t buffer_sent;
+    uint32_t crc;           // CRC-32C of the body up to checked
+    off_t checked;
+    off_t end;              // Where the body ends
+    struct stat st;         // Version of the file the cached CRCs must match
+    int versioned;          // st is valid: 1, unknown: 0, cannot be had: -1
+} file_body_t;
+
+// Prepare to send length bytes of file_fd starting at offset
+void file_body_init(file_body_t *body, int file_fd, off_t offset, uint64_t length,
+                    int zero_copy);
+
+// Returned by file_body_send() when the allowance ran out first
+#define BODY_YIELD 2
+
+// Send as much of the body as the socket accepts, at most *allowance
+// bytes, which is reduced by what went out. Returns 1 when finished,
+// 0 when the socket would block, BODY_YIELD when the allowance is used
+// up, -1 on error.
+int file_body_send(file_body_t *body, int sock, uint64_t *allowance);
+
+// Free buffers and pipes held by the sender (not the file descriptor)
+void file_body_release(file_body_t *body);
+
+// Send a whole file range on a blocking socket. Returns 0 or -1.
+int send_file_body(int sock, int file_fd, off_t offset, uint64_t length, int zero_copy);
+
+#endif /* TRANSFER_H */
@@ -0,0 +1,741 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include "cupid.h"
+#include "protocol.h"
+#include "server.h"
+#include "checksum.h"
+#include "scheduler.h"
+
+// Submission queue depth; the completion queue is twice as deep
+#define URING_ENTRIES 512
+
+// Registered buffers shared by all transfers
+#define URING_BUFFERS 64
+
+// How long the kernel submission thread spins before sleeping (ms)
+#define URING_SQPOLL_IDLE 100
+
+// Longest sleep while throttled connections wait to resume (ns)
+#define URING_THROTTLE_TICK (10 * 1000 * 1000)
+
+// Operation tag kept in the low bits of an SQE's user_data
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_READ 3
+#define OP_WRITE 4
+#define OP_TIMEOUT 5
+#define OP_MASK 7
+
+// Where a connection is in its request/response cycle
+#define CONN_READ_HEADER 0
+#define CONN_READ_PAYLOAD 1
+#define CONN_SEND_HEAD 2
+#define CONN_SEND_BODY 3
+
+// Per-connection state driven by completions
+typedef struct uring_conn {
+    int fd;
+    int state;
+    struct sockaddr_in addr;
+    unsigned char raw_header[CUPID_HEADER_SIZE];
+    size_t received;
+    cupid_header_t header;
+    char payload[MAX_PACKET_SIZE];
+    response_t response;
+    int buffer;             // Registered buffer index, or -1
+    size_t chunk_len;       // Bytes of the current body chunk
+    size_t chunk_sent;
+    int read_result;
+    int write_result;
+    int pending;            // SQEs in flight for this connection
+    int close_after_response;   // The request was unusable; end the session
+    sched_flow_t flow;
+    uint64_t wake;              // sched_now() at which a throttled send resumes
+    struct uring_conn *next_throttled;
+} uring_conn_t;
+
+// Mapped rings plus the server state that drives them
+typedef struct {
+    int ring_fd;
+    int sqpoll;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // SQEs filled but not yet published
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;        // Mappings, kept for teardown
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    int server_socket;
+    struct sockaddr_in accept_addr;
+    socklen_t accept_addr_len;
+
+    char *buffers[URING_BUFFERS];
+    int free_buffers[URING_BUFFERS];
+    int free_count;
+    // Bodies waiting for a buffer, served in virtual finish order; while
+    // any wait, a transfer hands its buffer on after every chunk
+    sched_queue_t waiting;
+    uring_conn_t *throttled;        // Paying off bandwidth debt
+    int timer_armed;
+    struct __kernel_timespec timeout;
+} uring_server_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Create the ring and map its queues. Returns 0 or -1 with errno set.
+static int uring_setup(uring_server_t *server) {
+    struct io_uring_params params;
+    size_t sq_size, cq_size, sqes_size;
+    char *sq_ptr, *cq_ptr;
+    struct io_uring_sqe *sqes;
+
+    // Prefer a kernel submission thread so steady-state I/O needs no
+    // syscalls; unprivileged use needs a recent kernel, so fall back
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = URING_SQPOLL_IDLE;
+    server->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    server->sqpoll = 1;
+    if (server->ring_fd == -1) {
+        memset(&params, 0, sizeof(params));
+        server->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+        server->sqpoll = 0;
+    }
+    if (server->ring_fd == -1)
+        return -1;
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  server->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return -1;
+    server->sq_ring = sq_ptr;
+    server->sq_ring_size = sq_size;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      server->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return -1;
+        server->cq_ring = cq_ptr;
+        server->cq_ring_size = cq_size;
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                server->ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return -1;
+    server->sqes = sqes;
+    server->sqes_size = sqes_size;
+
+    server->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    server->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    server->sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    server->sq_flags = (unsigned *)(sq_ptr + params.sq_off.flags);
+    server->sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    server->sq_entries = params.sq_entries;
+    server->sq_local_tail = *server->sq_tail;
+    server->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    server->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    server->cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    server->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+// Allocate transfer buffers and register them with the kernel
+static int uring_register_buffers(uring_server_t *server) {
+    struct iovec iov[URING_BUFFERS];
+    int count = URING_BUFFERS;
+
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        server->buffers[i] = aligned_alloc(4096, TRANSFER_CHUNK_SIZE);
+        if (server->buffers[i] == NULL)
+            return -1;
+        iov[i].iov_base = server->buffers[i];
+        iov[i].iov_len = TRANSFER_CHUNK_SIZE;
+    }
+
+    // Registered memory counts against RLIMIT_MEMLOCK; shrink until it fits
+    while (sys_io_uring_register(server->ring_fd, IORING_REGISTER_BUFFERS, iov, count) == -1) {
+        if (errno != ENOMEM || count == 1)
+            return -1;
+        count /= 2;
+    }
+
+    server->free_count = count;
+    for (int i = 0; i < count; i++)
+        server->free_buffers[i] = i;
+    return 0;
+}
+
+// Publish filled SQEs and let the kernel pick them up
+static void uring_submit(uring_server_t *server, unsigned wait_for) {
+    unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(server->sq_tail, server->sq_local_tail, __ATOMIC_RELEASE);
+
+    if (server->sqpoll) {
+        // The kernel thread consumes SQEs on its own unless it went idle
+        if (__atomic_load_n(server->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        server->to_submit = 0;
+        if (flags == 0)
+            return;
+        while (sys_io_uring_enter(server->ring_fd, 0, wait_for, flags) == -1 && errno == EINTR)
+            ;
+        return;
+    }
+
+    if (server->to_submit == 0 && wait_for == 0)
+        return;
+    while (sys_io_uring_enter(server->ring_fd, server->to_submit, wait_for, flags) == -1 &&
+           errno == EINTR)
+        ;
+    server->to_submit = 0;
+}
+
+// Free SQ slots from the application's point of view
+static unsigned uring_sq_space(uring_server_t *server) {
+    unsigned head = __atomic_load_n(server->sq_head, __ATOMIC_ACQUIRE);
+    return server->sq_entries - (server->sq_local_tail - head);
+}
+
+// Reserve count consecutive SQEs, submitting pending ones if the ring is full
+static struct io_uring_sqe *uring_get_sqes(uring_server_t *server, unsigned count) {
+    struct io_uring_sqe *first = NULL;
+
+    while (uring_sq_space(server) < count) {
+        uring_submit(server, 0);
+        if (uring_sq_space(server) < count)
+            sched_yield();
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        unsigned index = server->sq_local_tail & *server->sq_mask;
+        struct io_uring_sqe *sqe = &server->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        server->sq_array[index] = index;
+        server->sq_local_tail++;
+        server->to_submit++;
+        if (first == NULL)
+            first = sqe;
+    }
+
+    return first;
+}
+
+// The SQE following sqe in the ring
+static struct io_uring_sqe *uring_next_sqe(uring_server_t *server, struct io_uring_sqe *sqe) {
+    return &server->sqes[(sqe - server->sqes + 1) & *server->sq_mask];
+}
+
+static uint64_t tag(uring_conn_t *conn, int op) {
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+// Queue an accept on the listening socket
+static void queue_accept(uring_server_t *server) {
+    struct io_uring_sqe *sqe = uring_get_sqes(server, 1);
+
+    server->accept_addr_len = sizeof(server->accept_addr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->server_socket;
+    sqe->addr = (uint64_t)(uintptr_t)&server->accept_addr;
+    sqe->addr2 = (uint64_t)(uintptr_t)&server->accept_addr_len;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+}
+
+// Queue a receive of the rest of the current request part
+static void queue_recv(uring_server_t *server, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqes(server, 1);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    if (conn->state == CONN_READ_HEADER) {
+        sqe->addr = (uint64_t)(uintptr_t)(conn->raw_header + conn->received);
+        sqe->len = CUPID_HEADER_SIZE - conn->received;
+    } else {
+        sqe->addr = (uint64_t)(uintptr_t)(conn->payload + conn->received);
+        sqe->len = conn->header.length - conn->received;
+    }
+    sqe->user_data = tag(conn, OP_RECV);
+    conn->pending++;
+}
+
+// Queue a send of the rest of the response head
+static void queue_send_head(uring_server_t *server, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqes(server, 1);
+    response_t *response = &conn->response;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(response->head + response->head_sent);
+    sqe->len = response->head_len - response->head_sent;
+    sqe->msg_flags = MSG_NOSIGNAL | (response_has_body(response) ? MSG_MORE : 0);
+    sqe->user_data = tag(conn, OP_SEND);
+    conn->pending++;
+}
+
+// Queue the next body chunk as a linked file read -> socket write pair
+// through the connection's registered buffer
+static void queue_body_chunk(uring_server_t *server, uring_conn_t *conn) {
+    file_body_t *body = &conn->response.body;
+    struct io_uring_sqe *read_sqe = uring_get_sqes(server, 2);
+    struct io_uring_sqe *write_sqe = uring_next_sqe(server, read_sqe);
+
+    conn->chunk_len = body->remaining < TRANSFER_CHUNK_SIZE ? body->remaining : TRANSFER_CHUNK_SIZE;
+    conn->chunk_sent = 0;
+
+    read_sqe->opcode = IORING_OP_READ_FIXED;
+    read_sqe->flags = IOSQE_IO_LINK;
+    read_sqe->fd = conn->response.file_fd;
+    read_sqe->off = body->offset;
+    read_sqe->addr = (uint64_t)(uintptr_t)server->buffers[conn->buffer];
+    read_sqe->len = conn->chunk_len;
+    read_sqe->buf_index = conn->buffer;
+    read_sqe->user_data = tag(conn, OP_READ);
+
+    write_sqe->opcode = IORING_OP_WRITE_FIXED;
+    write_sqe->fd = conn->fd;
+    write_sqe->off = (uint64_t)-1;
+    write_sqe->addr = (uint64_t)(uintptr_t)server->buffers[conn->buffer];
+    write_sqe->len = conn->chunk_len;
+    write_sqe->buf_index = conn->buffer;
+    write_sqe->user_data = tag(conn, OP_WRITE);
+
+    conn->read_result = 0;
+    conn->write_result = 0;
+    conn->pending += 2;
+}
+
+// Queue a write of the unsent tail of the current chunk
+static void queue_chunk_rest(uring_server_t *server, uring_conn_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqes(server, 1);
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = conn->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)(server->buffers[conn->buffer] + conn->chunk_sent);
+    sqe->len = conn->chunk_len - conn->chunk_sent;
+    sqe->buf_index = conn->buffer;
+    sqe->user_data = tag(conn, OP_WRITE);
+
+    conn->read_result = conn->chunk_len - conn->chunk_sent;
+    conn->write_result = 0;
+    conn->pending++;
+}
+
+// Queue a wake-up for throttled connections, due when the first one is
+static void queue_timer(uring_server_t *server) {
+    struct io_uring_sqe *sqe;
+    uint64_t now = sched_now(), wait = URING_THROTTLE_TICK;
+
+    for (uring_conn_t *conn = server->throttled; conn != NULL; conn = conn->next_throttled) {
+        if (conn->wake <= now)
+            wait = 0;
+        else if (conn->wake - now < wait)
+            wait = conn->wake - now;
+    }
+
+    sqe = uring_get_sqes(server, 1);
+    server->timeout.tv_sec = 0;
+    server->timeout.tv_nsec = wait;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&server->timeout;
+    sqe->len = 1;
+    sqe->user_data = tag(NULL, OP_TIMEOUT);
+    server->timer_armed = 1;
+}
+
+// Return a registered buffer, handing it to the waiting body whose
+// turn is next, if any
+static void release_buffer(uring_server_t *server, int buffer) {
+    sched_flow_t *flow = sched_queue_pop(&server->waiting);
+    uring_conn_t *conn;
+
+    if (flow == NULL) {
+        server->free_buffers[server->free_count++] = buffer;
+        return;
+    }
+
+    conn = flow->owner;
+    conn->buffer = buffer;
+    queue_body_chunk(server, conn);
+}
+
+// Tear down a connection with no operations in flight
+static void conn_close(uring_server_t *server, uring_conn_t *conn) {
+    if (conn->buffer != -1)
+        release_buffer(server, conn->buffer);
+    response_release(&conn->response);
+    close(conn->fd);
+    client_disconnected(&conn->addr, &conn->response.tcp);
+    sched_flow_release(&conn->flow);
+    free(conn);
+}
+
+// Set a connection with nothing in flight aside: until wait nanoseconds
+// from now when it owes bandwidth, else until a buffer comes free in its
+// turn after it sent sent bytes
+static void conn_defer(uring_server_t *server, uring_conn_t *conn, uint64_t wait,
+                       uint64_t sent) {
+    if (wait > 0) {
+        conn->wake = sched_now() + wait;
+        conn->next_throttled = server->throttled;
+        server->throttled = conn;
+        return;
+    }
+
+    if (sched_queue_push(&server->waiting, &conn->flow, conn->response.sched_class, sent) == -1) {
+        perror("Error queueing connection");
+        conn_close(server, conn);
+    }
+}
+
+// A response is fully sent: wait for the next request on the session
+static void finish_response(uring_server_t *server, uring_conn_t *conn) {
+    response_sent(&conn->response, 0, 1);
+    if (conn->buffer != -1) {
+        release_buffer(server, conn->buffer);
+        conn->buffer = -1;
+    }
+    response_release(&conn->response);
+
+    if (conn->close_after_response) {
+        conn_close(server, conn);
+        return;
+    }
+
+    conn->state = CONN_READ_HEADER;
+    conn->received = 0;
+    queue_recv(server, conn);
+}
+
+// Start streaming the file body, or wait for a free buffer
+static void start_body(uring_server_t *server, uring_conn_t *conn) {
+    conn->state = CONN_SEND_BODY;
+
+    if (server->free_count > 0) {
+        conn->buffer = server->free_buffers[--server->free_count];
+        queue_body_chunk(server, conn);
+        return;
+    }
+
+    conn_defer(server, conn, 0, 0);
+}
+
+// Queue whatever the response still has to send: the rest of the head,
+// the file body, or the next part of a streamed response
+static void advance_response(uring_server_t *server, uring_conn_t *conn) {
+    response_t *response = &conn->response;
+
+    do {
+        if (response->head_sent < response->head_len) {
+            conn->state = CONN_SEND_HEAD;
+            queue_send_head(server, conn);
+            return;
+        }
+        if (response_has_body(response)) {
+            start_body(server, conn);
+            return;
+        }
+    } while (response_next(response));
+
+    finish_response(server, conn);
+}
+
+// A receive finished: advance request parsing
+static void on_recv(uring_server_t *server, uring_conn_t *conn, int result) {
+    if (result <= 0) {
+        conn_close(server, conn);
+        return;
+    }
+
+    conn->received += result;
+    if (conn->state == CONN_READ_HEADER) {
+        if (conn->received < CUPID_HEADER_SIZE) {
+            queue_recv(server, conn);
+            return;
+        }
+        decode_header(conn->raw_header, &conn->header);
+        conn->received = 0;
+        if (conn->header.version != CUPID_PROTO_VERSION) {
+            response_init(&conn->response, 0);
+            response_error(&conn->response, ERR_VERSION, "Unsupported protocol version");
+            conn->close_after_response = 1;
+        } else if (conn->header.length >= sizeof(conn->payload)) {
+            response_init(&conn->response, conn->header.request_id);
+            response_error(&conn->response, ERR_BAD_REQUEST, "Request too large");
+            conn->close_after_response = 1;
+        } else if (conn->header.length > 0) {
+            conn->state = CONN_READ_PAYLOAD;
+            queue_recv(server, conn);
+            return;
+        } else {
+            conn->payload[0] = '\0';
+            handle_request(&conn->response, &conn->header, conn->payload);
+        }
+    } else {
+        if (conn->received < conn->header.length) {
+            queue_recv(server, conn);
+            return;
+        }
+        conn->payload[conn->header.length] = '\0';
+        handle_request(&conn->response, &conn->header, conn->payload);
+    }
+
+    advance_response(server, conn);
+}
+
+// A head send finished: continue with the head or move on to the body
+static void on_send(uring_server_t *server, uring_conn_t *conn, int result) {
+    response_t *response = &conn->response;
+    uint64_t wait;
+
+    if (result < 0) {
+        conn_close(server, conn);
+        return;
+    }
+
+    response->head_sent += result;
+    response_sent(response, result, 0);
+    wait = sched_charge(&conn->flow, result);
+    if (wait > 0) {
+        conn_defer(server, conn, wait, result);
+        return;
+    }
+    advance_response(server, conn);
+}
+
+// Both halves of a chunk (or a rest write) finished
+static void on_chunk(uring_server_t *server, uring_conn_t *conn) {
+    file_body_t *body = &conn->response.body;
+    uint64_t wait;
+    int buffer;
+
+    // A short read breaks the link and cancels the write
+    if (conn->read_result != (int)(conn->chunk_len - conn->chunk_sent) ||
+        conn->write_result <= 0) {
+        conn_close(server, conn);
+        return;
+    }
+
+    conn->chunk_sent += conn->write_result;
+    response_sent(&conn->response, conn->write_result, 0);
+    if (conn->chunk_sent < conn->chunk_len) {
+        queue_chunk_rest(server, conn);
+        return;
+    }
+
+    // Sum the bytes exactly as they went out
+    body->crc = crc32c(body->crc, server->buffers[conn->buffer], conn->chunk_len);
+    body->offset += conn->chunk_len;
+    body->remaining -= conn->chunk_len;
+    wait = sched_charge(&conn->flow, conn->chunk_len);
+    if (body->remaining > 0 && wait == 0 && server->waiting.count == 0) {
+        queue_body_chunk(server, conn);
+        return;
+    }
+
+    buffer = conn->buffer;
+    conn->buffer = -1;
+    if (body->remaining > 0 || wait > 0) {
+        // Others are waiting or the bucket is empty: take a turn in line
+        conn_defer(server, conn, wait, conn->chunk_len);
+        release_buffer(server, buffer);
+        return;
+    }
+
+    release_buffer(server, buffer);
+    advance_response(server, conn);
+}
+
+// Resume throttled connections whose debt is paid
+static void wake_throttled(uring_server_t *server) {
+    uring_conn_t **link = &server->throttled;
+    uint64_t now = sched_now();
+
+    while (*link != NULL) {
+        uring_conn_t *conn = *link;
+
+        if (conn->wake > now) {
+            link = &conn->next_throttled;
+            continue;
+        }
+        *link = conn->next_throttled;
+        advance_response(server, conn);
+    }
+}
+
+// An accept finished: set up the connection and re-arm the accept
+static void on_accept(uring_server_t *server, int result) {
+    if (result >= 0) {
+        uring_conn_t *conn = malloc(sizeof(uring_conn_t));
+
+        if (conn == NULL) {
+            perror("Error allocating memory");
+            close(result);
+        } else {
+            conn->fd = result;
+            conn->state = CONN_READ_HEADER;
+            conn->addr = server->accept_addr;
+            conn->received = 0;
+            conn->buffer = -1;
+            conn->pending = 0;
+            conn->close_after_response = 0;
+            response_init(&conn->response, 0);
+            sched_flow_init(&conn->flow, &conn->addr, conn);
+
+            client_connected(conn->fd, &conn->addr, &conn->response.tcp);
+            queue_recv(server, conn);
+        }
+    } else if (result != -EINTR && result != -ECONNABORTED) {
+        fprintf(stderr, "Error accepting connection: %s\n", strerror(-result));
+    }
+
+    queue_accept(server);
+}
+
+// Dispatch one completion
+static void handle_completion(uring_server_t *server, struct io_uring_cqe *cqe) {
+    uring_conn_t *conn = (uring_conn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    int op = cqe->user_data & OP_MASK;
+
+    if (op == OP_ACCEPT) {
+        on_accept(server, cqe->res);
+        return;
+    }
+    if (op == OP_TIMEOUT) {
+        server->timer_armed = 0;
+        return;
+    }
+
+    conn->pending--;
+    switch (op) {
+        case OP_RECV:
+            on_recv(server, conn, cqe->res);
+            break;
+        case OP_SEND:
+            on_send(server, conn, cqe->res);
+            break;
+        case OP_READ:
+            conn->read_result = cqe->res;
+            break;
+        case OP_WRITE:
+            conn->write_result = cqe->res;
+            break;
+    }
+
+    if ((op == OP_READ || op == OP_WRITE) && conn->pending == 0)
+        on_chunk(server, conn);
+}
+
+// Release what uring_setup() and uring_register_buffers() got before
+// failing, so the engine that takes over does not inherit it
+static void uring_teardown(uring_server_t *server) {
+    if (server->sqes != NULL)
+        munmap(server->sqes, server->sqes_size);
+    if (server->cq_ring != NULL)
+        munmap(server->cq_ring, server->cq_ring_size);
+    if (server->sq_ring != NULL)
+        munmap(server->sq_ring, server->sq_ring_size);
+    // Closing the ring also drops the buffer registration
+    if (server->ring_fd > 0)
+        close(server->ring_fd);
+    for (int i = 0; i < URING_BUFFERS; i++)
+        free(server->buffers[i]);
+}
+
+// Serve connections on the listening socket with io_uring
+int run_uring(int server_socket) {
+    uring_server_t *server;
+
+    server = calloc(1, sizeof(uring_server_t));
+    if (server == NULL) {
+        perror("Error allocating memory");
+        return EXIT_FAILURE;
+    }
+    server->server_socket = server_socket;
+
+    if (uring_setup(server) == -1 || uring_register_buffers(server) == -1) {
+        fprintf(stderr, "io_uring unavailable (%s); falling back to thread-per-connection\n",
+                strerror(errno));
+        uring_teardown(server);
+        free(server);
+        return URING_UNAVAILABLE;
+    }
+
+    printf("Serving with io_uring (%s, %d registered buffers)\n",
+           server->sqpoll ? "kernel submission thread" : "batched submission",
+           server->free_count);
+
+    queue_accept(server);
+
+    while (1) {
+        unsigned head, tail;
+
+        // Only enter the kernel to wait when nothing has completed
+        head = *server->cq_head;
+        tail = __atomic_load_n(server->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (server->throttled != NULL && !server->timer_armed)
+                queue_timer(server);
+            uring_submit(server, 1);
+            continue;
+        }
+
+        while (head != tail) {
+            handle_completion(server, &server->cqes[head & *server->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(server->cq_head, head, __ATOMIC_RELEASE);
+
+        wake_throttled(server);
+        uring_submit(server, 0);
+    }
+
+    return EXIT_FAILURE;
+}